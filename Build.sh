@@ -11,6 +11,10 @@ flags=$flags" -g -p"
 flags=$flags" -fsanitize=address -fno-omit-frame-pointer"
 
 CC=g++
-$CC $flags -c -o build/base.o src/base.cpp -I./src
-$CC $flags -c -o build/navigation.o src/navigation.cpp -I./src
-$CC $flags -o build/nav build/{base,navigation}.o
+# nav is built apart from make's objects so they are all built with the same flags.
+mkdir -p build/nav_objects/
+nav_objects="base navigation regexp replace textbuffer io snapshot journal linetree columns scan pool worker mem"
+for object in $nav_objects; do
+	$CC $flags -pthread -c -o build/nav_objects/$object.o src/$object.cpp -I./src || exit 1
+done
+$CC $flags -pthread -o build/nav $(for object in $nav_objects; do echo build/nav_objects/$object.o; done)
@@ -11,7 +11,9 @@
 
 #include <errno.h>
 #include <execinfo.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 
 /// module BASE ///
@@ -102,6 +104,7 @@ static inline struct err err_make(int errno_v, const char *loc, const char *func
   e.errno_val = errno_v;
   e.loc = loc;
   e.func = func;
+  e.cause = NULL;
   return e;
 }
 
@@ -427,19 +430,183 @@ void* pool_new_object(struct pool *pool);
 void pool_return_object(struct pool *pool, void *object);
 #define pool_is_full(pool) (pool->used == pool->capacity)
 
+// Slab: a growable allocator of constant size objects, for allocating many small objects with a common owner.
+// - objects are carved out of large blocks, arrays of objects can also be allocated contiguously.
+// - freed objects are recycled, but blocks are only released all at once by slab_reset().
+// - objects are always returned zeroed.
+struct slab_block;
+struct slab {
+	size_t object_size;
+	size_t block_objects;         // number of objects in a default block
+	struct slab_block *blocks;
+	char *cursor;                 // free space at the end of the current block
+	char *limit;
+	void *free_list;
+	size_t used;                  // number of objects in use
+	size_t capacity;              // number of objects in all blocks
+	size_t bytes;                 // memory held by all blocks
+};
+void slab_init(struct slab *slab, size_t object_size, size_t block_objects);
+void* slab_alloc(struct slab *slab);
+void* slab_alloc_array(struct slab *slab, size_t n);
+void slab_free(struct slab *slab, void *object);
+void slab_reset(struct slab *slab);
+
+
+/// module SCAN ///
+
+// Vectorized scanning primitives, declared in their own header so that they can be used outside of the editor.
+#include <scan.h>
+
+
+/// module REGEXP ///
+
+// Regular expressions, declared in their own header like scan.h.
+#include <regexp.h>
+
+
+/// module WORKER ///
+
+#define worker_max_threads 64
+
+// Number of threads used by worker_parallel_for(), based on the number of online cpus.
+int worker_thread_count();
+// Run fn(ctx, task) for every task in [0, ntasks) on a pool of threads, and return once all tasks are done.
+void worker_parallel_for(int ntasks, void (*fn)(void *ctx, int task), void *ctx);
+
+// A background task runs fn(ctx) on its own thread. Its owner checks worker_is_done() when the event loop wakes up,
+// and then collects the task with worker_join().
+struct worker_task {
+	pthread_t thread;
+	void (*fn)(void *ctx);
+	void *ctx;
+	int done;
+};
+
+// Returns 0 or -errno.
+int worker_start(struct worker_task *task, void (*fn)(void *ctx), void *ctx);
+int worker_is_done(struct worker_task *task);
+void worker_join(struct worker_task *task);
+// Wait until 'fd' has input, a background task completes, 'event_fd' is readable when it is not -1, or 'timeout_ms'
+// elapses. Returns 1 when 'fd' has input.
+int worker_wait_input(int fd, int event_fd, int timeout_ms);
+
 
 /// module IO ///
 
-// TODO: kill ??
-// DOCME
+// A read-only memory mapping of a whole file, together with the file stat at the time it was mapped.
 struct mapped_file {
 	char name[256];
 	struct stat file_stat;
 	struct slice data;
 };
 
-// DOCME
+// Map the file at 'path'. Returns 0 or -errno. Empty files are mapped to an empty slice.
 int mapped_file_load(struct mapped_file *f, const char *path);
+void mapped_file_unload(struct mapped_file *f);
+// Open the mapped file again if it is still the same file, unmodified since it was mapped.
+// Returns the file descriptor, -ESTALE if the file changed or was replaced, or -errno.
+int mapped_file_open_unchanged(struct mapped_file *f);
+
+// Writing a file without ever leaving it partially written: the new content goes to a temporary file in the same
+// directory, which is then renamed over the file. Appended text is not copied: the writer batches iovecs pointing
+// at it and writes them with writev(), so appended memory must stay valid until the writer is committed.
+// Consecutive texts adjacent in memory are written as one iovec.
+// When the writer has a source file, large texts inside the mapping of that file are not written but copied from
+// the file with copy_file_range(), which lets the filesystem share the extents (reflink) or copy them in the kernel.
+#define file_writer_iovecs 1024
+#define file_writer_copy_min Kilo(64)
+#define FILE_WRITER_SYNC 1 // fsync the file and its directory before returning
+
+struct file_writer {
+	int fd;
+	int fail;
+	char path[4096];
+	char tmp_path[4096];
+	struct iovec iov[file_writer_iovecs];
+	int niov;
+	size_t bytes;           // bytes appended
+	size_t written;         // bytes written so far, can be read from other threads
+	size_t copied;          // bytes copied from the source file
+	int source_fd;
+	slice source;           // mapping of source_fd
+};
+
+// Returns 0 or -errno. Once opened, the writer must be finished with file_writer_commit() or file_writer_abort().
+int file_writer_open(struct file_writer *w, const char *path);
+void file_writer_append(struct file_writer *w, slice text);
+// Copy the texts which are within 'data', a mapping of the file 'fd' from its start. The writer does not own 'fd'.
+// Writing falls back to writev() if the filesystems do not support copying.
+void file_writer_set_source(struct file_writer *w, int fd, slice data);
+// Write everything, then rename the temporary file over the file. Returns 0 or -errno.
+int file_writer_commit(struct file_writer *w, int flags);
+void file_writer_abort(struct file_writer *w);
+
+// Streamed files: read-only access to files larger than memory. The file is mapped in windows of
+// stream_window_size bytes on demand, and at most 'budget' bytes of windows are resident: the least recently used
+// window is dropped with madvise(MADV_DONTNEED) beyond that. Windows stay mapped, so text read from a window stays
+// valid and is just read back from the file when touched again.
+// Instead of lines, the index only keeps checkpoints: the offset of every stream_checkpoint_lines-th line, found by
+// scanning the file step by step. Going to a line starts from the checkpoint before it.
+#define stream_window_size Mega(64)
+#define stream_checkpoint_lines 0x10000
+#define stream_memory_budget Mega(512)
+#define stream_min_file_size Giga(2)    // the editor streams files larger than this
+
+struct stream_window {
+	char *data;                   // NULL until first used
+	u64 last_use;
+	int resident;
+};
+
+struct stream {
+	int fd;
+	off_t size;
+	struct stream_window *windows;
+	size_t nwindows;
+	size_t resident;
+	size_t max_resident;
+	u64 clock;
+
+	off_t *checkpoints;           // checkpoints[i] is the offset of line i * stream_checkpoint_lines
+	size_t ncheckpoints;
+	size_t checkpoints_capacity;
+	off_t indexed;                // bytes scanned for checkpoints so far
+	size_t indexed_lines;         // newlines found in these bytes
+	u32 *newlines;                // scan buffer
+
+	struct buffer copy;           // text spanning two windows
+};
+
+// Returns 0 or -errno.
+int stream_open(struct stream *stream, const char *path, size_t budget);
+void stream_close(struct stream *stream);
+// Scan about 'budget' more bytes for checkpoints. Returns 1 if there is more to scan, 0 when done, or -errno.
+int stream_index_step(struct stream *stream, size_t budget);
+int stream_is_indexed(struct stream *stream);
+// Number of lines, estimated until the file is fully scanned.
+size_t stream_line_count(struct stream *stream);
+// Bytes [offset, offset + len) of the file, clamped to the end of the file. The text points into the window, or
+// into a copy valid until the next read when it spans two windows. The slice is empty at the end of the file or on
+// failure.
+slice stream_read(struct stream *stream, off_t offset, size_t len);
+
+// A position at the start of a line of a streamed file.
+struct stream_cursor {
+	struct stream *stream;
+	size_t lineno;
+	off_t offset;
+};
+
+void stream_cursor_init(struct stream_cursor *cursor, struct stream *stream);
+// Go to a line, or to the last line if there are less lines. Scans the file up to that line if needed.
+// Returns 0 or -errno.
+int stream_cursor_goto_line(struct stream_cursor *cursor, size_t lineno);
+// Move to the next or previous line. Returns 0 at the last or first line, 1 otherwise.
+int stream_cursor_next_line(struct stream_cursor *cursor);
+int stream_cursor_prev_line(struct stream_cursor *cursor);
+// Text of the line of the cursor, without its newline and cut at 'maxlen' bytes, see stream_read().
+slice stream_cursor_line(struct stream_cursor *cursor, size_t maxlen);
 
 
 /// module ERROR ///
@@ -602,13 +769,17 @@ static inline int is_printable_key(int code)
 void term_init(int term_in_fd, int term_out_fd);  // put the terminal in raw mode
 vec term_get_size();                              // return the current size of the terminal where x:rows and y::columns
 struct input term_get_input(int term_in_fd);      // return the next keyboard or mouse input
+int term_input_pending(int term_in_fd, int timeout_ms); // return true if input can be read without blocking
 
 
+// Every cell of a framebuffer holds one char: up to framebuffer_cell_bytes bytes of UTF-8, padded with zeros.
+#define framebuffer_cell_bytes 4
+
 // struct for managing a 2d grid of character "pixels" and draws them on the terminal
 struct framebuffer {
   vec window;                     // size of the display
   size_t buffer_len;              // size of the various buffers in number of cells
-  char *text;                     // 2d buffer for storing text
+  char *text;                     // 2d buffer for storing text, framebuffer_cell_bytes per cell
   int *fg_colors;                 // 2d buffer for storing foreground colors
   int *bg_colors;                 // 2d buffer for storing background colors
   struct buffer output_buffer;    // append buffer for storing all control sequences and output text to the terminal for one frame
@@ -653,8 +824,10 @@ void framebuffer_iter_goto(struct framebuffer_iter *iter, int n);
 // Both these function returns true if the iterator was moved forward or backward.
 int framebuffer_iter_next(struct framebuffer_iter *iter);
 int framebuffer_iter_prev(struct framebuffer_iter *iter);
-// These three functions return the number of framebuffer slots into which text or colors were pushed.
+// These four functions return the number of framebuffer slots into which text or colors were pushed.
+// framebuffer_push_text() puts one byte per cell, framebuffer_push_cells() copies whole cells of framebuffer_cell_bytes.
 size_t framebuffer_push_text(struct framebuffer_iter *iter, char *text, size_t size);
+size_t framebuffer_push_cells(struct framebuffer_iter *iter, const char *cells, size_t size);
 size_t framebuffer_push_fg(struct framebuffer_iter *iter, int fg, size_t size);
 size_t framebuffer_push_bg(struct framebuffer_iter *iter, int bg, size_t size);
 
@@ -668,29 +841,298 @@ struct textpiece {
 
 // A single line of text, made of a linked list of struct slices.
 // Lines are linked together in a doubly-linked lists for simple navigation and insertions.
+// Lines are also the nodes of a balanced tree (see linetree.cpp) for finding lines by index or by byte offset.
+// Lines are nodes rather than views over a packed array of line starts, because:
+// - edits split and join lines in O(log n), without shifting or renumbering the lines after them;
+// - every line keeps its own fragments, cursors, cached columns, lexer state and wrapped rows.
+// The cost is sizeof(struct line) per line, 136 bytes on 64-bit targets, i.e. about 130MB for 1M lines.
+// Loading builds lines from the packed u32 newline offsets of scan_newlines(), one block of lines per scanned batch.
+// Large files are loaded lazily, see textbuffer_load_lazy(), which only defers that cost: the idle loop keeps indexing
+// until every line is built, so a fully loaded file still pays it for all of its lines.
 struct line {
   struct line *prev;
   struct line *next;
   struct textpiece *fragments;
   size_t bytelen;
+  struct textpiece inline_fragment;     // storage for the first fragment, lines loaded from a file have only this one
+  struct cursor *cursors;               // tracked cursors on this line
+  struct line_columns *columns;         // cached display columns of a long line, until it is edited
+  u8 lexer_state;                       // syntax highlighting state at the end of the line, see highlight.cpp
+  u8 lexer_dirty;                       // the line was edited since it was lexed
+  u32 wrap_rows;                        // rows of the line wrapped at textbuffer->wrap_width, see columns.cpp
+
+  // line tree
+  struct line *parent;
+  struct line *left;
+  struct line *right;
+  u32 priority;
+  size_t count;         // number of lines in this subtree
+  size_t bytes;         // number of bytes in this subtree, counting one newline per line
+  size_t rows;          // number of wrapped rows in this subtree
+};
+
+// Line tree operations, all O(log n). Indexes are 0-based.
+struct line* linetree_build(struct line *first, size_t n);
+struct line* linetree_build_array(struct line *lines, size_t n);   // builds subtrees in parallel
+struct line* linetree_merge(struct line *first, struct line *second);  // concatenate two trees, returns the new root
+void linetree_update(struct line *line);        // propagate a change of line->bytelen or line->wrap_rows to the root
+// Call 'update' on every line of a tree, then recompute the counters of every node, O(n). Subtrees are refreshed in
+// parallel: 'update' must only change the line it is given.
+void linetree_refresh(struct line *root, void (*update)(void *ctx, struct line *line), void *ctx);
+void linetree_insert_after(struct line **root, struct line *at, struct line *line);
+void linetree_insert_before(struct line **root, struct line *at, struct line *line);
+void linetree_remove(struct line **root, struct line *line);
+struct line* linetree_at(struct line *root, size_t index);
+struct line* linetree_at_offset(struct line *root, size_t offset, size_t *offset_in_line);
+struct line* linetree_at_row(struct line *root, size_t row, size_t *row_in_line);
+size_t line_index(struct line *line);
+size_t line_offset(struct line *line);
+size_t line_row(struct line *line);             // wrapped row of the start of the line
+
+// Display columns of lines, see columns.cpp.
+// Tabs advance to the next multiple of column_tab_width, any other UTF-8 char takes one column, and so does every
+// byte which is not part of a valid UTF-8 char. Long lines cache byte to column checkpoints, decoded lazily.
+#define column_tab_width 8
+size_t line_width(struct textbuffer *textbuffer, struct line *line);
+size_t line_column_at(struct textbuffer *textbuffer, struct line *line, size_t x);         // column of the char at byte x
+size_t line_x_at_column(struct textbuffer *textbuffer, struct line *line, size_t column);  // byte offset of the char covering a column, or bytelen
+size_t line_next_char(struct line *line, size_t x);     // byte offsets of the chars after and before the char at x
+size_t line_prev_char(struct line *line, size_t x);
+void line_columns_invalidate(struct textbuffer *textbuffer, struct line *line, size_t x);  // the text of the line changed from byte x
+void textbuffer_free_columns(struct textbuffer *textbuffer);
+
+// Wrapped lines take one row per started window of textbuffer->wrap_width columns, and at least one row. The line
+// tree sums the rows of lines, see line_row() and linetree_at_row().
+size_t line_wrap_row(struct textbuffer *textbuffer, struct line *line, size_t x);  // row of the char at byte x inside the line
+void line_wrap_update(struct textbuffer *textbuffer, struct line *line);   // the width of the line changed
+void linetree_wrap(struct textbuffer *textbuffer, struct line *root);     // measure every line of a tree, in parallel
+// Wrap lines at 'width' columns, or stop wrapping with 0. Every line is measured again when the width changes.
+void textbuffer_set_wrap_width(struct textbuffer *textbuffer, size_t width);
+
+// Reading the chars of a line from any column, without decoding the line before: drawing a window of columns of a
+// very long line only costs in proportion to the window.
+struct column_iter {
+  struct textpiece *fragment;   // fragment containing x, or NULL at the end of the line
+  size_t fragment_x;            // offset of the fragment in the line
+  size_t x;                     // next char
+  size_t column;
+};
+
+struct column_char {
+  size_t x;
+  size_t column;
+  size_t len;                   // in bytes
+  size_t width;                 // in columns
+  int valid;                    // ASCII or a valid UTF-8 char, otherwise a single byte
+  char bytes[4];
 };
 
+// Start at the char covering 'column', which is a tab starting before 'column' when it covers it.
+void column_iter_init(struct column_iter *iter, struct textbuffer *textbuffer, struct line *line, size_t column);
+int column_iter_next(struct column_iter *iter, struct column_char *c);    // returns 0 at the end of the line
+
 // A cursor pointing into a single location into a single line of text.
 // The owner (struct view essentially) should always have cursor + textbuffer reference.
+// The line number of a cursor is not stored but derived from the line tree, so that inserting or removing lines
+// never requires to renumber cursors.
+// Cursors of a textbuffer are tracked: they are linked on their line, and an edit only updates the cursors of the
+// lines it changes, whatever the number of cursors. Copies of cursors made with cursor_copy() are not tracked.
 struct cursor {
+  struct textbuffer *textbuffer;
   struct line *line;
-  int lineno;
-  int x_offset_actual;
-  int x_offset_want;
+  int x_offset_actual;          // byte offset in the line
+  int x_offset_want;            // column kept when moving up and down, or -1 for the column of x_offset_actual
+
+  int tracked;
+  struct cursor *line_prev;     // other cursors on the same line
+  struct cursor *line_next;
+  struct cursor *prev;          // all cursors of the textbuffer
+  struct cursor *next;
 };
 
-char* cursor_to_string(struct cursor *cursor);
+struct cursor cursor_copy(struct cursor *cursor);
+// Copy the text of the line from the cursor into 'buffer', at most size - 1 bytes, and terminate it. Returns the
+// number of bytes copied.
+size_t cursor_to_string(struct cursor *cursor, char *buffer, size_t size);
+int cursor_lineno(struct cursor *cursor);       // estimated until the textbuffer is fully indexed
 struct line* cursor_prev_line(struct cursor *cursor);
 struct line* cursor_next_line(struct cursor *cursor);
+// Move by one char inside the line, returns 0 at the start or at the end of the line.
+int cursor_prev_char(struct cursor *cursor);
+int cursor_next_char(struct cursor *cursor);
 
 // Used internally to textbuffer to read a file in segments, and to hold inserted content
 struct textchunk;
 
+// Undo/redo history of a textbuffer, see journal.cpp.
+// Edits are recorded as a byte offset and the slices of the inserted or deleted text. Slices point into the textchunks
+// and the mapped file instead of copying the text: both stay valid as long as the textbuffer lives since textchunks
+// are append-only, so recording even a very large deletion only costs one slice per piece of deleted text.
+// A batch edit is made at many sites at once, like typing at every cursor: every site deletes its own text, then the
+// same text is inserted at every site. The slices are the deleted text of every site in order, then the inserted text.
+enum journal_edit_type {
+  JOURNAL_INSERT,
+  JOURNAL_DELETE,
+  JOURNAL_BATCH,
+};
+
+struct journal_site {
+  size_t offset;        // in the text before the edit
+  size_t deleted;
+};
+
+struct journal_edit {
+  size_t offset;
+  size_t len;           // inserted at every site for a batch
+  size_t first_slice;   // index of the first slice of the edit in journal->slices
+  size_t nslices;
+  size_t first_site;    // sites of a batch in journal->sites
+  size_t nsites;
+  u32 transaction;      // edits of the same transaction are undone and redone together
+  int type;
+};
+
+struct journal {
+  struct journal_edit *edits;
+  size_t nedits;
+  size_t edits_capacity;
+  size_t current;       // edits before 'current' are applied, edits from 'current' can be redone
+  slice *slices;
+  size_t nslices;
+  size_t slices_capacity;
+  struct journal_site *sites;
+  size_t nsites;
+  size_t sites_capacity;
+  size_t limit;         // memory above which the oldest transactions get dropped
+  size_t dropped;       // edits dropped so far, trimmed or undone and forgotten
+
+  u32 transaction;      // id of the last transaction
+  int transaction_depth;
+  int coalesce;         // the next edit can be merged into the last edit
+  int paused;           // edits are not recorded while undoing or redoing
+
+  // state of the edit being recorded
+  int recording;
+  int failed;
+  size_t open_offset;
+  size_t open_first_slice;
+  size_t open_first_site;
+  size_t pending_newlines;
+  slice pending_stored;         // the pending newlines when they are consecutive stored newline characters
+};
+
+void journal_init(struct journal *journal, size_t limit);
+void journal_free(struct journal *journal);
+size_t journal_bytes(struct journal *journal);
+// Recording an edit: begin, then add the edit text in order, then end.
+void journal_begin_edit(struct journal *journal, size_t offset);
+void journal_add_slice(struct journal *journal, slice slice);
+// 'newline_char' is the newline character in the stored text, or NULL when the newline is not stored.
+void journal_add_newline(struct journal *journal, char *newline_char);
+// A batch edit adds every site after its deleted text, then the inserted text, and ends as JOURNAL_BATCH.
+void journal_add_site(struct journal *journal, size_t offset, size_t deleted);
+void journal_end_edit(struct journal *journal, int type, size_t len);
+void journal_begin_transaction(struct journal *journal);
+void journal_end_transaction(struct journal *journal);
+// Step back or forward by one transaction. Returns its number of edits and points 'edits' to the first one.
+size_t journal_undo(struct journal *journal, struct journal_edit **edits);
+size_t journal_redo(struct journal *journal, struct journal_edit **edits);
+
+// Immutable snapshots of the text of a textbuffer, see snapshot.cpp.
+// A snapshot is the list of pieces of the text in order, pointing into the textchunks and the mapped file like the
+// journal. The list is split in reference counted blocks of pieces shared between snapshots: a new snapshot is derived
+// from the previous one by copying only the blocks touched by the changes made in between. Snapshots are never
+// modified once created, and can be read from any thread without locking while the textbuffer is edited. They must be
+// released before the textbuffer is freed, since their text lives in the textbuffer. A snapshot holds the epoch of
+// the textbuffer it was taken in, so that the mappings of previous versions of the file outlive it.
+#define snapshot_block_pieces 256
+
+struct snapshot_block {
+  int refs;
+  int npieces;
+  size_t bytes;
+  slice pieces[snapshot_block_pieces];
+};
+
+struct textbuffer_snapshot {
+  int refs;
+  int failed;                   // out of memory while building
+  size_t bytes;
+  struct snapshot_block **blocks;
+  size_t nblocks;
+  size_t capacity;
+  size_t pending_newlines;      // newlines not added yet while building
+  slice pending_stored;         // the pending newlines when they are consecutive stored newline characters
+  struct textbuffer_epoch *epoch;       // released with the snapshot, NULL for snapshots not taken from a textbuffer
+};
+
+// A change to the text since a snapshot: 'deleted' bytes removed at 'offset', then 'inserted' inserted there.
+// A batch, like an edit at every cursor, is a change with 'nsites' set followed by its sites: changes applied at once,
+// sorted by offset and not overlapping, whose offsets are all in the text before the batch. Sites at the same offset
+// insert one after the other.
+struct snapshot_change {
+  size_t offset;
+  size_t deleted;
+  slice inserted;
+  size_t nsites;
+};
+
+// Building a snapshot: create it, append the text in order, then finish it.
+// snapshot_new() returns NULL and snapshot_finish() returns -ENOMEM when out of memory.
+struct textbuffer_snapshot* snapshot_new();
+void snapshot_append(struct textbuffer_snapshot *snapshot, slice piece);
+// 'newline_char' is the newline character in the stored text, or NULL when the newline is not stored. Stored newlines
+// are merged with the pieces around them.
+void snapshot_append_newline(struct textbuffer_snapshot *snapshot, char *newline_char);
+int snapshot_finish(struct textbuffer_snapshot *snapshot);
+// Apply changes to a copy of 'base' sharing all blocks that are not changed. Returns NULL when out of memory.
+struct textbuffer_snapshot* snapshot_derive(struct textbuffer_snapshot *base, struct snapshot_change *changes, size_t n);
+void snapshot_acquire(struct textbuffer_snapshot *snapshot);
+void snapshot_release(struct textbuffer_snapshot *snapshot);
+
+struct snapshot_iterator {
+  struct textbuffer_snapshot *snapshot;
+  size_t block;
+  int piece;
+};
+
+void snapshot_iterator_init(struct snapshot_iterator *iterator, struct textbuffer_snapshot *snapshot);
+// Get the next piece of text. Returns 0 at the end.
+int snapshot_iterator_next(struct snapshot_iterator *iterator, slice *piece);
+
+// Length of the longest common prefix of the snapshot text and 'text'.
+size_t snapshot_common_prefix(struct textbuffer_snapshot *snapshot, slice text);
+// Length of the longest common suffix of the snapshot text and 'text', at most 'limit'.
+size_t snapshot_common_suffix(struct textbuffer_snapshot *snapshot, slice text, size_t limit);
+// Find the first occurrence of 'needle' starting at or after 'from', or the last one starting before 'from' when
+// 'backward'. Occurrences can span pieces. Returns 1 and sets 'match' to its offset, 0 if there is none, or -ENOMEM.
+int snapshot_find(struct textbuffer_snapshot *snapshot, slice needle, size_t from, int backward, size_t *match);
+// Call fn(ctx, offset) for every occurrence of 'needle' starting in [from, to), in order, until it returns nonzero.
+// Occurrences can overlap and span pieces. Returns 1 if 'fn' stopped the search, 0 if not, or -ENOMEM.
+int snapshot_find_all(struct textbuffer_snapshot *snapshot, slice needle, size_t from, size_t to,
+		int (*fn)(void *ctx, size_t offset), void *ctx);
+// Keep in place the offsets among the 'n' sorted 'offsets' where 'needle' occurs. Returns how many are kept.
+size_t snapshot_filter(struct textbuffer_snapshot *snapshot, slice needle, size_t *offsets, size_t n);
+// Find the first match of 're' starting at or after 'from', or the last one starting before 'from' when 'backward'.
+// Returns 1 and sets the match to [*start, *end), 0 if there is none, or -ENOMEM.
+int snapshot_find_regexp(struct textbuffer_snapshot *snapshot, struct regexp *re, size_t from, int backward,
+		size_t *start, size_t *end);
+
+// When a file is reloaded, the mapping of its previous version is retired: the journal, the snapshots, and the text
+// itself after an undo, can still point into it. The textbuffer checks what it points into after reloading and when
+// edits leave the journal. A mapping nothing in the textbuffer points into anymore is handed over to the current
+// epoch, which ends there: the snapshot kept to derive the next ones is dropped, so that no later snapshot shares
+// pieces with it. Snapshots hold the epoch they were taken in, and every epoch holds the next one, so that the
+// mappings handed over to an epoch are unmapped once its snapshots and those of every previous epoch are released.
+struct textbuffer_epoch {
+  int refs;                     // the textbuffer while it is current, its snapshots, and the previous epoch
+  struct textbuffer_epoch *next;
+  struct mapped_file *files;    // unmapped when the epoch is released
+  size_t nfiles;
+};
+
+void textbuffer_epoch_release(struct textbuffer_epoch *epoch);
+
 struct textbuffer {
   // path on disk of the file, 'path' is owned by the textbuffer, 'basename' just points into path.
   char *path;
@@ -699,25 +1141,192 @@ struct textbuffer {
   // linked list of buffers for adding text
   struct textchunk *textchunk_head;
   struct textchunk *textchunk_last;
+  struct textchunk *textchunk_hint;     // last chunk found by textbuffer_stored_newline()
+
+  // original file content when loaded with textbuffer_load_mapped(), lines fragments point directly into it.
+  struct mapped_file file;
+  int pristine;                 // the text is still exactly the mapped file, nothing was edited
 
   // lines
-  size_t line_number;
+  size_t line_number;   // estimated until the textbuffer is fully indexed
   struct line *line_first;
   struct line *line_last;
-
-  // cursors, always ordered by cursor lineno
-  struct cursor_list {
-    struct cursor_list *next;
-    struct cursor cursor;
-  } cursor_list;
+  struct line *line_root;
+
+  // storage for lines and fragments, released all at once when the textbuffer is freed
+  struct slab line_slab;
+  struct slab textpiece_slab;
+  struct line_columns *columns;         // cached columns of lines, not allocated from a slab
+  struct highlight_language *language;  // syntax highlighting, or NULL
+  size_t highlight_dirty;               // index of the first line whose lexer state may be stale
+  size_t wrap_width;                    // columns at which views wrap lines, 0 when no view wraps them
+  int wrap_views;                       // views wrapping lines, see view_set_wrapping()
+
+  // parts of the mapped file not indexed yet, before the first line and after the last line, see textbuffer_load_lazy()
+  struct slice unindexed_head;
+  struct slice unindexed_tail;
+  // text appended to a followed file while its tail is unindexed: pieces in textchunks, cut into lines after the tail
+  struct slice *tail_appended;
+  size_t ntail_appended;
+  size_t tail_appended_capacity;
+  size_t tail_appended_bytes;
+
+  // cursors: the main cursor always exists, more cursors live in cursor_slab and are linked after the main cursor
+  struct cursor cursor;
+  struct slab cursor_slab;
+  size_t cursor_count;
 
   // TODO: selections
 
-  // TODO: command history, should it be tracked by cursor
+  struct journal journal;
+
+  // last snapshot, and the changes made since which are applied to it to derive the next snapshot
+  struct textbuffer_snapshot *snapshot;
+  struct snapshot_change *changes;
+  size_t nchanges;
+  size_t changes_capacity;
+  size_t change_sets;                   // changes, counting a batch with its sites once
+  size_t last_batch;                    // index of the last batch in 'changes'
+
+  // registry of open textbuffers, see textbuffer_open()
+  int registered;
+  int open_count;
+  dev_t file_dev;               // identity of the file, file_ino is 0 when unknown
+  ino_t file_ino;
+  off_t file_size;              // size and mtime of the file when it was last loaded, saved or reloaded
+  struct timespec file_mtime;
+  int watch;                    // inotify watch of the file directory, or -1
+  int follow;                   // appends to the file are read as they happen, see textbuffer_follow()
+
+  // mappings of previous versions of the file, which the text or the journal can still point into
+  struct mapped_file *retired_files;
+  size_t nretired_files;
+  size_t retired_dropped;       // journal.dropped when they were last checked
+  struct textbuffer_epoch *epoch;       // current epoch, allocated by the first snapshot
+
+  // background save, see textbuffer_save_async()
+  struct textbuffer_save_job *save_job;
+  int save_result;
 };
 
+// Both load functions return 0 or -errno.
+// textbuffer_load() copies the file content into textchunks.
+// textbuffer_load_mapped() maps the file instead and only scans it for newlines: only inserted text lives in textchunks.
 int textbuffer_load(const char *path, struct textbuffer *textbuffer);
+int textbuffer_load_mapped(const char *path, struct textbuffer *textbuffer);
 void textbuffer_free(struct textbuffer *textbuffer);
+size_t textbuffer_bytelen(struct textbuffer *textbuffer);
+// Take a snapshot of the text, released with snapshot_release(). Returns NULL when out of memory.
+// The first snapshot walks all lines, the next ones are derived from the previous one and the changes made since.
+struct textbuffer_snapshot* textbuffer_snapshot(struct textbuffer *textbuffer);
+// Write the textbuffer to 'path', or to its own path when 'path' is NULL, see file_writer. Returns 0 or -errno.
+// The text is written straight from textchunks and from the mapped file, without being copied. When the file
+// has not changed on disk since it was mapped, its unmodified parts are copied by the filesystem instead.
+int textbuffer_save(struct textbuffer *textbuffer, const char *path, int flags);
+// Same as textbuffer_save(), but the file is written by a background task while editing continues. Returns 0 once
+// the task is started, -EBUSY if a save is already running, or -errno. textbuffer_save_poll() must be called when the
+// event loop wakes up: it returns 1 once the save has completed, with its result in textbuffer_save_status().
+int textbuffer_save_async(struct textbuffer *textbuffer, const char *path, int flags);
+int textbuffer_save_poll(struct textbuffer *textbuffer);
+
+struct textbuffer_save_status {
+  int running;
+  int result;                   // result of the last completed save, 0 or -errno
+  size_t bytes;                 // size of the running save
+  size_t written;               // bytes of the running save written so far
+};
+
+void textbuffer_save_status(struct textbuffer *textbuffer, struct textbuffer_save_status *status);
+
+// Lazy loading for large files: like textbuffer_load_mapped(), but only the lines from 'offset' up to about
+// textbuffer_index_first_budget bytes are indexed when loading. The rest of the file gets indexed by calling
+// textbuffer_index_step() between input events, or on demand when cursors move out of the indexed lines.
+#define textbuffer_index_first_budget Kilo(256)
+#define textbuffer_index_step_budget Mega(4)
+int textbuffer_load_lazy(const char *path, struct textbuffer *textbuffer, size_t offset);
+// Index about 'budget' more bytes. Returns 1 if there is more to index, 0 when done, or -errno.
+int textbuffer_index_step(struct textbuffer *textbuffer, size_t budget);
+int textbuffer_is_indexed(struct textbuffer *textbuffer);
+
+// Open textbuffers are kept in a registry indexed by canonical path and by file identity.
+// textbuffer_open() returns the textbuffer already open for the same file if any, whatever the path used to open
+// it, or loads the file with textbuffer_load_lazy(). Returns NULL and sets 'fail' to -errno on failure.
+// Every textbuffer_open() is matched by a textbuffer_close(), which frees the textbuffer when it is closed
+// as many times as it was opened.
+struct textbuffer* textbuffer_open(const char *path, int *fail);
+void textbuffer_close(struct textbuffer *textbuffer);
+// The open textbuffer for the file at 'path', whatever the path used to open it, or NULL.
+struct textbuffer* textbuffer_find(const char *path);
+size_t textbuffer_registry_count();
+
+// External changes: registered textbuffers are watched with inotify through the directories of their files.
+// textbuffer_watch_fd() becomes readable when watched files change, or is -1 when nothing is watched, and
+// textbuffer_watch_process() then reloads the changed textbuffers. Returns the number of reloaded textbuffers.
+int textbuffer_watch_fd();
+int textbuffer_watch_process();
+// Reload a textbuffer if its file changed on disk since it was loaded, saved or reloaded. Returns 1 when reloaded,
+// 0 when unchanged, or -errno. Only the range that differs from the current text is replaced, as one transaction
+// which can be undone. Cursors and lines before and after that range keep their positions. A file written in place
+// cannot be compared with its previous content, and is replaced entirely without history.
+int textbuffer_reload(struct textbuffer *textbuffer);
+// Follow mode, for logs: when the file grows, only the appended bytes are read and cut into lines at the end of the
+// textbuffer, and cursors at the end of the text move to the new end. Writes are noticed as they happen instead of
+// when the file is closed. Other changes, like truncating or replacing the file, still reload it.
+void textbuffer_follow(struct textbuffer *textbuffer, int follow);
+
+// Memory held by a textbuffer.
+struct textbuffer_stats {
+  size_t lines;                 // lines in use
+  size_t textpieces;            // textpieces in use, not counting the fragments stored inline in lines
+  size_t textchunks;
+  size_t line_bytes;            // memory held for lines, including free and recycled lines
+  size_t textpiece_bytes;       // memory held for textpieces, including free and recycled textpieces
+  size_t textchunk_bytes;
+  size_t mapped_bytes;
+  size_t history_bytes;
+};
+void textbuffer_get_stats(struct textbuffer *textbuffer, struct textbuffer_stats *stats);
+
+// Cursor jumps in O(log n) in the indexed lines. Line numbers are 1-based and clamped to the textbuffer.
+void cursor_goto_line(struct cursor *cursor, size_t lineno);
+void cursor_goto_offset(struct cursor *cursor, size_t offset);
+size_t cursor_offset(struct cursor *cursor);
+// Wrapped rows of the indexed lines, or line indexes when lines are not wrapped. Going to a row moves the cursor to
+// the first char of the row.
+size_t cursor_row(struct cursor *cursor);
+void cursor_goto_row(struct cursor *cursor, size_t row);
+
+// Insert 'text' at the cursor and move the cursor after it. Returns 0 or -errno.
+// Inserted text is appended to the last textchunk and never moves: typing at the same place just extends the
+// fragment before the cursor instead of creating one textpiece per keystroke.
+int textbuffer_insert(struct cursor *cursor, slice text);
+// Delete 'len' bytes after the cursor. Returns 0 or -errno.
+int textbuffer_delete(struct cursor *cursor, size_t len);
+// Move the cursor to the next occurrence of 'needle' after the cursor, or to the previous one when 'backward'.
+// Returns 1 if found, 0 if not, or -errno. The text is searched in place through a snapshot, and occurrences can
+// span fragments and lines.
+int textbuffer_search(struct cursor *cursor, slice needle, int backward);
+// Same as textbuffer_search() for the matches of a regexp. Sets 'len' to the length of the match found.
+int textbuffer_search_regexp(struct cursor *cursor, struct regexp *re, int backward, size_t *len);
+
+// More cursors, for instance one per search match. Returns NULL if out of memory.
+struct cursor* textbuffer_add_cursor(struct textbuffer *textbuffer, size_t offset);
+void textbuffer_remove_cursor(struct cursor *cursor);   // the main cursor cannot be removed
+void textbuffer_remove_extra_cursors(struct textbuffer *textbuffer);
+// Insert or delete at every cursor as a single transaction. 'len' counts bytes after the cursors, or before them
+// when negative. Cursors ending at the same place are merged. Returns 0 or -errno.
+int textbuffer_insert_all(struct textbuffer *textbuffer, slice text);
+int textbuffer_delete_all(struct textbuffer *textbuffer, int len);
+
+// Undo and redo edits one transaction at a time, moving the textbuffer cursor to the edit.
+// Returns 1 if a transaction was undone or redone, 0 if there was none, or -errno.
+// Consecutive insertions or deletions at the same place are merged, like when typing or hitting backspace.
+// Explicit transactions group all the edits made until the matching end, and can be nested.
+#define textbuffer_history_limit Mega(64)
+int textbuffer_undo(struct textbuffer *textbuffer);
+int textbuffer_redo(struct textbuffer *textbuffer);
+void textbuffer_begin_transaction(struct textbuffer *textbuffer);
+void textbuffer_end_transaction(struct textbuffer *textbuffer);
 
 
 // TODO: define all ops
@@ -726,6 +1335,10 @@ enum textbuffer_op {
   TEXTBUFFER_TOUCH,
   TEXTBUFFER_SAVE,
   TEXTBUFFER_CLOSE,
+  TEXTBUFFER_INSERT,    // args: the text to insert at every cursor, arg_size: its length
+  TEXTBUFFER_DELETE,    // arg_size: number of bytes to delete after every cursor, or before if negative
+  TEXTBUFFER_UNDO,
+  TEXTBUFFER_REDO,
 
   TEXTBUFFER_MAX,
 };
@@ -737,8 +1350,85 @@ struct textbuffer_command {
 };
 
 
-void textbuffer_init();
-struct err textbuffer_operation(struct textbuffer textbuffer, struct textbuffer_command *command);
+struct err textbuffer_operation(struct textbuffer *textbuffer, struct textbuffer_command *command);
+
+
+/// module FIND ///
+
+
+// Search as you type: the matches of the query are kept between updates, and when the new query extends the
+// previous one only the previous matches are checked again. The rest of the text is searched by a background task,
+// while the matches in the visible part of the text are found right away by find_visible().
+struct find {
+  struct textbuffer *textbuffer;
+  struct textbuffer_snapshot *snapshot;   // the text the matches are in
+  char *query;
+  size_t query_len;
+
+  // sorted offsets of the matches starting before 'scanned', only complete once the background task is done
+  size_t *matches;
+  size_t nmatches;
+  size_t capacity;
+  size_t scanned;
+
+  // matches found synchronously for the last range passed to find_visible()
+  size_t *visible;
+  size_t nvisible;
+  size_t visible_capacity;
+  size_t visible_from;
+  size_t visible_to;
+
+  struct find_job *job;
+};
+
+void find_init(struct find *find, struct textbuffer *textbuffer);
+void find_free(struct find *find);
+// Set the query and start searching it in the background. An empty query clears the matches. Returns 0 or -errno.
+int find_update(struct find *find, slice query);
+// Must be called when the event loop wakes up while a search is running: returns 1 once it has completed.
+int find_poll(struct find *find);
+// Get the sorted offsets of the matches overlapping [from, to), searching that range right away if the background
+// task has not reached it yet. The textbuffer is searched again if it changed. Returns the number of matches.
+size_t find_visible(struct find *find, size_t from, size_t to, const size_t **matches);
+// Find the first match starting at or after 'offset', or the last one starting before it when 'backward'.
+// Returns 1 and sets 'match', 0 if there is none, or -errno.
+int find_next(struct find *find, size_t offset, int backward, size_t *match);
+
+struct find_status {
+  int running;
+  size_t count;                 // matches found so far
+  size_t scanned;               // text searched so far
+  size_t bytes;
+};
+
+void find_status(struct find *find, struct find_status *status);
+
+
+/// module HIGHLIGHT ///
+
+// Incremental syntax highlighting, see highlight.cpp.
+struct highlight_language;
+
+// A run of bytes of a line drawn in the same color.
+struct highlight_run {
+  size_t x;
+  size_t len;
+  int color;
+};
+
+struct highlight_language* highlight_language_for(const char *path);   // from the extension, NULL if none is known
+// Returns 0, or -ENOMEM. A NULL language turns off highlighting.
+int highlight_set_language(struct textbuffer *textbuffer, struct highlight_language *language);
+// Write the colored runs of a line within bytes [from, to) into 'runs', up to 'capacity' runs, and return their
+// number. Bytes without a run keep the default color.
+size_t highlight_line(struct textbuffer *textbuffer, struct line *line, size_t from, size_t to,
+		struct highlight_run *runs, size_t capacity);
+
+
+/// module REPLACE ///
+
+// Replacing across files, declared in its own header for the navigation index.
+#include <replace.h>
 
 
 /// module VIEWS ///
@@ -750,11 +1440,24 @@ struct err textbuffer_operation(struct textbuffer textbuffer, struct textbuffer_
 struct view {
   struct textbuffer *textbuffer;
   struct cursor *cursor;
+  struct stream_cursor *stream;   // views on streamed files have no textbuffer
+  struct find *find;              // matches to highlight, or NULL
   int y_offset;
-  u8 are_line_wrapping;
+  size_t x_offset;                // first column displayed, scrolled to keep the cursor in view
+  u8 are_line_wrapping;           // long lines continue on the next rows instead of scrolling horizontally
   u8 are_lineno_absolute;
   // hightlining mode ...
   // tab display ...
 };
 
+void view_init(struct view *view, struct cursor *cursor);
+void view_init_stream(struct view *view, struct stream_cursor *cursor);
+// Move the cursor up or down by dy lines, scrolling the view to keep the cursor inside 'height' rows.
+void view_move_cursor(struct view *view, int dy, int height);
+// Move the cursor left or right by dx chars inside its line, the view scrolls horizontally when drawn.
+void view_move_cursor_x(struct view *view, int dx);
+// Turn line wrapping on or off. Lines of a textbuffer are only measured for wrapping while one of its views wraps them.
+void view_set_wrapping(struct view *view, int wrapping);
+void view_draw(struct view *view, struct framebuffer *framebuffer, rec rec);
+
 #endif
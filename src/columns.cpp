@@ -0,0 +1,422 @@
+// columns.cpp implements the display columns of lines, for moving cursors up and down at the same column and for
+// drawing a window of columns of a line.
+//
+// Finding the byte offset at a given column means decoding the line from its start. Short lines are decoded on
+// every call. Lines longer than columns_step bytes cache one checkpoint every columns_step bytes: the column of the
+// last char boundary at or before that byte. A byte offset then maps to a column starting from the checkpoint before
+// it, and a column to a byte offset with a binary search of the checkpoints, both decoding at most columns_step
+// bytes whatever the length of the line. Runs of ASCII text without tabs are skipped with scan_plain().
+//
+// Checkpoints are only decoded as far as they are needed: showing the start of a 50MB line does not decode the rest
+// of it. An edit only drops the checkpoints after the edited byte, so that typing at the end of a long line does not
+// decode it again from its start.
+//
+// Views wrapping lines need the rows of every line: each line stores its number of rows at the wrap width, and the
+// line tree sums them. Edits measure again the lines they change, and a new width measures every line once.
+#include <chi.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+static const size_t columns_step = 256;
+
+// Longest UTF-8 char: a checkpoint only depends on the bytes before it and the bytes of the char starting there.
+static const size_t columns_max_char = 4;
+
+struct column_checkpoint {
+	size_t x;
+	size_t column;
+};
+
+struct line_columns {
+	struct line_columns *prev;    // all the cached columns of a textbuffer
+	struct line_columns *next;
+	struct column_checkpoint *checkpoints;        // checkpoints[k] is the last char boundary at or before byte k * columns_step
+	size_t ncheckpoints;          // decoded so far, at least the one at byte 0
+	size_t capacity;
+	size_t width;                 // width of the line, once 'complete'
+	int complete;
+};
+
+static void column_iter_seek_fragment(struct column_iter *iter)
+{
+	while (iter->fragment && iter->x - iter->fragment_x >= slice_len(iter->fragment->slice)) {
+		iter->fragment_x += slice_len(iter->fragment->slice);
+		iter->fragment = iter->fragment->next;
+	}
+}
+
+// 'x' must be a char boundary at 'column'.
+static void column_iter_seek(struct column_iter *iter, struct line *line, size_t x, size_t column)
+{
+	iter->fragment = line->fragments;
+	iter->fragment_x = 0;
+	iter->x = x;
+	iter->column = column;
+	column_iter_seek_fragment(iter);
+}
+
+// Byte 'i' bytes after the iterator position, or -1 past the end of the line. Chars can span fragments.
+static int column_iter_peek(struct column_iter *iter, size_t i)
+{
+	struct textpiece *fragment = iter->fragment;
+	size_t offset = iter->x - iter->fragment_x + i;
+	while (fragment && offset >= slice_len(fragment->slice)) {
+		offset -= slice_len(fragment->slice);
+		fragment = fragment->next;
+	}
+	return fragment ? (u8) fragment->slice.start[offset] : -1;
+}
+
+// Length of the UTF-8 char starting with 'lead' at the iterator position, or 1 if it is not a valid char. Overlong
+// encodings, surrogates and code points above U+10FFFF are not valid.
+static size_t column_iter_char_len(struct column_iter *iter, u8 lead)
+{
+	size_t len;
+	int lo = 0x80;        // range of the second byte
+	int hi = 0xbf;
+	if (lead < 0xc2) {
+		return 1;
+	} else if (lead < 0xe0) {
+		len = 2;
+	} else if (lead < 0xf0) {
+		len = 3;
+		lo = lead == 0xe0 ? 0xa0 : lo;
+		hi = lead == 0xed ? 0x9f : hi;
+	} else if (lead < 0xf5) {
+		len = 4;
+		lo = lead == 0xf0 ? 0x90 : lo;
+		hi = lead == 0xf4 ? 0x8f : hi;
+	} else {
+		return 1;
+	}
+	for (size_t i = 1; i < len; i++) {
+		int c = column_iter_peek(iter, i);
+		if (c < lo || hi < c) {
+			return 1;
+		}
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	return len;
+}
+
+// Move over the chars which end at or before byte 'x' and column 'column'.
+static void column_walk(struct column_iter *iter, size_t x, size_t column)
+{
+	while (iter->x < x && iter->column < column) {
+		column_iter_seek_fragment(iter);
+		if (!iter->fragment) {
+			return;
+		}
+		const char *text = iter->fragment->slice.start + (iter->x - iter->fragment_x);
+		size_t available = slice_len(iter->fragment->slice) - (iter->x - iter->fragment_x);
+		size_t n = min(available, min(x - iter->x, column - iter->column));
+		size_t plain = scan_plain(text, n);
+		iter->x += plain;
+		iter->column += plain;
+		if (plain == n) {
+			continue;
+		}
+		u8 c = text[plain];
+		size_t len = 1;
+		size_t width = 1;
+		if (c == '\t') {
+			width = column_tab_width - iter->column % column_tab_width;
+		} else {
+			len = column_iter_char_len(iter, c);
+		}
+		if (x - iter->x < len || column - iter->column < width) {
+			return;
+		}
+		iter->x += len;
+		iter->column += width;
+	}
+}
+
+static struct line_columns* line_columns_alloc(struct textbuffer *textbuffer, struct line *line)
+{
+	struct line_columns *columns = (struct line_columns*) calloc(1, sizeof(struct line_columns));
+	if_null(columns) {
+		return NULL;
+	}
+	columns->next = textbuffer->columns;
+	if (textbuffer->columns) {
+		textbuffer->columns->prev = columns;
+	}
+	textbuffer->columns = columns;
+	line->columns = columns;
+	return columns;
+}
+
+// Decode the checkpoints up to checkpoints[k]. Returns 0, or -ENOMEM.
+static int line_columns_extend(struct line_columns *columns, struct line *line, size_t k)
+{
+	if (k < columns->ncheckpoints) {
+		return 0;
+	}
+	size_t n = line->bytelen / columns_step + 1;
+	assert(k < n);
+	if (columns->capacity < n) {
+		struct column_checkpoint *checkpoints = (struct column_checkpoint*) realloc(columns->checkpoints, n * sizeof(struct column_checkpoint));
+		if_null(checkpoints) {
+			return -ENOMEM;
+		}
+		columns->checkpoints = checkpoints;
+		columns->capacity = n;
+	}
+	if (!columns->ncheckpoints) {
+		columns->checkpoints[0] = {0, 0};
+		columns->ncheckpoints = 1;
+	}
+	struct column_checkpoint last = columns->checkpoints[columns->ncheckpoints - 1];
+	struct column_iter iter;
+	column_iter_seek(&iter, line, last.x, last.column);
+	while (columns->ncheckpoints <= k) {
+		column_walk(&iter, columns->ncheckpoints * columns_step, SIZE_MAX);
+		columns->checkpoints[columns->ncheckpoints++] = {iter.x, iter.column};
+	}
+	return 0;
+}
+
+// Columns of a long line decoded up to checkpoints[k], or NULL for a short line or when out of memory: the line is
+// then decoded from its start.
+static struct line_columns* line_columns_get(struct textbuffer *textbuffer, struct line *line, size_t k)
+{
+	if (line->bytelen <= columns_step) {
+		return NULL;
+	}
+	struct line_columns *columns = line->columns ? line->columns : line_columns_alloc(textbuffer, line);
+	if (!columns || line_columns_extend(columns, line, k)) {
+		return NULL;
+	}
+	return columns;
+}
+
+size_t line_width(struct textbuffer *textbuffer, struct line *line)
+{
+	size_t last = line->bytelen / columns_step;
+	struct line_columns *columns = line_columns_get(textbuffer, line, last);
+	if (columns && columns->complete) {
+		return columns->width;
+	}
+	struct column_iter iter;
+	struct column_checkpoint at = columns ? columns->checkpoints[last] : (struct column_checkpoint) {0, 0};
+	column_iter_seek(&iter, line, at.x, at.column);
+	column_walk(&iter, SIZE_MAX, SIZE_MAX);
+	if (columns) {
+		columns->width = iter.column;
+		columns->complete = 1;
+	}
+	return iter.column;
+}
+
+size_t line_column_at(struct textbuffer *textbuffer, struct line *line, size_t x)
+{
+	x = min(x, line->bytelen);
+	struct line_columns *columns = line_columns_get(textbuffer, line, x / columns_step);
+	struct column_checkpoint at = columns ? columns->checkpoints[x / columns_step] : (struct column_checkpoint) {0, 0};
+	struct column_iter iter;
+	column_iter_seek(&iter, line, at.x, at.column);
+	column_walk(&iter, x, SIZE_MAX);
+	return iter.column;
+}
+
+// Last checkpoint at or before a column, decoding checkpoints until one is past the column.
+static struct column_checkpoint line_checkpoint_before(struct textbuffer *textbuffer, struct line *line, size_t column)
+{
+	struct column_checkpoint at = {0, 0};
+	struct line_columns *columns = line_columns_get(textbuffer, line, 0);
+	if (!columns) {
+		return at;
+	}
+	size_t n = line->bytelen / columns_step + 1;
+	while (columns->ncheckpoints < n && columns->checkpoints[columns->ncheckpoints - 1].column <= column) {
+		if (line_columns_extend(columns, line, columns->ncheckpoints)) {
+			break;
+		}
+	}
+	size_t lo = 0;
+	size_t hi = columns->ncheckpoints;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (columns->checkpoints[mid].column <= column) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return columns->checkpoints[lo];
+}
+
+size_t line_x_at_column(struct textbuffer *textbuffer, struct line *line, size_t column)
+{
+	struct column_checkpoint at = line_checkpoint_before(textbuffer, line, column);
+	struct column_iter iter;
+	column_iter_seek(&iter, line, at.x, at.column);
+	column_walk(&iter, SIZE_MAX, column);
+	return iter.x;
+}
+
+size_t line_next_char(struct line *line, size_t x)
+{
+	if (x >= line->bytelen) {
+		return line->bytelen;
+	}
+	struct column_iter iter;
+	column_iter_seek(&iter, line, x, 0);
+	return x + column_iter_char_len(&iter, column_iter_peek(&iter, 0));
+}
+
+// A byte which starts a valid char ending at 'x' is a char boundary: no char contains it otherwise, since a valid
+// char only contains continuation bytes after its first byte, and invalid bytes are chars of their own.
+size_t line_prev_char(struct line *line, size_t x)
+{
+	x = min(x, line->bytelen);
+	if (x == 0) {
+		return 0;
+	}
+	struct column_iter iter;
+	for (size_t len = min(x, columns_max_char); len > 1; len--) {
+		column_iter_seek(&iter, line, x - len, 0);
+		if (column_iter_char_len(&iter, column_iter_peek(&iter, 0)) == len) {
+			return x - len;
+		}
+	}
+	return x - 1;
+}
+
+void column_iter_init(struct column_iter *iter, struct textbuffer *textbuffer, struct line *line, size_t column)
+{
+	struct column_checkpoint at = line_checkpoint_before(textbuffer, line, column);
+	column_iter_seek(iter, line, at.x, at.column);
+	column_walk(iter, SIZE_MAX, column);
+}
+
+int column_iter_next(struct column_iter *iter, struct column_char *c)
+{
+	column_iter_seek_fragment(iter);
+	if (!iter->fragment) {
+		return 0;
+	}
+	int lead = column_iter_peek(iter, 0);
+	c->x = iter->x;
+	c->column = iter->column;
+	c->len = 1;
+	c->width = 1;
+	c->valid = lead < 0x80;
+	if (lead == '\t') {
+		c->width = column_tab_width - iter->column % column_tab_width;
+	} else if (lead >= 0x80) {
+		c->len = column_iter_char_len(iter, lead);
+		c->valid = c->len > 1;
+	}
+	for (size_t i = 0; i < c->len; i++) {
+		c->bytes[i] = (char) column_iter_peek(iter, i);
+	}
+	iter->x += c->len;
+	iter->column += c->width;
+	return 1;
+}
+
+void line_columns_invalidate(struct textbuffer *textbuffer, struct line *line, size_t x)
+{
+	struct line_columns *columns = line->columns;
+	if (!columns) {
+		return;
+	}
+	// Checkpoints up to the last one not depending on the bytes from 'x' are kept.
+	size_t kept = x >= columns_max_char ? (x - columns_max_char) / columns_step + 1 : 0;
+	if (kept > 1 && line->bytelen > columns_step) {
+		columns->ncheckpoints = min(columns->ncheckpoints, kept);
+		columns->complete = 0;
+		return;
+	}
+	if (columns->prev) {
+		columns->prev->next = columns->next;
+	} else {
+		textbuffer->columns = columns->next;
+	}
+	if (columns->next) {
+		columns->next->prev = columns->prev;
+	}
+	free(columns->checkpoints);
+	free(columns);
+	line->columns = NULL;
+}
+
+// Lines are released all at once with their slab, only the cached columns need to be visited.
+void textbuffer_free_columns(struct textbuffer *textbuffer)
+{
+	struct line_columns *columns = textbuffer->columns;
+	while (columns) {
+		struct line_columns *next = columns->next;
+		free(columns->checkpoints);
+		free(columns);
+		columns = next;
+	}
+	textbuffer->columns = NULL;
+}
+
+// Width of a line decoded from its start without caching checkpoints, so that lines can be measured from several
+// threads at once.
+static size_t line_measure(struct line *line)
+{
+	if (line->columns && line->columns->complete) {
+		return line->columns->width;
+	}
+	struct column_iter iter;
+	column_iter_seek(&iter, line, 0, 0);
+	column_walk(&iter, SIZE_MAX, SIZE_MAX);
+	return iter.column;
+}
+
+static u32 line_wrap_rows(size_t width, size_t wrap_width)
+{
+	return max((size_t) 1, (width + wrap_width - 1) / wrap_width);
+}
+
+// No char is wider than a tab: most lines fit in a row without being decoded.
+static int line_fits_row(struct line *line, size_t wrap_width)
+{
+	return line->bytelen * column_tab_width <= wrap_width;
+}
+
+size_t line_wrap_row(struct textbuffer *textbuffer, struct line *line, size_t x)
+{
+	if (!textbuffer->wrap_width || line->wrap_rows <= 1) {
+		return 0;
+	}
+	// The end of a line filling its last row stays on that row.
+	return min(line_column_at(textbuffer, line, x) / textbuffer->wrap_width, (size_t) line->wrap_rows - 1);
+}
+
+void line_wrap_update(struct textbuffer *textbuffer, struct line *line)
+{
+	size_t wrap_width = textbuffer->wrap_width;
+	if (wrap_width) {
+		line->wrap_rows = line_fits_row(line, wrap_width) ? 1 : line_wrap_rows(line_width(textbuffer, line), wrap_width);
+	}
+}
+
+static void line_wrap_measure(void *ctx, struct line *line)
+{
+	size_t wrap_width = *(size_t*) ctx;
+	line->wrap_rows = line_fits_row(line, wrap_width) ? 1 : line_wrap_rows(line_measure(line), wrap_width);
+}
+
+void linetree_wrap(struct textbuffer *textbuffer, struct line *root)
+{
+	if (textbuffer->wrap_width) {
+		linetree_refresh(root, line_wrap_measure, &textbuffer->wrap_width);
+	}
+}
+
+void textbuffer_set_wrap_width(struct textbuffer *textbuffer, size_t width)
+{
+	if (textbuffer->wrap_width == width) {
+		return;
+	}
+	textbuffer->wrap_width = width;
+	linetree_wrap(textbuffer, textbuffer->line_root);
+}
@@ -33,10 +33,13 @@ static struct keyval keyval_from_line(struct slice s)
 void config_init()
 {
 	struct mapped_file config;
-	mapped_file_load(&config, "./config.txt");
+	if (mapped_file_load(&config, "./config.txt") < 0) {
+		return;
+	}
 
-	while (slice_len(config.data)) {
-		struct slice line = slice_take_line(&config.data);
+	struct slice data = config.data;
+	while (slice_len(data)) {
+		struct slice line = slice_take_line(&data);
 		if (slice_empty(line)) {
 			continue;
 		}
@@ -59,4 +62,6 @@ ifdebug {
 		if (k) free(k);
 		if (v) free(v);
 	}
+
+	mapped_file_unload(&config);
 }
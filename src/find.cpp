@@ -0,0 +1,349 @@
+// find.cpp implements searching as you type.
+//
+// Typing a query one character at a time must not search the whole text again on every key. Any match of a query
+// which extends the previous one is also a match of the previous query: when the text has not changed, only the
+// previous matches are checked again, with snapshot_filter(). The text beyond the previous matches, or all the text
+// for a new query, is searched by a background task on a snapshot, in steps so that the task can be cancelled when
+// the query changes again. A cancelled task still leaves the matches found so far for the next query to refine.
+//
+// Meanwhile, find_visible() searches the range of text drawn on screen synchronously, so that the matches in view
+// appear before the background task is done, and the number of matches is read while the task runs.
+#include <chi.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+// Text searched and candidates checked between checks for cancellation.
+static const size_t find_scan_step = Mega(4);
+static const size_t find_refine_step = 0x10000;
+
+struct find_offsets {
+	size_t *offsets;
+	size_t count;
+	size_t capacity;
+	int fail;
+};
+
+static int find_offsets_reserve(struct find_offsets *offsets, size_t n)
+{
+	if (offsets->count + n <= offsets->capacity) {
+		return 0;
+	}
+	size_t capacity = max(max(offsets->capacity * 2, offsets->count + n), (size_t) 64);
+	size_t *array = (size_t*) realloc(offsets->offsets, capacity * sizeof(size_t));
+	if_null(array) {
+		offsets->fail = -ENOMEM;
+		return -ENOMEM;
+	}
+	offsets->offsets = array;
+	offsets->capacity = capacity;
+	return 0;
+}
+
+// Callback for snapshot_find_all(). The count is read by other threads while a task runs.
+static int find_offsets_add(void *ctx, size_t offset)
+{
+	struct find_offsets *offsets = (struct find_offsets*) ctx;
+	if (find_offsets_reserve(offsets, 1)) {
+		return 1;
+	}
+	offsets->offsets[offsets->count] = offset;
+	__atomic_store_n(&offsets->count, offsets->count + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+struct find_job {
+	struct worker_task task;
+	struct textbuffer_snapshot *snapshot;
+	char *query;
+	size_t query_len;
+	// matches of the previous query, complete before 'candidates_end'
+	size_t *candidates;
+	size_t ncandidates;
+	size_t candidates_end;
+	// matches found, complete before 'done'
+	struct find_offsets found;
+	size_t done;
+	int cancel;
+};
+
+static void find_job_free(struct find_job *job)
+{
+	snapshot_release(job->snapshot);
+	free(job->query);
+	free(job->candidates);
+	free(job->found.offsets);
+	free(job);
+}
+
+static int find_job_cancelled(struct find_job *job)
+{
+	return __atomic_load_n(&job->cancel, __ATOMIC_RELAXED);
+}
+
+static void find_run(void *ctx)
+{
+	struct find_job *job = (struct find_job*) ctx;
+	struct find_offsets *found = &job->found;
+	slice needle = s(job->query, job->query + job->query_len);
+
+	for (size_t i = 0; i < job->ncandidates && !find_job_cancelled(job); i += find_refine_step) {
+		size_t n = min(find_refine_step, job->ncandidates - i);
+		size_t kept = snapshot_filter(job->snapshot, needle, job->candidates + i, n);
+		if (find_offsets_reserve(found, kept)) {
+			return;
+		}
+		memcpy(found->offsets + found->count, job->candidates + i, kept * sizeof(size_t));
+		__atomic_store_n(&found->count, found->count + kept, __ATOMIC_RELAXED);
+		size_t done = i + n < job->ncandidates ? job->candidates[i + n] : job->candidates_end;
+		__atomic_store_n(&job->done, done, __ATOMIC_RELAXED);
+	}
+	if (job->ncandidates == 0) {
+		__atomic_store_n(&job->done, job->candidates_end, __ATOMIC_RELAXED);
+	}
+
+	size_t from = job->done;
+	while (from < job->snapshot->bytes && !find_job_cancelled(job)) {
+		size_t to = min(job->snapshot->bytes, from + find_scan_step);
+		snapshot_find_all(job->snapshot, needle, from, to, find_offsets_add, found);
+		if (found->fail) {
+			return;
+		}
+		__atomic_store_n(&job->done, to, __ATOMIC_RELAXED);
+		from = to;
+	}
+}
+
+// Wait for the running task, and keep what it found.
+static void find_collect(struct find *find)
+{
+	struct find_job *job = find->job;
+	worker_join(&job->task);
+	free(find->matches);
+	find->matches = job->found.offsets;
+	find->nmatches = job->found.count;
+	find->capacity = job->found.capacity;
+	find->scanned = job->done;
+	job->found.offsets = NULL;
+	find->job = NULL;
+	find_job_free(job);
+}
+
+static void find_cancel(struct find *find)
+{
+	if (find->job) {
+		__atomic_store_n(&find->job->cancel, 1, __ATOMIC_RELAXED);
+		find_collect(find);
+	}
+}
+
+void find_init(struct find *find, struct textbuffer *textbuffer)
+{
+	memset(find, 0, sizeof(struct find));
+	find->textbuffer = textbuffer;
+}
+
+void find_free(struct find *find)
+{
+	find_cancel(find);
+	if (find->snapshot) {
+		snapshot_release(find->snapshot);
+	}
+	free(find->query);
+	free(find->matches);
+	free(find->visible);
+	memset(find, 0, sizeof(struct find));
+}
+
+int find_update(struct find *find, slice query)
+{
+	find_cancel(find);
+	struct textbuffer_snapshot *snapshot = textbuffer_snapshot(find->textbuffer);
+	if_null(snapshot) {
+		return -ENOMEM;
+	}
+	size_t len = slice_len(query);
+	char *copy = (char*) malloc(len + 1);
+	if_null(copy) {
+		snapshot_release(snapshot);
+		return -ENOMEM;
+	}
+	memcpy(copy, query.start, len);
+
+	int refine = snapshot == find->snapshot && find->query_len && len >= find->query_len &&
+		!memcmp(copy, find->query, find->query_len);
+	if (!refine) {
+		find->nmatches = 0;
+		find->scanned = 0;
+	}
+	if (find->snapshot) {
+		snapshot_release(find->snapshot);
+	}
+	free(find->query);
+	find->snapshot = snapshot;
+	find->query = copy;
+	find->query_len = len;
+	find->nvisible = 0;
+	find->visible_from = 0;
+	find->visible_to = 0;
+	if (!len) {
+		find->nmatches = 0;
+		find->scanned = snapshot->bytes;
+		return 0;
+	}
+
+	struct find_job *job = (struct find_job*) calloc(1, sizeof(struct find_job));
+	char *job_query = (char*) malloc(len);
+	if (!job || !job_query) {
+		free(job);
+		free(job_query);
+		find->nmatches = 0;
+		find->scanned = 0;
+		return -ENOMEM;
+	}
+	memcpy(job_query, copy, len);
+	job->query = job_query;
+	job->query_len = len;
+	snapshot_acquire(snapshot);
+	job->snapshot = snapshot;
+	// The job refines the current matches, and owns them until it is collected.
+	job->candidates = find->matches;
+	job->ncandidates = find->nmatches;
+	job->candidates_end = find->scanned;
+	find->matches = NULL;
+	find->nmatches = 0;
+	find->capacity = 0;
+	find->scanned = 0;
+
+	int fail = worker_start(&job->task, find_run, job);
+	if (fail) {
+		find_job_free(job);
+		return fail;
+	}
+	find->job = job;
+	return 0;
+}
+
+int find_poll(struct find *find)
+{
+	if (!find->job || !worker_is_done(&find->job->task)) {
+		return 0;
+	}
+	find_collect(find);
+	return 1;
+}
+
+// Search again when the text changed since the last update.
+static int find_refresh(struct find *find)
+{
+	if (!find->query_len) {
+		return 0;
+	}
+	struct textbuffer_snapshot *snapshot = textbuffer_snapshot(find->textbuffer);
+	if_null(snapshot) {
+		return -ENOMEM;
+	}
+	int changed = snapshot != find->snapshot;
+	snapshot_release(snapshot);
+	if (!changed) {
+		return 0;
+	}
+	return find_update(find, s(find->query, find->query + find->query_len));
+}
+
+// First index in the sorted 'offsets' with an offset at or after 'offset'.
+static size_t find_lower_bound(const size_t *offsets, size_t n, size_t offset)
+{
+	size_t lo = 0;
+	size_t hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (offsets[mid] < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static size_t find_range(const size_t *offsets, size_t n, size_t from, size_t to, const size_t **matches)
+{
+	size_t first = find_lower_bound(offsets, n, from);
+	size_t last = find_lower_bound(offsets, n, to);
+	*matches = offsets + first;
+	return last - first;
+}
+
+size_t find_visible(struct find *find, size_t from, size_t to, const size_t **matches)
+{
+	*matches = NULL;
+	if (find_refresh(find) || !find->query_len) {
+		return 0;
+	}
+	to = min(to, find->snapshot->bytes);
+	// Matches starting up to query_len - 1 bytes before 'from' overlap the range.
+	from = from >= find->query_len ? from - find->query_len + 1 : 0;
+	if (to <= find->scanned) {
+		return find_range(find->matches, find->nmatches, from, to, matches);
+	}
+	if (from < find->visible_from || find->visible_to < to) {
+		struct find_offsets visible = {
+			.offsets = find->visible,
+			.count = 0,
+			.capacity = find->visible_capacity,
+			.fail = 0,
+		};
+		snapshot_find_all(find->snapshot, s(find->query, find->query + find->query_len), from, to, find_offsets_add, &visible);
+		find->visible = visible.offsets;
+		find->visible_capacity = visible.capacity;
+		find->nvisible = visible.count;
+		find->visible_from = from;
+		find->visible_to = visible.fail ? from : to;
+	}
+	return find_range(find->visible, find->nvisible, from, to, matches);
+}
+
+int find_next(struct find *find, size_t offset, int backward, size_t *match)
+{
+	int fail = find_refresh(find);
+	if (fail) {
+		return fail;
+	}
+	if (!find->query_len) {
+		return 0;
+	}
+	// Until the background task is done, search the snapshot directly.
+	if (find->scanned < find->snapshot->bytes) {
+		return snapshot_find(find->snapshot, s(find->query, find->query + find->query_len), offset, backward, match);
+	}
+	size_t i = find_lower_bound(find->matches, find->nmatches, offset);
+	if (backward) {
+		if (i == 0) {
+			return 0;
+		}
+		*match = find->matches[i - 1];
+		return 1;
+	}
+	if (i == find->nmatches) {
+		return 0;
+	}
+	*match = find->matches[i];
+	return 1;
+}
+
+void find_status(struct find *find, struct find_status *status)
+{
+	memset(status, 0, sizeof(struct find_status));
+	struct find_job *job = find->job;
+	status->bytes = find->snapshot ? find->snapshot->bytes : 0;
+	if (job) {
+		status->running = 1;
+		status->count = __atomic_load_n(&job->found.count, __ATOMIC_RELAXED);
+		status->scanned = __atomic_load_n(&job->done, __ATOMIC_RELAXED);
+	} else {
+		status->count = find->nmatches;
+		status->scanned = find->scanned;
+	}
+}
@@ -0,0 +1,577 @@
+// highlight.cpp implements syntax highlighting.
+//
+// Languages are described by their delimited tokens (comments and strings), their keywords and their types, and
+// compiled once into a table driven state machine: every byte moves the lexer to next[state][byte], flagged with
+// highlight_start when the byte starts a new token. The state reached at the end of a line is the state the next
+// line starts in, so that tokens like block comments continue across lines.
+//
+// Every line stores the lexer state at its end. An edit marks its line dirty and lowers textbuffer->highlight_dirty,
+// the index of the first line whose state may be stale. Before a line is colored, the lines from highlight_dirty to
+// it are brought up to date: dirty lines are lexed again, and so are the lines after a line whose end state changed.
+// Other lines keep their state without being lexed, so that an edit only lexes the lines it actually changes, until
+// the end states match again. Only the lines drawn in a view are colored.
+#include <chi.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define highlight_max_states 128
+#define highlight_start 0x80
+#define highlight_max_word 32
+
+// Longer lines are not colored, but still lexed for the state of the next lines.
+static const size_t highlight_max_line = 0x10000;
+
+enum highlight_kind {
+	HIGHLIGHT_TEXT,
+	HIGHLIGHT_KEYWORD,
+	HIGHLIGHT_TYPE,
+	HIGHLIGHT_NUMBER,
+	HIGHLIGHT_STRING,
+	HIGHLIGHT_COMMENT,
+	HIGHLIGHT_PREPROC,
+	HIGHLIGHT_KINDS,
+};
+
+// Text is left in the default color.
+static const int highlight_colors[HIGHLIGHT_KINDS] = {
+	[HIGHLIGHT_TEXT]	= 0,
+	[HIGHLIGHT_KEYWORD]	= 75,
+	[HIGHLIGHT_TYPE]	= 79,
+	[HIGHLIGHT_NUMBER]	= 173,
+	[HIGHLIGHT_STRING]	= 107,
+	[HIGHLIGHT_COMMENT]	= 244,
+	[HIGHLIGHT_PREPROC]	= 170,
+};
+
+// A delimited token. When a start delimiter is a prefix of another one, the shorter one wins.
+struct highlight_rule {
+	const char *start;
+	const char *end;              // NULL for tokens ending with the line
+	char escape;                  // escapes the next char, or the end of the line
+	int multiline;                // continues on the next lines until 'end'
+	int kind;
+};
+
+struct highlight_keyword {
+	slice word;
+	int kind;
+};
+
+struct highlight_machine {
+	u8 next[highlight_max_states][256];
+	u8 kind[highlight_max_states];
+	u8 word[highlight_max_states];        // tokens ending in this state are looked up in the keywords
+	int nstates;
+	struct highlight_keyword *keywords;   // sorted
+	size_t nkeywords;
+};
+
+struct highlight_language {
+	const char *name;
+	const char *extensions;               // space separated
+	const struct highlight_rule *rules;   // terminated by a rule without start
+	const char *keywords;                 // space separated
+	const char *types;
+	struct highlight_machine *machine;    // compiled on first use
+};
+
+static const struct highlight_rule highlight_c_rules[] = {
+	{"//", NULL, 0, 0, HIGHLIGHT_COMMENT},
+	{"/*", "*/", 0, 1, HIGHLIGHT_COMMENT},
+	{"\"", "\"", '\\', 0, HIGHLIGHT_STRING},
+	{"'", "'", '\\', 0, HIGHLIGHT_STRING},
+	{"#", NULL, '\\', 0, HIGHLIGHT_PREPROC},
+	{},
+};
+
+static const struct highlight_rule highlight_python_rules[] = {
+	{"#", NULL, 0, 0, HIGHLIGHT_COMMENT},
+	{"\"", "\"", '\\', 0, HIGHLIGHT_STRING},
+	{"'", "'", '\\', 0, HIGHLIGHT_STRING},
+	{},
+};
+
+static const struct highlight_rule highlight_shell_rules[] = {
+	{"#", NULL, 0, 0, HIGHLIGHT_COMMENT},
+	{"\"", "\"", '\\', 1, HIGHLIGHT_STRING},
+	{"'", "'", 0, 1, HIGHLIGHT_STRING},
+	{},
+};
+
+static struct highlight_language highlight_languages[] = {
+	{
+		.name = "c",
+		.extensions = ".c .h .cc .cpp .cxx .hh .hpp",
+		.rules = highlight_c_rules,
+		.keywords = "auto break case catch class const constexpr continue default delete do else enum extern for "
+			"goto if inline namespace new nullptr operator private protected public register return sizeof "
+			"static struct switch template this throw try typedef typename union using virtual volatile while "
+			"true false NULL",
+		.types = "bool char double float int long short signed unsigned void size_t ssize_t off_t "
+			"u8 u16 u32 u64 i8 i16 i32 i64 int8_t int16_t int32_t int64_t uint8_t uint16_t uint32_t uint64_t",
+		.machine = NULL,
+	},
+	{
+		.name = "python",
+		.extensions = ".py",
+		.rules = highlight_python_rules,
+		.keywords = "and as assert async await break class continue def del elif else except finally for from "
+			"global if import in is lambda nonlocal not or pass raise return try while with yield "
+			"True False None self",
+		.types = "bool bytes dict float int list object set str tuple",
+		.machine = NULL,
+	},
+	{
+		.name = "shell",
+		.extensions = ".sh .bash",
+		.rules = highlight_shell_rules,
+		.keywords = "case do done elif else esac exit fi for function if in local return then until while "
+			"export readonly shift",
+		.types = "",
+		.machine = NULL,
+	},
+};
+
+/// Compiling languages ///
+
+static int highlight_is_word(u8 c)
+{
+	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' || c >= 0x80;
+}
+
+static int highlight_is_digit(u8 c)
+{
+	return '0' <= c && c <= '9';
+}
+
+enum {
+	HIGHLIGHT_STATE_DEFAULT,
+	HIGHLIGHT_STATE_WORD,
+	HIGHLIGHT_STATE_NUMBER,
+};
+
+// A strict prefix of start delimiters, while the lexer cannot tell yet which token starts.
+struct highlight_prefix {
+	const char *start;
+	size_t len;
+	int state;
+};
+
+// States of a rule: the body, with 'j' bytes of the end delimiter matched in state body + j for each j < len(end),
+// then the escape state and the state after the end delimiter.
+struct highlight_rule_states {
+	int body;
+	int escape;
+	int end;
+};
+
+struct highlight_compiler {
+	struct highlight_machine *machine;
+	const struct highlight_rule *rules;
+	struct highlight_rule_states *states;
+	struct highlight_prefix prefixes[highlight_max_states];
+	size_t nprefixes;
+};
+
+static int highlight_add_state(struct highlight_machine *machine, int kind)
+{
+	if (machine->nstates == highlight_max_states) {
+		return -1;
+	}
+	machine->kind[machine->nstates] = kind;
+	return machine->nstates++;
+}
+
+// State after reading 'len' bytes of 'text' then 'c' from the start of a token, or -1 if no token starts this way.
+static int highlight_delimiter_state(struct highlight_compiler *compiler, const char *text, size_t len, u8 c)
+{
+	for (size_t i = 0; compiler->rules[i].start; i++) {
+		const char *start = compiler->rules[i].start;
+		if (strlen(start) == len + 1 && !memcmp(start, text, len) && (u8) start[len] == c) {
+			return compiler->states[i].body;
+		}
+	}
+	for (size_t i = 0; i < compiler->nprefixes; i++) {
+		struct highlight_prefix *prefix = compiler->prefixes + i;
+		if (prefix->len == len + 1 && !memcmp(prefix->start, text, len) && (u8) prefix->start[len] == c) {
+			return prefix->state;
+		}
+	}
+	return -1;
+}
+
+// Transition from the start of a token on 'c', flagged with highlight_start unless it stays in the default state.
+static u8 highlight_start_edge(struct highlight_compiler *compiler, u8 c)
+{
+	int state = highlight_delimiter_state(compiler, "", 0, c);
+	if (state < 0) {
+		state = highlight_is_word(c) ? HIGHLIGHT_STATE_WORD : highlight_is_digit(c) ? HIGHLIGHT_STATE_NUMBER : HIGHLIGHT_STATE_DEFAULT;
+	}
+	return state == HIGHLIGHT_STATE_DEFAULT ? state : state | highlight_start;
+}
+
+// The current token ends before 'c'.
+static u8 highlight_end_edge(struct highlight_compiler *compiler, u8 c)
+{
+	return highlight_start_edge(compiler, c) | highlight_start;
+}
+
+static int highlight_add_rule_states(struct highlight_compiler *compiler, size_t r)
+{
+	struct highlight_machine *machine = compiler->machine;
+	const struct highlight_rule *rule = compiler->rules + r;
+	struct highlight_rule_states *states = compiler->states + r;
+	size_t m = rule->end ? strlen(rule->end) : 0;
+	states->body = highlight_add_state(machine, rule->kind);
+	states->escape = -1;
+	states->end = -1;
+	if (states->body < 0) {
+		return -ENOMEM;
+	}
+	for (size_t j = 1; j < m; j++) {
+		if (highlight_add_state(machine, rule->kind) < 0) {
+			return -ENOMEM;
+		}
+	}
+	if (rule->escape && (states->escape = highlight_add_state(machine, rule->kind)) < 0) {
+		return -ENOMEM;
+	}
+	if (m && (states->end = highlight_add_state(machine, rule->kind)) < 0) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+// End delimiters are at most this long.
+#define highlight_max_end 8
+
+static void highlight_compile_rule(struct highlight_compiler *compiler, size_t r)
+{
+	struct highlight_machine *machine = compiler->machine;
+	const struct highlight_rule *rule = compiler->rules + r;
+	size_t m = rule->end ? strlen(rule->end) : 0;
+	int body = compiler->states[r].body;
+	int escape = compiler->states[r].escape;
+	int end = compiler->states[r].end;
+
+	// Matching the end delimiter is a KMP automaton: 'fail[j]' is the longest proper border of end[0..j].
+	size_t fail[highlight_max_end] = {};
+	for (size_t j = 1, k = 0; j < m; j++) {
+		while (k && rule->end[j] != rule->end[k]) {
+			k = fail[k - 1];
+		}
+		k += rule->end[j] == rule->end[k];
+		fail[j] = k;
+	}
+	for (size_t j = 0; j < max(m, (size_t) 1); j++) {
+		u8 *next = machine->next[body + j];
+		for (int c = 0; c < 256; c++) {
+			size_t k = j;
+			while (m && k && (u8) rule->end[k] != c) {
+				k = fail[k - 1];
+			}
+			k += m && (u8) rule->end[k] == c;
+			if (rule->escape && c == (u8) rule->escape) {
+				next[c] = escape;
+			} else if (m && k == m) {
+				next[c] = end;
+			} else {
+				next[c] = body + k;
+			}
+		}
+		next['\n'] = rule->multiline ? body : highlight_end_edge(compiler, '\n');
+	}
+	if (escape >= 0) {
+		memset(machine->next[escape], body, 256);
+	}
+	if (end >= 0) {
+		for (int c = 0; c < 256; c++) {
+			machine->next[end][c] = highlight_end_edge(compiler, c);
+		}
+	}
+}
+
+static int highlight_keyword_compare(const void *a, const void *b)
+{
+	const struct highlight_keyword *ka = (const struct highlight_keyword*) a;
+	const struct highlight_keyword *kb = (const struct highlight_keyword*) b;
+	size_t la = slice_len(ka->word);
+	size_t lb = slice_len(kb->word);
+	int r = memcmp(ka->word.start, kb->word.start, min(la, lb));
+	return r ? r : (la > lb) - (la < lb);
+}
+
+static size_t highlight_add_keywords(struct highlight_keyword *keywords, size_t n, const char *words, int kind)
+{
+	const char *c = words;
+	while (*c) {
+		while (*c == ' ') {
+			c++;
+		}
+		const char *start = c;
+		while (*c && *c != ' ') {
+			c++;
+		}
+		if (c > start) {
+			if (keywords) {
+				keywords[n] = {s((char*) start, (char*) c), kind};
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+static int highlight_compile(struct highlight_language *language)
+{
+	struct highlight_machine *machine = (struct highlight_machine*) calloc(1, sizeof(struct highlight_machine));
+	size_t nrules = 0;
+	while (language->rules[nrules].start) {
+		nrules++;
+	}
+	struct highlight_rule_states *states = (struct highlight_rule_states*) calloc(max(nrules, (size_t) 1), sizeof(struct highlight_rule_states));
+	size_t nkeywords = highlight_add_keywords(NULL, 0, language->keywords, HIGHLIGHT_KEYWORD);
+	nkeywords = highlight_add_keywords(NULL, nkeywords, language->types, HIGHLIGHT_TYPE);
+	struct highlight_keyword *keywords = (struct highlight_keyword*) calloc(max(nkeywords, (size_t) 1), sizeof(struct highlight_keyword));
+	if (!machine || !states || !keywords) {
+		free(machine);
+		free(states);
+		free(keywords);
+		return -ENOMEM;
+	}
+	highlight_add_keywords(keywords, highlight_add_keywords(keywords, 0, language->keywords, HIGHLIGHT_KEYWORD),
+		language->types, HIGHLIGHT_TYPE);
+	qsort(keywords, nkeywords, sizeof(struct highlight_keyword), highlight_keyword_compare);
+	machine->keywords = keywords;
+	machine->nkeywords = nkeywords;
+
+	struct highlight_compiler compiler = {};
+	compiler.machine = machine;
+	compiler.rules = language->rules;
+	compiler.states = states;
+	int fail = 0;
+	highlight_add_state(machine, HIGHLIGHT_TEXT);
+	highlight_add_state(machine, HIGHLIGHT_TEXT);
+	highlight_add_state(machine, HIGHLIGHT_NUMBER);
+	machine->word[HIGHLIGHT_STATE_WORD] = 1;
+
+	// States are allocated first, so that transitions can refer to any state. Prefixes which are complete
+	// delimiters of other rules do not get a state of their own.
+	for (size_t r = 0; r < nrules && !fail; r++) {
+		const char *end = language->rules[r].end;
+		fail = end && strlen(end) > highlight_max_end ? -EINVAL : highlight_add_rule_states(&compiler, r);
+	}
+	for (size_t r = 0; r < nrules && !fail; r++) {
+		const char *start = language->rules[r].start;
+		for (size_t len = 1; len < strlen(start) && !fail; len++) {
+			if (highlight_delimiter_state(&compiler, start, len - 1, start[len - 1]) >= 0) {
+				continue;
+			}
+			int state = highlight_add_state(machine, HIGHLIGHT_TEXT);
+			fail = state < 0 ? -ENOMEM : 0;
+			compiler.prefixes[compiler.nprefixes++] = {start, len, state};
+		}
+	}
+	if (fail) {
+		free(states);
+		free(keywords);
+		free(machine);
+		return fail;
+	}
+	for (size_t r = 0; r < nrules; r++) {
+		highlight_compile_rule(&compiler, r);
+	}
+
+	for (int c = 0; c < 256; c++) {
+		machine->next[HIGHLIGHT_STATE_DEFAULT][c] = highlight_start_edge(&compiler, c);
+		int in_word = highlight_is_word(c) || highlight_is_digit(c);
+		machine->next[HIGHLIGHT_STATE_WORD][c] = in_word ? (u8) HIGHLIGHT_STATE_WORD : highlight_end_edge(&compiler, c);
+		int in_number = in_word || c == '.';
+		machine->next[HIGHLIGHT_STATE_NUMBER][c] = in_number ? (u8) HIGHLIGHT_STATE_NUMBER : highlight_end_edge(&compiler, c);
+	}
+	for (size_t i = 0; i < compiler.nprefixes; i++) {
+		struct highlight_prefix *prefix = compiler.prefixes + i;
+		for (int c = 0; c < 256; c++) {
+			int state = highlight_delimiter_state(&compiler, prefix->start, prefix->len, c);
+			machine->next[prefix->state][c] = state >= 0 ? state : highlight_end_edge(&compiler, c);
+		}
+	}
+	free(states);
+	language->machine = machine;
+	return 0;
+}
+
+/// Lexing ///
+
+struct highlight_lexer {
+	struct highlight_machine *machine;
+	u8 state;
+	size_t token;                 // start of the current token
+	char word[highlight_max_word];
+	size_t wordlen;
+
+	// colored runs in [from, to)
+	size_t from;
+	size_t to;
+	struct highlight_run *runs;
+	size_t nruns;
+	size_t capacity;
+};
+
+static int highlight_token_kind(struct highlight_lexer *lexer)
+{
+	struct highlight_machine *machine = lexer->machine;
+	if (!machine->word[lexer->state]) {
+		return machine->kind[lexer->state];
+	}
+	if (lexer->wordlen > highlight_max_word) {
+		return HIGHLIGHT_TEXT;
+	}
+	struct highlight_keyword key = {s(lexer->word, lexer->word + lexer->wordlen), 0};
+	struct highlight_keyword *keyword = (struct highlight_keyword*) bsearch(&key, machine->keywords, machine->nkeywords,
+		sizeof(struct highlight_keyword), highlight_keyword_compare);
+	return keyword ? keyword->kind : HIGHLIGHT_TEXT;
+}
+
+// The current token ends at 'x'.
+static void highlight_emit(struct highlight_lexer *lexer, size_t x)
+{
+	size_t x0 = max(lexer->token, lexer->from);
+	size_t x1 = min(x, lexer->to);
+	if (x0 >= x1) {
+		return;
+	}
+	int color = highlight_colors[highlight_token_kind(lexer)];
+	if (!color) {
+		return;
+	}
+	struct highlight_run *last = lexer->nruns ? lexer->runs + lexer->nruns - 1 : NULL;
+	if (last && last->color == color && last->x + last->len == x0) {
+		last->len += x1 - x0;
+	} else if (lexer->nruns < lexer->capacity) {
+		lexer->runs[lexer->nruns++] = {x0, x1 - x0, color};
+	}
+}
+
+static void highlight_lex_runs(struct highlight_lexer *lexer, struct line *line)
+{
+	struct highlight_machine *machine = lexer->machine;
+	size_t x = 0;
+	for (struct textpiece *fragment = line->fragments; fragment; fragment = fragment->next) {
+		for (const char *c = fragment->slice.start; c < fragment->slice.stop; c++, x++) {
+			u8 next = machine->next[lexer->state][(u8) *c];
+			if (next & highlight_start) {
+				highlight_emit(lexer, x);
+				lexer->token = x;
+				lexer->wordlen = 0;
+			}
+			lexer->state = next & ~highlight_start;
+			if (machine->word[lexer->state]) {
+				if (lexer->wordlen < highlight_max_word) {
+					lexer->word[lexer->wordlen] = *c;
+				}
+				lexer->wordlen++;
+			}
+		}
+	}
+	highlight_emit(lexer, x);
+}
+
+// Line states are stored plus one, 0 for lines never lexed.
+static u8 highlight_start_state(struct line *line)
+{
+	return line->prev && line->prev->lexer_state ? line->prev->lexer_state - 1 : 0;
+}
+
+// State at the end of a line starting in 'state'.
+static u8 highlight_lex_end(struct highlight_machine *machine, struct line *line, u8 state)
+{
+	for (struct textpiece *fragment = line->fragments; fragment; fragment = fragment->next) {
+		for (const char *c = fragment->slice.start; c < fragment->slice.stop; c++) {
+			state = machine->next[state][(u8) *c] & ~highlight_start;
+		}
+	}
+	return machine->next[state]['\n'] & ~highlight_start;
+}
+
+// Bring the end states of the lines before 'line' up to date.
+static void highlight_update(struct textbuffer *textbuffer, struct line *line)
+{
+	struct highlight_machine *machine = textbuffer->language->machine;
+	size_t index = line_index(line);
+	if (textbuffer->highlight_dirty >= index) {
+		return;
+	}
+	struct line *l = linetree_at(textbuffer->line_root, textbuffer->highlight_dirty);
+	u8 state = highlight_start_state(l);
+	int changed = 0;
+	for (; l != line; l = l->next) {
+		if (changed || l->lexer_dirty || !l->lexer_state) {
+			u8 end = highlight_lex_end(machine, l, state);
+			changed = end + 1 != l->lexer_state;
+			l->lexer_state = end + 1;
+			l->lexer_dirty = 0;
+		}
+		state = l->lexer_state - 1;
+	}
+	// The start of the line changed, it is lexed again whenever the lines after it are updated.
+	if (changed) {
+		line->lexer_dirty = 1;
+	}
+	textbuffer->highlight_dirty = index;
+}
+
+struct highlight_language* highlight_language_for(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+	const char *slash = strrchr(path, '/');
+	if (!dot || (slash && dot < slash)) {
+		return NULL;
+	}
+	size_t len = strlen(dot);
+	for (size_t i = 0; i < sizeof(highlight_languages) / sizeof(highlight_languages[0]); i++) {
+		const char *extension = highlight_languages[i].extensions;
+		while ((extension = strstr(extension, dot))) {
+			if (extension[len] == ' ' || extension[len] == 0) {
+				return highlight_languages + i;
+			}
+			extension += len;
+		}
+	}
+	return NULL;
+}
+
+int highlight_set_language(struct textbuffer *textbuffer, struct highlight_language *language)
+{
+	if (language && !language->machine) {
+		int fail = highlight_compile(language);
+		if (fail) {
+			return fail;
+		}
+	}
+	textbuffer->language = language;
+	for (struct line *line = textbuffer->line_first; line; line = line->next) {
+		line->lexer_state = 0;
+	}
+	textbuffer->highlight_dirty = 0;
+	return 0;
+}
+
+size_t highlight_line(struct textbuffer *textbuffer, struct line *line, size_t from, size_t to,
+		struct highlight_run *runs, size_t capacity)
+{
+	if (!textbuffer->language || line->bytelen > highlight_max_line) {
+		return 0;
+	}
+	highlight_update(textbuffer, line);
+	struct highlight_lexer lexer = {};
+	lexer.machine = textbuffer->language->machine;
+	lexer.state = highlight_start_state(line);
+	lexer.from = from;
+	lexer.to = to;
+	lexer.runs = runs;
+	lexer.capacity = capacity;
+	highlight_lex_runs(&lexer, line);
+	return lexer.nruns;
+}
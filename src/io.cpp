@@ -6,35 +6,277 @@
 //#include <string.h>
 
 #include <fcntl.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 int mapped_file_load(struct mapped_file *f, const char *path)
 {
-	// TODO: return error if path is too long
 	size_t maxlen = _arraylen(f->name);
 	memset(f->name, 0, maxlen);
-	maxlen = strnlen(path, maxlen - 1) + 1;
-	memcpy(f->name, path, maxlen);
+	f->data = s(NULL, NULL);
+	size_t namelen = strnlen(path, maxlen);
+	if (namelen == maxlen) {
+		return -ENAMETOOLONG;
+	}
+	memcpy(f->name, path, namelen + 1);
 
 	int fd = open(f->name, O_RDONLY);
-	assertf_success(fd < 0, "failed to open %s", f->name);
-	// TODO: return error instead
+	if (fd < 0) {
+		return -errno;
+	}
 
 	int r = fstat(fd, &f->file_stat);
-	assertf_success(r < 0, "failed to stat %s", f->name);
-	// TODO: return error instead
+	if (r < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
 
 	int prot = PROT_READ;
 	int flags = MAP_SHARED;
 	int offset = 0;
 	size_t len = f->file_stat.st_size;
 
-	f->data.start = (char*) mmap(NULL, len, prot, flags, fd, offset);
-	f->data.stop  = f->data.start + len;
-	assert(f->data.start != MAP_FAILED);
+	// mmap() refuses empty mappings: empty files are just an empty slice.
+	if (len) {
+		char *data = (char*) mmap(NULL, len, prot, flags, fd, offset);
+		if (data == MAP_FAILED) {
+			r = -errno;
+			close(fd);
+			return r;
+		}
+		f->data = s(data, data + len);
+	}
 
 	close(fd);
 	return 0;
 }
+
+void mapped_file_unload(struct mapped_file *f)
+{
+	if (!slice_empty(f->data)) {
+		assert_success(munmap(f->data.start, slice_len(f->data)));
+	}
+	f->data = s(NULL, NULL);
+}
+
+int mapped_file_open_unchanged(struct mapped_file *f)
+{
+	if (slice_empty(f->data)) {
+		return -ESTALE;
+	}
+	int fd = open(f->name, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	struct stat file_stat;
+	int r = fstat(fd, &file_stat);
+	if (r < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+	struct stat *mapped_stat = &f->file_stat;
+	if (file_stat.st_dev != mapped_stat->st_dev || file_stat.st_ino != mapped_stat->st_ino
+			|| file_stat.st_size != mapped_stat->st_size
+			|| file_stat.st_mtim.tv_sec != mapped_stat->st_mtim.tv_sec
+			|| file_stat.st_mtim.tv_nsec != mapped_stat->st_mtim.tv_nsec) {
+		close(fd);
+		return -ESTALE;
+	}
+	return fd;
+}
+
+int file_writer_open(struct file_writer *w, const char *path)
+{
+	memset(w, 0, sizeof(struct file_writer));
+	w->fd = -1;
+	w->source_fd = -1;
+
+	// Symlinks are followed, so that saving replaces the file they point to and not the link itself.
+	char *target = realpath(path, NULL);
+	if (target) {
+		path = target;
+	}
+	size_t len = strlen(path);
+	int fail = 0;
+	if (len + sizeof(".chi-XXXXXX") > sizeof(w->path)) {
+		fail = -ENAMETOOLONG;
+	} else {
+		memcpy(w->path, path, len + 1);
+		snprintf(w->tmp_path, sizeof(w->tmp_path), "%s.chi-XXXXXX", path);
+	}
+	free(target);
+	if (fail) {
+		return fail;
+	}
+
+	w->fd = mkstemp(w->tmp_path);
+	if (w->fd < 0) {
+		return -errno;
+	}
+	// mkstemp() creates the file with mode 0600: keep the mode of the replaced file, or use the default mode.
+	struct stat file_stat;
+	mode_t mode;
+	if (stat(w->path, &file_stat) == 0) {
+		mode = file_stat.st_mode & 07777;
+	} else {
+		mode_t mask = umask(0);
+		umask(mask);
+		mode = 0666 & ~mask;
+	}
+	fchmod(w->fd, mode);
+	return 0;
+}
+
+static void file_writer_writev(struct file_writer *w, struct iovec *iov, int n)
+{
+	while (n && !w->fail) {
+		ssize_t written = writev(w->fd, iov, n);
+		if (written < 0) {
+			if (errno != EINTR) {
+				w->fail = -errno;
+			}
+			continue;
+		}
+		__atomic_fetch_add(&w->written, written, __ATOMIC_RELAXED);
+		// Partial write: skip the iovecs written entirely and advance into the next one.
+		while (n && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char*) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+static int file_writer_is_copyable(struct file_writer *w, struct iovec *iov)
+{
+	char *start = (char*) iov->iov_base;
+	return w->source_fd >= 0 && iov->iov_len >= file_writer_copy_min
+		&& w->source.start <= start && start + iov->iov_len <= w->source.stop;
+}
+
+// Copy the text of 'iov' from the source file. Returns 0 once copied, or 1 when the rest of 'iov' must be written
+// instead because the filesystems do not support copying between these files.
+static int file_writer_copy(struct file_writer *w, struct iovec *iov)
+{
+	loff_t offset = (char*) iov->iov_base - w->source.start;
+	while (iov->iov_len && !w->fail) {
+		ssize_t copied = copy_file_range(w->source_fd, &offset, w->fd, NULL, iov->iov_len, 0);
+		if (copied < 0 && errno == EINTR) {
+			continue;
+		}
+		if (copied < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+			w->fail = -errno;
+			break;
+		}
+		if (copied <= 0) {
+			// Unsupported, or the source file got shorter: stop copying and write from memory.
+			w->source_fd = -1;
+			return 1;
+		}
+		w->copied += copied;
+		__atomic_fetch_add(&w->written, copied, __ATOMIC_RELAXED);
+		iov->iov_base = (char*) iov->iov_base + copied;
+		iov->iov_len -= copied;
+	}
+	return 0;
+}
+
+// Large texts from the source file are copied by the filesystem, everything else is written with writev().
+static int file_writer_flush(struct file_writer *w)
+{
+	struct iovec *iov = w->iov;
+	int first = 0;
+	for (int i = 0; i < w->niov && !w->fail; i++) {
+		if (file_writer_is_copyable(w, iov + i)) {
+			file_writer_writev(w, iov + first, i - first);
+			first = file_writer_copy(w, iov + i) ? i : i + 1;
+		}
+	}
+	file_writer_writev(w, iov + first, w->niov - first);
+	w->niov = 0;
+	return w->fail;
+}
+
+void file_writer_set_source(struct file_writer *w, int fd, slice data)
+{
+	w->source_fd = fd;
+	w->source = data;
+}
+
+static void file_writer_push(struct file_writer *w, slice text)
+{
+	w->bytes += slice_len(text);
+	if (w->niov) {
+		struct iovec *last = w->iov + w->niov - 1;
+		if ((char*) last->iov_base + last->iov_len == text.start) {
+			last->iov_len += slice_len(text);
+			return;
+		}
+	}
+	if (w->niov == file_writer_iovecs) {
+		file_writer_flush(w);
+	}
+	w->iov[w->niov].iov_base = text.start;
+	w->iov[w->niov].iov_len = slice_len(text);
+	w->niov++;
+}
+
+void file_writer_append(struct file_writer *w, slice text)
+{
+	if (w->fail || slice_empty(text)) {
+		return;
+	}
+	file_writer_push(w, text);
+}
+
+int file_writer_commit(struct file_writer *w, int flags)
+{
+	int fail = file_writer_flush(w);
+	if (!fail && (flags & FILE_WRITER_SYNC) && fsync(w->fd) < 0) {
+		fail = -errno;
+	}
+	if (close(w->fd) < 0 && !fail) {
+		fail = -errno;
+	}
+	w->fd = -1;
+	if (!fail && rename(w->tmp_path, w->path) < 0) {
+		fail = -errno;
+	}
+	if (fail) {
+		unlink(w->tmp_path);
+		return fail;
+	}
+	if (flags & FILE_WRITER_SYNC) {
+		// Make the rename itself durable.
+		char *slash = strrchr(w->path, '/');
+		if (slash) {
+			*slash = 0;
+		}
+		int dir = open(slash ? (slash == w->path ? "/" : w->path) : ".", O_RDONLY | O_DIRECTORY);
+		if (slash) {
+			*slash = '/';
+		}
+		if (dir >= 0) {
+			fsync(dir);
+			close(dir);
+		}
+	}
+	return 0;
+}
+
+void file_writer_abort(struct file_writer *w)
+{
+	if (w->fd >= 0) {
+		close(w->fd);
+		unlink(w->tmp_path);
+		w->fd = -1;
+	}
+}
@@ -0,0 +1,399 @@
+// journal.cpp implements the undo/redo history of a textbuffer.
+//
+// The journal only does the bookkeeping: the textbuffer records every edit it applies, and asks the journal which
+// edits to revert or to apply again for undo and redo.
+//
+// Compaction: consecutive slices adjacent in memory are merged, and the newlines between deleted lines are merged
+// with the slices around them when the textbuffer knows them to be stored newline characters, i.e. the characters
+// following a line in the same mapping or textchunk. Deleting a range of lines from a mapped file therefore records a
+// single slice. Consecutive insertions or deletions at the same place are merged
+// into one edit, so that typing a paragraph records one edit with one slice. Typing at every cursor records batch edits
+// which are merged the same way when every site continues the last batch.
+// When the history grows above its limit, the oldest transactions are dropped.
+#include <chi.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+// Storage for the newlines between deleted lines which are not backed by a newline character in the text.
+// Filled once before main, snapshots taken for background readers point into it so it is never written again.
+static char journal_newlines[Kilo(4)];
+
+__attribute__((constructor))
+static void journal_newlines_init()
+{
+	memset(journal_newlines, '\n', sizeof(journal_newlines));
+}
+
+void journal_init(struct journal *journal, size_t limit)
+{
+	memset(journal, 0, sizeof(struct journal));
+	journal->limit = limit;
+}
+
+void journal_free(struct journal *journal)
+{
+	free(journal->edits);
+	free(journal->slices);
+	free(journal->sites);
+	memset(journal, 0, sizeof(struct journal));
+}
+
+size_t journal_bytes(struct journal *journal)
+{
+	return journal->edits_capacity * sizeof(struct journal_edit) + journal->slices_capacity * sizeof(slice)
+		+ journal->sites_capacity * sizeof(struct journal_site);
+}
+
+static int journal_grow(void **array, size_t *capacity, size_t needed, size_t object_size)
+{
+	if (needed <= *capacity) {
+		return 0;
+	}
+	size_t new_capacity = max(2 * *capacity, (size_t) 64);
+	void *new_array = realloc(*array, new_capacity * object_size);
+	if_null(new_array) {
+		return -ENOMEM;
+	}
+	*array = new_array;
+	*capacity = new_capacity;
+	return 0;
+}
+
+static void journal_push_slice(struct journal *journal, slice slice)
+{
+	if (journal_grow((void**) &journal->slices, &journal->slices_capacity, journal->nslices + 1, sizeof(slice))) {
+		journal->failed = 1;
+		return;
+	}
+	journal->slices[journal->nslices++] = slice;
+}
+
+static slice* journal_last_open_slice(struct journal *journal)
+{
+	if (journal->nslices == journal->open_first_slice) {
+		return NULL;
+	}
+	return journal->slices + journal->nslices - 1;
+}
+
+// Add the pending newlines. When they are consecutive newline characters in the stored text they are a slice like any
+// other, merged with the last slice when adjacent in memory. Otherwise they point into journal_newlines.
+static void journal_flush_newlines(struct journal *journal)
+{
+	size_t n = journal->pending_newlines;
+	if (!n) {
+		return;
+	}
+	journal->pending_newlines = 0;
+
+	slice stored = journal->pending_stored;
+	if (stored.start) {
+		slice *last = journal_last_open_slice(journal);
+		if (last && last->stop == stored.start) {
+			last->stop = stored.stop;
+		} else {
+			journal_push_slice(journal, stored);
+		}
+		return;
+	}
+	while (n) {
+		size_t len = min(n, sizeof(journal_newlines));
+		journal_push_slice(journal, s(journal_newlines, journal_newlines + len));
+		n -= len;
+	}
+}
+
+void journal_begin_edit(struct journal *journal, size_t offset)
+{
+	if (journal->paused) {
+		return;
+	}
+	assert(!journal->recording);
+	// A new edit forgets the undone edits.
+	if (journal->current < journal->nedits) {
+		journal->nslices = journal->edits[journal->current].first_slice;
+		journal->nsites = journal->edits[journal->current].first_site;
+		journal->dropped += journal->nedits - journal->current;
+		journal->nedits = journal->current;
+		journal->coalesce = 0;
+	}
+	journal->recording = 1;
+	journal->failed = 0;
+	journal->open_offset = offset;
+	journal->open_first_slice = journal->nslices;
+	journal->open_first_site = journal->nsites;
+	journal->pending_newlines = 0;
+}
+
+void journal_add_slice(struct journal *journal, slice slice)
+{
+	if (!journal->recording || journal->failed || slice_empty(slice)) {
+		return;
+	}
+	journal_flush_newlines(journal);
+	struct slice *last = journal_last_open_slice(journal);
+	if (last && last->stop == slice.start) {
+		last->stop = slice.stop;
+		return;
+	}
+	journal_push_slice(journal, slice);
+}
+
+void journal_add_newline(struct journal *journal, char *newline_char)
+{
+	if (!journal->recording) {
+		return;
+	}
+	slice *stored = &journal->pending_stored;
+	if (!journal->pending_newlines) {
+		*stored = newline_char ? s(newline_char, newline_char + 1) : s(NULL, NULL);
+	} else if (stored->start && newline_char == stored->stop) {
+		stored->stop++;
+	} else {
+		*stored = s(NULL, NULL);
+	}
+	journal->pending_newlines++;
+}
+
+void journal_add_site(struct journal *journal, size_t offset, size_t deleted)
+{
+	if (!journal->recording || journal->failed) {
+		return;
+	}
+	journal_flush_newlines(journal);
+	if (journal_grow((void**) &journal->sites, &journal->sites_capacity, journal->nsites + 1, sizeof(struct journal_site))) {
+		journal->failed = 1;
+		return;
+	}
+	journal->sites[journal->nsites].offset = offset;
+	journal->sites[journal->nsites].deleted = deleted;
+	journal->nsites++;
+}
+
+// Merge the slices on both sides of 'middle' when they are adjacent in memory.
+static void journal_join_slices(struct journal *journal, size_t middle)
+{
+	slice *slices = journal->slices;
+	if (slices[middle - 1].stop != slices[middle].start) {
+		return;
+	}
+	slices[middle - 1].stop = slices[middle].stop;
+	memmove(slices + middle, slices + middle + 1, (journal->nslices - middle - 1) * sizeof(slice));
+	journal->nslices--;
+}
+
+// Exchange two consecutive ranges of slices [first, middle) and [middle, nslices).
+static void journal_reverse_slices(slice *slices, size_t first, size_t last)
+{
+	while (first + 1 < last) {
+		last--;
+		slice tmp = slices[first];
+		slices[first] = slices[last];
+		slices[last] = tmp;
+		first++;
+	}
+}
+
+static void journal_rotate_slices(struct journal *journal, size_t first, size_t middle)
+{
+	journal_reverse_slices(journal->slices, first, middle);
+	journal_reverse_slices(journal->slices, middle, journal->nslices);
+	journal_reverse_slices(journal->slices, first, journal->nslices);
+}
+
+// Typing at every site of a batch: the new batch only inserts, right after the text inserted at every site by the last
+// batch. Offsets of the new sites are in the text after the last batch.
+static int journal_continues_batch(struct journal *journal, struct journal_edit *last, struct journal_edit *edit)
+{
+	if (!last->len || last->nsites != edit->nsites) {
+		return 0;
+	}
+	struct journal_site *last_sites = journal->sites + last->first_site;
+	struct journal_site *sites = journal->sites + edit->first_site;
+	size_t shift = 0;
+	for (size_t i = 0; i < edit->nsites; i++) {
+		if (sites[i].deleted || sites[i].offset != last_sites[i].offset + shift + last->len) {
+			return 0;
+		}
+		shift += last->len - last_sites[i].deleted;
+	}
+	return 1;
+}
+
+// Merge the new edit, whose slices are at the end, into the last edit when it continues it.
+static int journal_coalesce(struct journal *journal, struct journal_edit *edit)
+{
+	if (!journal->coalesce || !journal->nedits) {
+		return 0;
+	}
+	struct journal_edit *last = journal->edits + journal->nedits - 1;
+	if (last->type != edit->type) {
+		return 0;
+	}
+	size_t middle = edit->first_slice;
+	if (edit->type == JOURNAL_BATCH) {
+		if (!journal_continues_batch(journal, last, edit)) {
+			return 0;
+		}
+		journal->nsites = edit->first_site;
+	} else if (edit->type == JOURNAL_INSERT && edit->offset == last->offset + last->len) {
+		// typing
+	} else if (edit->type == JOURNAL_DELETE && edit->offset == last->offset) {
+		// deleting forward
+	} else if (edit->type == JOURNAL_DELETE && edit->offset + edit->len == last->offset) {
+		// deleting backward: the new slices go first
+		journal_rotate_slices(journal, last->first_slice, middle);
+		middle = last->first_slice + edit->nslices;
+		last->offset = edit->offset;
+	} else {
+		return 0;
+	}
+	last->len += edit->len;
+	if (last->first_slice < middle && middle < journal->nslices) {
+		journal_join_slices(journal, middle);
+	}
+	last->nslices = journal->nslices - last->first_slice;
+	return 1;
+}
+
+static size_t journal_edit_bytes(struct journal_edit *edit)
+{
+	return sizeof(struct journal_edit) + edit->nslices * sizeof(slice) + edit->nsites * sizeof(struct journal_site);
+}
+
+// Drop the oldest transactions when the history grows above its limit. The last transaction is always kept.
+// Trimming goes down to 3/4 of the limit, so that the history is not moved at every edit once it reaches the limit.
+static void journal_trim(struct journal *journal)
+{
+	size_t bytes = journal->nedits * sizeof(struct journal_edit) + journal->nslices * sizeof(slice)
+		+ journal->nsites * sizeof(struct journal_site);
+	if (bytes <= journal->limit) {
+		return;
+	}
+	size_t target = journal->limit / 4 * 3;
+	size_t ndropped = 0;
+	u32 last_transaction = journal->edits[journal->nedits - 1].transaction;
+	while (bytes > target && journal->edits[ndropped].transaction != last_transaction) {
+		struct journal_edit *edit = journal->edits + ndropped;
+		bytes -= journal_edit_bytes(edit);
+		ndropped++;
+		// Transactions are dropped entirely.
+		while (journal->edits[ndropped].transaction == edit->transaction) {
+			bytes -= journal_edit_bytes(journal->edits + ndropped);
+			ndropped++;
+		}
+	}
+	if (!ndropped) {
+		return;
+	}
+	size_t first_slice = journal->edits[ndropped].first_slice;
+	size_t first_site = journal->edits[ndropped].first_site;
+	journal->nedits -= ndropped;
+	journal->current -= ndropped;
+	journal->dropped += ndropped;
+	journal->nslices -= first_slice;
+	journal->nsites -= first_site;
+	memmove(journal->edits, journal->edits + ndropped, journal->nedits * sizeof(struct journal_edit));
+	memmove(journal->slices, journal->slices + first_slice, journal->nslices * sizeof(slice));
+	memmove(journal->sites, journal->sites + first_site, journal->nsites * sizeof(struct journal_site));
+	for (size_t i = 0; i < journal->nedits; i++) {
+		journal->edits[i].first_slice -= first_slice;
+		journal->edits[i].first_site -= first_site;
+	}
+}
+
+void journal_end_edit(struct journal *journal, int type, size_t len)
+{
+	if (!journal->recording) {
+		return;
+	}
+	journal->recording = 0;
+	journal_flush_newlines(journal);
+
+	int fail = journal->failed;
+	if (!fail) {
+		fail = journal_grow((void**) &journal->edits, &journal->edits_capacity, journal->nedits + 1, sizeof(struct journal_edit));
+	}
+	if (fail) {
+		// The edit cannot be undone, and neither can the edits before it.
+		journal->dropped += journal->nedits;
+		journal->nedits = 0;
+		journal->current = 0;
+		journal->nslices = 0;
+		journal->nsites = 0;
+		journal->coalesce = 0;
+		return;
+	}
+	size_t nsites = journal->nsites - journal->open_first_site;
+	if (!len && !nsites) {
+		journal->nslices = journal->open_first_slice;
+		return;
+	}
+
+	struct journal_edit edit = {
+		.offset = journal->open_offset,
+		.len = len,
+		.first_slice = journal->open_first_slice,
+		.nslices = journal->nslices - journal->open_first_slice,
+		.first_site = journal->open_first_site,
+		.nsites = nsites,
+		.transaction = journal->transaction,
+		.type = type,
+	};
+	if (!journal_coalesce(journal, &edit)) {
+		if (!journal->transaction_depth) {
+			edit.transaction = ++journal->transaction;
+		}
+		journal->edits[journal->nedits++] = edit;
+	}
+	journal->current = journal->nedits;
+	journal->coalesce = 1;
+	journal_trim(journal);
+}
+
+void journal_begin_transaction(struct journal *journal)
+{
+	if (journal->transaction_depth++ == 0) {
+		journal->transaction++;
+		journal->coalesce = 0;
+	}
+}
+
+void journal_end_transaction(struct journal *journal)
+{
+	assert(journal->transaction_depth > 0);
+	if (--journal->transaction_depth == 0) {
+		journal->coalesce = 0;
+	}
+}
+
+size_t journal_undo(struct journal *journal, struct journal_edit **edits)
+{
+	journal->coalesce = 0;
+	size_t end = journal->current;
+	if (!end) {
+		return 0;
+	}
+	u32 transaction = journal->edits[end - 1].transaction;
+	while (journal->current && journal->edits[journal->current - 1].transaction == transaction) {
+		journal->current--;
+	}
+	*edits = journal->edits + journal->current;
+	return end - journal->current;
+}
+
+size_t journal_redo(struct journal *journal, struct journal_edit **edits)
+{
+	journal->coalesce = 0;
+	size_t start = journal->current;
+	if (start == journal->nedits) {
+		return 0;
+	}
+	u32 transaction = journal->edits[start].transaction;
+	while (journal->current < journal->nedits && journal->edits[journal->current].transaction == transaction) {
+		journal->current++;
+	}
+	*edits = journal->edits + start;
+	return journal->current - start;
+}
@@ -0,0 +1,450 @@
+// linetree.cpp implements the balanced tree of lines of a textbuffer.
+//
+// Lines are the nodes of a treap ordered by their position in the text. Every node tracks the number of lines, the
+// number of bytes (counting one newline per line) and the number of wrapped rows of its subtree. This gives O(log n)
+// lookups from line index, byte offset or wrapped row to line and back, and O(log n) line insertions and removals.
+// Since the index of a line is not stored anywhere but derived from the tree, nothing needs to be renumbered when
+// lines are inserted or removed.
+//
+// Priorities: bulk built trees are perfectly balanced and their nodes get a priority derived from their height,
+// which keeps the heap order without any rotation. Nodes inserted one by one get a random priority below any bulk
+// node priority, and end up forming random treaps below the bulk tree leaves.
+#include <chi.h>
+
+#include <assert.h>
+
+#define linetree_height_shift 24
+#define linetree_random_mask ((1u << linetree_height_shift) - 1)
+
+static u32 linetree_random_state = 0x9e3779b9;
+
+static u32 linetree_random()
+{
+	// xorshift32
+	u32 x = linetree_random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	linetree_random_state = x;
+	return x;
+}
+
+static inline size_t linetree_count(struct line *line)
+{
+	return line ? line->count : 0;
+}
+
+static inline size_t linetree_bytes(struct line *line)
+{
+	return line ? line->bytes : 0;
+}
+
+static inline size_t linetree_rows(struct line *line)
+{
+	return line ? line->rows : 0;
+}
+
+// Recompute the counters of a single node from its children.
+static void linetree_fix(struct line *line)
+{
+	line->count = 1 + linetree_count(line->left) + linetree_count(line->right);
+	line->bytes = line->bytelen + 1 + linetree_bytes(line->left) + linetree_bytes(line->right);
+	line->rows = line->wrap_rows + linetree_rows(line->left) + linetree_rows(line->right);
+}
+
+static void linetree_fix_upward(struct line *line)
+{
+	while (line) {
+		linetree_fix(line);
+		line = line->parent;
+	}
+}
+
+void linetree_update(struct line *line)
+{
+	linetree_fix_upward(line);
+}
+
+static void linetree_replace_child(struct line **root, struct line *parent, struct line *old_child, struct line *new_child)
+{
+	if (new_child) {
+		new_child->parent = parent;
+	}
+	if (!parent) {
+		*root = new_child;
+	} else if (parent->left == old_child) {
+		parent->left = new_child;
+	} else {
+		parent->right = new_child;
+	}
+}
+
+// Rotate 'line' above its parent.
+static void linetree_rotate_up(struct line **root, struct line *line)
+{
+	struct line *parent = line->parent;
+	assert(parent);
+	linetree_replace_child(root, parent->parent, parent, line);
+	if (parent->left == line) {
+		parent->left = line->right;
+		if (line->right) line->right->parent = parent;
+		line->right = parent;
+	} else {
+		parent->right = line->left;
+		if (line->left) line->left->parent = parent;
+		line->left = parent;
+	}
+	parent->parent = line;
+	linetree_fix(parent);
+	linetree_fix(line);
+}
+
+static void linetree_insert_leaf(struct line **root, struct line *parent, struct line *line, int as_left)
+{
+	line->left = NULL;
+	line->right = NULL;
+	line->parent = parent;
+	line->priority = linetree_random() & linetree_random_mask;
+	if (!parent) {
+		*root = line;
+	} else if (as_left) {
+		parent->left = line;
+	} else {
+		parent->right = line;
+	}
+	linetree_fix_upward(line);
+
+	while (line->parent && line->parent->priority < line->priority) {
+		linetree_rotate_up(root, line);
+	}
+}
+
+void linetree_insert_after(struct line **root, struct line *at, struct line *line)
+{
+	if (!at) {
+		assert(!*root);
+		linetree_insert_leaf(root, NULL, line, 1);
+		return;
+	}
+	if (!at->right) {
+		linetree_insert_leaf(root, at, line, 0);
+		return;
+	}
+	struct line *leftmost = at->right;
+	while (leftmost->left) {
+		leftmost = leftmost->left;
+	}
+	linetree_insert_leaf(root, leftmost, line, 1);
+}
+
+void linetree_insert_before(struct line **root, struct line *at, struct line *line)
+{
+	if (!at->left) {
+		linetree_insert_leaf(root, at, line, 1);
+		return;
+	}
+	struct line *rightmost = at->left;
+	while (rightmost->right) {
+		rightmost = rightmost->right;
+	}
+	linetree_insert_leaf(root, rightmost, line, 0);
+}
+
+void linetree_remove(struct line **root, struct line *line)
+{
+	// Rotate the line down until it has at most one child, then splice it out.
+	while (line->left && line->right) {
+		struct line *child = line->left->priority > line->right->priority ? line->left : line->right;
+		linetree_rotate_up(root, child);
+	}
+	struct line *parent = line->parent;
+	struct line *child = line->left ? line->left : line->right;
+	linetree_replace_child(root, parent, line, child);
+	linetree_fix_upward(parent);
+
+	line->parent = NULL;
+	line->left = NULL;
+	line->right = NULL;
+}
+
+// Build a perfectly balanced subtree out of the next n lines of a linked list.
+static struct line* linetree_build_list(struct line **list, size_t n, struct line *parent, u32 *height)
+{
+	if (!n) {
+		*height = 0;
+		return NULL;
+	}
+	u32 left_height, right_height;
+	size_t nleft = n / 2;
+	struct line *left = linetree_build_list(list, nleft, NULL, &left_height);
+	struct line *line = *list;
+	*list = line->next;
+	struct line *right = linetree_build_list(list, n - nleft - 1, line, &right_height);
+
+	line->parent = parent;
+	line->left = left;
+	line->right = right;
+	if (left) left->parent = line;
+	*height = 1 + max(left_height, right_height);
+	line->priority = (*height << linetree_height_shift) | (linetree_random() & linetree_random_mask);
+	linetree_fix(line);
+	return line;
+}
+
+struct line* linetree_build(struct line *first, size_t n)
+{
+	u32 height;
+	return linetree_build_list(&first, n, NULL, &height);
+}
+
+static struct line* linetree_merge_subtrees(struct line *first, struct line *second)
+{
+	if (!first) return second;
+	if (!second) return first;
+	if (first->priority > second->priority) {
+		first->right = linetree_merge_subtrees(first->right, second);
+		first->right->parent = first;
+		linetree_fix(first);
+		return first;
+	}
+	second->left = linetree_merge_subtrees(first, second->left);
+	second->left->parent = second;
+	linetree_fix(second);
+	return second;
+}
+
+struct line* linetree_merge(struct line *first, struct line *second)
+{
+	struct line *root = linetree_merge_subtrees(first, second);
+	if (root) {
+		root->parent = NULL;
+	}
+	return root;
+}
+
+size_t line_index(struct line *line)
+{
+	size_t index = linetree_count(line->left);
+	while (line->parent) {
+		if (line->parent->right == line) {
+			index += linetree_count(line->parent->left) + 1;
+		}
+		line = line->parent;
+	}
+	return index;
+}
+
+size_t line_offset(struct line *line)
+{
+	size_t offset = linetree_bytes(line->left);
+	while (line->parent) {
+		struct line *parent = line->parent;
+		if (parent->right == line) {
+			offset += linetree_bytes(parent->left) + parent->bytelen + 1;
+		}
+		line = parent;
+	}
+	return offset;
+}
+
+size_t line_row(struct line *line)
+{
+	size_t row = linetree_rows(line->left);
+	while (line->parent) {
+		struct line *parent = line->parent;
+		if (parent->right == line) {
+			row += linetree_rows(parent->left) + parent->wrap_rows;
+		}
+		line = parent;
+	}
+	return row;
+}
+
+struct line* linetree_at(struct line *root, size_t index)
+{
+	struct line *line = root;
+	while (line) {
+		size_t nleft = linetree_count(line->left);
+		if (index < nleft) {
+			line = line->left;
+		} else if (index == nleft) {
+			return line;
+		} else {
+			index -= nleft + 1;
+			line = line->right;
+		}
+	}
+	return NULL;
+}
+
+struct line* linetree_at_offset(struct line *root, size_t offset, size_t *offset_in_line)
+{
+	struct line *line = root;
+	while (line) {
+		size_t left_bytes = linetree_bytes(line->left);
+		if (offset < left_bytes) {
+			line = line->left;
+		} else if (offset <= left_bytes + line->bytelen) {
+			// The newline ending a line is considered part of that line.
+			*offset_in_line = offset - left_bytes;
+			return line;
+		} else {
+			offset -= left_bytes + line->bytelen + 1;
+			line = line->right;
+		}
+	}
+	return NULL;
+}
+
+struct line* linetree_at_row(struct line *root, size_t row, size_t *row_in_line)
+{
+	struct line *line = root;
+	while (line) {
+		size_t left_rows = linetree_rows(line->left);
+		if (row < left_rows) {
+			line = line->left;
+		} else if (row < left_rows + line->wrap_rows) {
+			*row_in_line = row - left_rows;
+			return line;
+		} else {
+			row -= left_rows + line->wrap_rows;
+			line = line->right;
+		}
+	}
+	return NULL;
+}
+
+// Height of a subtree of n lines built by splitting at n / 2.
+static inline u32 linetree_height(size_t n)
+{
+	return n ? 64 - __builtin_clzl(n) : 0;
+}
+
+// Build a perfectly balanced subtree out of an array of lines, with the same shape as linetree_build_list().
+// The top 'depth' levels only link subtrees which have been built already.
+static struct line* linetree_build_range(struct line *lines, size_t n, struct line *parent, int depth)
+{
+	if (!n) {
+		return NULL;
+	}
+	size_t nleft = n / 2;
+	struct line *line = lines + nleft;
+	if (depth == 0) {
+		line->parent = parent;
+		return line;
+	}
+	line->parent = parent;
+	line->left = linetree_build_range(lines, nleft, line, depth - 1);
+	line->right = linetree_build_range(lines + nleft + 1, n - nleft - 1, line, depth - 1);
+	// Subtrees are built concurrently: derive the random bits from the node address instead of linetree_random().
+	u32 random = ((uintptr_t) line * 0x9e3779b97f4a7c15UL) >> 40;
+	line->priority = (linetree_height(n) << linetree_height_shift) | (random & linetree_random_mask);
+	linetree_fix(line);
+	return line;
+}
+
+struct linetree_build_job {
+	struct line *lines[worker_max_threads * 4];
+	size_t counts[worker_max_threads * 4];
+	int ntasks;
+};
+
+static void linetree_collect_subtrees(struct linetree_build_job *job, struct line *lines, size_t n, int depth)
+{
+	if (!n) {
+		return;
+	}
+	if (depth == 0) {
+		job->lines[job->ntasks] = lines;
+		job->counts[job->ntasks] = n;
+		job->ntasks++;
+		return;
+	}
+	size_t nleft = n / 2;
+	linetree_collect_subtrees(job, lines, nleft, depth - 1);
+	linetree_collect_subtrees(job, lines + nleft + 1, n - nleft - 1, depth - 1);
+}
+
+static void linetree_build_subtree_task(void *ctx, int task)
+{
+	struct linetree_build_job *job = (struct linetree_build_job*) ctx;
+	linetree_build_range(job->lines[task], job->counts[task], NULL, -1);
+}
+
+struct line* linetree_build_array(struct line *lines, size_t n)
+{
+	// Split the tree at a depth giving a few subtrees per thread, build these in parallel, then link them together.
+	int depth = 0;
+	while ((1 << depth) < 2 * worker_thread_count() && (1UL << (depth + 8)) < n) {
+		depth++;
+	}
+	struct linetree_build_job job;
+	job.ntasks = 0;
+	linetree_collect_subtrees(&job, lines, n, depth);
+	worker_parallel_for(job.ntasks, linetree_build_subtree_task, &job);
+	return linetree_build_range(lines, n, NULL, depth);
+}
+
+struct linetree_refresh_job {
+	struct line *subtrees[worker_max_threads * 4];
+	int ntasks;
+	void (*update)(void *ctx, struct line *line);
+	void *ctx;
+};
+
+static void linetree_refresh_subtree(struct linetree_refresh_job *job, struct line *line)
+{
+	if (!line) {
+		return;
+	}
+	linetree_refresh_subtree(job, line->left);
+	linetree_refresh_subtree(job, line->right);
+	job->update(job->ctx, line);
+	linetree_fix(line);
+}
+
+static void linetree_refresh_task(void *ctx, int task)
+{
+	struct linetree_refresh_job *job = (struct linetree_refresh_job*) ctx;
+	linetree_refresh_subtree(job, job->subtrees[task]);
+}
+
+// Collect the subtrees 'depth' levels below 'line' as tasks, or refresh the levels above them once they are done.
+static void linetree_refresh_levels(struct linetree_refresh_job *job, struct line *line, int depth, int collect)
+{
+	if (!line) {
+		return;
+	}
+	if (depth == 0) {
+		if (collect) {
+			job->subtrees[job->ntasks++] = line;
+		}
+		return;
+	}
+	linetree_refresh_levels(job, line->left, depth - 1, collect);
+	linetree_refresh_levels(job, line->right, depth - 1, collect);
+	if (!collect) {
+		job->update(job->ctx, line);
+		linetree_fix(line);
+	}
+}
+
+void linetree_refresh(struct line *root, void (*update)(void *ctx, struct line *line), void *ctx)
+{
+	if (!root) {
+		return;
+	}
+	// Like linetree_build_array(): the subtrees a few levels below the root are refreshed in parallel, then the
+	// nodes above them.
+	int depth = 0;
+	while ((1 << depth) < 2 * worker_thread_count() && (1UL << (depth + 8)) < root->count) {
+		depth++;
+	}
+	struct linetree_refresh_job job;
+	job.ntasks = 0;
+	job.update = update;
+	job.ctx = ctx;
+	linetree_refresh_levels(&job, root, depth, 1);
+	worker_parallel_for(job.ntasks, linetree_refresh_task, &job);
+	linetree_refresh_levels(&job, root, depth, 0);
+}
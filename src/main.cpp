@@ -96,6 +96,24 @@ struct slice input_to_string(slice slice, struct input input)
 	return slice_strcpy(slice, "INPUT:UNKNOWN");
 }
 
+static void editor_command(struct textbuffer *textbuffer, int op, int arg_size, void *args)
+{
+	// Streamed files are read-only.
+	if_null(textbuffer) {
+		return;
+	}
+	struct textbuffer_command command = {
+		.op = op,
+		.arg_size = arg_size,
+		.args = args,
+	};
+	struct err err = textbuffer_operation(textbuffer, &command);
+	if (err.is_error) {
+		logm("textbuffer op %d failed: %s\n", op, error_msg(err));
+		err_acknoledge(err);
+	}
+}
+
 struct err foo() { return error_because(EINVAL); }
 //struct err foo() { return noerror(); }
 struct err foo1() { struct err e = foo(); return_if_error(e); return noerror(); }
@@ -115,11 +133,152 @@ static void err_stack_trace_example()
 		err_acknoledge(err);
 	}
 }
+// Incremental search, started with CTRL_F: every key typed updates the query and moves to the first match after
+// where the search started. CTRL_F again moves to the next match, ENTER stops typing and keeps the matches
+// highlighted, ESC stops searching and goes back.
+struct search {
+	struct find find;
+	int typing;
+	size_t origin;
+	char query[256];
+	size_t query_len;
+};
+
+static void search_goto(struct search *search, struct cursor *cursor, size_t from)
+{
+	size_t match;
+	int found = find_next(&search->find, from, 0, &match);
+	if (found == 0 && from) {
+		// Wrap around.
+		found = find_next(&search->find, 0, 0, &match);
+	}
+	if (found == 1) {
+		cursor_goto_offset(cursor, match);
+	}
+}
+
+static void search_update(struct search *search, struct cursor *cursor)
+{
+	int fail = find_update(&search->find, s(search->query, search->query + search->query_len));
+	if (fail) {
+		logm("search failed: %s\n", strerror(-fail));
+		return;
+	}
+	search_goto(search, cursor, search->origin);
+}
+
+// Returns 1 if the input was for the search.
+static int search_input(struct search *search, struct view *view, struct input input)
+{
+	struct cursor *cursor = view->cursor;
+	if (!search->typing) {
+		if (input.code != CTRL_F || !cursor) {
+			return 0;
+		}
+		search->typing = 1;
+		search->origin = cursor_offset(cursor);
+		search->query_len = 0;
+		view->find = &search->find;
+		search_update(search, cursor);
+		return 1;
+	}
+	switch (input.code) {
+	case CTRL_F:
+		search_goto(search, cursor, cursor_offset(cursor) + 1);
+		break;
+	case ENTER:
+		search->typing = 0;
+		break;
+	case ESC:
+		search->typing = 0;
+		search->query_len = 0;
+		find_update(&search->find, s(search->query, search->query));
+		view->find = NULL;
+		cursor_goto_offset(cursor, search->origin);
+		break;
+	case DEL:
+		if (search->query_len) {
+			search->query_len--;
+			search_update(search, cursor);
+		}
+		break;
+	default:
+		if (!is_printable_key(input.code)) {
+			return 0;
+		}
+		if (search->query_len < sizeof(search->query)) {
+			search->query[search->query_len++] = (char) input.code;
+			search_update(search, cursor);
+		}
+		break;
+	}
+	return 1;
+}
+
+// The query and the number of matches on the last row, counted as the background search goes.
+static void search_draw(struct search *search, struct framebuffer *framebuffer)
+{
+	if (!search->typing) {
+		return;
+	}
+	struct find_status status;
+	find_status(&search->find, &status);
+	char text[512];
+	int n;
+	if (status.running) {
+		n = snprintf(text, sizeof(text), "find: %.*s  %zu matches, %zu%%", (int) search->query_len, search->query,
+			status.count, status.bytes ? status.scanned * 100 / status.bytes : 100);
+	} else {
+		n = snprintf(text, sizeof(text), "find: %.*s  %zu matches", (int) search->query_len, search->query, status.count);
+	}
+	// Blank the rest of the row.
+	n = min(n, (int) sizeof(text) - 1);
+	int width = min(framebuffer->window.x, (int) sizeof(text));
+	if (n < width) {
+		memset(text + n, ' ', width - n);
+		n = width;
+	}
+	framebuffer_put_text(framebuffer, s(text, text + n), v(0, framebuffer->window.y - 1));
+}
+
 #include <assert.h>
 
 int main(int argc, char **args) {
 	log_init();
 	config_init();
+
+	// -f follows a growing file, like tail -f.
+	int follow = argc > 1 && !strcmp(args[1], "-f");
+	if (follow) {
+		argc--;
+		args++;
+	}
+	const char *file = argc > 1 ? args[1] : "./src/chi.h";
+	// Files larger than memory are streamed instead of loaded, and cannot be edited.
+	int fail = 0;
+	struct textbuffer *tb = NULL;
+	struct stream stream = {};
+	struct stream_cursor stream_cursor = {};
+	struct stat file_stat;
+	if (!follow && stat(file, &file_stat) == 0 && file_stat.st_size > stream_min_file_size) {
+		fail = stream_open(&stream, file, stream_memory_budget);
+		stream_cursor_init(&stream_cursor, &stream);
+	} else {
+		tb = textbuffer_open(file, &fail);
+	}
+	if (fail) {
+		printf("cannot open %s: %s\n", file, strerror(-fail));
+		return 1;
+	}
+	if (tb) {
+		// Highlighting is only cosmetic, the file is shown in plain text when it fails.
+		highlight_set_language(tb, highlight_language_for(file));
+	}
+	if (follow) {
+		textbuffer_follow(tb, 1);
+		cursor_goto_offset(&tb->cursor, textbuffer_bytelen(tb));
+	}
+
 	term_init(STDIN_FILENO, STDOUT_FILENO);
 
 	struct framebuffer framebuffer = {};
@@ -127,24 +286,29 @@ int main(int argc, char **args) {
 	resize(&editor, &framebuffer);
 
 	// Debugging textbuffer_load
-	struct textbuffer tb = {};
-	char file[] = "./src/chi.h";
-	textbuffer_load(file, &tb);
-
-	struct cursor *cursor = &tb.cursor_list.cursor;
+	struct cursor *cursor = tb ? &tb->cursor : NULL;
 	if (0)
 	for (;;) {
-		char* line = cursor_to_string(cursor);
-		printf("%d: %s\n", cursor->lineno, line);
+		char line[256];
+		cursor_to_string(cursor, line, sizeof(line));
+		printf("%d: %s\n", cursor_lineno(cursor), line);
 		term_get_input(STDIN_FILENO);
 		if_null(cursor_next_line(cursor)) {
 			break;
 		}
-		free(line);
 	}
 
-	textbuffer_free(&tb);
-	if (0) return 0;
+	struct view view = {};
+	if (tb) {
+		view_init(&view, cursor);
+	} else {
+		view_init_stream(&view, &stream_cursor);
+	}
+
+	struct search search = {};
+	if (tb) {
+		find_init(&search.find, tb);
+	}
 
 	char buffer[128] = "HELLO WOLD!";
 	slice slice = s(buffer, buffer + 128);
@@ -152,22 +316,97 @@ int main(int argc, char **args) {
 	for (;;) {
 		framebuffer_clear(&framebuffer, r(v(0,0), framebuffer.window));
 
+		// Index the rest of the textbuffer between input events.
+		while (tb && !term_input_pending(STDIN_FILENO, 0) && textbuffer_index_step(tb, textbuffer_index_step_budget) > 0) {
+		}
+		while (!tb && !term_input_pending(STDIN_FILENO, 0) && stream_index_step(&stream, stream_window_size) > 0) {
+		}
+
+		// Wait for input, and report background saves completing and reload files changed on disk in the meantime.
+		// While a search runs, wake up regularly to update its count of matches.
+		int redraw = 0;
+		while (!redraw && !term_input_pending(STDIN_FILENO, 0) &&
+				!worker_wait_input(STDIN_FILENO, textbuffer_watch_fd(), search.find.job ? 100 : -1)) {
+			if (tb && textbuffer_save_poll(tb)) {
+				struct textbuffer_save_status status;
+				textbuffer_save_status(tb, &status);
+				if (status.result) {
+					logm("saving %s failed: %s\n", tb->path, strerror(-status.result));
+				}
+			}
+			redraw = textbuffer_watch_process() > 0;
+			if (search.find.job) {
+				find_poll(&search.find);
+				redraw |= search.typing;
+			}
+		}
+		if (redraw) {
+			// Redraw without waiting for input.
+			view_draw(&view, &framebuffer, r(v(0,0), framebuffer.window));
+			search_draw(&search, &framebuffer);
+			framebuffer_draw_to_term(STDOUT_FILENO, &framebuffer, v(5,5));
+			continue;
+		}
+
 		struct input input = term_get_input(STDIN_FILENO);
-		switch (input.code) {
-		case INPUT_RESIZE_CODE:
-			resize(&editor, &framebuffer);
-			break;
-		case CTRL_C:
-			// TODO: confirmation for saving buffers with pending changes.
-			return 0;
-		default:
-			break;
+		// Keys typed while searching edit the query.
+		if (!search_input(&search, &view, input)) {
+			switch (input.code) {
+			case INPUT_RESIZE_CODE:
+				resize(&editor, &framebuffer);
+				break;
+			case INPUT_KEY_ARROW_UP:
+				view_move_cursor(&view, -1, framebuffer.window.y);
+				break;
+			case INPUT_KEY_ARROW_DOWN:
+				view_move_cursor(&view, 1, framebuffer.window.y);
+				break;
+			case INPUT_KEY_ARROW_LEFT:
+				view_move_cursor_x(&view, -1);
+				break;
+			case INPUT_KEY_ARROW_RIGHT:
+				view_move_cursor_x(&view, 1);
+				break;
+			case CTRL_C:
+				// TODO: confirmation for saving buffers with pending changes.
+				if (tb) {
+					find_free(&search.find);
+					textbuffer_close(tb);
+				} else {
+					stream_close(&stream);
+				}
+				return 0;
+			case DEL:
+				editor_command(tb, TEXTBUFFER_DELETE, -1, NULL);
+				break;
+			case CTRL_S:
+				editor_command(tb, TEXTBUFFER_SAVE, 0, NULL);
+				break;
+			case CTRL_W:
+				view_set_wrapping(&view, !view.are_line_wrapping);
+				break;
+			case CTRL_Z:
+				editor_command(tb, TEXTBUFFER_UNDO, 0, NULL);
+				break;
+			case CTRL_Y:
+				editor_command(tb, TEXTBUFFER_REDO, 0, NULL);
+				break;
+			default:
+				if (is_printable_key(input.code) || input.code == ENTER) {
+					char c = input.code == ENTER ? '\n' : (char) input.code;
+					editor_command(tb, TEXTBUFFER_INSERT, 1, &c);
+				}
+				break;
+			}
 		}
 
 vec term_size = term_get_size();
 #define DEBUG 0
 debugf("term_size: %d,%d\n", term_size.x, term_size.y);
 
+		view_draw(&view, &framebuffer, r(v(0,0), framebuffer.window));
+		search_draw(&search, &framebuffer);
+
 		struct slice input_descr = input_to_string(slice, input);
 		//struct slice input_descr = slice_take(slice, 11);
 		framebuffer_put_text(&framebuffer, input_descr, v(5,5));
@@ -9,6 +9,8 @@
 #include <fcntl.h>
 
 #include <base.h>
+#include <regexp.h>
+#include <replace.h>
 
 #define __stringize1(x) #x
 #define __stringize2(x) __stringize1(x)
@@ -317,14 +319,32 @@ enum match_type {
 	match_anywhere,
 	match_anywhere_ignorecase,
 	match_from_start,
+	match_regexp,
 };
 
-int is_match(stringview candidate, stringview pattern, enum match_type mt)
+// Ignoring case and regular expressions are matched with a regexp compiled once per search: the pattern as a plain
+// string ignoring case, or as a regular expression. Returns NULL for the other match types or an invalid pattern.
+struct regexp* match_compile(stringview pattern, enum match_type mt, const char **error)
 {
+	*error = NULL;
 	switch (mt) {
 	case match_anywhere_ignorecase:
-		// undefined !!
-		//return strcasestr(candidate, pattern) != NULL;
+		return regexp_compile(pattern.cstr(), pattern.length, REGEXP_LITERAL | REGEXP_ICASE, error);
+	case match_regexp:
+		return regexp_compile(pattern.cstr(), pattern.length, 0, error);
+	default:
+		return NULL;
+	}
+}
+
+int is_match(stringview candidate, stringview pattern, enum match_type mt, struct regexp *re)
+{
+	size_t start;
+	size_t end;
+	switch (mt) {
+	case match_anywhere_ignorecase:
+	case match_regexp:
+		return regexp_find(re, candidate.cstr(), candidate.length, 0, &start, &end);
 	case match_anywhere:
 		return strstr(candidate.cstr(), pattern.cstr()) != NULL;
 	case match_from_start:
@@ -338,9 +358,15 @@ int is_match(stringview candidate, stringview pattern, enum match_type mt)
 slice<int> index_find_all_matches(struct index index, stringview pattern, enum match_type mt)
 {
 	slice<int> out = {};
+	const char *error;
+	struct regexp *re = match_compile(pattern, mt, &error);
+	if (error) {
+		printf("invalid pattern \"%s\": %s\n", pattern.cstr(), error);
+		return out;
+	}
 	for (int i = 1 /* skip root */; i < index.size(); i++) {
 		int j = i;
-		while (0 < j && !is_match(index[j].name(), pattern, mt)) {
+		while (0 < j && !is_match(index[j].name(), pattern, mt, re)) {
 			j = index[j].parent;
 		}
 		if (j <= 0) {
@@ -348,6 +374,7 @@ slice<int> index_find_all_matches(struct index index, stringview pattern, enum m
 		}
 		out = append(out, i);
 	}
+	regexp_free(re);
 	return out;
 }
 
@@ -369,6 +396,46 @@ void index_copy_complete_name(char* dst, slice<struct index_entry> entries, int
 	assert(left == 0);
 }
 
+// Replace 'needle' by 'replacement' in the regular files among the index 'entries', and print the report.
+// Returns 0 or -errno.
+int index_replace(struct index index, slice<int> entries, stringview needle, stringview replacement)
+{
+	slice<const char*> paths = {};
+	char buffer[256];
+	for (int i = 0; i < entries.size; i++) {
+		if (index[entries[i]].d_type != DT_REG) {
+			continue;
+		}
+		index_copy_complete_name(buffer, index.entries, entries[i]);
+		paths = append(paths, (const char*) strdup(buffer));
+	}
+
+	struct replace_report report;
+	int r = replace_in_files(paths.size ? paths.at(0) : NULL, paths.size, needle.cstr(), needle.length,
+			replacement.cstr(), replacement.length, 0, &report);
+	for (int i = 0; i < paths.size; i++) {
+		free((void*) paths[i]);
+	}
+	paths.dealloc();
+	if (r < 0) {
+		printf("replace failed: %s\n", strerror(-r));
+		return r;
+	}
+
+	for (size_t i = 0; i < report.nresults; i++) {
+		struct replace_result *result = report.results + i;
+		if (result->error) {
+			printf("%s: %s\n", result->path, strerror(-result->error));
+		} else if (result->replacements) {
+			printf("%s: %lu replacements%s\n", result->path, result->replacements,
+				result->in_textbuffer ? " (open buffer)" : "");
+		}
+	}
+	printf("%lu replacements in %lu files, %lu errors\n", report.replacements, report.changed, report.errors);
+	replace_report_free(&report);
+	return 0;
+}
+
 enum index_error {
 	index_error_none,
 	index_error_invalid_root,
@@ -566,13 +633,32 @@ int navigation_manualtest(int argc, char** argv)
 		}
 	}
 
+	// -i ignores case, -r matches a regular expression.
+	// -s <text> <replacement> replaces text in the matching files.
+	enum match_type mt = match_anywhere;
+	if (argc > 3 && !strcmp(argv[3], "-i")) {
+		mt = match_anywhere_ignorecase;
+	}
+	if (argc > 3 && !strcmp(argv[3], "-r")) {
+		mt = match_regexp;
+	}
 	string* look_pattern = string::make(argv[2], 128);
-	slice<int> matches = index_find_all_matches(index, view(look_pattern), match_anywhere);
+	slice<int> matches = index_find_all_matches(index, view(look_pattern), mt);
 	printf("%d matches\n", matches.size);
 	for (int i = 0; i < matches.size; i++) {
 		index_copy_complete_name(buffer, index.entries, matches[i]);
 		puts(buffer);
 	}
+	for (int i = 3; i + 2 < argc; i++) {
+		if (!strcmp(argv[i], "-s")) {
+			string* needle = string::make(argv[i + 1], 128);
+			string* replacement = string::make(argv[i + 2], 128);
+			index_replace(index, matches, view(needle), view(replacement));
+			free(needle);
+			free(replacement);
+			break;
+		}
+	}
 	matches.dealloc();
 	free(look_pattern);
 
@@ -80,3 +80,95 @@ void pool_return_object(struct pool *pool, void *object)
 	free_object_map[old_last] = new_last;
 	free_object_map[new_last] = new_last;
 }
+
+// Slab blocks are chained together in a list owned by the slab. Objects follow the header.
+struct slab_block {
+	struct slab_block *next;
+	size_t size;
+	char objects[0] __attribute__((aligned(16)));
+};
+
+void slab_init(struct slab *slab, size_t object_size, size_t block_objects)
+{
+	assert(object_size >= sizeof(void*));
+	assert(block_objects);
+	memset(slab, 0, sizeof(struct slab));
+	slab->object_size = object_size;
+	slab->block_objects = block_objects;
+}
+
+static struct slab_block* slab_new_block(struct slab *slab, size_t nobjects)
+{
+	size_t size = nobjects * slab->object_size;
+	// calloc because objects are handed out zeroed, and for large arrays calloc gets fresh zero pages for free.
+	struct slab_block *block = (struct slab_block*) calloc(sizeof(struct slab_block) + size, 1);
+	if_null(block) {
+		return NULL;
+	}
+	block->size = size;
+	block->next = slab->blocks;
+	slab->blocks = block;
+	slab->capacity += nobjects;
+	slab->bytes += sizeof(struct slab_block) + size;
+	return block;
+}
+
+void* slab_alloc(struct slab *slab)
+{
+	void *object = slab->free_list;
+	if (object) {
+		slab->free_list = *(void**) object;
+		memset(object, 0, slab->object_size);
+		slab->used++;
+		return object;
+	}
+	if (slab->cursor == slab->limit) {
+		struct slab_block *block = slab_new_block(slab, slab->block_objects);
+		if_null(block) {
+			return NULL;
+		}
+		slab->cursor = block->objects;
+		slab->limit = block->objects + block->size;
+	}
+	object = slab->cursor;
+	slab->cursor += slab->object_size;
+	slab->used++;
+	return object;
+}
+
+void* slab_alloc_array(struct slab *slab, size_t n)
+{
+	size_t size = n * slab->object_size;
+	void *objects;
+	if (size <= (size_t) (slab->limit - slab->cursor)) {
+		objects = slab->cursor;
+		slab->cursor += size;
+	} else {
+		// Large arrays get their own block, the current block stays in use for single objects.
+		struct slab_block *block = slab_new_block(slab, n);
+		if_null(block) {
+			return NULL;
+		}
+		objects = block->objects;
+	}
+	slab->used += n;
+	return objects;
+}
+
+void slab_free(struct slab *slab, void *object)
+{
+	*(void**) object = slab->free_list;
+	slab->free_list = object;
+	slab->used--;
+}
+
+void slab_reset(struct slab *slab)
+{
+	struct slab_block *block = slab->blocks;
+	while (block) {
+		struct slab_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	slab_init(slab, slab->object_size, slab->block_objects);
+}
@@ -0,0 +1,1218 @@
+// regexp.cpp implements regular expressions matched with a lazily built DFA.
+//
+// Compiling: the pattern is parsed into a syntax tree, which is compiled twice into a Thompson NFA, a program of
+// byte set, split, jump and assertion instructions. The forward program is preceded by a lazy loop consuming any
+// byte, so that it finds matches anywhere. The reverse program matches the reversed pattern and is anchored.
+//
+// Matching: a DFA state is the ordered list of NFA instructions alive after the epsilon closure. Instructions are
+// ordered by preference, and everything after a match instruction is dropped: once a match is found, only more
+// preferred threads keep running, which gives leftmost-first matches. States are built the first time they are
+// reached and their transitions are cached per byte class. The cache is bounded: when it is full, it is flushed
+// and states are built again as needed.
+// The forward DFA finds where the first match ends, and the reverse DFA, run backward from there, finds where it
+// starts. Both only need the text one byte after the other, so they run directly on pieces of text.
+//
+// Anchors: ^ is resolved when a state is built, knowing the byte before it. $ needs the byte after it, so it stays
+// in the state until the next byte is known. For the same reason a match is only reported on the transition after
+// it: the state built from a match instruction carries a 'matched' flag.
+#include <regexp.h>
+#include <scan.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define regexp_max_insts        0x4000
+#define regexp_max_states       0x1000
+#define regexp_max_cache_bytes  0x800000 // 8M
+#define regexp_buckets          0x1000
+#define regexp_max_depth        0x100
+#define regexp_unbounded        -1
+
+enum regexp_op {
+	regexp_op_set,                  // consume a byte of sets[x], continue at the next instruction
+	regexp_op_split,                // continue at x, or y with a lower preference
+	regexp_op_jmp,                  // continue at x
+	regexp_op_bol,                  // assert the start of a line, continue at the next instruction
+	regexp_op_eol,                  // assert the end of a line, continue at the next instruction
+	regexp_op_match,
+};
+
+struct regexp_inst {
+	uint32_t op;
+	uint32_t x;
+	uint32_t y;
+};
+
+struct regexp_set {
+	uint64_t bits[4];
+};
+
+enum regexp_node_type {
+	regexp_node_empty,
+	regexp_node_set,
+	regexp_node_concat,
+	regexp_node_alt,
+	regexp_node_repeat,
+	regexp_node_bol,
+	regexp_node_eol,
+};
+
+// Syntax tree nodes, stored in an array and linked by index.
+struct regexp_node {
+	int type;
+	int set;
+	int child;                      // first child
+	int next;                       // next sibling
+	int min;
+	int max;
+	int greedy;
+};
+
+struct regexp_state {
+	struct regexp_state *bucket_next;
+	uint32_t hash;
+	uint8_t matched;                // a match ends before the byte leading to this state
+	uint8_t at_bol;
+	int8_t end_matched[2];          // whether a match ends when the text stops here, without and with $, or -1
+	uint32_t ninsts;
+	uint32_t *insts;
+	// By byte class, the next state tagged with its 'matched' flag in the low bit, or 0 if not built yet. Matching
+	// only loads one entry per byte.
+	uintptr_t next[];
+};
+
+// The cache of DFA states of one program, with the scratch space used to build them.
+struct regexp_dfa {
+	struct regexp_inst *insts;
+	uint32_t ninsts;
+	uint32_t start;
+	int longest;                    // keep running after a match to find the longest one
+	struct regexp_state *buckets[regexp_buckets];
+	struct regexp_state *starts[2]; // by at_bol
+	size_t nstates;
+	size_t bytes;
+	uint32_t *dense;                // sparse set of the instructions added to a closure
+	uint32_t *sparse;
+	uint32_t ndense;
+	uint32_t *stack;
+	uint32_t *list;
+	uint32_t nlist;
+	uint32_t *alive;
+	size_t generation;              // number of flushes
+};
+
+struct regexp {
+	struct regexp_set *sets;
+	int nsets;
+	uint8_t classes[256];
+	uint32_t nclasses;
+	char *literal;
+	size_t literal_len;
+	int multiline;
+	struct regexp_dfa forward;
+	struct regexp_dfa reverse;
+};
+
+static struct regexp_state regexp_dead = {};
+
+
+// Parsing
+
+struct regexp_parser {
+	const char *pattern;
+	const char *c;
+	const char *end;
+	int flags;
+	const char *error;
+	struct regexp_node *nodes;
+	int nnodes;
+	int capacity;
+	struct regexp_set *sets;
+	int nsets;
+	int sets_capacity;
+	int depth;
+};
+
+static int regexp_node_add(struct regexp_parser *parser, int type)
+{
+	if (parser->nnodes == parser->capacity) {
+		int capacity = parser->capacity ? 2 * parser->capacity : 64;
+		struct regexp_node *nodes = (struct regexp_node*) realloc(parser->nodes, capacity * sizeof(struct regexp_node));
+		if (!nodes) {
+			parser->error = "out of memory";
+			return -1;
+		}
+		parser->nodes = nodes;
+		parser->capacity = capacity;
+	}
+	struct regexp_node *node = parser->nodes + parser->nnodes;
+	memset(node, 0, sizeof(struct regexp_node));
+	node->type = type;
+	node->child = -1;
+	node->next = -1;
+	return parser->nnodes++;
+}
+
+static void regexp_set_add(struct regexp_set *set, int c)
+{
+	set->bits[c >> 6] |= 1UL << (c & 63);
+}
+
+static void regexp_set_add_range(struct regexp_set *set, int from, int to)
+{
+	for (int c = from; c <= to; c++) {
+		regexp_set_add(set, c);
+	}
+}
+
+static int regexp_set_has(struct regexp_set *set, int c)
+{
+	return (set->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static void regexp_set_negate(struct regexp_set *set)
+{
+	for (int i = 0; i < 4; i++) {
+		set->bits[i] = ~set->bits[i];
+	}
+	set->bits['\n' >> 6] &= ~(1UL << ('\n' & 63));
+}
+
+static void regexp_set_ignore_case(struct regexp_set *set)
+{
+	for (int c = 'a'; c <= 'z'; c++) {
+		if (regexp_set_has(set, c) || regexp_set_has(set, c - 'a' + 'A')) {
+			regexp_set_add(set, c);
+			regexp_set_add(set, c - 'a' + 'A');
+		}
+	}
+}
+
+// Add the class of the escape sequence \c to 'set'. Returns 0 if 'c' is not a class.
+static int regexp_set_add_class(struct regexp_set *set, char c)
+{
+	struct regexp_set byte_class = {};
+	switch (c | 0x20) {
+	case 'd':
+		regexp_set_add_range(&byte_class, '0', '9');
+		break;
+	case 'w':
+		regexp_set_add_range(&byte_class, '0', '9');
+		regexp_set_add_range(&byte_class, 'a', 'z');
+		regexp_set_add_range(&byte_class, 'A', 'Z');
+		regexp_set_add(&byte_class, '_');
+		break;
+	case 's':
+		regexp_set_add(&byte_class, ' ');
+		regexp_set_add(&byte_class, '\t');
+		regexp_set_add(&byte_class, '\r');
+		regexp_set_add(&byte_class, '\v');
+		regexp_set_add(&byte_class, '\f');
+		break;
+	default:
+		return 0;
+	}
+	if (c >= 'A' && c <= 'Z') {
+		regexp_set_negate(&byte_class);
+	}
+	for (int i = 0; i < 4; i++) {
+		set->bits[i] |= byte_class.bits[i];
+	}
+	return 1;
+}
+
+static int regexp_escape_byte(char c)
+{
+	switch (c) {
+	case 'n': return '\n';
+	case 't': return '\t';
+	case 'r': return '\r';
+	case 'f': return '\f';
+	case 'v': return '\v';
+	case '0': return '\0';
+	default:
+		// Escaped letters and digits are reserved.
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+			return -1;
+		}
+		return (unsigned char) c;
+	}
+}
+
+static int regexp_node_add_set(struct regexp_parser *parser, struct regexp_set *set)
+{
+	if (parser->flags & REGEXP_ICASE) {
+		regexp_set_ignore_case(set);
+	}
+	if (parser->nsets == parser->sets_capacity) {
+		int capacity = parser->sets_capacity ? 2 * parser->sets_capacity : 32;
+		struct regexp_set *sets = (struct regexp_set*) realloc(parser->sets, capacity * sizeof(struct regexp_set));
+		if (!sets) {
+			parser->error = "out of memory";
+			return -1;
+		}
+		parser->sets = sets;
+		parser->sets_capacity = capacity;
+	}
+	int n = regexp_node_add(parser, regexp_node_set);
+	if (n < 0) {
+		return -1;
+	}
+	parser->sets[parser->nsets] = *set;
+	parser->nodes[n].set = parser->nsets++;
+	return n;
+}
+
+static int regexp_node_add_byte(struct regexp_parser *parser, int c)
+{
+	struct regexp_set set = {};
+	regexp_set_add(&set, c);
+	return regexp_node_add_set(parser, &set);
+}
+
+static int regexp_parse_class(struct regexp_parser *parser)
+{
+	struct regexp_set set = {};
+	int negated = parser->c < parser->end && *parser->c == '^';
+	if (negated) {
+		parser->c++;
+	}
+	int first = 1;
+	while (parser->c < parser->end && (*parser->c != ']' || first)) {
+		first = 0;
+		int from = (unsigned char) *parser->c++;
+		if (from == '\\') {
+			if (parser->c == parser->end) {
+				break;
+			}
+			if (regexp_set_add_class(&set, *parser->c)) {
+				parser->c++;
+				continue;
+			}
+			from = regexp_escape_byte(*parser->c++);
+			if (from < 0) {
+				parser->error = "invalid escape sequence";
+				return -1;
+			}
+		}
+		int to = from;
+		if (parser->c + 1 < parser->end && parser->c[0] == '-' && parser->c[1] != ']') {
+			parser->c++;
+			to = (unsigned char) *parser->c++;
+			if (to == '\\') {
+				to = parser->c < parser->end ? regexp_escape_byte(*parser->c++) : -1;
+			}
+			if (to < from) {
+				parser->error = "invalid range in byte_class";
+				return -1;
+			}
+		}
+		regexp_set_add_range(&set, from, to);
+	}
+	if (parser->c == parser->end) {
+		parser->error = "missing ]";
+		return -1;
+	}
+	parser->c++;
+	if (negated) {
+		// Ignoring case before negating, so that [^a] does not match 'A' either.
+		if (parser->flags & REGEXP_ICASE) {
+			regexp_set_ignore_case(&set);
+		}
+		regexp_set_negate(&set);
+	}
+	return regexp_node_add_set(parser, &set);
+}
+
+static int regexp_parse_alt(struct regexp_parser *parser);
+
+static int regexp_parse_atom(struct regexp_parser *parser)
+{
+	char c = *parser->c++;
+	switch (c) {
+	case '(': {
+		if (++parser->depth > regexp_max_depth) {
+			parser->error = "pattern too deeply nested";
+			return -1;
+		}
+		if (parser->end - parser->c >= 2 && parser->c[0] == '?' && parser->c[1] == ':') {
+			parser->c += 2;
+		}
+		int n = regexp_parse_alt(parser);
+		if (n < 0) {
+			return -1;
+		}
+		if (parser->c == parser->end || *parser->c != ')') {
+			parser->error = "missing )";
+			return -1;
+		}
+		parser->c++;
+		parser->depth--;
+		return n;
+	}
+	case '[':
+		return regexp_parse_class(parser);
+	case '.': {
+		struct regexp_set set = {};
+		regexp_set_negate(&set);
+		return regexp_node_add_set(parser, &set);
+	}
+	case '^':
+		return regexp_node_add(parser, regexp_node_bol);
+	case '$':
+		return regexp_node_add(parser, regexp_node_eol);
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		parser->error = "nothing to repeat";
+		return -1;
+	case '\\': {
+		if (parser->c == parser->end) {
+			parser->error = "trailing \\";
+			return -1;
+		}
+		struct regexp_set set = {};
+		if (regexp_set_add_class(&set, *parser->c)) {
+			parser->c++;
+			return regexp_node_add_set(parser, &set);
+		}
+		int b = regexp_escape_byte(*parser->c++);
+		if (b < 0) {
+			parser->error = "invalid escape sequence";
+			return -1;
+		}
+		return regexp_node_add_byte(parser, b);
+	}
+	default:
+		return regexp_node_add_byte(parser, (unsigned char) c);
+	}
+}
+
+static int regexp_parse_count(struct regexp_parser *parser)
+{
+	int n = -1;
+	while (parser->c < parser->end && *parser->c >= '0' && *parser->c <= '9') {
+		n = (n < 0 ? 0 : n) * 10 + *parser->c++ - '0';
+		if (n > 1000) {
+			return -2;
+		}
+	}
+	return n;
+}
+
+// Parse {n}, {n,} or {n,m}, with parser->c after the '{'.
+static int regexp_parse_bounds(struct regexp_parser *parser, int *min, int *max)
+{
+	*min = regexp_parse_count(parser);
+	*max = *min;
+	if (parser->c < parser->end && *parser->c == ',') {
+		parser->c++;
+		*max = regexp_parse_count(parser);
+		if (*max == -1) {
+			*max = regexp_unbounded;
+		}
+	}
+	if (parser->c == parser->end || *parser->c != '}' || *min < 0 || *max < -1 || (*max >= 0 && *max < *min)) {
+		parser->error = *min == -2 || *max == -2 ? "repetition count too large" : "invalid repetition";
+		return -1;
+	}
+	parser->c++;
+	return 0;
+}
+
+static int regexp_parse_repeat(struct regexp_parser *parser)
+{
+	int n = regexp_parse_atom(parser);
+	while (n >= 0 && parser->c < parser->end) {
+		int min;
+		int max;
+		switch (*parser->c) {
+		case '*': min = 0; max = regexp_unbounded; break;
+		case '+': min = 1; max = regexp_unbounded; break;
+		case '?': min = 0; max = 1; break;
+		case '{': min = 0; max = 0; break;
+		default:
+			return n;
+		}
+		parser->c++;
+		if (parser->c[-1] == '{' && regexp_parse_bounds(parser, &min, &max) < 0) {
+			return -1;
+		}
+		int greedy = 1;
+		if (parser->c < parser->end && *parser->c == '?') {
+			parser->c++;
+			greedy = 0;
+		}
+		int r = regexp_node_add(parser, regexp_node_repeat);
+		if (r < 0) {
+			return -1;
+		}
+		parser->nodes[r].child = n;
+		parser->nodes[r].min = min;
+		parser->nodes[r].max = max;
+		parser->nodes[r].greedy = greedy;
+		n = r;
+	}
+	return n;
+}
+
+// Make a node of type 'type' out of the nodes linked from 'first', or return 'first' if it is alone.
+static int regexp_node_list(struct regexp_parser *parser, int type, int first)
+{
+	if (first >= 0 && parser->nodes[first].next < 0) {
+		return first;
+	}
+	int n = regexp_node_add(parser, first < 0 ? regexp_node_empty : type);
+	if (n >= 0) {
+		parser->nodes[n].child = first;
+	}
+	return n;
+}
+
+static int regexp_parse_concat(struct regexp_parser *parser)
+{
+	int first = -1;
+	int last = -1;
+	while (parser->c < parser->end && *parser->c != '|' && *parser->c != ')') {
+		int n = regexp_parse_repeat(parser);
+		if (n < 0) {
+			return -1;
+		}
+		if (last < 0) {
+			first = n;
+		} else {
+			parser->nodes[last].next = n;
+		}
+		last = n;
+	}
+	return regexp_node_list(parser, regexp_node_concat, first);
+}
+
+static int regexp_parse_alt(struct regexp_parser *parser)
+{
+	int first = regexp_parse_concat(parser);
+	int last = first;
+	while (last >= 0 && parser->c < parser->end && *parser->c == '|') {
+		parser->c++;
+		int n = regexp_parse_concat(parser);
+		if (n < 0) {
+			return -1;
+		}
+		parser->nodes[last].next = n;
+		last = n;
+	}
+	if (last < 0) {
+		return -1;
+	}
+	return regexp_node_list(parser, regexp_node_alt, first);
+}
+
+static int regexp_parse(struct regexp_parser *parser)
+{
+	if (parser->flags & REGEXP_LITERAL) {
+		int first = -1;
+		int last = -1;
+		for (; parser->c < parser->end; parser->c++) {
+			int n = regexp_node_add_byte(parser, (unsigned char) *parser->c);
+			if (n < 0) {
+				return -1;
+			}
+			if (last < 0) {
+				first = n;
+			} else {
+				parser->nodes[last].next = n;
+			}
+			last = n;
+		}
+		return regexp_node_list(parser, regexp_node_concat, first);
+	}
+	int n = regexp_parse_alt(parser);
+	if (n >= 0 && parser->c < parser->end) {
+		parser->error = "unmatched )";
+		return -1;
+	}
+	return n;
+}
+
+
+// Compiling
+
+struct regexp_compiler {
+	struct regexp_parser *parser;
+	struct regexp_inst *insts;
+	uint32_t ninsts;
+	int reverse;
+	const char *error;
+};
+
+static int regexp_emit(struct regexp_compiler *compiler, uint32_t op, uint32_t x, uint32_t y)
+{
+	if (compiler->ninsts == regexp_max_insts) {
+		compiler->error = "pattern too large";
+		return -1;
+	}
+	struct regexp_inst *inst = compiler->insts + compiler->ninsts;
+	inst->op = op;
+	inst->x = x;
+	inst->y = y;
+	return compiler->ninsts++;
+}
+
+static int regexp_compile_node(struct regexp_compiler *compiler, int n)
+{
+	struct regexp_node *node = compiler->parser->nodes + n;
+	switch (node->type) {
+	case regexp_node_empty:
+		return 0;
+	case regexp_node_set:
+		return regexp_emit(compiler, regexp_op_set, node->set, 0) < 0 ? -1 : 0;
+	case regexp_node_bol:
+	case regexp_node_eol: {
+		// The reverse program reads lines backward.
+		int bol = (node->type == regexp_node_bol) != compiler->reverse;
+		return regexp_emit(compiler, bol ? regexp_op_bol : regexp_op_eol, 0, 0) < 0 ? -1 : 0;
+	}
+	case regexp_node_concat: {
+		if (!compiler->reverse) {
+			for (int c = node->child; c >= 0; c = compiler->parser->nodes[c].next) {
+				if (regexp_compile_node(compiler, c) < 0) {
+					return -1;
+				}
+			}
+			return 0;
+		}
+		int nchildren = 0;
+		for (int c = node->child; c >= 0; c = compiler->parser->nodes[c].next) {
+			nchildren++;
+		}
+		int *children = (int*) malloc(nchildren * sizeof(int));
+		if (!children) {
+			compiler->error = "out of memory";
+			return -1;
+		}
+		int i = nchildren;
+		for (int c = node->child; c >= 0; c = compiler->parser->nodes[c].next) {
+			children[--i] = c;
+		}
+		int fail = 0;
+		for (i = 0; i < nchildren && !fail; i++) {
+			fail = regexp_compile_node(compiler, children[i]);
+		}
+		free(children);
+		return fail;
+	}
+	case regexp_node_alt: {
+		// split L1, L2; L1: first; jmp end; L2: split L3, L4 ... and the last alternative falls through to end.
+		int jumps = -1;
+		for (int c = node->child; c >= 0; c = compiler->parser->nodes[c].next) {
+			int split = -1;
+			if (compiler->parser->nodes[c].next >= 0) {
+				split = regexp_emit(compiler, regexp_op_split, 0, 0);
+				if (split < 0) {
+					return -1;
+				}
+				compiler->insts[split].x = compiler->ninsts;
+			}
+			if (regexp_compile_node(compiler, c) < 0) {
+				return -1;
+			}
+			if (split >= 0) {
+				// Jumps to the end are chained through their x until patched.
+				int jmp = regexp_emit(compiler, regexp_op_jmp, jumps, 0);
+				if (jmp < 0) {
+					return -1;
+				}
+				jumps = jmp;
+				compiler->insts[split].y = compiler->ninsts;
+			}
+		}
+		while (jumps >= 0) {
+			int next = (int) compiler->insts[jumps].x;
+			compiler->insts[jumps].x = compiler->ninsts;
+			jumps = next;
+		}
+		return 0;
+	}
+	case regexp_node_repeat: {
+		for (int i = 0; i < node->min; i++) {
+			if (regexp_compile_node(compiler, node->child) < 0) {
+				return -1;
+			}
+		}
+		if (node->max == regexp_unbounded) {
+			// L: split body, end; body; jmp L
+			int split = regexp_emit(compiler, regexp_op_split, 0, 0);
+			if (split < 0 || regexp_compile_node(compiler, node->child) < 0) {
+				return -1;
+			}
+			if (regexp_emit(compiler, regexp_op_jmp, split, 0) < 0) {
+				return -1;
+			}
+			compiler->insts[split].x = node->greedy ? split + 1 : compiler->ninsts;
+			compiler->insts[split].y = node->greedy ? compiler->ninsts : split + 1;
+			return 0;
+		}
+		// Optional copies of the body: split body, end; body; split body, end; body ... end
+		int noptional = node->max - node->min;
+		if (!noptional) {
+			return 0;
+		}
+		int *splits = (int*) malloc(noptional * sizeof(int));
+		if (!splits) {
+			compiler->error = "out of memory";
+			return -1;
+		}
+		int fail = 0;
+		for (int i = 0; i < noptional && !fail; i++) {
+			splits[i] = regexp_emit(compiler, regexp_op_split, 0, 0);
+			fail = splits[i] < 0 ? -1 : regexp_compile_node(compiler, node->child);
+		}
+		for (int i = 0; i < noptional && !fail; i++) {
+			struct regexp_inst *split = compiler->insts + splits[i];
+			split->x = node->greedy ? splits[i] + 1 : compiler->ninsts;
+			split->y = node->greedy ? compiler->ninsts : splits[i] + 1;
+		}
+		free(splits);
+		return fail;
+	}
+	}
+	return -1;
+}
+
+// Compile the program of 'dfa': the forward one starts with a lazy loop over any byte.
+static int regexp_compile_program(struct regexp_dfa *dfa, struct regexp_parser *parser, int root, int reverse, int any)
+{
+	struct regexp_compiler compiler = {};
+	compiler.parser = parser;
+	compiler.reverse = reverse;
+	compiler.insts = (struct regexp_inst*) malloc(regexp_max_insts * sizeof(struct regexp_inst));
+	if (!compiler.insts) {
+		parser->error = "out of memory";
+		return -1;
+	}
+	if (!reverse) {
+		// 0: split 3, 1; 1: any byte; 2: jmp 0; 3: pattern
+		regexp_emit(&compiler, regexp_op_split, 3, 1);
+		regexp_emit(&compiler, regexp_op_set, any, 0);
+		regexp_emit(&compiler, regexp_op_jmp, 0, 0);
+	}
+	if (regexp_compile_node(&compiler, root) < 0 || regexp_emit(&compiler, regexp_op_match, 0, 0) < 0) {
+		parser->error = compiler.error;
+		free(compiler.insts);
+		return -1;
+	}
+	struct regexp_inst *insts = (struct regexp_inst*) realloc(compiler.insts, compiler.ninsts * sizeof(struct regexp_inst));
+	dfa->insts = insts ? insts : compiler.insts;
+	dfa->ninsts = compiler.ninsts;
+	dfa->start = 0;
+	dfa->longest = reverse;
+	dfa->dense = (uint32_t*) malloc(dfa->ninsts * sizeof(uint32_t));
+	dfa->sparse = (uint32_t*) malloc(dfa->ninsts * sizeof(uint32_t));
+	// Every instruction pushes at most two others on the stack of a closure.
+	dfa->stack = (uint32_t*) malloc((2 * dfa->ninsts + 1) * sizeof(uint32_t));
+	dfa->list = (uint32_t*) malloc(dfa->ninsts * sizeof(uint32_t));
+	dfa->alive = (uint32_t*) malloc(dfa->ninsts * sizeof(uint32_t));
+	if (!dfa->dense || !dfa->sparse || !dfa->stack || !dfa->list || !dfa->alive) {
+		parser->error = "out of memory";
+		return -1;
+	}
+	return 0;
+}
+
+// Split bytes in classes of bytes which no set tells apart. '\n' is alone in its class, for the anchors.
+static void regexp_compute_classes(struct regexp *re)
+{
+	uint8_t boundaries[257] = {};
+	boundaries['\n'] = 1;
+	boundaries['\n' + 1] = 1;
+	for (int s = 0; s < re->nsets; s++) {
+		for (int c = 1; c < 256; c++) {
+			if (regexp_set_has(re->sets + s, c) != regexp_set_has(re->sets + s, c - 1)) {
+				boundaries[c] = 1;
+			}
+		}
+	}
+	uint32_t byte_class = 0;
+	for (int c = 0; c < 256; c++) {
+		if (c && boundaries[c]) {
+			byte_class++;
+		}
+		re->classes[c] = byte_class;
+	}
+	re->nclasses = byte_class + 1;
+}
+
+// A literal in every match of the node 'n', as [*start, *len) of the bytes in 'bytes'. When the node always matches
+// exactly these bytes, *exact is set.
+static void regexp_required_literal(struct regexp_parser *parser, int n, char *bytes, size_t *start, size_t *len,
+		int *exact)
+{
+	struct regexp_node *node = parser->nodes + n;
+	*start = 0;
+	*len = 0;
+	*exact = 0;
+	switch (node->type) {
+	case regexp_node_empty:
+	case regexp_node_bol:
+	case regexp_node_eol:
+		*exact = 1;
+		return;
+	case regexp_node_set: {
+		int byte = -1;
+		for (int c = 0; c < 256; c++) {
+			if (regexp_set_has(parser->sets + node->set, c)) {
+				if (byte >= 0) {
+					return;
+				}
+				byte = c;
+			}
+		}
+		if (byte >= 0) {
+			bytes[0] = (char) byte;
+			*len = 1;
+			*exact = 1;
+		}
+		return;
+	}
+	case regexp_node_concat: {
+		// Runs of exact children are literals too. 'bytes' is large enough for the whole pattern.
+		size_t run = 0;
+		size_t used = 0;
+		*exact = 1;
+		for (int c = node->child; c >= 0; c = parser->nodes[c].next) {
+			size_t child_start;
+			size_t child_len;
+			int child_exact;
+			regexp_required_literal(parser, c, bytes + used, &child_start, &child_len, &child_exact);
+			if (child_exact) {
+				used += child_len;
+			} else {
+				*exact = 0;
+				if (child_len > *len) {
+					*start = used + child_start;
+					*len = child_len;
+				}
+				used += child_start + child_len;
+				run = used;
+			}
+			if (used - run > *len) {
+				*start = run;
+				*len = used - run;
+			}
+		}
+		return;
+	}
+	case regexp_node_repeat:
+		if (node->min > 0) {
+			int child_exact;
+			regexp_required_literal(parser, node->child, bytes, start, len, &child_exact);
+			*exact = child_exact && node->min == node->max && node->min == 1;
+		}
+		return;
+	case regexp_node_alt:
+		return;
+	}
+}
+
+struct regexp* regexp_compile(const char *pattern, size_t len, int flags, const char **error)
+{
+	struct regexp_parser parser = {};
+	parser.pattern = pattern;
+	parser.c = pattern;
+	parser.end = pattern + len;
+	parser.flags = flags;
+	struct regexp *re = (struct regexp*) calloc(1, sizeof(struct regexp));
+	if (!re) {
+		*error = "out of memory";
+		return NULL;
+	}
+	int root = regexp_parse(&parser);
+	struct regexp_set any = {};
+	regexp_set_negate(&any);
+	regexp_set_add(&any, '\n');
+	int any_set = root < 0 ? -1 : parser.nsets;
+	if (root >= 0 && regexp_node_add_set(&parser, &any) < 0) {
+		root = -1;
+	}
+	if (root >= 0 && (regexp_compile_program(&re->forward, &parser, root, 0, any_set) < 0
+			|| regexp_compile_program(&re->reverse, &parser, root, 1, any_set) < 0)) {
+		root = -1;
+	}
+	if (root >= 0) {
+		char *bytes = (char*) malloc(len + 1);
+		size_t start;
+		int exact;
+		if (bytes && !(flags & REGEXP_ICASE)) {
+			regexp_required_literal(&parser, root, bytes, &start, &re->literal_len, &exact);
+			memmove(bytes, bytes + start, re->literal_len);
+		}
+		re->literal = bytes;
+		if (!bytes) {
+			parser.error = "out of memory";
+			root = -1;
+		}
+	}
+	if (root >= 0) {
+		re->sets = parser.sets;
+		re->nsets = parser.nsets;
+		parser.sets = NULL;
+		regexp_compute_classes(re);
+		for (int s = 0; s < any_set; s++) {
+			re->multiline |= regexp_set_has(re->sets + s, '\n');
+		}
+	}
+	free(parser.nodes);
+	free(parser.sets);
+	if (root < 0) {
+		*error = parser.error ? parser.error : "invalid pattern";
+		regexp_free(re);
+		return NULL;
+	}
+	return re;
+}
+
+static void regexp_flush(struct regexp_dfa *dfa)
+{
+	for (int b = 0; b < regexp_buckets; b++) {
+		struct regexp_state *state = dfa->buckets[b];
+		while (state) {
+			struct regexp_state *next = state->bucket_next;
+			free(state);
+			state = next;
+		}
+		dfa->buckets[b] = NULL;
+	}
+	dfa->starts[0] = NULL;
+	dfa->starts[1] = NULL;
+	dfa->nstates = 0;
+	dfa->bytes = 0;
+	dfa->generation++;
+}
+
+static void regexp_dfa_free(struct regexp_dfa *dfa)
+{
+	regexp_flush(dfa);
+	free(dfa->insts);
+	free(dfa->dense);
+	free(dfa->sparse);
+	free(dfa->stack);
+	free(dfa->list);
+	free(dfa->alive);
+}
+
+void regexp_free(struct regexp *re)
+{
+	if (!re) {
+		return;
+	}
+	regexp_dfa_free(&re->forward);
+	regexp_dfa_free(&re->reverse);
+	free(re->sets);
+	free(re->literal);
+	free(re);
+}
+
+const char* regexp_literal(struct regexp *re, size_t *len)
+{
+	*len = re->literal_len;
+	return re->literal_len ? re->literal : NULL;
+}
+
+int regexp_multiline(struct regexp *re)
+{
+	return re->multiline;
+}
+
+
+// Matching
+
+static void regexp_closure_clear(struct regexp_dfa *dfa)
+{
+	dfa->ndense = 0;
+	dfa->nlist = 0;
+}
+
+static int regexp_closure_mark(struct regexp_dfa *dfa, uint32_t pc)
+{
+	uint32_t i = dfa->sparse[pc];
+	if (i < dfa->ndense && dfa->dense[i] == pc) {
+		return 0;
+	}
+	dfa->sparse[pc] = dfa->ndense;
+	dfa->dense[dfa->ndense++] = pc;
+	return 1;
+}
+
+// Add the instructions reached from 'pc' without consuming a byte to dfa->list, in order of preference. $ is kept
+// as is, unless 'at_eol' is 0 or 1, telling whether it holds. Returns 1 if a match instruction was added.
+static int regexp_closure(struct regexp_dfa *dfa, uint32_t pc, int at_bol, int at_eol)
+{
+	uint32_t nstack = 0;
+	dfa->stack[nstack++] = pc;
+	while (nstack) {
+		pc = dfa->stack[--nstack];
+		if (!regexp_closure_mark(dfa, pc)) {
+			continue;
+		}
+		struct regexp_inst *inst = dfa->insts + pc;
+		switch (inst->op) {
+		case regexp_op_set:
+			dfa->list[dfa->nlist++] = pc;
+			break;
+		case regexp_op_match:
+			dfa->list[dfa->nlist++] = pc;
+			// Everything after a match is less preferred.
+			if (!dfa->longest) {
+				return 1;
+			}
+			break;
+		case regexp_op_split:
+			dfa->stack[nstack++] = inst->y;
+			dfa->stack[nstack++] = inst->x;
+			break;
+		case regexp_op_jmp:
+			dfa->stack[nstack++] = inst->x;
+			break;
+		case regexp_op_bol:
+			if (at_bol) {
+				dfa->stack[nstack++] = pc + 1;
+			}
+			break;
+		case regexp_op_eol:
+			if (at_eol < 0) {
+				dfa->list[dfa->nlist++] = pc;
+			} else if (at_eol) {
+				dfa->stack[nstack++] = pc + 1;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+static uint32_t regexp_hash(uint32_t *insts, uint32_t n, int flags)
+{
+	uint32_t h = 2166136261u ^ flags;
+	for (uint32_t i = 0; i < n; i++) {
+		h = (h ^ insts[i]) * 16777619u;
+	}
+	return h;
+}
+
+// The state for the instructions in dfa->list, built if it is not in the cache.
+static struct regexp_state* regexp_state_get(struct regexp *re, struct regexp_dfa *dfa, int matched, int at_bol)
+{
+	if (!dfa->nlist && !matched) {
+		return &regexp_dead;
+	}
+	uint32_t hash = regexp_hash(dfa->list, dfa->nlist, matched | at_bol << 1);
+	struct regexp_state **bucket = dfa->buckets + hash % regexp_buckets;
+	for (struct regexp_state *state = *bucket; state; state = state->bucket_next) {
+		if (state->hash == hash && state->matched == matched && state->at_bol == at_bol
+				&& state->ninsts == dfa->nlist && !memcmp(state->insts, dfa->list, dfa->nlist * sizeof(uint32_t))) {
+			return state;
+		}
+	}
+	if (dfa->nstates == regexp_max_states || dfa->bytes > regexp_max_cache_bytes) {
+		regexp_flush(dfa);
+		bucket = dfa->buckets + hash % regexp_buckets;
+	}
+	size_t size = sizeof(struct regexp_state) + re->nclasses * sizeof(uintptr_t) + dfa->nlist * sizeof(uint32_t);
+	struct regexp_state *state = (struct regexp_state*) calloc(1, size);
+	if (!state) {
+		// Keep going without caching: the cache is emptied to make room.
+		regexp_flush(dfa);
+		state = (struct regexp_state*) calloc(1, size);
+		if (!state) {
+			abort();
+		}
+		bucket = dfa->buckets + hash % regexp_buckets;
+	}
+	state->hash = hash;
+	state->matched = matched;
+	state->at_bol = at_bol;
+	state->end_matched[0] = -1;
+	state->end_matched[1] = -1;
+	state->ninsts = dfa->nlist;
+	state->insts = (uint32_t*) (state->next + re->nclasses);
+	memcpy(state->insts, dfa->list, dfa->nlist * sizeof(uint32_t));
+	state->bucket_next = *bucket;
+	*bucket = state;
+	dfa->nstates++;
+	dfa->bytes += size;
+	return state;
+}
+
+static struct regexp_state* regexp_start_state(struct regexp *re, struct regexp_dfa *dfa, int at_bol)
+{
+	if (!dfa->starts[at_bol]) {
+		regexp_closure_clear(dfa);
+		regexp_closure(dfa, dfa->start, at_bol, -1);
+		dfa->starts[at_bol] = regexp_state_get(re, dfa, 0, at_bol);
+	}
+	return dfa->starts[at_bol];
+}
+
+// Resolve $ in 'state', knowing whether it is at the end of a line. Returns 1 if a match ends there, and leaves the
+// instructions still alive in dfa->list.
+static int regexp_resolve(struct regexp_dfa *dfa, struct regexp_state *state, int at_eol)
+{
+	regexp_closure_clear(dfa);
+	for (uint32_t i = 0; i < state->ninsts; i++) {
+		if (regexp_closure(dfa, state->insts[i], state->at_bol, at_eol)) {
+			return 1;
+		}
+	}
+	for (uint32_t i = 0; i < dfa->nlist; i++) {
+		if (dfa->insts[dfa->list[i]].op == regexp_op_match) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uintptr_t regexp_transition(struct regexp *re, struct regexp_dfa *dfa, struct regexp_state *state, uint8_t c)
+{
+	uint32_t byte_class = re->classes[c];
+	int matched = regexp_resolve(dfa, state, c == '\n');
+	// Step the threads still alive over 'c'.
+	uint32_t nalive = dfa->nlist;
+	memcpy(dfa->alive, dfa->list, nalive * sizeof(uint32_t));
+	regexp_closure_clear(dfa);
+	for (uint32_t i = 0; i < nalive; i++) {
+		struct regexp_inst *inst = dfa->insts + dfa->alive[i];
+		if (inst->op == regexp_op_set && regexp_set_has(re->sets + inst->x, c)) {
+			if (regexp_closure(dfa, dfa->alive[i] + 1, c == '\n', -1)) {
+				break;
+			}
+		}
+	}
+	size_t generation = dfa->generation;
+	struct regexp_state *next = regexp_state_get(re, dfa, matched, c == '\n');
+	uintptr_t tagged = (uintptr_t) next | next->matched;
+	// Unless the cache was flushed, which freed 'state'.
+	if (dfa->generation == generation) {
+		state->next[byte_class] = tagged;
+	}
+	return tagged;
+}
+
+static int regexp_end_matched(struct regexp_dfa *dfa, struct regexp_state *state, int at_eol)
+{
+	if (state->end_matched[at_eol] < 0) {
+		state->end_matched[at_eol] = regexp_resolve(dfa, state, at_eol);
+	}
+	return state->end_matched[at_eol];
+}
+
+void regexp_run_start(struct regexp_run *run, struct regexp *re, int reverse, size_t pos, int at_line_boundary)
+{
+	run->re = re;
+	run->reverse = reverse;
+	run->state = regexp_start_state(re, reverse ? &re->reverse : &re->forward, at_line_boundary != 0);
+	run->pos = pos;
+	run->match = REGEXP_NO_MATCH;
+}
+
+int regexp_run_feed(struct regexp_run *run, const char *text, size_t len)
+{
+	struct regexp *re = run->re;
+	struct regexp_dfa *dfa = run->reverse ? &re->reverse : &re->forward;
+	struct regexp_state *state = run->state;
+	const uint8_t *c = (const uint8_t*) (run->reverse ? text + len - 1 : text);
+	ptrdiff_t step = run->reverse ? -1 : 1;
+	const uint8_t *classes = re->classes;
+	size_t i = 0;
+	size_t matched = REGEXP_NO_MATCH;
+	while (i < len && state != &regexp_dead) {
+		uintptr_t next = state->next[classes[*c]];
+		if (!next) {
+			next = regexp_transition(re, dfa, state, *c);
+		}
+		if (next & 1) {
+			matched = i;
+		}
+		state = (struct regexp_state*) (next & ~(uintptr_t) 1);
+		c += step;
+		i++;
+	}
+	if (matched != REGEXP_NO_MATCH) {
+		run->match = run->reverse ? run->pos - matched : run->pos + matched;
+	}
+	run->pos = run->reverse ? run->pos - i : run->pos + i;
+	run->state = state;
+	return state == &regexp_dead;
+}
+
+void regexp_run_finish(struct regexp_run *run, int at_line_boundary)
+{
+	struct regexp_dfa *dfa = run->reverse ? &run->re->reverse : &run->re->forward;
+	if (run->state != &regexp_dead && regexp_end_matched(dfa, run->state, at_line_boundary != 0)) {
+		run->match = run->pos;
+	}
+	run->state = &regexp_dead;
+}
+
+// Find the first match starting in text[from..to), reading no further than 'to'.
+static int regexp_find_range(struct regexp *re, const char *text, size_t len, size_t from, size_t to, size_t *start,
+		size_t *end)
+{
+	struct regexp_run run;
+	regexp_run_start(&run, re, 0, from, from == 0 || text[from - 1] == '\n');
+	if (!regexp_run_feed(&run, text + from, to - from)) {
+		regexp_run_finish(&run, to == len || text[to] == '\n');
+	}
+	if (run.match == REGEXP_NO_MATCH) {
+		return 0;
+	}
+	*end = run.match;
+	regexp_run_start(&run, re, 1, *end, *end == len || text[*end] == '\n');
+	if (!regexp_run_feed(&run, text + from, *end - from)) {
+		regexp_run_finish(&run, from == 0 || text[from - 1] == '\n');
+	}
+	assert(run.match != REGEXP_NO_MATCH);
+	*start = run.match;
+	return 1;
+}
+
+// Offset of the literal in text[from..len), or len.
+static size_t regexp_find_literal(struct regexp *re, const char *text, size_t len, size_t from)
+{
+	// scan_find() reads at most scan_max_len bytes at once.
+	while (len - from >= re->literal_len) {
+		size_t n = len - from < (size_t) scan_max_len ? len - from : (size_t) scan_max_len;
+		size_t found = scan_find(text + from, n, re->literal, re->literal_len);
+		if (found < n) {
+			return from + found;
+		}
+		if (n == len - from) {
+			break;
+		}
+		from += n - re->literal_len + 1;
+	}
+	return len;
+}
+
+int regexp_find(struct regexp *re, const char *text, size_t len, size_t from, size_t *start, size_t *end)
+{
+	if (!re->literal_len || re->multiline) {
+		return regexp_find_range(re, text, len, from, len, start, end);
+	}
+	// Only the lines containing the literal can match.
+	while (from < len) {
+		size_t found = regexp_find_literal(re, text, len, from);
+		if (found == len) {
+			return 0;
+		}
+		const char *line_start = (const char*) memrchr(text + from, '\n', found - from);
+		const char *line_end = (const char*) memchr(text + found, '\n', len - found);
+		size_t stop = line_end ? line_end - text : len;
+		if (regexp_find_range(re, text, len, line_start ? line_start - text + 1 : from, stop, start, end)) {
+			return 1;
+		}
+		from = stop + 1;
+	}
+	return 0;
+}
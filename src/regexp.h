@@ -0,0 +1,55 @@
+#ifndef __chi_regexp__
+#define __chi_regexp__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Regular expressions matched with a lazily built DFA: matching is linear in the length of the text, and patterns
+// never backtrack.
+//
+// Syntax: bytes, '.', classes "[a-z_]" and "[^...]", the escapes \d \w \s \D \W \S \n \t \r and escaped punctuation,
+// groups "(...)" and "(?:...)", alternation '|', the quantifiers * + ? {n} {n,} {n,m} and their lazy versions
+// followed by '?', and the line anchors ^ and $. Matching is byte oriented. Only an explicit \n (or a newline in the
+// pattern) matches a newline: '.', negated classes and \s do not.
+// Matches are leftmost-first, like Perl: alternatives and quantifiers are tried in order of preference.
+
+#define REGEXP_ICASE     1      // ignore ascii case
+#define REGEXP_LITERAL   2      // the pattern is a plain string
+
+#define REGEXP_NO_MATCH  ((size_t) -1)
+
+struct regexp;
+struct regexp_state;
+
+// Compile a pattern. Returns NULL and sets 'error' to a static message if the pattern is invalid, too large, or out
+// of memory. A compiled regexp caches DFA states while matching: it must not be used by several threads at once.
+struct regexp* regexp_compile(const char *pattern, size_t len, int flags, const char **error);
+void regexp_free(struct regexp *re);
+
+// A literal contained in every match, or NULL. Candidates for a match can be found with scan_find() first.
+const char* regexp_literal(struct regexp *re, size_t *len);
+// Whether a match can contain a newline. When it cannot, only the lines containing the literal need to be matched.
+int regexp_multiline(struct regexp *re);
+
+// Running the DFA over text given in pieces, forward to find the end of the first match, or in reverse from the end
+// of a match to find where it starts. 'at_line_boundary' tells whether ^ (forward) or $ (reverse) hold at 'pos'.
+// regexp_run_feed() returns 1 once no match can be found or extended anymore. Once finished, 'match' is the end of
+// the match found forward, or its start in reverse, or REGEXP_NO_MATCH.
+struct regexp_run {
+	struct regexp *re;
+	int reverse;
+	struct regexp_state *state;
+	size_t pos;                 // forward: offset of the next byte, reverse: offset after the next byte
+	size_t match;
+};
+
+void regexp_run_start(struct regexp_run *run, struct regexp *re, int reverse, size_t pos, int at_line_boundary);
+// Forward, text[0..len) follows 'pos'. In reverse, text[0..len) precedes 'pos' and is read from its end.
+int regexp_run_feed(struct regexp_run *run, const char *text, size_t len);
+// The text stops at 'pos': 'at_line_boundary' tells whether $ (forward) or ^ (reverse) hold there.
+void regexp_run_finish(struct regexp_run *run, int at_line_boundary);
+
+// Find the first match in text[from..len). Returns 1 and sets the match to [*start, *end), or returns 0.
+int regexp_find(struct regexp *re, const char *text, size_t len, size_t from, size_t *start, size_t *end);
+
+#endif //__chi_regexp__
@@ -0,0 +1,234 @@
+// replace.cpp implements replacing a string across many files, see replace.h.
+//
+// Every file is a task of worker_parallel_for(). A task maps its file and looks for the first match: most files of
+// a project have none and are left alone without writing anything. Files with matches are written through a
+// file_writer, whose iovecs point at the mapping between matches and at the replacement, so that no file content
+// is copied into a buffer. Large unmodified spans are copied from the file itself when the filesystem allows it.
+#include <chi.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct replace_job {
+	struct replace_result *results;
+	slice needle;
+	slice replacement;
+	int flags;
+};
+
+// Offset of the first occurrence of 'needle' in text[from..len), or len.
+static size_t replace_find(const char *text, size_t len, size_t from, slice needle)
+{
+	size_t m = slice_len(needle);
+	// scan_find() reads at most scan_max_len bytes at once.
+	while (len - from >= m) {
+		size_t n = min(len - from, (size_t) scan_max_len);
+		size_t found = scan_find(text + from, n, needle.start, m);
+		if (found < n) {
+			return from + found;
+		}
+		if (n == len - from) {
+			break;
+		}
+		from += n - m + 1;
+	}
+	return len;
+}
+
+static int replace_in_file(struct replace_job *job, struct replace_result *result)
+{
+	struct mapped_file file;
+	int fail = mapped_file_load(&file, result->path);
+	if (fail) {
+		return fail;
+	}
+	const char *text = file.data.start;
+	size_t len = slice_len(file.data);
+	size_t m = slice_len(job->needle);
+	size_t match = replace_find(text, len, 0, job->needle);
+	if (match == len) {
+		mapped_file_unload(&file);
+		return 0;
+	}
+
+	// A file_writer is too large for the stack of a worker.
+	struct file_writer *writer = (struct file_writer*) malloc(sizeof(struct file_writer));
+	if_null(writer) {
+		mapped_file_unload(&file);
+		return -ENOMEM;
+	}
+	fail = file_writer_open(writer, result->path);
+	if (fail) {
+		free(writer);
+		mapped_file_unload(&file);
+		return fail;
+	}
+	int source_fd = mapped_file_open_unchanged(&file);
+	if (source_fd >= 0) {
+		file_writer_set_source(writer, source_fd, file.data);
+	}
+	size_t count = 0;
+	size_t from = 0;
+	while (match < len) {
+		file_writer_append(writer, s((char*) text + from, (char*) text + match));
+		if (!slice_empty(job->replacement)) {
+			file_writer_append(writer, job->replacement);
+		}
+		count++;
+		from = match + m;
+		match = replace_find(text, len, from, job->needle);
+	}
+	file_writer_append(writer, s((char*) text + from, (char*) text + len));
+	if (writer->fail) {
+		fail = writer->fail;
+		file_writer_abort(writer);
+	} else {
+		fail = file_writer_commit(writer, job->flags & REPLACE_SYNC ? FILE_WRITER_SYNC : 0);
+	}
+	if (source_fd >= 0) {
+		close(source_fd);
+	}
+	free(writer);
+	mapped_file_unload(&file);
+	if (!fail) {
+		result->replacements = count;
+	}
+	return fail;
+}
+
+static void replace_task(void *ctx, int task)
+{
+	struct replace_job *job = (struct replace_job*) ctx;
+	struct replace_result *result = job->results + task;
+	if (!result->in_textbuffer && !result->error) {
+		result->error = replace_in_file(job, result);
+	}
+}
+
+struct replace_matches {
+	size_t *offsets;
+	size_t count;
+	size_t capacity;
+	size_t needle_len;
+	int fail;
+};
+
+// Callback for snapshot_find_all(), which reports overlapping occurrences: only keep the ones after the last kept.
+static int replace_add_match(void *ctx, size_t offset)
+{
+	struct replace_matches *matches = (struct replace_matches*) ctx;
+	if (matches->count && offset < matches->offsets[matches->count - 1] + matches->needle_len) {
+		return 0;
+	}
+	if (matches->count == matches->capacity) {
+		size_t capacity = max(matches->capacity * 2, (size_t) 64);
+		size_t *offsets = (size_t*) realloc(matches->offsets, capacity * sizeof(size_t));
+		if_null(offsets) {
+			matches->fail = -ENOMEM;
+			return 1;
+		}
+		matches->offsets = offsets;
+		matches->capacity = capacity;
+	}
+	matches->offsets[matches->count++] = offset;
+	return 0;
+}
+
+// Open files are replaced in their textbuffer, from the last match to the first so that the offsets of the matches
+// before stay valid.
+static int replace_in_textbuffer(struct textbuffer *textbuffer, slice needle, slice replacement, size_t *count)
+{
+	struct textbuffer_snapshot *snapshot = textbuffer_snapshot(textbuffer);
+	if_null(snapshot) {
+		return -ENOMEM;
+	}
+	struct replace_matches matches = {};
+	matches.needle_len = slice_len(needle);
+	int fail = snapshot_find_all(snapshot, needle, 0, snapshot->bytes, replace_add_match, &matches);
+	snapshot_release(snapshot);
+	fail = fail < 0 ? fail : matches.fail;
+	if (fail || !matches.count) {
+		free(matches.offsets);
+		return fail;
+	}
+
+	struct cursor *cursor = textbuffer_add_cursor(textbuffer, 0);
+	if_null(cursor) {
+		free(matches.offsets);
+		return -ENOMEM;
+	}
+	textbuffer_begin_transaction(textbuffer);
+	for (size_t i = matches.count; i-- > 0 && !fail;) {
+		cursor_goto_offset(cursor, matches.offsets[i]);
+		fail = textbuffer_delete(cursor, slice_len(needle));
+		if (!fail && !slice_empty(replacement)) {
+			fail = textbuffer_insert(cursor, replacement);
+		}
+		if (!fail) {
+			(*count)++;
+		}
+	}
+	textbuffer_end_transaction(textbuffer);
+	textbuffer_remove_cursor(cursor);
+	free(matches.offsets);
+	return fail;
+}
+
+int replace_in_files(const char **paths, size_t npaths, const char *needle, size_t needle_len,
+		const char *replacement, size_t replacement_len, int flags, struct replace_report *report)
+{
+	memset(report, 0, sizeof(struct replace_report));
+	if (!needle_len) {
+		return -EINVAL;
+	}
+	struct replace_result *results = (struct replace_result*) calloc(npaths, sizeof(struct replace_result));
+	if (!results && npaths) {
+		return -ENOMEM;
+	}
+	report->results = results;
+	report->nresults = npaths;
+	for (size_t i = 0; i < npaths; i++) {
+		results[i].path = strdup(paths[i]);
+		if_null(results[i].path) {
+			replace_report_free(report);
+			return -ENOMEM;
+		}
+	}
+
+	struct replace_job job = {
+		.results = results,
+		.needle = s((char*) needle, (char*) needle + needle_len),
+		.replacement = s((char*) replacement, (char*) replacement + replacement_len),
+		.flags = flags,
+	};
+
+	// Textbuffers are not thread safe: open files are edited from this thread first.
+	if (textbuffer_registry_count()) {
+		for (size_t i = 0; i < npaths; i++) {
+			struct textbuffer *textbuffer = textbuffer_find(results[i].path);
+			if (textbuffer) {
+				results[i].in_textbuffer = 1;
+				results[i].error = replace_in_textbuffer(textbuffer, job.needle, job.replacement, &results[i].replacements);
+			}
+		}
+	}
+	worker_parallel_for(npaths, replace_task, &job);
+
+	for (size_t i = 0; i < npaths; i++) {
+		report->replacements += results[i].replacements;
+		report->changed += results[i].replacements > 0;
+		report->errors += results[i].error != 0;
+	}
+	return 0;
+}
+
+void replace_report_free(struct replace_report *report)
+{
+	for (size_t i = 0; i < report->nresults; i++) {
+		free(report->results[i].path);
+	}
+	free(report->results);
+	memset(report, 0, sizeof(struct replace_report));
+}
@@ -0,0 +1,36 @@
+#ifndef __chi_replace__
+#define __chi_replace__
+
+#include <stddef.h>
+
+// Replacing a string in many files at once, for instance in all the files of a navigation index.
+// The files are fanned out to a pool of threads: every file is mapped and searched with scan_find(), and only the
+// files with matches are written again, to a temporary file renamed over the file (see file_writer).
+// Files open in a textbuffer are not written: their textbuffer is edited instead, as a single undoable transaction,
+// and left unsaved. Textbuffers are edited by the calling thread, which must be the thread owning them.
+
+#define REPLACE_SYNC 1          // fsync the rewritten files
+
+struct replace_result {
+	char *path;
+	size_t replacements;          // occurrences replaced
+	int in_textbuffer;            // the file is open and its textbuffer was edited
+	int error;                    // 0 or -errno, files are left unchanged on error
+};
+
+struct replace_report {
+	struct replace_result *results;       // one per file, in the order of the paths
+	size_t nresults;
+	size_t changed;                       // files and textbuffers with replacements
+	size_t replacements;
+	size_t errors;
+};
+
+// Replace every occurrence of 'needle' by 'replacement' in the files at 'paths', from left to right without
+// overlaps. Returns 0 once the report is filled, even when some files failed, or -EINVAL for an empty needle, or
+// -ENOMEM. The report is freed with replace_report_free().
+int replace_in_files(const char **paths, size_t npaths, const char *needle, size_t needle_len,
+		const char *replacement, size_t replacement_len, int flags, struct replace_report *report);
+void replace_report_free(struct replace_report *report);
+
+#endif //__chi_replace__
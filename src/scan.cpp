@@ -0,0 +1,416 @@
+// scan.cpp implements vectorized byte scanning used for indexing lines in large texts.
+//
+// Every primitive exists in an AVX2, an SSE2 and a scalar version. The version used is selected once at runtime
+// with __builtin_cpu_supports() and stored in a function pointer.
+#include <scan.h>
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+typedef size_t (*scan_newlines_fn)(const char*, size_t, uint32_t*, size_t, size_t*);
+typedef size_t (*scan_count_newlines_fn)(const char*, size_t);
+typedef size_t (*scan_find_fn)(const char*, size_t, const char*, size_t);
+typedef size_t (*scan_plain_fn)(const char*, size_t);
+
+static size_t scan_newlines_scalar(const char *text, size_t len, uint32_t *newlines, size_t capacity, size_t *scanned)
+{
+	size_t n = 0;
+	const char *c = text;
+	const char *end = text + len;
+	while (n < capacity) {
+		c = (const char*) memchr(c, '\n', end - c);
+		if (!c) {
+			c = end;
+			break;
+		}
+		newlines[n++] = c - text;
+		c++;
+	}
+	*scanned = c - text;
+	return n;
+}
+
+static size_t scan_count_newlines_scalar(const char *text, size_t len)
+{
+	size_t n = 0;
+	const char *c = text;
+	const char *end = text + len;
+	while ((c = (const char*) memchr(c, '\n', end - c))) {
+		n++;
+		c++;
+	}
+	return n;
+}
+
+// Searching needles of at least 2 bytes, shorter than the text.
+static size_t scan_find_scalar(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	const char *c = text;
+	const char *last = text + len - needle_len;
+	while (c <= last) {
+		c = (const char*) memchr(c, needle[0], last - c + 1);
+		if (!c) {
+			break;
+		}
+		if (c[needle_len - 1] == needle[needle_len - 1] && !memcmp(c + 1, needle + 1, needle_len - 2)) {
+			return c - text;
+		}
+		c++;
+	}
+	return len;
+}
+
+static size_t scan_rfind_scalar(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	size_t n = len - needle_len + 1;
+	while (n) {
+		const char *c = (const char*) memrchr(text, needle[0], n);
+		if (!c) {
+			break;
+		}
+		if (c[needle_len - 1] == needle[needle_len - 1] && !memcmp(c + 1, needle + 1, needle_len - 2)) {
+			return c - text;
+		}
+		n = c - text;
+	}
+	return len;
+}
+
+static size_t scan_plain_scalar(const char *text, size_t len)
+{
+	size_t i = 0;
+	while (i < len && (unsigned char) text[i] < 0x80 && text[i] != '\t') {
+		i++;
+	}
+	return i;
+}
+
+// Verify the candidates of a block starting at 'base' from the first one, or from the last one.
+static inline size_t scan_verify_first(uint32_t mask, const char *text, size_t base, const char *needle, size_t needle_len, size_t none)
+{
+	while (mask) {
+		size_t k = base + __builtin_ctz(mask);
+		if (!memcmp(text + k + 1, needle + 1, needle_len - 2)) {
+			return k;
+		}
+		mask &= mask - 1;
+	}
+	return none;
+}
+
+static inline size_t scan_verify_last(uint32_t mask, const char *text, size_t base, const char *needle, size_t needle_len, size_t none)
+{
+	while (mask) {
+		int bit = 31 - __builtin_clz(mask);
+		size_t k = base + bit;
+		if (!memcmp(text + k + 1, needle + 1, needle_len - 2)) {
+			return k;
+		}
+		mask &= ~(1u << bit);
+	}
+	return none;
+}
+
+// Emit the offsets of all bits set in a movemask.
+static inline size_t scan_emit_mask(uint32_t mask, uint32_t base, uint32_t *newlines, size_t n)
+{
+	while (mask) {
+		newlines[n++] = base + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+	return n;
+}
+
+// Finish a vectorized scan from text[i] with the scalar version, when less than a block is left.
+static size_t scan_newlines_tail(const char *text, size_t len, uint32_t *newlines, size_t capacity, size_t *scanned, size_t i, size_t n)
+{
+	size_t tail_scanned;
+	size_t tail_n = scan_newlines_scalar(text + i, len - i, newlines + n, capacity - n, &tail_scanned);
+	for (size_t k = n; k < n + tail_n; k++) {
+		newlines[k] += i;
+	}
+	*scanned = i + tail_scanned;
+	return n + tail_n;
+}
+
+#if SCAN_X86
+
+static size_t scan_newlines_sse2(const char *text, size_t len, uint32_t *newlines, size_t capacity, size_t *scanned)
+{
+	const __m128i newline = _mm_set1_epi8('\n');
+	size_t n = 0;
+	size_t i = 0;
+	// Only process a full block when all its newlines can be written.
+	while (i + 16 <= len && n + 16 <= capacity) {
+		__m128i block = _mm_loadu_si128((const __m128i*) (text + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+		n = scan_emit_mask(mask, i, newlines, n);
+		i += 16;
+	}
+	return scan_newlines_tail(text, len, newlines, capacity, scanned, i, n);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_newlines_avx2(const char *text, size_t len, uint32_t *newlines, size_t capacity, size_t *scanned)
+{
+	const __m256i newline = _mm256_set1_epi8('\n');
+	size_t n = 0;
+	size_t i = 0;
+	while (i + 64 <= len && n + 64 <= capacity) {
+		__m256i block0 = _mm256_loadu_si256((const __m256i*) (text + i));
+		__m256i block1 = _mm256_loadu_si256((const __m256i*) (text + i + 32));
+		uint32_t mask0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block0, newline));
+		uint32_t mask1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block1, newline));
+		n = scan_emit_mask(mask0, i, newlines, n);
+		n = scan_emit_mask(mask1, i + 32, newlines, n);
+		i += 64;
+	}
+	return scan_newlines_tail(text, len, newlines, capacity, scanned, i, n);
+}
+
+static size_t scan_count_newlines_sse2(const char *text, size_t len)
+{
+	const __m128i newline = _mm_set1_epi8('\n');
+	size_t n = 0;
+	size_t i = 0;
+	while (i + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*) (text + i));
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+		i += 16;
+	}
+	return n + scan_count_newlines_scalar(text + i, len - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t scan_count_newlines_avx2(const char *text, size_t len)
+{
+	const __m256i newline = _mm256_set1_epi8('\n');
+	size_t n = 0;
+	size_t i = 0;
+	while (i + 32 <= len) {
+		__m256i block = _mm256_loadu_si256((const __m256i*) (text + i));
+		n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+		i += 32;
+	}
+	return n + scan_count_newlines_scalar(text + i, len - i);
+}
+
+static size_t scan_find_sse2(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+	size_t i = 0;
+	while (i + needle_len - 1 + 16 <= len) {
+		__m128i block_first = _mm_loadu_si128((const __m128i*) (text + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i*) (text + i + needle_len - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+		size_t k = scan_verify_first(mask, text, i, needle, needle_len, len);
+		if (k != len) {
+			return k;
+		}
+		i += 16;
+	}
+	size_t k = scan_find_scalar(text + i, len - i, needle, needle_len);
+	return k == len - i ? len : i + k;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_find_avx2(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+	size_t i = 0;
+	while (i + needle_len - 1 + 32 <= len) {
+		__m256i block_first = _mm256_loadu_si256((const __m256i*) (text + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i*) (text + i + needle_len - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+		size_t k = scan_verify_first(mask, text, i, needle, needle_len, len);
+		if (k != len) {
+			return k;
+		}
+		i += 32;
+	}
+	size_t k = scan_find_scalar(text + i, len - i, needle, needle_len);
+	return k == len - i ? len : i + k;
+}
+
+// Blocks are processed from the end of the text, the positions left before the first block are searched last.
+static size_t scan_rfind_sse2(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+	size_t end = len - needle_len + 1;      // candidate positions are [0, end)
+	while (end >= 16) {
+		size_t i = end - 16;
+		__m128i block_first = _mm_loadu_si128((const __m128i*) (text + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i*) (text + i + needle_len - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+		size_t k = scan_verify_last(mask, text, i, needle, needle_len, len);
+		if (k != len) {
+			return k;
+		}
+		end = i;
+	}
+	size_t k = scan_rfind_scalar(text, end + needle_len - 1, needle, needle_len);
+	return k == end + needle_len - 1 ? len : k;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_rfind_avx2(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+	size_t end = len - needle_len + 1;
+	while (end >= 32) {
+		size_t i = end - 32;
+		__m256i block_first = _mm256_loadu_si256((const __m256i*) (text + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i*) (text + i + needle_len - 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+		size_t k = scan_verify_last(mask, text, i, needle, needle_len, len);
+		if (k != len) {
+			return k;
+		}
+		end = i;
+	}
+	size_t k = scan_rfind_scalar(text, end + needle_len - 1, needle, needle_len);
+	return k == end + needle_len - 1 ? len : k;
+}
+
+// Bytes which are not ASCII are the ones with the high bit set, which movemask extracts directly.
+static size_t scan_plain_sse2(const char *text, size_t len)
+{
+	const __m128i tab = _mm_set1_epi8('\t');
+	size_t i = 0;
+	while (i + 16 <= len) {
+		__m128i block = _mm_loadu_si128((const __m128i*) (text + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_or_si128(block, _mm_cmpeq_epi8(block, tab)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+		i += 16;
+	}
+	return i + scan_plain_scalar(text + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_plain_avx2(const char *text, size_t len)
+{
+	const __m256i tab = _mm256_set1_epi8('\t');
+	size_t i = 0;
+	while (i + 32 <= len) {
+		__m256i block = _mm256_loadu_si256((const __m256i*) (text + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(block, _mm256_cmpeq_epi8(block, tab)));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+		i += 32;
+	}
+	return i + scan_plain_scalar(text + i, len - i);
+}
+
+#endif // SCAN_X86
+
+static scan_newlines_fn scan_newlines_impl = NULL;
+static scan_count_newlines_fn scan_count_newlines_impl = NULL;
+static scan_find_fn scan_find_impl = NULL;
+static scan_find_fn scan_rfind_impl = NULL;
+static scan_plain_fn scan_plain_impl = NULL;
+static const char *scan_implementation_name = NULL;
+
+static void scan_dispatch_init()
+{
+	scan_newlines_impl = scan_newlines_scalar;
+	scan_count_newlines_impl = scan_count_newlines_scalar;
+	scan_find_impl = scan_find_scalar;
+	scan_rfind_impl = scan_rfind_scalar;
+	scan_plain_impl = scan_plain_scalar;
+	scan_implementation_name = "scalar";
+#if SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_newlines_impl = scan_newlines_avx2;
+		scan_count_newlines_impl = scan_count_newlines_avx2;
+		scan_find_impl = scan_find_avx2;
+		scan_rfind_impl = scan_rfind_avx2;
+		scan_plain_impl = scan_plain_avx2;
+		scan_implementation_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan_newlines_impl = scan_newlines_sse2;
+		scan_count_newlines_impl = scan_count_newlines_sse2;
+		scan_find_impl = scan_find_sse2;
+		scan_rfind_impl = scan_rfind_sse2;
+		scan_plain_impl = scan_plain_sse2;
+		scan_implementation_name = "sse2";
+	}
+#endif
+}
+
+size_t scan_newlines(const char *text, size_t len, uint32_t *newlines, size_t capacity, size_t *scanned)
+{
+	assert(len <= (size_t) scan_max_len);
+	if (!scan_newlines_impl) {
+		scan_dispatch_init();
+	}
+	return scan_newlines_impl(text, len, newlines, capacity, scanned);
+}
+
+size_t scan_count_newlines(const char *text, size_t len)
+{
+	if (!scan_count_newlines_impl) {
+		scan_dispatch_init();
+	}
+	return scan_count_newlines_impl(text, len);
+}
+
+size_t scan_find(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	if (!needle_len || needle_len > len) {
+		return len;
+	}
+	if (needle_len == 1) {
+		const char *c = (const char*) memchr(text, needle[0], len);
+		return c ? c - text : len;
+	}
+	if (!scan_find_impl) {
+		scan_dispatch_init();
+	}
+	return scan_find_impl(text, len, needle, needle_len);
+}
+
+size_t scan_rfind(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	if (!needle_len || needle_len > len) {
+		return len;
+	}
+	if (needle_len == 1) {
+		const char *c = (const char*) memrchr(text, needle[0], len);
+		return c ? c - text : len;
+	}
+	if (!scan_rfind_impl) {
+		scan_dispatch_init();
+	}
+	return scan_rfind_impl(text, len, needle, needle_len);
+}
+
+size_t scan_plain(const char *text, size_t len)
+{
+	if (!scan_plain_impl) {
+		scan_dispatch_init();
+	}
+	return scan_plain_impl(text, len);
+}
+
+const char* scan_implementation()
+{
+	if (!scan_implementation_name) {
+		scan_dispatch_init();
+	}
+	return scan_implementation_name;
+}
@@ -0,0 +1,37 @@
+#ifndef __chi_scan__
+#define __chi_scan__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Vectorized scanning of byte arrays.
+// Every function dispatches at runtime to AVX2, SSE2 or scalar code depending on what the cpu supports.
+
+// Offsets are 32 bits: a single call must not scan more than this many bytes.
+#define scan_max_len 0x40000000L // 1G
+
+// Write the offsets of the newline chars found in text[0..len) into 'newlines', until either 'capacity' offsets are
+// written or 'len' bytes are scanned. Returns the number of offsets written, and the number of bytes scanned in
+// 'scanned'. All the newlines in text[0..scanned) are reported.
+size_t scan_newlines(const char *text, size_t len, uint32_t *newlines, size_t capacity, size_t *scanned);
+
+// Count the newline chars in text[0..len).
+size_t scan_count_newlines(const char *text, size_t len);
+
+// Offset of the first occurrence of needle[0..needle_len) in text[0..len), or len if there is none. An empty needle
+// is never found.
+// Candidates are positions where both the first and the last byte of the needle match, checked for a whole block of
+// positions at once, and then verified.
+size_t scan_find(const char *text, size_t len, const char *needle, size_t needle_len);
+
+// Offset of the last occurrence of needle[0..needle_len) in text[0..len), or len if there is none.
+size_t scan_rfind(const char *text, size_t len, const char *needle, size_t needle_len);
+
+// Offset of the first byte of text[0..len) which is a tab or not ASCII, or len. Each byte before it is displayed in
+// exactly one column.
+size_t scan_plain(const char *text, size_t len);
+
+// Name of the implementation selected at runtime, for debugging.
+const char* scan_implementation();
+
+#endif //__chi_scan__
@@ -0,0 +1,1023 @@
+// snapshot.cpp implements immutable snapshots of the text of a textbuffer.
+//
+// A snapshot is a list of pieces of text split in blocks. Blocks are reference counted and shared between snapshots:
+// deriving a snapshot copies the array of block pointers, and a block is copied before being changed only if another
+// snapshot uses it too. The textbuffer keeps its last snapshot and the changes made since, so that taking the next
+// snapshot costs the number of blocks plus the blocks touched by the changes, instead of walking all lines.
+//
+// Reference counts are the only state shared between threads: a block or a snapshot is never modified once it is
+// reachable from another snapshot, and release is the only operation done from readers.
+#include <chi.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+// Storage for the newlines between lines which are not backed by a newline character in the text.
+// Filled once before main, background readers of snapshots point into it so it is never written again.
+static char snapshot_newlines[256];
+
+__attribute__((constructor))
+static void snapshot_newlines_init()
+{
+	memset(snapshot_newlines, '\n', sizeof(snapshot_newlines));
+}
+
+static struct snapshot_block* snapshot_block_new()
+{
+	struct snapshot_block *block = (struct snapshot_block*) malloc(sizeof(struct snapshot_block));
+	if_null(block) {
+		return NULL;
+	}
+	block->refs = 1;
+	block->npieces = 0;
+	block->bytes = 0;
+	return block;
+}
+
+static void snapshot_block_release(struct snapshot_block *block)
+{
+	if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(block);
+	}
+}
+
+struct textbuffer_snapshot* snapshot_new()
+{
+	struct textbuffer_snapshot *snapshot = (struct textbuffer_snapshot*) calloc(1, sizeof(struct textbuffer_snapshot));
+	if_null(snapshot) {
+		return NULL;
+	}
+	snapshot->refs = 1;
+	return snapshot;
+}
+
+void snapshot_acquire(struct textbuffer_snapshot *snapshot)
+{
+	__atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+}
+
+void snapshot_release(struct textbuffer_snapshot *snapshot)
+{
+	if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	for (size_t i = 0; i < snapshot->nblocks; i++) {
+		snapshot_block_release(snapshot->blocks[i]);
+	}
+	free(snapshot->blocks);
+	if (snapshot->epoch) {
+		textbuffer_epoch_release(snapshot->epoch);
+	}
+	free(snapshot);
+}
+
+// Insert a block in the block array at 'index'.
+static int snapshot_insert_block(struct textbuffer_snapshot *snapshot, size_t index, struct snapshot_block *block)
+{
+	if (snapshot->nblocks == snapshot->capacity) {
+		size_t capacity = max(2 * snapshot->capacity, (size_t) 16);
+		struct snapshot_block **blocks = (struct snapshot_block**) realloc(snapshot->blocks, capacity * sizeof(void*));
+		if_null(blocks) {
+			return -ENOMEM;
+		}
+		snapshot->blocks = blocks;
+		snapshot->capacity = capacity;
+	}
+	memmove(snapshot->blocks + index + 1, snapshot->blocks + index, (snapshot->nblocks - index) * sizeof(void*));
+	snapshot->blocks[index] = block;
+	snapshot->nblocks++;
+	return 0;
+}
+
+static void snapshot_remove_block(struct textbuffer_snapshot *snapshot, size_t index)
+{
+	snapshot_block_release(snapshot->blocks[index]);
+	snapshot->nblocks--;
+	memmove(snapshot->blocks + index, snapshot->blocks + index + 1, (snapshot->nblocks - index) * sizeof(void*));
+}
+
+static void snapshot_push(struct textbuffer_snapshot *snapshot, slice piece)
+{
+	snapshot->bytes += slice_len(piece);
+	struct snapshot_block *block = snapshot->nblocks ? snapshot->blocks[snapshot->nblocks - 1] : NULL;
+	if (block && block->npieces && block->pieces[block->npieces - 1].stop == piece.start) {
+		block->pieces[block->npieces - 1].stop = piece.stop;
+		block->bytes += slice_len(piece);
+		return;
+	}
+	if (!block || block->npieces == snapshot_block_pieces) {
+		block = snapshot_block_new();
+		if (!block || snapshot_insert_block(snapshot, snapshot->nblocks, block)) {
+			free(block);
+			snapshot->failed = 1;
+			return;
+		}
+	}
+	block->pieces[block->npieces++] = piece;
+	block->bytes += slice_len(piece);
+}
+
+// Add the pending newlines. When they are consecutive newline characters in the stored text they are a piece like any
+// other, merged with the last piece when adjacent in memory. Otherwise they point into snapshot_newlines.
+static void snapshot_push_newlines(struct textbuffer_snapshot *snapshot)
+{
+	size_t n = snapshot->pending_newlines;
+	snapshot->pending_newlines = 0;
+	if (snapshot->pending_stored.start) {
+		snapshot_push(snapshot, snapshot->pending_stored);
+		return;
+	}
+	while (n) {
+		size_t len = min(n, sizeof(snapshot_newlines));
+		snapshot_push(snapshot, s(snapshot_newlines, snapshot_newlines + len));
+		n -= len;
+	}
+}
+
+void snapshot_append(struct textbuffer_snapshot *snapshot, slice piece)
+{
+	if (slice_empty(piece)) {
+		return;
+	}
+	if (snapshot->pending_newlines) {
+		snapshot_push_newlines(snapshot);
+	}
+	snapshot_push(snapshot, piece);
+}
+
+void snapshot_append_newline(struct textbuffer_snapshot *snapshot, char *newline_char)
+{
+	slice *stored = &snapshot->pending_stored;
+	if (!snapshot->pending_newlines) {
+		*stored = newline_char ? s(newline_char, newline_char + 1) : s(NULL, NULL);
+	} else if (stored->start && newline_char == stored->stop) {
+		stored->stop++;
+	} else {
+		*stored = s(NULL, NULL);
+	}
+	snapshot->pending_newlines++;
+}
+
+int snapshot_finish(struct textbuffer_snapshot *snapshot)
+{
+	if (snapshot->pending_newlines) {
+		snapshot_push_newlines(snapshot);
+	}
+	return snapshot->failed ? -ENOMEM : 0;
+}
+
+// Get a block which can be modified, copying it if it is shared with another snapshot.
+static struct snapshot_block* snapshot_own_block(struct textbuffer_snapshot *snapshot, size_t index)
+{
+	struct snapshot_block *block = snapshot->blocks[index];
+	if (__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) == 1) {
+		return block;
+	}
+	struct snapshot_block *copy = snapshot_block_new();
+	if_null(copy) {
+		return NULL;
+	}
+	copy->npieces = block->npieces;
+	copy->bytes = block->bytes;
+	memcpy(copy->pieces, block->pieces, block->npieces * sizeof(slice));
+	snapshot->blocks[index] = copy;
+	snapshot_block_release(block);
+	return copy;
+}
+
+// Make room for one more piece in a block, by moving its second half to a new block after it.
+static int snapshot_split_block(struct textbuffer_snapshot *snapshot, size_t index)
+{
+	struct snapshot_block *block = snapshot->blocks[index];
+	struct snapshot_block *next = snapshot_block_new();
+	if (!next || snapshot_insert_block(snapshot, index + 1, next)) {
+		free(next);
+		return -ENOMEM;
+	}
+	int half = block->npieces / 2;
+	next->npieces = block->npieces - half;
+	memcpy(next->pieces, block->pieces + half, next->npieces * sizeof(slice));
+	for (int i = 0; i < next->npieces; i++) {
+		next->bytes += slice_len(next->pieces[i]);
+	}
+	block->npieces = half;
+	block->bytes -= next->bytes;
+	return 0;
+}
+
+// Find the position of the piece starting at 'offset', splitting the piece containing 'offset' if needed.
+// At the end of the text, the position is after the last piece.
+static int snapshot_split(struct textbuffer_snapshot *snapshot, size_t offset, size_t *block_index, int *piece_index)
+{
+	if (!snapshot->nblocks) {
+		struct snapshot_block *block = snapshot_block_new();
+		if (!block || snapshot_insert_block(snapshot, 0, block)) {
+			free(block);
+			return -ENOMEM;
+		}
+	}
+	size_t b = 0;
+	while (b + 1 < snapshot->nblocks && snapshot->blocks[b]->bytes <= offset) {
+		offset -= snapshot->blocks[b]->bytes;
+		b++;
+	}
+	struct snapshot_block *block = snapshot->blocks[b];
+	assert(offset <= block->bytes);
+	int p = 0;
+	while (p < block->npieces && slice_len(block->pieces[p]) <= offset) {
+		offset -= slice_len(block->pieces[p]);
+		p++;
+	}
+	if (offset) {
+		block = snapshot_own_block(snapshot, b);
+		if_null(block) {
+			return -ENOMEM;
+		}
+		if (block->npieces == snapshot_block_pieces) {
+			if (snapshot_split_block(snapshot, b)) {
+				return -ENOMEM;
+			}
+			if (p >= block->npieces) {
+				p -= block->npieces;
+				block = snapshot->blocks[++b];
+			}
+		}
+		slice piece = block->pieces[p];
+		memmove(block->pieces + p + 1, block->pieces + p, (block->npieces - p) * sizeof(slice));
+		block->npieces++;
+		block->pieces[p] = s(piece.start, piece.start + offset);
+		block->pieces[p + 1] = s(piece.start + offset, piece.stop);
+		p++;
+	}
+	*block_index = b;
+	*piece_index = p;
+	return 0;
+}
+
+static int snapshot_delete(struct textbuffer_snapshot *snapshot, size_t offset, size_t len)
+{
+	size_t b;
+	int p;
+	if (snapshot_split(snapshot, offset, &b, &p)) {
+		return -ENOMEM;
+	}
+	snapshot->bytes -= len;
+	while (len) {
+		assert(b < snapshot->nblocks);
+		struct snapshot_block *block = snapshot_own_block(snapshot, b);
+		if_null(block) {
+			return -ENOMEM;
+		}
+		// Remove whole pieces, then cut the start of the last piece.
+		int first = p;
+		while (p < block->npieces && slice_len(block->pieces[p]) <= len) {
+			len -= slice_len(block->pieces[p]);
+			block->bytes -= slice_len(block->pieces[p]);
+			p++;
+		}
+		memmove(block->pieces + first, block->pieces + p, (block->npieces - p) * sizeof(slice));
+		block->npieces -= p - first;
+		p = first;
+		if (len && p < block->npieces) {
+			block->pieces[p].start += len;
+			block->bytes -= len;
+			len = 0;
+		}
+		if (!block->npieces && snapshot->nblocks > 1) {
+			snapshot_remove_block(snapshot, b);
+		} else if (len) {
+			b++;
+		}
+		p = 0;
+	}
+	return 0;
+}
+
+static int snapshot_insert(struct textbuffer_snapshot *snapshot, size_t offset, slice text)
+{
+	size_t b;
+	int p;
+	if (snapshot_split(snapshot, offset, &b, &p)) {
+		return -ENOMEM;
+	}
+	snapshot->bytes += slice_len(text);
+
+	// Typing extends the piece before, which ends where the text was stored.
+	size_t prev_b = b;
+	int prev_p = p - 1;
+	if (prev_p < 0 && b > 0) {
+		prev_b = b - 1;
+		prev_p = snapshot->blocks[prev_b]->npieces - 1;
+	}
+	if (prev_p >= 0 && snapshot->blocks[prev_b]->pieces[prev_p].stop == text.start) {
+		struct snapshot_block *block = snapshot_own_block(snapshot, prev_b);
+		if_null(block) {
+			return -ENOMEM;
+		}
+		block->pieces[prev_p].stop = text.stop;
+		block->bytes += slice_len(text);
+		return 0;
+	}
+
+	struct snapshot_block *block = snapshot_own_block(snapshot, b);
+	if_null(block) {
+		return -ENOMEM;
+	}
+	if (block->npieces == snapshot_block_pieces) {
+		if (snapshot_split_block(snapshot, b)) {
+			return -ENOMEM;
+		}
+		if (p > block->npieces) {
+			p -= block->npieces;
+			block = snapshot->blocks[++b];
+		}
+	}
+	memmove(block->pieces + p + 1, block->pieces + p, (block->npieces - p) * sizeof(slice));
+	block->npieces++;
+	block->pieces[p] = text;
+	block->bytes += slice_len(text);
+	return 0;
+}
+
+// Append a piece to 'open', the last block of a batch being applied, which is owned by the snapshot. A new block is
+// opened when it is full, or when the last block is shared.
+static void snapshot_batch_push(struct textbuffer_snapshot *snapshot, struct snapshot_block **open, slice piece)
+{
+	if (slice_empty(piece)) {
+		return;
+	}
+	struct snapshot_block *block = *open;
+	if (block && block->npieces && block->pieces[block->npieces - 1].stop == piece.start) {
+		block->pieces[block->npieces - 1].stop = piece.stop;
+		block->bytes += slice_len(piece);
+		return;
+	}
+	if (!block || block->npieces == snapshot_block_pieces) {
+		block = snapshot_block_new();
+		if (!block || snapshot_insert_block(snapshot, snapshot->nblocks, block)) {
+			free(block);
+			snapshot->failed = 1;
+			*open = NULL;
+			return;
+		}
+		*open = block;
+	}
+	block->pieces[block->npieces++] = piece;
+	block->bytes += slice_len(piece);
+}
+
+// Apply the sites of a batch in one pass over the blocks: the blocks without sites are kept as they are, the blocks
+// with sites are rebuilt into new blocks. Sites at the end of the text are appended after the last block.
+static int snapshot_apply_batch(struct textbuffer_snapshot *snapshot, struct snapshot_change *sites, size_t n)
+{
+	struct snapshot_block **blocks = snapshot->blocks;
+	size_t nblocks = snapshot->nblocks;
+	snapshot->blocks = NULL;
+	snapshot->nblocks = 0;
+	snapshot->capacity = 0;
+
+	struct snapshot_block *open = NULL;
+	size_t site = 0;
+	size_t skip = 0;      // bytes left to delete by the last site
+	size_t block_start = 0;
+	for (size_t b = 0; b < nblocks; b++) {
+		struct snapshot_block *block = blocks[b];
+		size_t block_end = block_start + block->bytes;
+		if (!skip && (site == n || sites[site].offset >= block_end)) {
+			if (snapshot_insert_block(snapshot, snapshot->nblocks, block)) {
+				snapshot_block_release(block);
+				snapshot->failed = 1;
+			}
+			open = NULL;
+			block_start = block_end;
+			continue;
+		}
+		size_t piece_start = block_start;
+		for (int p = 0; p < block->npieces; p++) {
+			slice piece = block->pieces[p];
+			size_t len = slice_len(piece);
+			size_t x = 0;
+			for (;;) {
+				size_t skipped = min(skip, len - x);
+				x += skipped;
+				skip -= skipped;
+				if (site == n || sites[site].offset >= piece_start + len || skip) {
+					break;
+				}
+				size_t at = sites[site].offset - piece_start;
+				snapshot_batch_push(snapshot, &open, s(piece.start + x, piece.start + at));
+				snapshot_batch_push(snapshot, &open, sites[site].inserted);
+				skip = sites[site].deleted;
+				x = at;
+				site++;
+			}
+			snapshot_batch_push(snapshot, &open, s(piece.start + x, piece.stop));
+			piece_start += len;
+		}
+		snapshot_block_release(block);
+		block_start = block_end;
+	}
+	for (; site < n; site++) {
+		snapshot_batch_push(snapshot, &open, sites[site].inserted);
+	}
+	free(blocks);
+
+	for (size_t i = 0; i < n; i++) {
+		snapshot->bytes += slice_len(sites[i].inserted) - sites[i].deleted;
+	}
+	return snapshot->failed ? -ENOMEM : 0;
+}
+
+struct textbuffer_snapshot* snapshot_derive(struct textbuffer_snapshot *base, struct snapshot_change *changes, size_t n)
+{
+	struct textbuffer_snapshot *snapshot = snapshot_new();
+	if_null(snapshot) {
+		return NULL;
+	}
+	snapshot->blocks = (struct snapshot_block**) malloc(max(base->nblocks, (size_t) 1) * sizeof(void*));
+	if_null(snapshot->blocks) {
+		free(snapshot);
+		return NULL;
+	}
+	snapshot->capacity = max(base->nblocks, (size_t) 1);
+	snapshot->nblocks = base->nblocks;
+	snapshot->bytes = base->bytes;
+	for (size_t i = 0; i < base->nblocks; i++) {
+		struct snapshot_block *block = base->blocks[i];
+		__atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+		snapshot->blocks[i] = block;
+	}
+
+	int fail = 0;
+	for (size_t i = 0; i < n && !fail; i++) {
+		struct snapshot_change *change = changes + i;
+		if (change->nsites) {
+			fail = snapshot_apply_batch(snapshot, change + 1, change->nsites);
+			i += change->nsites;
+			continue;
+		}
+		if (change->deleted) {
+			fail = snapshot_delete(snapshot, change->offset, change->deleted);
+		}
+		if (!fail && !slice_empty(change->inserted)) {
+			fail = snapshot_insert(snapshot, change->offset, change->inserted);
+		}
+	}
+	if (fail) {
+		snapshot_release(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+void snapshot_iterator_init(struct snapshot_iterator *iterator, struct textbuffer_snapshot *snapshot)
+{
+	iterator->snapshot = snapshot;
+	iterator->block = 0;
+	iterator->piece = 0;
+}
+
+int snapshot_iterator_next(struct snapshot_iterator *iterator, slice *piece)
+{
+	struct textbuffer_snapshot *snapshot = iterator->snapshot;
+	while (iterator->block < snapshot->nblocks) {
+		struct snapshot_block *block = snapshot->blocks[iterator->block];
+		if (iterator->piece < block->npieces) {
+			*piece = block->pieces[iterator->piece++];
+			return 1;
+		}
+		iterator->block++;
+		iterator->piece = 0;
+	}
+	return 0;
+}
+
+static size_t common_prefix(const char *a, const char *b, size_t n)
+{
+	size_t i = 0;
+	// Compare by blocks first, the mismatching block is then searched byte by byte.
+	while (i + 64 <= n && !memcmp(a + i, b + i, 64)) {
+		i += 64;
+	}
+	while (i < n && a[i] == b[i]) {
+		i++;
+	}
+	return i;
+}
+
+static size_t common_suffix(const char *a_end, const char *b_end, size_t n)
+{
+	size_t i = 0;
+	while (i + 64 <= n && !memcmp(a_end - i - 64, b_end - i - 64, 64)) {
+		i += 64;
+	}
+	while (i < n && a_end[-(ptrdiff_t) i - 1] == b_end[-(ptrdiff_t) i - 1]) {
+		i++;
+	}
+	return i;
+}
+
+size_t snapshot_common_prefix(struct textbuffer_snapshot *snapshot, slice text)
+{
+	size_t prefix = 0;
+	struct snapshot_iterator iterator;
+	snapshot_iterator_init(&iterator, snapshot);
+	slice piece;
+	while (snapshot_iterator_next(&iterator, &piece)) {
+		size_t n = min(slice_len(piece), slice_len(text) - prefix);
+		size_t same = common_prefix(piece.start, text.start + prefix, n);
+		prefix += same;
+		if (same < slice_len(piece)) {
+			break;
+		}
+	}
+	return prefix;
+}
+
+size_t snapshot_common_suffix(struct textbuffer_snapshot *snapshot, slice text, size_t limit)
+{
+	size_t suffix = 0;
+	for (size_t b = snapshot->nblocks; b > 0 && suffix < limit; b--) {
+		struct snapshot_block *block = snapshot->blocks[b - 1];
+		for (int p = block->npieces; p > 0 && suffix < limit; p--) {
+			slice piece = block->pieces[p - 1];
+			size_t n = min(slice_len(piece), limit - suffix);
+			size_t same = common_suffix(piece.stop, text.stop - suffix, n);
+			suffix += same;
+			if (same < slice_len(piece)) {
+				return suffix;
+			}
+		}
+	}
+	return suffix;
+}
+
+// Searching:
+//	Pieces are searched in place with scan_find() or scan_rfind(). Matches spanning pieces are found in a small
+//	buffer holding the needle_len - 1 bytes on the side of the piece already searched, followed or preceded by the
+//	first or last needle_len - 1 bytes of the piece. Searching forward, a match spanning pieces starts before any
+//	match inside the piece, so it is looked for first. Searching backward, it ends after any match inside the piece.
+
+// Find the piece containing 'offset': its block, its index and its start offset.
+static void snapshot_seek(struct textbuffer_snapshot *snapshot, size_t offset, size_t *block_index, int *piece_index, size_t *start)
+{
+	size_t pos = 0;
+	size_t b = 0;
+	while (b < snapshot->nblocks && pos + snapshot->blocks[b]->bytes <= offset) {
+		pos += snapshot->blocks[b]->bytes;
+		b++;
+	}
+	int p = 0;
+	if (b < snapshot->nblocks) {
+		struct snapshot_block *block = snapshot->blocks[b];
+		while (pos + slice_len(block->pieces[p]) <= offset) {
+			pos += slice_len(block->pieces[p]);
+			p++;
+		}
+	}
+	*block_index = b;
+	*piece_index = p;
+	*start = pos;
+}
+
+// Call fn(ctx, offset) for the occurrences starting in [from, to), until it returns nonzero. Returns 1 if it did.
+static int snapshot_find_forward(struct textbuffer_snapshot *snapshot, slice needle, size_t from, size_t to, char *carry,
+		int (*fn)(void *ctx, size_t offset), void *ctx)
+{
+	size_t m = slice_len(needle);
+	size_t b;
+	int p;
+	size_t pos;
+	snapshot_seek(snapshot, from, &b, &p, &pos);
+	size_t ncarry = 0;
+	for (; b < snapshot->nblocks; b++, p = 0) {
+		struct snapshot_block *block = snapshot->blocks[b];
+		for (; p < block->npieces; p++) {
+			slice piece = block->pieces[p];
+			if (pos < from) {
+				piece.start += from - pos;
+				pos = from;
+			}
+			// Occurrences starting before 'to' end before to + m - 1.
+			if (pos + slice_len(piece) > to + m - 1) {
+				piece.stop = piece.start + (to + m - 1 - pos);
+			}
+			size_t len = slice_len(piece);
+			if (ncarry) {
+				size_t n = min(len, m - 1);
+				memcpy(carry + ncarry, piece.start, n);
+				size_t k = 0;
+				while ((k += scan_find(carry + k, ncarry + n - k, needle.start, m)) < ncarry) {
+					if (pos - ncarry + k >= to) {
+						return 0;
+					}
+					if (fn(ctx, pos - ncarry + k)) {
+						return 1;
+					}
+					k++;
+				}
+			}
+			size_t k = 0;
+			while ((k += scan_find(piece.start + k, len - k, needle.start, m)) < len) {
+				if (pos + k >= to) {
+					return 0;
+				}
+				if (fn(ctx, pos + k)) {
+					return 1;
+				}
+				k++;
+			}
+			// Keep the last m - 1 bytes searched.
+			if (len >= m - 1) {
+				ncarry = m - 1;
+				memcpy(carry, piece.stop - ncarry, ncarry);
+			} else {
+				size_t keep = min(ncarry, m - 1 - len);
+				memmove(carry, carry + ncarry - keep, keep);
+				memcpy(carry + keep, piece.start, len);
+				ncarry = keep + len;
+			}
+			pos += len;
+			if (pos >= to + m - 1) {
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static int snapshot_find_backward(struct textbuffer_snapshot *snapshot, slice needle, size_t end, char *carry, size_t *match)
+{
+	size_t m = slice_len(needle);
+	size_t b;
+	int p;
+	size_t pos;
+	snapshot_seek(snapshot, end - 1, &b, &p, &pos);
+	// The first m - 1 bytes searched are kept at 'after', with room before them for the end of the piece.
+	char *after = carry + m - 1;
+	size_t ncarry = 0;
+	for (;;) {
+		slice piece = snapshot->blocks[b]->pieces[p];
+		if (pos + slice_len(piece) > end) {
+			piece.stop = piece.start + (end - pos);
+		}
+		size_t len = slice_len(piece);
+		if (ncarry) {
+			size_t n = min(len, m - 1);
+			memcpy(after - n, piece.stop - n, n);
+			size_t k = scan_rfind(after - n, n + ncarry, needle.start, m);
+			if (k < n + ncarry && k + m > n) {
+				*match = pos + len - n + k;
+				return 1;
+			}
+		}
+		size_t k = scan_rfind(piece.start, len, needle.start, m);
+		if (k < len) {
+			*match = pos + k;
+			return 1;
+		}
+		if (len >= m - 1) {
+			ncarry = m - 1;
+			memcpy(after, piece.start, ncarry);
+		} else {
+			size_t keep = min(ncarry, m - 1 - len);
+			memmove(after + len, after, keep);
+			memcpy(after, piece.start, len);
+			ncarry = keep + len;
+		}
+
+		// Previous piece
+		while (--p < 0) {
+			if (!b) {
+				return 0;
+			}
+			p = snapshot->blocks[--b]->npieces;
+		}
+		pos -= slice_len(snapshot->blocks[b]->pieces[p]);
+	}
+}
+
+static int snapshot_find_first(void *ctx, size_t offset)
+{
+	*(size_t*) ctx = offset;
+	return 1;
+}
+
+int snapshot_find(struct textbuffer_snapshot *snapshot, slice needle, size_t from, int backward, size_t *match)
+{
+	size_t m = slice_len(needle);
+	if (!m || m > snapshot->bytes) {
+		return 0;
+	}
+	char *carry = (char*) malloc(2 * m);
+	if_null(carry) {
+		return -ENOMEM;
+	}
+	int found;
+	if (backward) {
+		// Matches starting before 'from' can end after it.
+		size_t end = min(snapshot->bytes, from + m - 1);
+		found = end >= m ? snapshot_find_backward(snapshot, needle, end, carry, match) : 0;
+	} else {
+		found = from < snapshot->bytes && snapshot_find_forward(snapshot, needle, from, snapshot->bytes, carry, snapshot_find_first, match);
+	}
+	free(carry);
+	return found;
+}
+
+int snapshot_find_all(struct textbuffer_snapshot *snapshot, slice needle, size_t from, size_t to,
+		int (*fn)(void *ctx, size_t offset), void *ctx)
+{
+	size_t m = slice_len(needle);
+	to = min(to, snapshot->bytes);
+	if (!m || from >= to) {
+		return 0;
+	}
+	char *carry = (char*) malloc(2 * m);
+	if_null(carry) {
+		return -ENOMEM;
+	}
+	int stopped = snapshot_find_forward(snapshot, needle, from, to, carry, fn, ctx);
+	free(carry);
+	return stopped;
+}
+
+size_t snapshot_filter(struct textbuffer_snapshot *snapshot, slice needle, size_t *offsets, size_t n)
+{
+	size_t m = slice_len(needle);
+	size_t kept = 0;
+	size_t b = 0;
+	int p = 0;
+	size_t block_pos = 0;
+	size_t pos = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t offset = offsets[i];
+		// Offsets are sorted: the next ones are past the end too.
+		if (offset + m > snapshot->bytes) {
+			break;
+		}
+		while (block_pos + snapshot->blocks[b]->bytes <= offset) {
+			block_pos += snapshot->blocks[b]->bytes;
+			b++;
+			p = 0;
+			pos = block_pos;
+		}
+		struct snapshot_block *block = snapshot->blocks[b];
+		while (pos + slice_len(block->pieces[p]) <= offset) {
+			pos += slice_len(block->pieces[p]);
+			p++;
+		}
+		// Compare the needle with the text from 'offset', across pieces.
+		size_t cb = b;
+		int cp = p;
+		size_t skip = offset - pos;
+		size_t k = 0;
+		while (k < m) {
+			slice piece = snapshot->blocks[cb]->pieces[cp];
+			size_t len = min(slice_len(piece) - skip, m - k);
+			if (memcmp(piece.start + skip, needle.start + k, len)) {
+				break;
+			}
+			k += len;
+			skip = 0;
+			if (++cp == snapshot->blocks[cb]->npieces) {
+				cb++;
+				cp = 0;
+			}
+		}
+		if (k == m) {
+			offsets[kept++] = offset;
+		}
+	}
+	return kept;
+}
+
+// Regular expressions:
+//	Pieces are fed to the DFA of the regexp one after the other, forward to find the end of a match and then
+//	backward to find its start. When matches cannot span lines and contain a literal, only the lines containing the
+//	literal are matched, and the literal is found with snapshot_find().
+//	Searching backward, a match is the last one starting before 'from' in the sequence of matches found forward from
+//	the start of its line. Lines are searched backward one after the other from the literal found backward, or else
+//	in windows of lines growing backward.
+
+#define snapshot_regexp_window 0x10000
+
+// Feed the text in [from, to) to 'run', forward or backward like the run. Returns 1 once the run is done.
+static int snapshot_feed(struct textbuffer_snapshot *snapshot, struct regexp_run *run, size_t from, size_t to)
+{
+	if (from >= to) {
+		return 0;
+	}
+	size_t b;
+	int p;
+	size_t pos;
+	snapshot_seek(snapshot, run->reverse ? to - 1 : from, &b, &p, &pos);
+	for (;;) {
+		slice piece = snapshot->blocks[b]->pieces[p];
+		size_t len = slice_len(piece);
+		slice text = s(piece.start + (from > pos ? from - pos : 0), piece.start + min(len, to - pos));
+		if (regexp_run_feed(run, text.start, slice_len(text))) {
+			return 1;
+		}
+		if (run->reverse) {
+			if (pos <= from) {
+				return 0;
+			}
+			while (--p < 0) {
+				p = snapshot->blocks[--b]->npieces;
+			}
+			pos -= slice_len(snapshot->blocks[b]->pieces[p]);
+		} else {
+			pos += len;
+			if (pos >= to) {
+				return 0;
+			}
+			while (++p == snapshot->blocks[b]->npieces) {
+				b++;
+				p = -1;
+			}
+		}
+	}
+}
+
+// Start of the line containing 'offset'.
+static size_t snapshot_line_start(struct textbuffer_snapshot *snapshot, size_t offset)
+{
+	if (!offset) {
+		return 0;
+	}
+	size_t b;
+	int p;
+	size_t pos;
+	snapshot_seek(snapshot, offset - 1, &b, &p, &pos);
+	for (;;) {
+		slice piece = snapshot->blocks[b]->pieces[p];
+		size_t len = min(slice_len(piece), offset - pos);
+		char *newline_char = (char*) memrchr(piece.start, '\n', len);
+		if (newline_char) {
+			return pos + (newline_char - piece.start) + 1;
+		}
+		while (--p < 0) {
+			if (!b) {
+				return 0;
+			}
+			p = snapshot->blocks[--b]->npieces;
+		}
+		pos -= slice_len(snapshot->blocks[b]->pieces[p]);
+	}
+}
+
+// Offset of the newline ending the line containing 'offset', or the end of the text.
+static size_t snapshot_line_end(struct textbuffer_snapshot *snapshot, size_t offset)
+{
+	if (offset >= snapshot->bytes) {
+		return snapshot->bytes;
+	}
+	size_t b;
+	int p;
+	size_t pos;
+	snapshot_seek(snapshot, offset, &b, &p, &pos);
+	for (; b < snapshot->nblocks; b++, p = 0) {
+		struct snapshot_block *block = snapshot->blocks[b];
+		for (; p < block->npieces; p++) {
+			slice piece = block->pieces[p];
+			size_t skip = offset > pos ? offset - pos : 0;
+			char *newline_char = (char*) memchr(piece.start + skip, '\n', slice_len(piece) - skip);
+			if (newline_char) {
+				return pos + (newline_char - piece.start);
+			}
+			pos += slice_len(piece);
+		}
+	}
+	return snapshot->bytes;
+}
+
+static char snapshot_byte(struct textbuffer_snapshot *snapshot, size_t offset)
+{
+	size_t b;
+	int p;
+	size_t pos;
+	snapshot_seek(snapshot, offset, &b, &p, &pos);
+	return snapshot->blocks[b]->pieces[p].start[offset - pos];
+}
+
+static int snapshot_at_line_start(struct textbuffer_snapshot *snapshot, size_t offset)
+{
+	return !offset || snapshot_byte(snapshot, offset - 1) == '\n';
+}
+
+static int snapshot_at_line_end(struct textbuffer_snapshot *snapshot, size_t offset)
+{
+	return offset >= snapshot->bytes || snapshot_byte(snapshot, offset) == '\n';
+}
+
+// Find the first match starting at or after 'from', reading no further than 'stop'.
+static int snapshot_match(struct textbuffer_snapshot *snapshot, struct regexp *re, size_t from, size_t stop,
+		size_t *start, size_t *end)
+{
+	struct regexp_run run;
+	regexp_run_start(&run, re, 0, from, snapshot_at_line_start(snapshot, from));
+	if (!snapshot_feed(snapshot, &run, from, stop)) {
+		regexp_run_finish(&run, snapshot_at_line_end(snapshot, stop));
+	}
+	if (run.match == REGEXP_NO_MATCH) {
+		return 0;
+	}
+	*end = run.match;
+	regexp_run_start(&run, re, 1, *end, snapshot_at_line_end(snapshot, *end));
+	if (!snapshot_feed(snapshot, &run, from, *end)) {
+		regexp_run_finish(&run, snapshot_at_line_start(snapshot, from));
+	}
+	*start = run.match;
+	return 1;
+}
+
+// Find the last match starting before 'limit' in the matches found from 'from', reading no further than 'stop'.
+static int snapshot_match_last(struct textbuffer_snapshot *snapshot, struct regexp *re, size_t from, size_t stop,
+		size_t limit, size_t *start, size_t *end)
+{
+	int found = 0;
+	size_t match_start;
+	size_t match_end;
+	while (from <= stop && snapshot_match(snapshot, re, from, stop, &match_start, &match_end) && match_start < limit) {
+		*start = match_start;
+		*end = match_end;
+		found = 1;
+		// Empty matches move one byte forward.
+		from = match_end > match_start ? match_end : match_end + 1;
+	}
+	return found;
+}
+
+static int snapshot_find_regexp_forward(struct textbuffer_snapshot *snapshot, struct regexp *re, size_t from,
+		size_t *start, size_t *end)
+{
+	size_t literal_len;
+	const char *literal = regexp_literal(re, &literal_len);
+	if (!literal || regexp_multiline(re)) {
+		return snapshot_match(snapshot, re, from, snapshot->bytes, start, end);
+	}
+	while (from < snapshot->bytes) {
+		size_t found;
+		int fail = snapshot_find(snapshot, s((char*) literal, (char*) literal + literal_len), from, 0, &found);
+		if (fail <= 0) {
+			return fail;
+		}
+		size_t line_end = snapshot_line_end(snapshot, found);
+		if (snapshot_match(snapshot, re, max(from, snapshot_line_start(snapshot, found)), line_end, start, end)) {
+			return 1;
+		}
+		from = line_end + 1;
+	}
+	return 0;
+}
+
+static int snapshot_find_regexp_backward(struct textbuffer_snapshot *snapshot, struct regexp *re, size_t from,
+		size_t *start, size_t *end)
+{
+	size_t literal_len;
+	const char *literal = regexp_literal(re, &literal_len);
+	size_t line_start = snapshot_line_start(snapshot, from);
+	if (literal && !regexp_multiline(re)) {
+		// The line of 'from', and then the lines containing the literal before it.
+		size_t line_end = snapshot_line_end(snapshot, from);
+		while (!snapshot_match_last(snapshot, re, line_start, line_end, from, start, end)) {
+			size_t found;
+			slice needle = s((char*) literal, (char*) literal + literal_len);
+			int fail = line_start ? snapshot_find(snapshot, needle, line_start, 1, &found) : 0;
+			if (fail <= 0) {
+				return fail;
+			}
+			line_start = snapshot_line_start(snapshot, found);
+			line_end = snapshot_line_end(snapshot, found);
+			from = line_end + 1;
+		}
+		return 1;
+	}
+	size_t stop = regexp_multiline(re) ? snapshot->bytes : snapshot_line_end(snapshot, from);
+	size_t window = snapshot_regexp_window;
+	size_t limit = from;
+	for (;;) {
+		size_t window_start = line_start > window ? snapshot_line_start(snapshot, line_start - window) : 0;
+		if (snapshot_match_last(snapshot, re, window_start, stop, limit, start, end)) {
+			return 1;
+		}
+		if (!window_start) {
+			return 0;
+		}
+		// Matches starting before the window end before it, unless they span lines.
+		limit = window_start;
+		line_start = window_start;
+		stop = regexp_multiline(re) ? stop : window_start - 1;
+		window *= 2;
+	}
+}
+
+int snapshot_find_regexp(struct textbuffer_snapshot *snapshot, struct regexp *re, size_t from, int backward,
+		size_t *start, size_t *end)
+{
+	if (backward) {
+		return snapshot_find_regexp_backward(snapshot, re, min(from, snapshot->bytes), start, end);
+	}
+	return from <= snapshot->bytes ? snapshot_find_regexp_forward(snapshot, re, from, start, end) : 0;
+}
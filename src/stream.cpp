@@ -0,0 +1,279 @@
+// stream.cpp implements streamed files, for browsing files larger than memory without loading them.
+//
+// Windows: the file is cut in windows of stream_window_size bytes, which are mapped the first time they are read.
+// Reading a window marks it as used, and reading a window which is not resident makes it resident, dropping the
+// least recently used window once the budget is reached. Dropped windows stay mapped: madvise(MADV_DONTNEED) only
+// releases their pages, so that slices previously returned never dangle.
+//
+// Checkpoints: stream_index_step() scans the file for newlines and records the offset of every
+// stream_checkpoint_lines-th line. Finding a line walks at most stream_checkpoint_lines lines from the checkpoint
+// before it, whatever the size of the file.
+#include <chi.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t stream_window_len(struct stream *stream, size_t w)
+{
+	return min((off_t) stream_window_size, stream->size - (off_t) (w * stream_window_size));
+}
+
+int stream_open(struct stream *stream, const char *path, size_t budget)
+{
+	memset(stream, 0, sizeof(struct stream));
+	stream->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (stream->fd < 0) {
+		return -errno;
+	}
+	struct stat file_stat;
+	if (fstat(stream->fd, &file_stat) < 0) {
+		int fail = -errno;
+		close(stream->fd);
+		return fail;
+	}
+	stream->size = file_stat.st_size;
+	stream->nwindows = (stream->size + stream_window_size - 1) / stream_window_size;
+	// Text can span two windows.
+	stream->max_resident = max(budget / stream_window_size, (size_t) 2);
+	stream->windows = (struct stream_window*) calloc(max(stream->nwindows, (size_t) 1), sizeof(struct stream_window));
+	stream->checkpoints_capacity = 64;
+	stream->checkpoints = (off_t*) malloc(stream->checkpoints_capacity * sizeof(off_t));
+	stream->newlines = (u32*) malloc(stream_checkpoint_lines * sizeof(u32));
+	if (!stream->windows || !stream->checkpoints || !stream->newlines) {
+		stream_close(stream);
+		return -ENOMEM;
+	}
+	stream->checkpoints[stream->ncheckpoints++] = 0;
+	return 0;
+}
+
+void stream_close(struct stream *stream)
+{
+	for (size_t w = 0; w < stream->nwindows && stream->windows; w++) {
+		if (stream->windows[w].data) {
+			munmap(stream->windows[w].data, stream_window_len(stream, w));
+		}
+	}
+	free(stream->windows);
+	free(stream->checkpoints);
+	free(stream->newlines);
+	free(stream->copy.memory);
+	if (stream->fd >= 0) {
+		close(stream->fd);
+	}
+	memset(stream, 0, sizeof(struct stream));
+	stream->fd = -1;
+}
+
+static void stream_evict(struct stream *stream)
+{
+	struct stream_window *oldest = NULL;
+	for (size_t w = 0; w < stream->nwindows; w++) {
+		struct stream_window *window = stream->windows + w;
+		if (window->resident && (!oldest || window->last_use < oldest->last_use)) {
+			oldest = window;
+		}
+	}
+	if (oldest) {
+		madvise(oldest->data, stream_window_len(stream, oldest - stream->windows), MADV_DONTNEED);
+		oldest->resident = 0;
+		stream->resident--;
+	}
+}
+
+// Start of the window 'w', mapped and resident.
+static char* stream_window(struct stream *stream, size_t w)
+{
+	struct stream_window *window = stream->windows + w;
+	if (!window->resident) {
+		if (!window->data) {
+			off_t offset = w * stream_window_size;
+			void *data = mmap(NULL, stream_window_len(stream, w), PROT_READ, MAP_SHARED, stream->fd, offset);
+			if (data == MAP_FAILED) {
+				return NULL;
+			}
+			window->data = (char*) data;
+		}
+		if (stream->resident == stream->max_resident) {
+			stream_evict(stream);
+		}
+		window->resident = 1;
+		stream->resident++;
+	}
+	window->last_use = ++stream->clock;
+	return window->data;
+}
+
+// Text from 'offset' to the end of its window.
+static slice stream_window_text(struct stream *stream, off_t offset)
+{
+	size_t w = offset / stream_window_size;
+	char *data = stream_window(stream, w);
+	if_null(data) {
+		return s(NULL, NULL);
+	}
+	return s(data + offset - w * stream_window_size, data + stream_window_len(stream, w));
+}
+
+slice stream_read(struct stream *stream, off_t offset, size_t len)
+{
+	len = min((off_t) len, stream->size - offset);
+	if (!len) {
+		return s(NULL, NULL);
+	}
+	slice text = stream_window_text(stream, offset);
+	if (slice_empty(text) || slice_len(text) >= len) {
+		return slice_empty(text) ? text : s(text.start, text.start + len);
+	}
+	slice rest = stream_window_text(stream, offset + slice_len(text));
+	if (slice_empty(rest)) {
+		return s(NULL, NULL);
+	}
+	buffer_ensure_size(&stream->copy, len);
+	memcpy(stream->copy.memory, text.start, slice_len(text));
+	memcpy(stream->copy.memory + slice_len(text), rest.start, len - slice_len(text));
+	return s(stream->copy.memory, stream->copy.memory + len);
+}
+
+int stream_index_step(struct stream *stream, size_t budget)
+{
+	off_t stop = min(stream->size, stream->indexed + (off_t) budget);
+	while (stream->indexed < stop) {
+		slice text = stream_window_text(stream, stream->indexed);
+		if (slice_empty(text)) {
+			return -ENOMEM;
+		}
+		size_t len = min((off_t) slice_len(text), stop - stream->indexed);
+		// Scan until the newline ending the line before the next checkpoint.
+		size_t remaining = stream->ncheckpoints * stream_checkpoint_lines - stream->indexed_lines;
+		size_t scanned;
+		size_t n = scan_newlines(text.start, len, stream->newlines, remaining, &scanned);
+		stream->indexed_lines += n;
+		if (n == remaining) {
+			if (stream->ncheckpoints == stream->checkpoints_capacity) {
+				size_t capacity = 2 * stream->checkpoints_capacity;
+				off_t *checkpoints = (off_t*) realloc(stream->checkpoints, capacity * sizeof(off_t));
+				if_null(checkpoints) {
+					return -ENOMEM;
+				}
+				stream->checkpoints = checkpoints;
+				stream->checkpoints_capacity = capacity;
+			}
+			stream->checkpoints[stream->ncheckpoints++] = stream->indexed + stream->newlines[n - 1] + 1;
+		}
+		stream->indexed += scanned;
+	}
+	return stream->indexed < stream->size;
+}
+
+int stream_is_indexed(struct stream *stream)
+{
+	return stream->indexed == stream->size;
+}
+
+size_t stream_line_count(struct stream *stream)
+{
+	if (stream_is_indexed(stream)) {
+		return stream->indexed_lines + 1;
+	}
+	if (!stream->indexed_lines) {
+		return 1;
+	}
+	return (double) stream->indexed_lines * stream->size / stream->indexed;
+}
+
+// Start of the line after 'offset', or -1 if 'offset' is on the last line.
+static off_t stream_next_line_start(struct stream *stream, off_t offset)
+{
+	while (offset < stream->size) {
+		slice text = stream_window_text(stream, offset);
+		if (slice_empty(text)) {
+			return -1;
+		}
+		char *newline_char = (char*) memchr(text.start, '\n', slice_len(text));
+		if (newline_char) {
+			return offset + (newline_char - text.start) + 1;
+		}
+		offset += slice_len(text);
+	}
+	return -1;
+}
+
+// Start of the line ending before 'offset'.
+static off_t stream_line_start(struct stream *stream, off_t offset)
+{
+	while (offset > 0) {
+		size_t w = (offset - 1) / stream_window_size;
+		char *data = stream_window(stream, w);
+		if_null(data) {
+			return 0;
+		}
+		off_t window_start = w * stream_window_size;
+		char *newline_char = (char*) memrchr(data, '\n', offset - window_start);
+		if (newline_char) {
+			return window_start + (newline_char - data) + 1;
+		}
+		offset = window_start;
+	}
+	return 0;
+}
+
+void stream_cursor_init(struct stream_cursor *cursor, struct stream *stream)
+{
+	cursor->stream = stream;
+	cursor->lineno = 0;
+	cursor->offset = 0;
+}
+
+int stream_cursor_goto_line(struct stream_cursor *cursor, size_t lineno)
+{
+	struct stream *stream = cursor->stream;
+	while (!stream_is_indexed(stream) && lineno >= stream->ncheckpoints * stream_checkpoint_lines) {
+		int fail = stream_index_step(stream, stream_window_size);
+		if (fail < 0) {
+			return fail;
+		}
+	}
+	size_t checkpoint = min(lineno / stream_checkpoint_lines, stream->ncheckpoints - 1);
+	cursor->lineno = checkpoint * stream_checkpoint_lines;
+	cursor->offset = stream->checkpoints[checkpoint];
+	while (cursor->lineno < lineno && stream_cursor_next_line(cursor)) {
+	}
+	return 0;
+}
+
+int stream_cursor_next_line(struct stream_cursor *cursor)
+{
+	off_t next = stream_next_line_start(cursor->stream, cursor->offset);
+	if (next < 0) {
+		return 0;
+	}
+	cursor->offset = next;
+	cursor->lineno++;
+	return 1;
+}
+
+int stream_cursor_prev_line(struct stream_cursor *cursor)
+{
+	if (!cursor->offset) {
+		return 0;
+	}
+	cursor->offset = stream_line_start(cursor->stream, cursor->offset - 1);
+	cursor->lineno--;
+	return 1;
+}
+
+slice stream_cursor_line(struct stream_cursor *cursor, size_t maxlen)
+{
+	slice line = stream_read(cursor->stream, cursor->offset, maxlen);
+	char *newline_char = slice_empty(line) ? NULL : (char*) memchr(line.start, '\n', slice_len(line));
+	if (newline_char) {
+		line.stop = newline_char;
+	}
+	return line;
+}
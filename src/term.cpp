@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 
@@ -143,12 +144,12 @@ void framebuffer_iter_reset_forward(struct framebuffer_iter *iter)
 
 void framebuffer_iter_reset_backward(struct framebuffer_iter *iter)
 {
-	iter->line = iter_line_max(iter) + 1;
+	iter->line = iter_line_max(iter);
 }
 
 void framebuffer_iter_goto(struct framebuffer_iter *iter, int n)
 {
-	iter->line = clamp(n, iter_line_min(iter), iter_line_max(iter));
+	iter->line = clamp(n, iter_line_min(iter), iter_line_max(iter) - 1);
 }
 
 void framebuffer_iter_move(struct framebuffer_iter *iter, int n)
@@ -160,8 +161,10 @@ int framebuffer_iter_next(struct framebuffer_iter *iter)
 {
 	int min = iter_line_min(iter);
 	int max = iter_line_max(iter);
-	assert_range(min - 1, iter->line, max + 1);
-	if (max <= iter->line) {
+	assert_range(min - 1, iter->line, max);
+	// Lines are in [min, max).
+	if (max - 1 <= iter->line) {
+		iter->line = max;
 		return 0;
 	}
 	iter->line++;
@@ -172,7 +175,7 @@ int framebuffer_iter_prev(struct framebuffer_iter *iter)
 {
 	int min = iter_line_min(iter);
 	int max = iter_line_max(iter);
-	assert_range(min - 1, iter->line, max + 1);
+	assert_range(min - 1, iter->line, max);
 	if (iter->line <= min) {
 		return 0;
 	}
@@ -180,11 +183,37 @@ int framebuffer_iter_prev(struct framebuffer_iter *iter)
 	return 1;
 }
 
+// Fill 'n' cells with the single byte 'c'.
+static void cells_fill(char *cells, char c, size_t n)
+{
+	memset(cells, 0, n * framebuffer_cell_bytes);
+	for (size_t i = 0; i < n; i++) {
+		cells[i * framebuffer_cell_bytes] = c;
+	}
+}
+
+// Put one byte of 'text' in each of 'n' cells.
+static void cells_put_text(char *cells, const char *text, size_t n)
+{
+	memset(cells, 0, n * framebuffer_cell_bytes);
+	for (size_t i = 0; i < n; i++) {
+		cells[i * framebuffer_cell_bytes] = text[i];
+	}
+}
+
 size_t framebuffer_push_text(struct framebuffer_iter *iter, char *text, size_t size)
 {
 	assert_range(iter_line_min(iter), iter->line, iter_line_max(iter));
 	size = min(size, (size_t) iter_line_len(iter));
-	memcpy(iter->text + iter_offset(iter), text, size);
+	cells_put_text(iter->text + iter_offset(iter) * framebuffer_cell_bytes, text, size);
+	return size;
+}
+
+size_t framebuffer_push_cells(struct framebuffer_iter *iter, const char *cells, size_t size)
+{
+	assert_range(iter_line_min(iter), iter->line, iter_line_max(iter));
+	size = min(size, (size_t) iter_line_len(iter));
+	memcpy(iter->text + iter_offset(iter) * framebuffer_cell_bytes, cells, size * framebuffer_cell_bytes);
 	return size;
 }
 
@@ -211,12 +240,12 @@ void framebuffer_init(struct framebuffer *framebuffer, vec term_size)
 	framebuffer->window = term_size;
 	size_t grid_size = term_size.x * term_size.y;
 	framebuffer->buffer_len = grid_size;
-	framebuffer->text = (char*) realloc(framebuffer->text, grid_size);
+	framebuffer->text = (char*) realloc(framebuffer->text, grid_size * framebuffer_cell_bytes);
 	framebuffer->fg_colors = (int*) realloc(framebuffer->fg_colors, sizeof(int) * grid_size);
 	framebuffer->bg_colors = (int*) realloc(framebuffer->bg_colors, sizeof(int) * grid_size);
 
 	buffer_ensure_size(&framebuffer->output_buffer, 0x10000);
-	memset(framebuffer->text, default_text, grid_size);
+	cells_fill(framebuffer->text, default_text, grid_size);
 	memset_i32(framebuffer->fg_colors, default_color_fg, sizeof(int) * grid_size);
 	memset_i32(framebuffer->bg_colors, default_color_bg, sizeof(int) * grid_size);
 
@@ -238,7 +267,7 @@ void framebuffer_draw_to_term(int term_out_fd, struct framebuffer *framebuffer,
 
 	vec window = framebuffer->window;
 	char *text = framebuffer->text;
-	char *text_end = text + window.x * window.y;
+	char *text_end = text + window.x * window.y * framebuffer_cell_bytes;
 	int *fg = framebuffer->fg_colors;
 	int *bg = framebuffer->bg_colors;
 	int x = 0;
@@ -249,18 +278,17 @@ ifdebug for (int i = 0; i < 40; i++) { //window.x * window.y; i++) {
 }
 debugf("\n");
 	while (text < text_end) {
-		char *section_start = text;
 		int current_fg = *fg;
 		int current_bg = *bg;
-debugf("section color offset +x:%ld fg:%d bg:%d\n", (ssize_t)(section_start - text), current_fg, current_bg);
+debugf("section color offset +x:%d fg:%d bg:%d\n", x, current_fg, current_bg);
 		color_start(&buffer, current_fg, current_bg);
 		while (x < window.x && *fg == current_fg && *bg == current_bg) {
+			buffer_append(&buffer, text, strnlen(text, framebuffer_cell_bytes));
 			x++;
-			text++;
+			text += framebuffer_cell_bytes;
 			fg++;
 			bg++;
 		}
-		buffer_append(&buffer, section_start, text - section_start);
 		color_stop(&buffer);
 		if (x == window.x) {
 			buffer_append_cstring(&buffer, TERM_NEWLINE);
@@ -287,7 +315,7 @@ void framebuffer_clear(struct framebuffer *framebuffer, rec rec)
 	struct framebuffer_iter iter = framebuffer_iter_make(framebuffer, rec);
 	while (framebuffer_iter_next(&iter)) {
 debugf("iterator current:%d max:%d\n", iter.line, iter_line_max(&iter));
-		memset(iter.text, default_text, iter_line_len(&iter));
+		cells_fill(iter.text + iter_offset(&iter) * framebuffer_cell_bytes, default_text, iter_line_len(&iter));
 		framebuffer_push_fg(&iter, default_color_fg, iter_line_len(&iter));
 		framebuffer_push_bg(&iter, default_color_bg, iter_line_len(&iter));
 	}
@@ -323,7 +351,7 @@ void framebuffer_put_text(struct framebuffer *framebuffer, slice s, vec vec)
 	}
 
 	size_t offset = vec.y * framebuffer->window.x + vec.x;
-	memcpy(framebuffer->text + offset, s.start, slice_len(s));
+	cells_put_text(framebuffer->text + offset * framebuffer_cell_bytes, s.start, slice_len(s));
 }
 
 void framebuffer_put_color_fg(struct framebuffer *framebuffer, int fg, rec rec)
@@ -384,6 +412,20 @@ static char input_buffer[3] = {};
 static char *pending_input_cursor = NULL;
 static char *pending_input_end = NULL;
 
+int term_input_pending(int term_in_fd, int timeout_ms)
+{
+	// Input already read but not consumed yet.
+	if (pending_input_cursor < pending_input_end) {
+		return 1;
+	}
+	struct pollfd pollfd = {
+		.fd = term_in_fd,
+		.events = POLLIN,
+		.revents = 0,
+	};
+	return poll(&pollfd, 1, timeout_ms) > 0;
+}
+
 static struct input term_get_mouse_input(int term_in_fd);
 
 // This function is not re-entrant. To make it re-entrant, stdin needs to be parametrized as a fd value since
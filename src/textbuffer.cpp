@@ -3,7 +3,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <sys/inotify.h>
 
 #define textchunk_datasize 0x8000 // 32k
 #define textchunk_size (textchunk_datasize + sizeof(struct textchunk))
@@ -24,9 +26,13 @@ static int textchunk_free_count = 0;
 struct textchunk* textchunk_alloc()
 {
 	if_null(textchunk_free_list_head) {
+		textchunk_free_list_head = (struct textchunk*) malloc(textchunk_size);
+		if_null(textchunk_free_list_head) {
+			return NULL;
+		}
+		textchunk_free_list_head->next = NULL;
 		textchunk_total_count++;
 		textchunk_free_count++;
-		textchunk_free_list_head = (struct textchunk*) malloc(textchunk_size);
 	}
 	textchunk_free_count--;
 	struct textchunk *chunk = textchunk_free_list_head;
@@ -50,143 +56,394 @@ void textchunk_free(struct textchunk *chunk)
 	textchunk_free_list_head = chunk;
 }
 
-struct textbuffer_impl {
-  struct textbuffer_impl *next_free_slot;
-  struct mapped_file file;
-  struct buffer append_buffer;
-  struct line *line_first;
-  struct line *line_last;
-  struct cursor_chain {
-    struct cursor *cursor;
-    struct cursor *next_cursor;
-  } cursors;
-  // TODO: operation buffer
+// The newline character stored right after 'text', or NULL when it is not known to be there: only the mapped file and
+// the textchunk holding 'text' are read, the memory past them may belong to anything else.
+static char* textbuffer_stored_newline(struct textbuffer *textbuffer, slice text)
+{
+	slice file = textbuffer->file.data;
+	if (file.start <= text.start && text.stop < file.stop) {
+		return *text.stop == '\n' ? text.stop : NULL;
+	}
+	// Lines are mostly visited in order, so the chunk is usually the one found last or the next one.
+	struct textchunk *hint = textbuffer->textchunk_hint;
+	struct textchunk *chunk = hint && hint->next ? hint->next : textbuffer->textchunk_head;
+	if (hint && textchunk_begin(hint) <= text.start && text.start < textchunk_end(hint)) {
+		chunk = hint;
+	} else if (!(chunk && textchunk_begin(chunk) <= text.start && text.start < textchunk_end(chunk))) {
+		chunk = textbuffer->textchunk_head;
+		while (chunk && !(textchunk_begin(chunk) <= text.start && text.start < textchunk_end(chunk))) {
+			chunk = chunk->next;
+		}
+	}
+	if_null(chunk) {
+		return NULL;
+	}
+	textbuffer->textchunk_hint = chunk;
+	return text.stop < textchunk_end(chunk) && *text.stop == '\n' ? text.stop : NULL;
+}
+
+// The newline character stored after the text of 'line', see textbuffer_stored_newline().
+static char* line_stored_newline(struct textbuffer *textbuffer, struct line *line)
+{
+	struct textpiece *last = line->fragments;
+	while (last->next) {
+		last = last->next;
+	}
+	return textbuffer_stored_newline(textbuffer, last->slice);
+}
+
+// Registry of open textbuffers:
+//	Textbuffers opened with textbuffer_open() are indexed by canonical path and by file identity (device and inode),
+//	so that opening a file already open through another path, a symlink or a hard link returns the same textbuffer.
+//	Both indexes are hash tables with open addressing and linear probing, kept at most half full. Removal shifts the
+//	following entries back instead of leaving tombstones.
+
+enum textbuffer_key {
+	TEXTBUFFER_KEY_PATH,
+	TEXTBUFFER_KEY_FILE,
+};
+
+struct textbuffer_table {
+	struct textbuffer **slots;
+	size_t capacity;        // 0 or a power of 2
+	size_t count;
 };
 
+static struct textbuffer_table textbuffer_tables[2];
 
-// Storage of text buffers:
-//	Text buffers are stored in a static array of fixed size with constant stride.
-//	The slots in that array are chained together by using the first field of struct textbuffer_impl. This also helps identify free slots.
-//	When a text buffer is allocated, the first free slot is used, and the chain of free slots is updated.
-//	When a text buffer is freed, the slot is returned to the free slot list.
-//	When the array is full and more buffers needs to be allocated, resizing needs to reconstruct the linked list.
+// FNV-1a
+static u64 textbuffer_path_hash(const char *path)
+{
+	u64 hash = 0xcbf29ce484222325;
+	for (const char *c = path; *c; c++) {
+		hash = (hash ^ (u8) *c) * 0x100000001b3;
+	}
+	return hash;
+}
 
-static struct textbuffer_impl *all_textbuffers = NULL;
-static struct textbuffer_impl *all_textbuffers_freelist_next = NULL;
-static struct textbuffer_impl *all_textbuffers_freelist_last = NULL;
-static size_t all_textbuffers_length = 0;
-static size_t all_textbuffers_capacity = 0;
+static u64 textbuffer_file_hash(dev_t dev, ino_t ino)
+{
+	u64 hash = ((u64) dev * 0x9e3779b97f4a7c15) ^ (u64) ino;
+	return (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9;
+}
 
-static const int all_textbuffer_length_default = 64;
+static u64 textbuffer_key_hash(struct textbuffer *textbuffer, int key)
+{
+	if (key == TEXTBUFFER_KEY_PATH) {
+		return textbuffer_path_hash(textbuffer->path);
+	}
+	return textbuffer_file_hash(textbuffer->file_dev, textbuffer->file_ino);
+}
 
-static void all_textbuffers_close_free_list()
+static void textbuffer_table_put(struct textbuffer_table *table, struct textbuffer *textbuffer, int key)
 {
-	// Write something else than NULL so that this slot counts as free.
-	all_textbuffers_freelist_last->next_free_slot = all_textbuffers_freelist_last;
+	size_t mask = table->capacity - 1;
+	size_t i = textbuffer_key_hash(textbuffer, key) & mask;
+	while (table->slots[i]) {
+		i = (i + 1) & mask;
+	}
+	table->slots[i] = textbuffer;
+	table->count++;
 }
 
-static inline struct textbuffer_impl* all_textbuffers_find_first_free_slot(struct textbuffer_impl *textbuffer)
+static int textbuffer_table_insert(int key, struct textbuffer *textbuffer)
 {
-	if (textbuffer) {
-		while (textbuffer->next_free_slot) {
-			textbuffer = textbuffer->next_free_slot;
+	struct textbuffer_table *table = textbuffer_tables + key;
+	if (2 * (table->count + 1) > table->capacity) {
+		struct textbuffer_table grown = {};
+		grown.capacity = max(2 * table->capacity, (size_t) 64);
+		grown.slots = (struct textbuffer**) calloc(grown.capacity, sizeof(struct textbuffer*));
+		if_null(grown.slots) {
+			return -ENOMEM;
+		}
+		for (size_t i = 0; i < table->capacity; i++) {
+			if (table->slots[i]) {
+				textbuffer_table_put(&grown, table->slots[i], key);
+			}
+		}
+		free(table->slots);
+		*table = grown;
+	}
+	textbuffer_table_put(table, textbuffer, key);
+	return 0;
+}
+
+static void textbuffer_table_remove(int key, struct textbuffer *textbuffer)
+{
+	struct textbuffer_table *table = textbuffer_tables + key;
+	if (!table->capacity) {
+		return;
+	}
+	size_t mask = table->capacity - 1;
+	size_t i = textbuffer_key_hash(textbuffer, key) & mask;
+	while (table->slots[i] != textbuffer) {
+		if (!table->slots[i]) {
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+	table->slots[i] = NULL;
+	table->count--;
+	// Move back the following entries which cannot be found anymore past the new hole.
+	size_t j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		struct textbuffer *next = table->slots[j];
+		if (!next) {
+			break;
+		}
+		size_t home = textbuffer_key_hash(next, key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slots[i] = next;
+			table->slots[j] = NULL;
+			i = j;
 		}
 	}
-	return textbuffer;
 }
 
-static void all_textbuffers_resize()
+static struct textbuffer* textbuffer_find_path(const char *path)
 {
-	int new_capa = all_textbuffers_capacity * 2;
-	if (!new_capa) {
-		new_capa = all_textbuffer_length_default;
+	struct textbuffer_table *table = textbuffer_tables + TEXTBUFFER_KEY_PATH;
+	if (!table->count) {
+		return NULL;
+	}
+	size_t mask = table->capacity - 1;
+	for (size_t i = textbuffer_path_hash(path) & mask; table->slots[i]; i = (i + 1) & mask) {
+		if (!strcmp(table->slots[i]->path, path)) {
+			return table->slots[i];
+		}
 	}
-	size_t new_size = new_capa * sizeof(struct textbuffer_impl);
+	return NULL;
+}
 
-	struct textbuffer_impl *new_storage = (struct textbuffer_impl*) realloc(all_textbuffers, new_size);
-	if (!all_textbuffers) {
-		memset(new_storage, 0, new_size);
-		// construct the freelist for the first time
-		all_textbuffers_freelist_next = new_storage;
-		all_textbuffers_freelist_last = new_storage + new_capa;
-		all_textbuffers_close_free_list();
-		struct textbuffer_impl *slot = new_storage;
-		while (slot < all_textbuffers_freelist_last) {
-			slot->next_free_slot = slot + 1;
-			slot = slot->next_free_slot;
+static struct textbuffer* textbuffer_find_file(dev_t dev, ino_t ino)
+{
+	struct textbuffer_table *table = textbuffer_tables + TEXTBUFFER_KEY_FILE;
+	if (!table->count) {
+		return NULL;
+	}
+	size_t mask = table->capacity - 1;
+	for (size_t i = textbuffer_file_hash(dev, ino) & mask; table->slots[i]; i = (i + 1) & mask) {
+		struct textbuffer *textbuffer = table->slots[i];
+		if (textbuffer->file_dev == dev && textbuffer->file_ino == ino) {
+			return textbuffer;
 		}
-	} else {
-		// reconstruct the freelist
-		// Since slots knows if they are allocated or not, we take the
-		// opportunity to defrag the list
-		all_textbuffers_freelist_next = all_textbuffers_find_first_free_slot(new_storage);
-		struct textbuffer_impl *slot = all_textbuffers_freelist_next;
-		while (slot < all_textbuffers_freelist_last) {
-			slot->next_free_slot = slot + 1;
-			slot = slot->next_free_slot;
-			// detect end of loop !
+	}
+	return NULL;
+}
+
+// Files are watched through their directory, so that files replaced by a rename are noticed like files written in
+// place. Textbuffers in the same directory share the watch of that directory.
+struct textbuffer_watch {
+	int wd;
+	int refs;
+	char *dir;
+};
+
+static int textbuffer_inotify_fd = -1;
+static struct textbuffer_watch *textbuffer_watches = NULL;
+static size_t textbuffer_nwatches = 0;
+
+static int textbuffer_find_watch(int wd)
+{
+	for (size_t i = 0; i < textbuffer_nwatches; i++) {
+		if (textbuffer_watches[i].wd == wd) {
+			return i;
 		}
-		all_textbuffers_freelist_last = new_storage + new_capa;
-		all_textbuffers_close_free_list();
 	}
-	all_textbuffers_capacity = new_capa;
-	all_textbuffers = new_storage;
+	return -1;
 }
 
-static struct textbuffer_impl* all_textbuffer_alloc()
+// Watch the directory of a registered textbuffer. Failing to watch is not an error: the textbuffer just does not
+// notice external changes by itself.
+static void textbuffer_watch(struct textbuffer *textbuffer)
 {
-	if (all_textbuffers_length == all_textbuffers_capacity) {
-		all_textbuffers_resize();
+	textbuffer->watch = -1;
+	if (textbuffer_inotify_fd < 0) {
+		textbuffer_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (textbuffer_inotify_fd < 0) {
+			return;
+		}
 	}
-	all_textbuffers_length++;
-	struct textbuffer_impl* textbuffer = all_textbuffers_freelist_next;
-	all_textbuffers_freelist_next = textbuffer->next_free_slot;
-	textbuffer->next_free_slot = NULL;
-	return textbuffer;
+	char *slash = strrchr(textbuffer->path, '/');
+	if (!slash || slash == textbuffer->path) {
+		return;
+	}
+	*slash = 0;
+	int wd = inotify_add_watch(textbuffer_inotify_fd, textbuffer->path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+	*slash = '/';
+	if (wd < 0) {
+		return;
+	}
+	int i = textbuffer_find_watch(wd);
+	if (i < 0) {
+		struct textbuffer_watch *watches = (struct textbuffer_watch*) realloc(textbuffer_watches, (textbuffer_nwatches + 1) * sizeof(struct textbuffer_watch));
+		char *dir = strndup(textbuffer->path, slash - textbuffer->path);
+		if (!watches || !dir) {
+			free(dir);
+			if (watches) {
+				textbuffer_watches = watches;
+			}
+			inotify_rm_watch(textbuffer_inotify_fd, wd);
+			return;
+		}
+		textbuffer_watches = watches;
+		i = textbuffer_nwatches++;
+		textbuffer_watches[i].wd = wd;
+		textbuffer_watches[i].refs = 0;
+		textbuffer_watches[i].dir = dir;
+	}
+	textbuffer_watches[i].refs++;
+	textbuffer->watch = wd;
+}
+
+static void textbuffer_unwatch(struct textbuffer *textbuffer)
+{
+	int i = textbuffer->watch < 0 ? -1 : textbuffer_find_watch(textbuffer->watch);
+	textbuffer->watch = -1;
+	if (i < 0 || --textbuffer_watches[i].refs) {
+		return;
+	}
+	inotify_rm_watch(textbuffer_inotify_fd, textbuffer_watches[i].wd);
+	free(textbuffer_watches[i].dir);
+	textbuffer_watches[i] = textbuffer_watches[--textbuffer_nwatches];
+}
 
+static int textbuffer_register(struct textbuffer *textbuffer)
+{
+	int fail = textbuffer_table_insert(TEXTBUFFER_KEY_PATH, textbuffer);
+	if (!fail && textbuffer->file_ino) {
+		fail = textbuffer_table_insert(TEXTBUFFER_KEY_FILE, textbuffer);
+		if (fail) {
+			textbuffer_table_remove(TEXTBUFFER_KEY_PATH, textbuffer);
+		}
+	}
+	if (!fail) {
+		textbuffer->registered = 1;
+		textbuffer_watch(textbuffer);
+	}
+	return fail;
 }
 
-static void all_textbuffers_free(struct textbuffer_impl *textbuffer)
+static void textbuffer_unregister(struct textbuffer *textbuffer)
 {
-	all_textbuffers_length++;
-	all_textbuffers_freelist_last->next_free_slot = textbuffer;
-	all_textbuffers_freelist_last = textbuffer;
-	all_textbuffers_close_free_list();
+	if (!textbuffer->registered) {
+		return;
+	}
+	textbuffer_table_remove(TEXTBUFFER_KEY_PATH, textbuffer);
+	if (textbuffer->file_ino) {
+		textbuffer_table_remove(TEXTBUFFER_KEY_FILE, textbuffer);
+	}
+	textbuffer_unwatch(textbuffer);
+	textbuffer->registered = 0;
 }
 
-static struct textbuffer_impl* textbuffer_alloc()
+// Remember the file as it is on disk, to detect external changes. Saving and reloading replace the file, so the file
+// key of a registered textbuffer is updated too.
+static void textbuffer_set_identity(struct textbuffer *textbuffer, struct stat *file_stat)
 {
-	return NULL;
+	int rekey = textbuffer->registered && (textbuffer->file_dev != file_stat->st_dev || textbuffer->file_ino != file_stat->st_ino);
+	if (rekey && textbuffer->file_ino) {
+		textbuffer_table_remove(TEXTBUFFER_KEY_FILE, textbuffer);
+	}
+	textbuffer->file_dev = file_stat->st_dev;
+	textbuffer->file_ino = file_stat->st_ino;
+	textbuffer->file_size = file_stat->st_size;
+	textbuffer->file_mtime = file_stat->st_mtim;
+	if (rekey && textbuffer_table_insert(TEXTBUFFER_KEY_FILE, textbuffer)) {
+		// Only deduplication through other paths to the same file is lost.
+		textbuffer->file_ino = 0;
+	}
 }
 
+static void textbuffer_update_identity(struct textbuffer *textbuffer)
+{
+	struct stat file_stat;
+	if (stat(textbuffer->path, &file_stat) == 0) {
+		textbuffer_set_identity(textbuffer, &file_stat);
+	}
+}
 
+static int textbuffer_same_identity(struct textbuffer *textbuffer, struct stat *file_stat)
+{
+	return textbuffer->file_dev == file_stat->st_dev && textbuffer->file_ino == file_stat->st_ino
+		&& textbuffer->file_size == file_stat->st_size
+		&& textbuffer->file_mtime.tv_sec == file_stat->st_mtim.tv_sec
+		&& textbuffer->file_mtime.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
 
-static struct err textbuffer_op_open(struct textbuffer textbuffer, struct textbuffer_command *command)
+static struct err textbuffer_op_open(struct textbuffer *textbuffer, struct textbuffer_command *command)
+{
+	return noerror();
+}
+static struct err textbuffer_op_touch(struct textbuffer *textbuffer, struct textbuffer_command *command)
+{
+	return noerror();
+}
+// 'args' is an optional path to save to, instead of the path of the textbuffer.
+static struct err textbuffer_op_save(struct textbuffer *textbuffer, struct textbuffer_command *command)
+{
+	int fail = textbuffer_save_async(textbuffer, (const char*) command->args, FILE_WRITER_SYNC);
+	if (fail) {
+		return error_because(-fail);
+	}
+	return noerror();
+}
+static struct err textbuffer_op_close(struct textbuffer *textbuffer, struct textbuffer_command *rgs)
+{
+	if (!textbuffer->registered) {
+		return error_because(EINVAL);
+	}
+	textbuffer_close(textbuffer);
+	return noerror();
+}
+static struct err textbuffer_op_insert(struct textbuffer *textbuffer, struct textbuffer_command *command)
 {
+	char *text = (char*) command->args;
+	int fail = textbuffer_insert_all(textbuffer, s(text, text + command->arg_size));
+	if (fail) {
+		return error_because(-fail);
+	}
 	return noerror();
 }
-static struct err textbuffer_op_touch(struct textbuffer textbuffer, struct textbuffer_command *command)
+static struct err textbuffer_op_delete(struct textbuffer *textbuffer, struct textbuffer_command *command)
 {
+	int fail = textbuffer_delete_all(textbuffer, command->arg_size);
+	if (fail) {
+		return error_because(-fail);
+	}
 	return noerror();
 }
-static struct err textbuffer_op_save(struct textbuffer textbuffer, struct textbuffer_command *command)
+static struct err textbuffer_op_undo(struct textbuffer *textbuffer, struct textbuffer_command *command)
 {
+	int r = textbuffer_undo(textbuffer);
+	if (r < 0) {
+		return error_because(-r);
+	}
 	return noerror();
 }
-static struct err textbuffer_op_close(struct textbuffer textbuffer, struct textbuffer_command *rgs)
+static struct err textbuffer_op_redo(struct textbuffer *textbuffer, struct textbuffer_command *command)
 {
+	int r = textbuffer_redo(textbuffer);
+	if (r < 0) {
+		return error_because(-r);
+	}
 	return noerror();
 }
 
-typedef struct err (*op_handler)(struct textbuffer, struct textbuffer_command*);
+typedef struct err (*op_handler)(struct textbuffer*, struct textbuffer_command*);
 static op_handler op_dispatch[TEXTBUFFER_MAX] = {
   [TEXTBUFFER_OPEN]	= textbuffer_op_open,
   [TEXTBUFFER_TOUCH]	= textbuffer_op_touch,
   [TEXTBUFFER_SAVE]	= textbuffer_op_save,
   [TEXTBUFFER_CLOSE]	= textbuffer_op_close,
+  [TEXTBUFFER_INSERT]	= textbuffer_op_insert,
+  [TEXTBUFFER_DELETE]	= textbuffer_op_delete,
+  [TEXTBUFFER_UNDO]	= textbuffer_op_undo,
+  [TEXTBUFFER_REDO]	= textbuffer_op_redo,
 };
 
-struct err textbuffer_operation(struct textbuffer textbuffer, struct textbuffer_command *command)
+struct err textbuffer_operation(struct textbuffer *textbuffer, struct textbuffer_command *command)
 {
 	int op = command->op;
 	if (op < 0 || TEXTBUFFER_MAX <= op) {
@@ -195,36 +452,64 @@ struct err textbuffer_operation(struct textbuffer textbuffer, struct textbuffer_
 	return op_dispatch[op](textbuffer, command);
 }
 
-void textbuffer_init()
+
+// Lines and textpieces are allocated from per-textbuffer slabs: loading a file allocates its lines as large arrays
+// instead of one allocation per line, and lines and textpieces released by edits are recycled for later edits.
+// Slabs are only released all at once when the textbuffer is freed, without visiting every line.
+#define textbuffer_slab_lines 0x1000
+#define textbuffer_slab_textpieces 0x1000
+#define textbuffer_slab_cursors 0x100
+
+static void textbuffer_init_storage(struct textbuffer *textbuffer)
+{
+	slab_init(&textbuffer->line_slab, sizeof(struct line), textbuffer_slab_lines);
+	slab_init(&textbuffer->textpiece_slab, sizeof(struct textpiece), textbuffer_slab_textpieces);
+	slab_init(&textbuffer->cursor_slab, sizeof(struct cursor), textbuffer_slab_cursors);
+	journal_init(&textbuffer->journal, textbuffer_history_limit);
+}
+
+static struct line* line_alloc_empty(struct textbuffer *textbuffer)
 {
-	// TODOs:
-	// setup memory for storing all textbuffer
-	// setup memory for storing an index of textbuffer by name
+	return (struct line*) slab_alloc(&textbuffer->line_slab);
 }
 
-static void textpiece_free(struct textpiece *textpiece)
+// Release the fragments of a line, except the inline fragment which belongs to the line itself.
+static void line_free_fragments(struct textbuffer *textbuffer, struct line *line)
 {
+	struct textpiece *textpiece = line->fragments;
 	while (textpiece) {
 		struct textpiece *next = textpiece->next;
-		free(textpiece);
+		if (textpiece != &line->inline_fragment) {
+			slab_free(&textbuffer->textpiece_slab, textpiece);
+		}
 		textpiece = next;
 	}
+	line->fragments = NULL;
+	line->bytelen = 0;
+	line_columns_invalidate(textbuffer, line, 0);
 }
 
-static struct line* line_alloc_empty()
+// Release a line which has been unlinked from the line list and the line tree.
+static void line_free(struct textbuffer *textbuffer, struct line *line)
 {
-	return (struct line*) calloc(sizeof(struct line), 1); // calloc because it needs to be zeroed
+	line_free_fragments(textbuffer, line);
+	slab_free(&textbuffer->line_slab, line);
 }
 
-static void line_free(struct line *line)
+// Lexer states of the lines from 'index' may be stale, see highlight.cpp.
+static void textbuffer_highlight_dirty(struct textbuffer *textbuffer, size_t index)
 {
-	textpiece_free(line->fragments);
-	free(line);
+	textbuffer->highlight_dirty = min(textbuffer->highlight_dirty, index);
 }
 
-static int line_x_length(struct line *line)
+// The text of a line changed from byte x.
+static void line_update(struct textbuffer *textbuffer, struct line *line, size_t x)
 {
-	return line->bytelen;
+	line_columns_invalidate(textbuffer, line, x);
+	line_wrap_update(textbuffer, line);
+	linetree_update(line);
+	line->lexer_dirty = 1;
+	textbuffer_highlight_dirty(textbuffer, line_index(line));
 }
 
 // Link two lines together. Can handle nulls
@@ -234,206 +519,2951 @@ static void line_link(struct line *line_first, struct line *line_second)
 	if (line_second) line_second->prev = line_first;
 }
 
-// Insert given line before the current cursor
-static void line_insert_pre(struct cursor *cursor, struct line *line)
+// Tracked cursors are linked on their line.
+static void cursor_link(struct cursor *cursor, struct line *line)
+{
+	cursor->line_prev = NULL;
+	cursor->line_next = line->cursors;
+	if (line->cursors) {
+		line->cursors->line_prev = cursor;
+	}
+	line->cursors = cursor;
+}
+
+static void cursor_unlink(struct cursor *cursor)
+{
+	if (cursor->line_prev) {
+		cursor->line_prev->line_next = cursor->line_next;
+	} else {
+		cursor->line->cursors = cursor->line_next;
+	}
+	if (cursor->line_next) {
+		cursor->line_next->line_prev = cursor->line_prev;
+	}
+}
+
+static void cursor_set_line(struct cursor *cursor, struct line *line)
+{
+	if (cursor->tracked && cursor->line != line) {
+		cursor_unlink(cursor);
+		cursor_link(cursor, line);
+	}
+	cursor->line = line;
+}
+
+// The column of the cursor is only computed when it first moves up or down, so that edits moving many cursors on a
+// long line do not decode it.
+static void cursor_set_x(struct cursor *cursor, size_t x)
 {
-	struct line *l1 = cursor->line->prev;
-	struct line *l2 = line;
-	struct line *l3 = cursor->line;
-	line_link(l1, l2);
-	line_link(l2, l3);
+	cursor->x_offset_actual = x;
+	cursor->x_offset_want = -1;
+}
 
-	// !!! this need to adjust the lineno of all cursors before
+static size_t cursor_want_column(struct cursor *cursor)
+{
+	if (cursor->x_offset_want < 0) {
+		cursor->x_offset_want = line_column_at(cursor->textbuffer, cursor->line, cursor->x_offset_actual);
+	}
+	return cursor->x_offset_want;
 }
 
-// Insert given line after the current cursor
-static void line_insert_post(struct cursor *cursor, struct line *line)
+// Insert given line before the 'at' line, in both the line list and the line tree.
+static void line_insert_before(struct textbuffer *textbuffer, struct line *at, struct line *line)
 {
-	struct line *l1 = cursor->line;
-	struct line *l2 = line;
-	struct line *l3 = cursor->line->next;
-	line_link(l1, l2);
-	line_link(l2, l3);
+	line_link(at->prev, line);
+	line_link(line, at);
+	if (textbuffer->line_first == at) {
+		textbuffer->line_first = line;
+	}
+	linetree_insert_before(&textbuffer->line_root, at, line);
+	textbuffer->line_number++;
+}
 
-	// !!! this need to adjust the lineno of all cursors after
+// Insert given line after the 'at' line, in both the line list and the line tree.
+static void line_insert_after(struct textbuffer *textbuffer, struct line *at, struct line *line)
+{
+	line_link(line, at->next);
+	line_link(at, line);
+	if (textbuffer->line_last == at) {
+		textbuffer->line_last = line;
+	}
+	linetree_insert_after(&textbuffer->line_root, at, line);
+	textbuffer->line_number++;
 }
 
-static void line_append_fragment(struct line *line, slice fragment)
+// Append a fragment at the end of a line. The first fragment of a line is stored inline in the line, and a fragment
+// directly following the last fragment in memory just extends it.
+static int line_append_fragment(struct textbuffer *textbuffer, struct line *line, slice fragment)
 {
+	if (!line->fragments) {
+		line->inline_fragment.next = NULL;
+		line->inline_fragment.slice = fragment;
+		line->fragments = &line->inline_fragment;
+		line->bytelen = slice_len(fragment);
+		return 0;
+	}
 	if (slice_empty(fragment)) {
-		return;
+		return 0;
 	}
-	struct textpiece **last_fragment = &line->fragments;
-	while (*last_fragment) {
-		*last_fragment = (*last_fragment)->next;
+	struct textpiece *last_fragment = line->fragments;
+	while (last_fragment->next) {
+		last_fragment = last_fragment->next;
 	}
-	*last_fragment = (struct textpiece*) calloc(sizeof(struct textpiece), 1);
-// TODO: this should return ENOMEM in case it fails
-	assert(*last_fragment);
-	(*last_fragment)->slice = fragment;
 	line->bytelen += slice_len(fragment);
+	if (last_fragment->slice.stop == fragment.start) {
+		last_fragment->slice.stop = fragment.stop;
+		return 0;
+	}
+	struct textpiece *textpiece = (struct textpiece*) slab_alloc(&textbuffer->textpiece_slab);
+	if_null(textpiece) {
+		line->bytelen -= slice_len(fragment);
+		return -ENOMEM;
+	}
+	textpiece->slice = fragment;
+	last_fragment->next = textpiece;
+	return 0;
+}
+
+// Maximum number of lines created per batch of newlines scanned by textbuffer_cut_lines().
+#define textbuffer_scan_batch 0x10000
+
+// Cut 'text' into lines appended at the end of the textbuffer.
+// The last line stays open until a newline is found, so that a line can span several calls (i.e several textchunks).
+// Every line is followed by a newline except the last one: "a\nb\n" gives the three lines "a", "b" and "".
+// Newlines are found in batches by the vectorized scanner, and each batch of lines is allocated as a single block,
+// with every line a view over its slice of 'text'.
+static int textbuffer_cut_lines(struct textbuffer *textbuffer, slice text)
+{
+	size_t capacity = min(slice_len(text) + 1, (size_t) textbuffer_scan_batch);
+	u32 *newlines = (u32*) malloc(capacity * sizeof(u32));
+	if_null(newlines) {
+		return -ENOMEM;
+	}
+
+	int fail = 0;
+	while (!slice_empty(text) && !fail) {
+		size_t scanned;
+		size_t len = min(slice_len(text), (size_t) scan_max_len);
+		size_t n = scan_newlines(text.start, len, newlines, capacity, &scanned);
+
+		struct line *lines = n ? (struct line*) slab_alloc_array(&textbuffer->line_slab, n) : NULL;
+		if (n && !lines) {
+			fail = -ENOMEM;
+			break;
+		}
+		// Only the first line can already have fragments when it started in a previous text.
+		char *line_start = text.start;
+		for (size_t i = 0; i < n && !fail; i++) {
+			char *newline_char = text.start + newlines[i];
+			fail = line_append_fragment(textbuffer, textbuffer->line_last, s(line_start, newline_char));
+			line_link(textbuffer->line_last, lines + i);
+			textbuffer->line_last = lines + i;
+			textbuffer->line_number++;
+			line_start = newline_char + 1;
+		}
+
+		text.start += scanned;
+		if (!fail) {
+			fail = line_append_fragment(textbuffer, textbuffer->line_last, s(line_start, text.start));
+		}
+	}
+
+	free(newlines);
+	return fail;
 }
 
 static size_t file_path_maxlen = 1024;
 
-int textbuffer_load(const char *path, struct textbuffer *textbuffer)
+static void textbuffer_set_path(struct textbuffer *textbuffer, const char *path)
 {
-	assert(path);
 	size_t len = strnlen(path, file_path_maxlen);
 	char* path_copy = (char*) malloc(len + 1);
-	memcpy(path_copy, path, len + 1);
-
-	int fd = open(path_copy, O_RDONLY);
-	if (!fd) {
-		return -errno;
-	}
-	struct stat stat;
-	int r = fstat(fd, &stat);
-	if (r < 0) {
-		close(fd);
-		return -errno;
-	}
+	memcpy(path_copy, path, len);
+	path_copy[len] = 0;
 
 	textbuffer->path = path_copy;
 	textbuffer->basename = path_copy;
-	//char* last_slash = path_copy;
-	//char* path_end = path_copy + len;
-	//while (last_slash) {
-	//	textbuffer->basename = last_slash;
-	//	last_slash = memchr(last_slash, '/', path_end - last_slash);
-	//	if (last_slash) last_slash++;
-	//}
-	//textbuffer->basename++;
 	for (char *c = path_copy; *c != 0; c++) {
 		if (*c == '/') {
 			textbuffer->basename = c + 1;
 		}
 	}
+}
 
-	// load file in chunk
-	int fail = 0;
-	ssize_t filesize = stat.st_size;
-	struct textchunk **chunk_emplace = &textbuffer->textchunk_head;
-	while (0 < filesize) {
-		struct textchunk *chunk = textchunk_alloc();
-		*chunk_emplace = chunk;
-		chunk_emplace = &chunk->next;
-		textbuffer->textchunk_last = chunk;
-		if (!chunk) {
-			fail = -ENOMEM;
-			break;
-		}
+// Setup the first line and the initial cursor before any text gets cut into lines.
+static void textbuffer_init_cursor(struct textbuffer *textbuffer)
+{
+	struct cursor *cursor = &textbuffer->cursor;
+	memset(cursor, 0, sizeof(struct cursor));
+	cursor->textbuffer = textbuffer;
+	cursor->line = textbuffer->line_first;
+	cursor->tracked = 1;
+	cursor_link(&textbuffer->cursor, textbuffer->line_first);
+	textbuffer->cursor_count = 1;
+}
 
-		ssize_t r = read(fd, chunk->text, textchunk_size);
-		if (r < 0) {
-			fail = -errno;
-			break;
-		}
-		if (r == 0) {
-			assert(filesize == 0);
-			// Broken invariant: r should always be <= filesize, and filesize always > 0
-			fail = -EINVAL;
-			break;
-		}
-		chunk->cursor += r;
-		filesize -= r;
-		assert((r == textchunk_size) || (filesize == 0));
+static int textbuffer_init_lines(struct textbuffer *textbuffer)
+{
+	textbuffer->line_first = line_alloc_empty(textbuffer);
+	if_null(textbuffer->line_first) {
+		return -ENOMEM;
 	}
+	textbuffer->line_last = textbuffer->line_first;
+	textbuffer->line_number = 1;
+	textbuffer_init_cursor(textbuffer);
+	return 0;
+}
 
-	close(fd);
-	if (fail) {
-		return fail;
-	}
+// Indexing a mapped file is split in ranges processed on the worker threads:
+//	1) count the newlines of every range,
+//	2) prefix sum the counts to get the index of the first newline of every range, and allocate all lines at once,
+//	3) cut every range into lines: newline #g found at p ends line #g at p and starts line #g+1 at p+1,
+//	4) link lines together, then build the line tree.
+// Steps 1), 3) and 4) run in parallel, the result is the same as textbuffer_cut_lines() on the whole file.
 
-	// cut the chunks into lines
-// BUG: what if the first chunk has no newline char (single line file)
-	filesize = stat.st_size;
-	struct textchunk *chunk = textbuffer->textchunk_head;
-	struct line **line_current = &(textbuffer->line_last); // null initially
-	while (0 < filesize) {
-		slice chunkslice = s(textchunk_begin(chunk), textchunk_end(chunk));
-		filesize -= slice_len(chunkslice);
-		while (0 < slice_len(chunkslice)) {
-			slice line = chunkslice;
-			char *newline_char = (char *) memchr(line.start, '\n', slice_len(line));
-			if (newline_char) {
-				struct line *previous_line = *line_current;
-				*line_current = line_alloc_empty();
-				if_null(*line_current) {
-					return -ENOMEM;
-				}
-				if_null(textbuffer->line_first) {
-					textbuffer->line_first = *line_current;
-				}
-				line_link(previous_line, *line_current);
-				chunkslice.start = newline_char + 1;
-				line.stop = newline_char;
-			} else {
-				// append everything to current line and clear current chunk
-				chunkslice.start = chunkslice.stop;
-			}
-			line_append_fragment(*line_current, line);
-		}
-	}
+// Minimum size of a range, smaller files are indexed as a single range on the calling thread.
+#define textbuffer_index_range_min Mega(4)
+#define textbuffer_index_ranges_max (worker_max_threads * 4)
 
-	// init one cursor
-	textbuffer->cursor_list.cursor = (struct cursor) {
-		.line = textbuffer->line_first,
-		.lineno = 1,
-		.x_offset_actual = 0,
-		.x_offset_want = 0,
-	};
+struct textbuffer_index_job {
+	slice text;
+	int nranges;
+	size_t newline_base[textbuffer_index_ranges_max + 1];
+	struct line *lines;
+	size_t nlines;
+	int fail;
+};
 
-	return 0;
+static slice textbuffer_index_range(struct textbuffer_index_job *job, int range)
+{
+	size_t len = slice_len(job->text);
+	return s(job->text.start + len * range / job->nranges, job->text.start + len * (range + 1) / job->nranges);
 }
 
-void textbuffer_free(struct textbuffer *textbuffer)
+static void textbuffer_index_count_task(void *ctx, int range)
 {
-	assert(textbuffer);
-	free(textbuffer->path);
-	textchunk_free(textbuffer->textchunk_head); // CHECK: should this memory be zeroed ??
-	struct line *line = textbuffer->line_first;
-	while (line) {
-		struct line *next = line->next;
-		line_free(line);
-		line = next;
+	struct textbuffer_index_job *job = (struct textbuffer_index_job*) ctx;
+	slice text = textbuffer_index_range(job, range);
+	size_t n = 0;
+	while (!slice_empty(text)) {
+		size_t len = min(slice_len(text), (size_t) scan_max_len);
+		n += scan_count_newlines(text.start, len);
+		text.start += len;
 	}
-	memset(textbuffer, 0, sizeof(struct textbuffer));
+	job->newline_base[range + 1] = n;
 }
 
-char* cursor_to_string(struct cursor *cursor)
+static void textbuffer_index_cut_task(void *ctx, int range)
 {
-	char *buffer = (char*) malloc(cursor->line->bytelen + 1);
-	char *a = buffer;
-	struct textpiece *fragment = cursor->line->fragments;
-	while (fragment) {
-		size_t len = slice_len(fragment->slice);
-		memcpy(a, fragment->slice.start, len);
-		a += len;
-		fragment = fragment->next;
+	struct textbuffer_index_job *job = (struct textbuffer_index_job*) ctx;
+	slice text = textbuffer_index_range(job, range);
+	size_t g = job->newline_base[range];
+
+	u32 *newlines = (u32*) malloc(textbuffer_scan_batch * sizeof(u32));
+	if_null(newlines) {
+		__atomic_store_n(&job->fail, -ENOMEM, __ATOMIC_RELAXED);
+		return;
+	}
+	while (!slice_empty(text)) {
+		size_t scanned;
+		size_t len = min(slice_len(text), (size_t) scan_max_len);
+		size_t n = scan_newlines(text.start, len, newlines, textbuffer_scan_batch, &scanned);
+		for (size_t i = 0; i < n; i++, g++) {
+			char *newline_char = text.start + newlines[i];
+			job->lines[g].inline_fragment.slice.stop = newline_char;
+			job->lines[g + 1].inline_fragment.slice.start = newline_char + 1;
+		}
+		text.start += scanned;
 	}
-	*a = 0;
-	return buffer;
+	free(newlines);
 }
 
-struct line* cursor_prev_line(struct cursor *cursor)
+static void textbuffer_index_link_task(void *ctx, int range)
 {
-	struct line *prev = cursor->line->prev;
-	if (prev) {
-		cursor->line = prev;
-		cursor->lineno--;
-		cursor->x_offset_actual = min(cursor->x_offset_actual, line_x_length(prev));
+	struct textbuffer_index_job *job = (struct textbuffer_index_job*) ctx;
+	struct line *lines = job->lines;
+	size_t first = job->nlines * range / job->nranges;
+	size_t last = job->nlines * (range + 1) / job->nranges;
+	for (size_t i = first; i < last; i++) {
+		struct line *line = lines + i;
+		line->fragments = &line->inline_fragment;
+		line->bytelen = slice_len(line->inline_fragment.slice);
+		line->prev = i ? line - 1 : NULL;
+		line->next = i + 1 < job->nlines ? line + 1 : NULL;
 	}
-	return prev;
 }
 
-struct line* cursor_next_line(struct cursor *cursor)
+// A run of lines cut out of a contiguous text, linked together and with their own line tree.
+struct linerun {
+	struct line *first;
+	struct line *last;
+	struct line *root;
+	size_t count;
+};
+
+// Cut 'text' into lines: text ends with the last line, not with a newline. An empty text makes one empty line.
+static int textbuffer_index_text(struct textbuffer *textbuffer, slice text, struct linerun *run)
 {
-	struct line *next = cursor->line->next;
-	if (next) {
-		cursor->line = next;
-		cursor->lineno++;
-		cursor->x_offset_actual = min(cursor->x_offset_actual, line_x_length(next));
+	struct textbuffer_index_job *job = (struct textbuffer_index_job*) calloc(sizeof(struct textbuffer_index_job), 1);
+	if_null(job) {
+		return -ENOMEM;
 	}
-	return next;
+	job->text = text;
+	size_t len = slice_len(job->text);
+	job->nranges = clamp(len / textbuffer_index_range_min, 1, min(4 * worker_thread_count(), textbuffer_index_ranges_max));
+
+	worker_parallel_for(job->nranges, textbuffer_index_count_task, job);
+	for (int r = 0; r < job->nranges; r++) {
+		job->newline_base[r + 1] += job->newline_base[r];
+	}
+
+	job->nlines = job->newline_base[job->nranges] + 1;
+	job->lines = (struct line*) slab_alloc_array(&textbuffer->line_slab, job->nlines);
+	if_null(job->lines) {
+		free(job);
+		return -ENOMEM;
+	}
+	job->lines[0].inline_fragment.slice.start = job->text.start;
+	job->lines[job->nlines - 1].inline_fragment.slice.stop = job->text.stop;
+	worker_parallel_for(job->nranges, textbuffer_index_cut_task, job);
+	worker_parallel_for(job->nranges, textbuffer_index_link_task, job);
+
+	int fail = job->fail;
+	if (!fail) {
+		run->first = job->lines;
+		run->last = job->lines + job->nlines - 1;
+		run->count = job->nlines;
+		run->root = linetree_build_array(job->lines, job->nlines);
+	}
+	free(job);
+	return fail;
+}
+
+static int textbuffer_index_mapped(struct textbuffer *textbuffer)
+{
+	struct linerun run;
+	int fail = textbuffer_index_text(textbuffer, textbuffer->file.data, &run);
+	if (!fail) {
+		textbuffer->line_first = run.first;
+		textbuffer->line_last = run.last;
+		textbuffer->line_root = run.root;
+		textbuffer->line_number = run.count;
+	}
+	return fail;
+}
+
+// Lazy indexing:
+//	Only a region of complete lines around the requested position is indexed when loading. The text before
+//	that region (the head) and after it (the tail) stay unindexed slices of the mapping, which are cut into lines
+//	step by step by textbuffer_index_step(), or on demand when cursors reach the first or last indexed line.
+//	The head excludes the newline ending its last line, the tail starts after the newline ending the last indexed
+//	line. Both are pending as long as their start pointer is not NULL, even when empty: an empty pending tail is
+//	the empty last line following a final newline.
+//	Until indexing completes, line numbers are estimated from the average line length of the indexed lines.
+
+static int textbuffer_has_head(struct textbuffer *textbuffer)
+{
+	return textbuffer->unindexed_head.start != NULL;
+}
+
+static int textbuffer_has_tail(struct textbuffer *textbuffer)
+{
+	return textbuffer->unindexed_tail.start != NULL;
+}
+
+static size_t textbuffer_estimate_lines(struct textbuffer *textbuffer, slice unindexed)
+{
+	// Count the newline excluded from the head or preceding the tail.
+	size_t bytes = slice_len(unindexed) + 1;
+	return max((size_t) 1, bytes * textbuffer->line_root->count / textbuffer->line_root->bytes);
+}
+
+static size_t textbuffer_estimated_head_lines(struct textbuffer *textbuffer)
+{
+	return textbuffer_has_head(textbuffer) ? textbuffer_estimate_lines(textbuffer, textbuffer->unindexed_head) : 0;
+}
+
+static void textbuffer_update_line_number(struct textbuffer *textbuffer)
+{
+	textbuffer->line_number = textbuffer->line_root->count + textbuffer_estimated_head_lines(textbuffer);
+	if (textbuffer_has_tail(textbuffer)) {
+		textbuffer->line_number += textbuffer_estimate_lines(textbuffer, textbuffer->unindexed_tail);
+	}
+}
+
+// Size in bytes of the head, including the newline ending it.
+static size_t textbuffer_head_bytelen(struct textbuffer *textbuffer)
+{
+	return textbuffer_has_head(textbuffer) ? slice_len(textbuffer->unindexed_head) + 1 : 0;
+}
+
+// Cut appended text into lines at the end of the textbuffer: the first line of the text continues the last line.
+static int textbuffer_append_lines(struct textbuffer *textbuffer, slice text)
+{
+	struct linerun run;
+	int fail = textbuffer_index_text(textbuffer, text, &run);
+	if (fail) {
+		return fail;
+	}
+	// On failure the lines of the run are not linked anywhere, they are released with the textbuffer.
+	struct line *first = run.first;
+	size_t x = textbuffer->line_last->bytelen;
+	fail = line_append_fragment(textbuffer, textbuffer->line_last, first->inline_fragment.slice);
+	if (fail) {
+		return fail;
+	}
+	line_update(textbuffer, textbuffer->line_last, x);
+	if (run.count > 1) {
+		linetree_wrap(textbuffer, run.root);
+		linetree_remove(&run.root, first);
+		line_link(textbuffer->line_last, first->next);
+		textbuffer->line_root = linetree_merge(textbuffer->line_root, run.root);
+		textbuffer->line_last = run.last;
+	}
+	line_free(textbuffer, first);
+	return 0;
+}
+
+static void textbuffer_drop_snapshot(struct textbuffer *textbuffer);
+
+// Cut the text appended behind the tail into lines, once the tail is indexed. The pieces which could not be added
+// are dropped, and read again from the file by the next reload.
+static int textbuffer_index_appended(struct textbuffer *textbuffer)
+{
+	int fail = 0;
+	size_t i = 0;
+	for (; i < textbuffer->ntail_appended && !fail; i++) {
+		fail = textbuffer_append_lines(textbuffer, textbuffer->tail_appended[i]);
+	}
+	if (fail) {
+		for (i--; i < textbuffer->ntail_appended; i++) {
+			textbuffer->file_size -= slice_len(textbuffer->tail_appended[i]);
+		}
+		textbuffer_drop_snapshot(textbuffer);
+	}
+	textbuffer->ntail_appended = 0;
+	textbuffer->tail_appended_bytes = 0;
+	return fail;
+}
+
+static int textbuffer_index_tail_step(struct textbuffer *textbuffer, size_t budget)
+{
+	slice tail = textbuffer->unindexed_tail;
+	slice region = tail;
+	if (budget < slice_len(tail)) {
+		// Stop at the last newline within budget, or at the end of the first line if it is longer than budget.
+		char *newline_char = (char*) memrchr(tail.start, '\n', budget);
+		if (!newline_char) {
+			newline_char = (char*) memchr(tail.start + budget, '\n', slice_len(tail) - budget);
+		}
+		if (newline_char) {
+			region.stop = newline_char;
+			tail.start = newline_char + 1;
+		}
+	}
+	if (region.stop == tail.stop) {
+		tail = s(NULL, NULL);
+	}
+
+	struct linerun run;
+	int fail = textbuffer_index_text(textbuffer, region, &run);
+	if (fail) {
+		return fail;
+	}
+	line_link(textbuffer->line_last, run.first);
+	if (!textbuffer->line_first) {
+		textbuffer->line_first = run.first;
+	}
+	textbuffer_highlight_dirty(textbuffer, textbuffer->line_root ? textbuffer->line_root->count : 0);
+	// New lines are measured for the wrap width before they join the line tree.
+	linetree_wrap(textbuffer, run.root);
+	textbuffer->line_last = run.last;
+	textbuffer->line_root = linetree_merge(textbuffer->line_root, run.root);
+	textbuffer->unindexed_tail = tail;
+	if (!textbuffer_has_tail(textbuffer) && textbuffer->ntail_appended) {
+		return textbuffer_index_appended(textbuffer);
+	}
+	return 0;
+}
+
+static int textbuffer_index_head_step(struct textbuffer *textbuffer, size_t budget)
+{
+	slice head = textbuffer->unindexed_head;
+	slice region = head;
+	if (budget < slice_len(head)) {
+		// Start after the first newline within budget, or at the start of the last line if it is longer than budget.
+		char *chunk_start = head.stop - budget;
+		char *newline_char = (char*) memchr(chunk_start, '\n', budget);
+		if (!newline_char) {
+			newline_char = (char*) memrchr(head.start, '\n', chunk_start - head.start);
+		}
+		if (newline_char) {
+			region.start = newline_char + 1;
+			head.stop = newline_char;
+		}
+	}
+	if (region.start == head.start) {
+		head = s(NULL, NULL);
+	}
+
+	struct linerun run;
+	int fail = textbuffer_index_text(textbuffer, region, &run);
+	if (fail) {
+		return fail;
+	}
+	line_link(run.last, textbuffer->line_first);
+	textbuffer->line_first = run.first;
+	textbuffer_highlight_dirty(textbuffer, 0);
+	linetree_wrap(textbuffer, run.root);
+	textbuffer->line_root = linetree_merge(run.root, textbuffer->line_root);
+	textbuffer->unindexed_head = head;
+	return 0;
+}
+
+int textbuffer_index_step(struct textbuffer *textbuffer, size_t budget)
+{
+	// The tail comes first since scrolling down is the most common.
+	int fail = 0;
+	if (textbuffer_has_tail(textbuffer)) {
+		fail = textbuffer_index_tail_step(textbuffer, budget);
+	} else if (textbuffer_has_head(textbuffer)) {
+		fail = textbuffer_index_head_step(textbuffer, budget);
+	}
+	if (fail) {
+		return fail;
+	}
+	textbuffer_update_line_number(textbuffer);
+	return textbuffer_has_head(textbuffer) || textbuffer_has_tail(textbuffer);
+}
+
+int textbuffer_is_indexed(struct textbuffer *textbuffer)
+{
+	return !textbuffer_has_head(textbuffer) && !textbuffer_has_tail(textbuffer);
+}
+
+// Index lines before or after the indexed lines when the cursor reaches the first or last indexed line.
+static void textbuffer_index_around(struct textbuffer *textbuffer, struct line *line)
+{
+	int fail = 0;
+	if (line == textbuffer->line_first && textbuffer_has_head(textbuffer)) {
+		fail = textbuffer_index_head_step(textbuffer, textbuffer_index_step_budget);
+	}
+	if (line == textbuffer->line_last && textbuffer_has_tail(textbuffer)) {
+		fail = textbuffer_index_tail_step(textbuffer, textbuffer_index_step_budget);
+	}
+	if (!fail) {
+		textbuffer_update_line_number(textbuffer);
+	}
+}
+
+int textbuffer_load(const char *path, struct textbuffer *textbuffer)
+{
+	assert(path);
+	textbuffer_set_path(textbuffer, path);
+	textbuffer_init_storage(textbuffer);
+
+	int fd = open(textbuffer->path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	struct stat stat;
+	int r = fstat(fd, &stat);
+	if (r < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	// load file in chunk
+	int fail = 0;
+	ssize_t filesize = stat.st_size;
+	struct textchunk **chunk_emplace = &textbuffer->textchunk_head;
+	while (0 < filesize) {
+		struct textchunk *chunk = textchunk_alloc();
+		if (!chunk) {
+			fail = -ENOMEM;
+			break;
+		}
+		*chunk_emplace = chunk;
+		chunk_emplace = &chunk->next;
+		textbuffer->textchunk_last = chunk;
+
+		ssize_t r = read(fd, chunk->text, textchunk_datasize);
+		if (r < 0) {
+			fail = -errno;
+			break;
+		}
+		if (r == 0) {
+			// Broken invariant: the file was truncated while reading it.
+			fail = -EINVAL;
+			break;
+		}
+		chunk->cursor += r;
+		filesize -= r;
+	}
+
+	close(fd);
+	if (fail) {
+		return fail;
+	}
+
+	// cut the chunks into lines
+	fail = textbuffer_init_lines(textbuffer);
+	struct textchunk *chunk = textbuffer->textchunk_head;
+	while (chunk && !fail) {
+		fail = textbuffer_cut_lines(textbuffer, s(textchunk_begin(chunk), textchunk_end(chunk)));
+		chunk = chunk->next;
+	}
+	if (!fail) {
+		textbuffer->line_root = linetree_build(textbuffer->line_first, textbuffer->line_number);
+	}
+	return fail;
+}
+
+int textbuffer_load_mapped(const char *path, struct textbuffer *textbuffer)
+{
+	assert(path);
+	textbuffer_set_path(textbuffer, path);
+	textbuffer_init_storage(textbuffer);
+
+	int fail = mapped_file_load(&textbuffer->file, textbuffer->path);
+	if (fail) {
+		return fail;
+	}
+	textbuffer->pristine = 1;
+
+	// Only the newline scan touches the mapping: pages are faulted in by the scan and never copied.
+	fail = textbuffer_index_mapped(textbuffer);
+	if (!fail) {
+		textbuffer_init_cursor(textbuffer);
+	}
+	return fail;
+}
+
+int textbuffer_load_lazy(const char *path, struct textbuffer *textbuffer, size_t offset)
+{
+	assert(path);
+	textbuffer_set_path(textbuffer, path);
+	textbuffer_init_storage(textbuffer);
+
+	int fail = mapped_file_load(&textbuffer->file, textbuffer->path);
+	if (fail) {
+		return fail;
+	}
+	textbuffer->pristine = 1;
+	slice data = textbuffer->file.data;
+	if (slice_len(data) <= textbuffer_index_step_budget) {
+		fail = textbuffer_index_mapped(textbuffer);
+		if (!fail) {
+			textbuffer_init_cursor(textbuffer);
+		}
+		return fail;
+	}
+
+	// Index the lines starting with the line containing 'offset', the rest of the file is indexed later.
+	offset = min(offset, slice_len(data));
+	char *region_start = data.start;
+	char *newline_char = (char*) memrchr(data.start, '\n', offset);
+	if (newline_char) {
+		textbuffer->unindexed_head = s(data.start, newline_char);
+		region_start = newline_char + 1;
+	}
+	textbuffer->unindexed_tail = s(region_start, data.stop);
+
+	fail = textbuffer_index_tail_step(textbuffer, textbuffer_index_first_budget);
+	if (fail) {
+		return fail;
+	}
+	textbuffer_update_line_number(textbuffer);
+	textbuffer_init_cursor(textbuffer);
+	return 0;
+}
+
+// Snapshots:
+//	The first snapshot walks all lines to collect their fragments, with the unindexed head and tail of lazily loaded
+//	files as single pieces. The textbuffer then records every change it applies as long as it keeps a snapshot, and
+//	the next snapshot is derived from the last one and these changes. Offsets of changes are computed only while a
+//	snapshot is kept. When the changes get too many, or a change fails halfway, the last snapshot is dropped and the
+//	next one walks all lines again.
+#define textbuffer_snapshot_changes_max 0x10000
+#define textbuffer_snapshot_sites_max Mega(1)
+
+static void textbuffer_drop_snapshot(struct textbuffer *textbuffer)
+{
+	if (textbuffer->snapshot) {
+		snapshot_release(textbuffer->snapshot);
+		textbuffer->snapshot = NULL;
+	}
+	textbuffer->nchanges = 0;
+	textbuffer->change_sets = 0;
+}
+
+// Make room for 'n' more changes, or drop the snapshot.
+static int textbuffer_reserve_changes(struct textbuffer *textbuffer, size_t n)
+{
+	size_t needed = textbuffer->nchanges + n;
+	if (textbuffer->change_sets == textbuffer_snapshot_changes_max || needed > (size_t) textbuffer_snapshot_sites_max) {
+		textbuffer_drop_snapshot(textbuffer);
+		return -1;
+	}
+	if (needed > textbuffer->changes_capacity) {
+		size_t capacity = max(max(2 * textbuffer->changes_capacity, (size_t) 64), needed);
+		struct snapshot_change *changes = (struct snapshot_change*) realloc(textbuffer->changes, capacity * sizeof(struct snapshot_change));
+		if_null(changes) {
+			textbuffer_drop_snapshot(textbuffer);
+			return -ENOMEM;
+		}
+		textbuffer->changes = changes;
+		textbuffer->changes_capacity = capacity;
+	}
+	textbuffer->change_sets++;
+	return 0;
+}
+
+static struct snapshot_change* textbuffer_last_batch(struct textbuffer *textbuffer)
+{
+	if (!textbuffer->nchanges) {
+		return NULL;
+	}
+	struct snapshot_change *batch = textbuffer->changes + textbuffer->last_batch;
+	if (textbuffer->last_batch >= textbuffer->nchanges || !batch->nsites || textbuffer->last_batch + 1 + batch->nsites != textbuffer->nchanges) {
+		return NULL;
+	}
+	return batch;
+}
+
+static void textbuffer_record_change(struct textbuffer *textbuffer, size_t offset, size_t deleted, slice inserted)
+{
+	if (!textbuffer->snapshot) {
+		return;
+	}
+	if (textbuffer->nchanges && !textbuffer_last_batch(textbuffer)) {
+		// Typing extends the last insertion.
+		struct snapshot_change *last = textbuffer->changes + textbuffer->nchanges - 1;
+		if (!deleted && offset == last->offset + slice_len(last->inserted) && last->inserted.stop == inserted.start) {
+			last->inserted.stop = inserted.stop;
+			return;
+		}
+	}
+	if (textbuffer_reserve_changes(textbuffer, 1)) {
+		return;
+	}
+	struct snapshot_change *change = textbuffer->changes + textbuffer->nchanges++;
+	change->offset = offset;
+	change->deleted = deleted;
+	change->inserted = inserted;
+	change->nsites = 0;
+}
+
+// Typing at every site of the last batch extends its insertions.
+static int textbuffer_extend_batch(struct textbuffer *textbuffer, struct snapshot_change *sites, size_t n)
+{
+	struct snapshot_change *batch = textbuffer_last_batch(textbuffer);
+	if (!batch || batch->nsites != n) {
+		return 0;
+	}
+	struct snapshot_change *last_sites = batch + 1;
+	size_t shift = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t inserted = slice_len(last_sites[i].inserted);
+		if (sites[i].deleted || sites[i].offset != last_sites[i].offset + shift + inserted || last_sites[i].inserted.stop != sites[i].inserted.start) {
+			return 0;
+		}
+		shift += inserted - last_sites[i].deleted;
+	}
+	for (size_t i = 0; i < n; i++) {
+		last_sites[i].inserted.stop = sites[i].inserted.stop;
+	}
+	return 1;
+}
+
+static void textbuffer_record_batch(struct textbuffer *textbuffer, struct snapshot_change *sites, size_t n)
+{
+	if (!textbuffer->snapshot || textbuffer_extend_batch(textbuffer, sites, n) || textbuffer_reserve_changes(textbuffer, n + 1)) {
+		return;
+	}
+	textbuffer->last_batch = textbuffer->nchanges;
+	struct snapshot_change *batch = textbuffer->changes + textbuffer->nchanges;
+	batch->offset = sites[0].offset;
+	batch->deleted = 0;
+	batch->inserted = s(NULL, NULL);
+	batch->nsites = n;
+	memcpy(batch + 1, sites, n * sizeof(struct snapshot_change));
+	textbuffer->nchanges += n + 1;
+}
+
+static struct textbuffer_snapshot* textbuffer_snapshot_collect(struct textbuffer *textbuffer)
+{
+	struct textbuffer_snapshot *snapshot = snapshot_new();
+	if_null(snapshot) {
+		return NULL;
+	}
+	if (textbuffer->pristine) {
+		// The text is the mapped file, lines do not need to be walked.
+		snapshot_append(snapshot, textbuffer->file.data);
+	} else {
+		if (textbuffer_has_head(textbuffer)) {
+			snapshot_append(snapshot, textbuffer->unindexed_head);
+			snapshot_append_newline(snapshot, textbuffer_stored_newline(textbuffer, textbuffer->unindexed_head));
+		}
+		for (struct line *line = textbuffer->line_first; line; line = line->next) {
+			struct textpiece *last = line->fragments;
+			for (struct textpiece *fragment = line->fragments; fragment; fragment = fragment->next) {
+				snapshot_append(snapshot, fragment->slice);
+				last = fragment;
+			}
+			if (line->next || textbuffer_has_tail(textbuffer)) {
+				snapshot_append_newline(snapshot, textbuffer_stored_newline(textbuffer, last->slice));
+			}
+		}
+		if (textbuffer_has_tail(textbuffer)) {
+			snapshot_append(snapshot, textbuffer->unindexed_tail);
+			for (size_t i = 0; i < textbuffer->ntail_appended; i++) {
+				snapshot_append(snapshot, textbuffer->tail_appended[i]);
+			}
+		}
+	}
+	if (snapshot_finish(snapshot)) {
+		snapshot_release(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+struct textbuffer_snapshot* textbuffer_snapshot(struct textbuffer *textbuffer)
+{
+	if (!textbuffer->epoch) {
+		textbuffer->epoch = (struct textbuffer_epoch*) calloc(1, sizeof(struct textbuffer_epoch));
+		if_null(textbuffer->epoch) {
+			return NULL;
+		}
+		textbuffer->epoch->refs = 1;
+	}
+	struct textbuffer_snapshot *snapshot = textbuffer->snapshot;
+	if (!snapshot) {
+		snapshot = textbuffer_snapshot_collect(textbuffer);
+	} else if (textbuffer->nchanges) {
+		snapshot = snapshot_derive(snapshot, textbuffer->changes, textbuffer->nchanges);
+	} else {
+		snapshot_acquire(snapshot);
+	}
+	textbuffer_drop_snapshot(textbuffer);
+	if_null(snapshot) {
+		return NULL;
+	}
+	assert(snapshot->bytes == textbuffer_bytelen(textbuffer));
+	if (!snapshot->epoch) {
+		__atomic_add_fetch(&textbuffer->epoch->refs, 1, __ATOMIC_RELAXED);
+		snapshot->epoch = textbuffer->epoch;
+	}
+	// One reference is kept by the textbuffer to derive the next snapshot.
+	snapshot_acquire(snapshot);
+	textbuffer->snapshot = snapshot;
+	return snapshot;
+}
+
+void textbuffer_epoch_release(struct textbuffer_epoch *epoch)
+{
+	while (epoch && __atomic_sub_fetch(&epoch->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (size_t i = 0; i < epoch->nfiles; i++) {
+			mapped_file_unload(epoch->files + i);
+		}
+		free(epoch->files);
+		struct textbuffer_epoch *next = epoch->next;
+		free(epoch);
+		epoch = next;
+	}
+}
+
+// Hand 'n' retired files over to the current epoch and start the next one, see struct textbuffer_epoch.
+// Returns 0, or -ENOMEM and the files stay with the textbuffer.
+static int textbuffer_end_epoch(struct textbuffer *textbuffer, struct mapped_file *files, size_t n)
+{
+	struct textbuffer_epoch *epoch = textbuffer->epoch;
+	if (!epoch) {
+		// No snapshot was ever taken.
+		for (size_t i = 0; i < n; i++) {
+			mapped_file_unload(files + i);
+		}
+		return 0;
+	}
+	struct textbuffer_epoch *next = (struct textbuffer_epoch*) calloc(1, sizeof(struct textbuffer_epoch));
+	struct mapped_file *handed = (struct mapped_file*) malloc(n * sizeof(struct mapped_file));
+	if (!next || !handed) {
+		free(next);
+		free(handed);
+		return -ENOMEM;
+	}
+	memcpy(handed, files, n * sizeof(struct mapped_file));
+	epoch->files = handed;
+	epoch->nfiles = n;
+	// The next epoch is held by the textbuffer, and by this one until its snapshots are released.
+	next->refs = 2;
+	epoch->next = next;
+	textbuffer->epoch = next;
+	textbuffer_drop_snapshot(textbuffer);
+	textbuffer_epoch_release(epoch);
+	return 0;
+}
+
+static int slice_points_into(slice text, slice file)
+{
+	return file.start <= text.start && text.start <= file.stop;
+}
+
+// Whether the text or the journal can still point into 'file'. Empty slices count too, since their position is used
+// to find the newline stored after them.
+static int textbuffer_points_into(struct textbuffer *textbuffer, slice file)
+{
+	if (slice_points_into(textbuffer->unindexed_head, file) || slice_points_into(textbuffer->unindexed_tail, file)) {
+		return 1;
+	}
+	for (struct line *line = textbuffer->line_first; line; line = line->next) {
+		for (struct textpiece *fragment = line->fragments; fragment; fragment = fragment->next) {
+			if (slice_points_into(fragment->slice, file)) {
+				return 1;
+			}
+		}
+	}
+	for (size_t i = 0; i < textbuffer->journal.nslices; i++) {
+		if (slice_points_into(textbuffer->journal.slices[i], file)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Hand the retired files which neither the text nor the journal point into anymore over to the current epoch.
+static void textbuffer_release_files(struct textbuffer *textbuffer)
+{
+	textbuffer->retired_dropped = textbuffer->journal.dropped;
+	// The files still pointed into are moved first.
+	size_t kept = 0;
+	for (size_t i = 0; i < textbuffer->nretired_files; i++) {
+		if (textbuffer_points_into(textbuffer, textbuffer->retired_files[i].data)) {
+			struct mapped_file file = textbuffer->retired_files[i];
+			textbuffer->retired_files[i] = textbuffer->retired_files[kept];
+			textbuffer->retired_files[kept++] = file;
+		}
+	}
+	if (kept < textbuffer->nretired_files &&
+			!textbuffer_end_epoch(textbuffer, textbuffer->retired_files + kept, textbuffer->nretired_files - kept)) {
+		textbuffer->nretired_files = kept;
+	}
+}
+
+// Finish recording an edit. Edits leaving the journal can be the last ones pointing into a retired file.
+static void textbuffer_end_edit(struct textbuffer *textbuffer, int type, size_t len)
+{
+	journal_end_edit(&textbuffer->journal, type, len);
+	if (textbuffer->nretired_files && textbuffer->journal.dropped != textbuffer->retired_dropped) {
+		textbuffer_release_files(textbuffer);
+	}
+}
+
+int textbuffer_search(struct cursor *cursor, slice needle, int backward)
+{
+	struct textbuffer_snapshot *snapshot = textbuffer_snapshot(cursor->textbuffer);
+	if_null(snapshot) {
+		return -ENOMEM;
+	}
+	size_t offset = cursor_offset(cursor);
+	size_t match;
+	int found = snapshot_find(snapshot, needle, backward ? offset : offset + 1, backward, &match);
+	snapshot_release(snapshot);
+	if (found > 0) {
+		cursor_goto_offset(cursor, match);
+	}
+	return found;
+}
+
+int textbuffer_search_regexp(struct cursor *cursor, struct regexp *re, int backward, size_t *len)
+{
+	struct textbuffer_snapshot *snapshot = textbuffer_snapshot(cursor->textbuffer);
+	if_null(snapshot) {
+		return -ENOMEM;
+	}
+	size_t offset = cursor_offset(cursor);
+	size_t start;
+	size_t end;
+	int found = snapshot_find_regexp(snapshot, re, backward ? offset : offset + 1, backward, &start, &end);
+	snapshot_release(snapshot);
+	if (found > 0) {
+		cursor_goto_offset(cursor, start);
+		*len = end - start;
+	}
+	return found;
+}
+
+// Saving:
+//	The text to save is a snapshot, written from the calling thread or from a background task while editing
+//	continues. Textchunks and the mapping are only released by textbuffer_free(), which waits for a running save.
+
+struct textbuffer_save_job {
+	struct worker_task task;
+	struct file_writer writer;
+	struct textbuffer_snapshot *snapshot;
+	int source_fd;
+	int flags;
+	int own_path;
+	int fail;
+};
+
+static void textbuffer_save_job_free(struct textbuffer_save_job *job)
+{
+	if (job->source_fd >= 0) {
+		close(job->source_fd);
+	}
+	if (job->snapshot) {
+		snapshot_release(job->snapshot);
+	}
+	free(job);
+}
+
+static struct textbuffer_save_job* textbuffer_save_prepare(struct textbuffer *textbuffer, const char *path, int flags, int *fail)
+{
+	if_null(path) {
+		path = textbuffer->path;
+	}
+	if_null(path) {
+		*fail = -EINVAL;
+		return NULL;
+	}
+	struct textbuffer_save_job *job = (struct textbuffer_save_job*) calloc(1, sizeof(struct textbuffer_save_job));
+	if_null(job) {
+		*fail = -ENOMEM;
+		return NULL;
+	}
+	job->flags = flags;
+	job->source_fd = -1;
+	job->own_path = !strcmp(path, textbuffer->path);
+	job->snapshot = textbuffer_snapshot(textbuffer);
+	job->fail = job->snapshot ? file_writer_open(&job->writer, path) : -ENOMEM;
+	if (job->fail) {
+		*fail = job->fail;
+		textbuffer_save_job_free(job);
+		return NULL;
+	}
+	// The unmodified parts of a mapped file are copied from the file when it has not changed since it was mapped.
+	job->source_fd = mapped_file_open_unchanged(&textbuffer->file);
+	if (job->source_fd >= 0) {
+		file_writer_set_source(&job->writer, job->source_fd, textbuffer->file.data);
+	}
+	return job;
+}
+
+static void textbuffer_save_run(void *ctx)
+{
+	struct textbuffer_save_job *job = (struct textbuffer_save_job*) ctx;
+	struct file_writer *writer = &job->writer;
+	struct snapshot_iterator iterator;
+	snapshot_iterator_init(&iterator, job->snapshot);
+	slice piece;
+	while (!writer->fail && snapshot_iterator_next(&iterator, &piece)) {
+		file_writer_append(writer, piece);
+	}
+	if (writer->fail) {
+		job->fail = writer->fail;
+		file_writer_abort(writer);
+	} else {
+		job->fail = file_writer_commit(writer, job->flags);
+	}
+}
+
+int textbuffer_save(struct textbuffer *textbuffer, const char *path, int flags)
+{
+	int fail = 0;
+	struct textbuffer_save_job *job = textbuffer_save_prepare(textbuffer, path, flags, &fail);
+	if_null(job) {
+		return fail;
+	}
+	textbuffer_save_run(job);
+	fail = job->fail;
+	if (!fail && job->own_path) {
+		textbuffer_update_identity(textbuffer);
+	}
+	textbuffer_save_job_free(job);
+	return fail;
+}
+
+int textbuffer_save_async(struct textbuffer *textbuffer, const char *path, int flags)
+{
+	if (textbuffer->save_job) {
+		return -EBUSY;
+	}
+	int fail = 0;
+	struct textbuffer_save_job *job = textbuffer_save_prepare(textbuffer, path, flags, &fail);
+	if_null(job) {
+		return fail;
+	}
+	fail = worker_start(&job->task, textbuffer_save_run, job);
+	if (fail) {
+		file_writer_abort(&job->writer);
+		textbuffer_save_job_free(job);
+		return fail;
+	}
+	textbuffer->save_job = job;
+	textbuffer->save_result = 0;
+	return 0;
+}
+
+static void textbuffer_save_finish(struct textbuffer *textbuffer)
+{
+	struct textbuffer_save_job *job = textbuffer->save_job;
+	worker_join(&job->task);
+	textbuffer->save_result = job->fail;
+	textbuffer->save_job = NULL;
+	if (!job->fail && job->own_path) {
+		textbuffer_update_identity(textbuffer);
+	}
+	textbuffer_save_job_free(job);
+}
+
+int textbuffer_save_poll(struct textbuffer *textbuffer)
+{
+	if (!textbuffer->save_job || !worker_is_done(&textbuffer->save_job->task)) {
+		return 0;
+	}
+	textbuffer_save_finish(textbuffer);
+	return 1;
+}
+
+void textbuffer_save_status(struct textbuffer *textbuffer, struct textbuffer_save_status *status)
+{
+	memset(status, 0, sizeof(struct textbuffer_save_status));
+	struct textbuffer_save_job *job = textbuffer->save_job;
+	status->result = textbuffer->save_result;
+	if (job) {
+		status->running = 1;
+		status->bytes = job->snapshot->bytes;
+		status->written = __atomic_load_n(&job->writer.written, __ATOMIC_RELAXED);
+	}
+}
+
+void textbuffer_free(struct textbuffer *textbuffer)
+{
+	assert(textbuffer);
+	if (textbuffer->save_job) {
+		textbuffer_save_finish(textbuffer);
+	}
+	textbuffer_unregister(textbuffer);
+	textbuffer_drop_snapshot(textbuffer);
+	free(textbuffer->changes);
+	free(textbuffer->tail_appended);
+	free(textbuffer->path);
+	if (textbuffer->textchunk_head) {
+		textchunk_free(textbuffer->textchunk_head); // CHECK: should this memory be zeroed ??
+	}
+	mapped_file_unload(&textbuffer->file);
+	for (size_t i = 0; i < textbuffer->nretired_files; i++) {
+		mapped_file_unload(textbuffer->retired_files + i);
+	}
+	free(textbuffer->retired_files);
+	textbuffer_epoch_release(textbuffer->epoch);
+	textbuffer_free_columns(textbuffer);
+	slab_reset(&textbuffer->line_slab);
+	slab_reset(&textbuffer->textpiece_slab);
+	slab_reset(&textbuffer->cursor_slab);
+	journal_free(&textbuffer->journal);
+	memset(textbuffer, 0, sizeof(struct textbuffer));
+}
+
+struct textbuffer* textbuffer_open(const char *path, int *fail)
+{
+	*fail = 0;
+	char *canonical_path = realpath(path, NULL);
+	if_null(canonical_path) {
+		*fail = -errno;
+		return NULL;
+	}
+	struct textbuffer *textbuffer = textbuffer_find_path(canonical_path);
+	struct stat file_stat;
+	if (!textbuffer && stat(canonical_path, &file_stat) == 0) {
+		textbuffer = textbuffer_find_file(file_stat.st_dev, file_stat.st_ino);
+	}
+	if (textbuffer) {
+		free(canonical_path);
+		textbuffer->open_count++;
+		return textbuffer;
+	}
+
+	textbuffer = (struct textbuffer*) calloc(1, sizeof(struct textbuffer));
+	if_null(textbuffer) {
+		free(canonical_path);
+		*fail = -ENOMEM;
+		return NULL;
+	}
+	*fail = textbuffer_load_lazy(canonical_path, textbuffer, 0);
+	free(canonical_path);
+	if (!*fail) {
+		textbuffer_set_identity(textbuffer, &textbuffer->file.file_stat);
+		*fail = textbuffer_register(textbuffer);
+	}
+	if (*fail) {
+		textbuffer_free(textbuffer);
+		free(textbuffer);
+		return NULL;
+	}
+	textbuffer->open_count = 1;
+	return textbuffer;
+}
+
+struct textbuffer* textbuffer_find(const char *path)
+{
+	char *canonical_path = realpath(path, NULL);
+	if_null(canonical_path) {
+		return NULL;
+	}
+	struct textbuffer *textbuffer = textbuffer_find_path(canonical_path);
+	struct stat file_stat;
+	if (!textbuffer && stat(canonical_path, &file_stat) == 0) {
+		textbuffer = textbuffer_find_file(file_stat.st_dev, file_stat.st_ino);
+	}
+	free(canonical_path);
+	return textbuffer;
+}
+
+void textbuffer_close(struct textbuffer *textbuffer)
+{
+	assert(textbuffer->registered && textbuffer->open_count > 0);
+	if (--textbuffer->open_count) {
+		return;
+	}
+	textbuffer_free(textbuffer);
+	free(textbuffer);
+}
+
+size_t textbuffer_registry_count()
+{
+	return textbuffer_tables[TEXTBUFFER_KEY_PATH].count;
+}
+
+size_t textbuffer_bytelen(struct textbuffer *textbuffer)
+{
+	if (!textbuffer->line_root) {
+		return 0;
+	}
+	size_t bytelen = textbuffer_head_bytelen(textbuffer) + textbuffer->line_root->bytes;
+	if (textbuffer_has_tail(textbuffer)) {
+		return bytelen + slice_len(textbuffer->unindexed_tail) + textbuffer->tail_appended_bytes;
+	}
+	// The last line is not followed by a newline.
+	return bytelen - 1;
+}
+
+void textbuffer_get_stats(struct textbuffer *textbuffer, struct textbuffer_stats *stats)
+{
+	memset(stats, 0, sizeof(struct textbuffer_stats));
+	stats->lines = textbuffer->line_slab.used;
+	stats->textpieces = textbuffer->textpiece_slab.used;
+	stats->line_bytes = textbuffer->line_slab.bytes;
+	stats->textpiece_bytes = textbuffer->textpiece_slab.bytes;
+	for (struct textchunk *chunk = textbuffer->textchunk_head; chunk; chunk = chunk->next) {
+		stats->textchunks++;
+		stats->textchunk_bytes += textchunk_size;
+	}
+	stats->mapped_bytes = slice_len(textbuffer->file.data);
+	for (size_t i = 0; i < textbuffer->nretired_files; i++) {
+		stats->mapped_bytes += slice_len(textbuffer->retired_files[i].data);
+	}
+	stats->history_bytes = journal_bytes(&textbuffer->journal);
+}
+
+struct cursor cursor_copy(struct cursor *cursor)
+{
+	struct cursor copy = *cursor;
+	copy.tracked = 0;
+	copy.line_prev = NULL;
+	copy.line_next = NULL;
+	copy.prev = NULL;
+	copy.next = NULL;
+	return copy;
+}
+
+size_t cursor_to_string(struct cursor *cursor, char *buffer, size_t size)
+{
+	assert(size);
+	size_t skip = cursor->x_offset_actual;
+	size_t len = 0;
+	struct textpiece *fragment = cursor->line->fragments;
+	while (fragment && len < size - 1) {
+		size_t fragment_len = slice_len(fragment->slice);
+		if (skip < fragment_len) {
+			size_t n = min(fragment_len - skip, size - 1 - len);
+			memcpy(buffer + len, fragment->slice.start + skip, n);
+			len += n;
+			skip = 0;
+		} else {
+			skip -= fragment_len;
+		}
+		fragment = fragment->next;
+	}
+	buffer[len] = 0;
+	return len;
+}
+
+int cursor_lineno(struct cursor *cursor)
+{
+	return textbuffer_estimated_head_lines(cursor->textbuffer) + line_index(cursor->line) + 1;
+}
+
+struct line* cursor_prev_line(struct cursor *cursor)
+{
+	textbuffer_index_around(cursor->textbuffer, cursor->line);
+	struct line *prev = cursor->line->prev;
+	if (prev) {
+		size_t column = cursor_want_column(cursor);
+		cursor_set_line(cursor, prev);
+		cursor->x_offset_actual = line_x_at_column(cursor->textbuffer, prev, column);
+	}
+	return prev;
+}
+
+struct line* cursor_next_line(struct cursor *cursor)
+{
+	textbuffer_index_around(cursor->textbuffer, cursor->line);
+	struct line *next = cursor->line->next;
+	if (next) {
+		size_t column = cursor_want_column(cursor);
+		cursor_set_line(cursor, next);
+		cursor->x_offset_actual = line_x_at_column(cursor->textbuffer, next, column);
+	}
+	return next;
+}
+
+int cursor_next_char(struct cursor *cursor)
+{
+	size_t x = line_next_char(cursor->line, cursor->x_offset_actual);
+	if (x == (size_t) cursor->x_offset_actual) {
+		return 0;
+	}
+	cursor_set_x(cursor, x);
+	return 1;
+}
+
+int cursor_prev_char(struct cursor *cursor)
+{
+	if (!cursor->x_offset_actual) {
+		return 0;
+	}
+	cursor_set_x(cursor, line_prev_char(cursor->line, cursor->x_offset_actual));
+	return 1;
+}
+
+// Jumping into the unindexed head or tail indexes it up to the jump target.
+void cursor_goto_line(struct cursor *cursor, size_t lineno)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	while (lineno <= textbuffer_estimated_head_lines(textbuffer) && textbuffer_has_head(textbuffer)) {
+		if (textbuffer_index_head_step(textbuffer, textbuffer_index_step_budget)) {
+			break;
+		}
+		textbuffer_update_line_number(textbuffer);
+	}
+	size_t head_lines = textbuffer_estimated_head_lines(textbuffer);
+	while (head_lines + textbuffer->line_root->count < lineno && textbuffer_has_tail(textbuffer)) {
+		if (textbuffer_index_tail_step(textbuffer, textbuffer_index_step_budget)) {
+			break;
+		}
+		textbuffer_update_line_number(textbuffer);
+	}
+
+	size_t index = lineno > head_lines ? lineno - head_lines - 1 : 0;
+	index = min(index, textbuffer->line_root->count - 1);
+	size_t column = cursor_want_column(cursor);
+	cursor_set_line(cursor, linetree_at(textbuffer->line_root, index));
+	cursor->x_offset_actual = line_x_at_column(textbuffer, cursor->line, column);
+}
+
+void cursor_goto_offset(struct cursor *cursor, size_t offset)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	offset = min(offset, textbuffer_bytelen(textbuffer));
+	while (offset < textbuffer_head_bytelen(textbuffer)) {
+		if (textbuffer_index_head_step(textbuffer, textbuffer_index_step_budget)) {
+			break;
+		}
+	}
+	while (textbuffer_head_bytelen(textbuffer) + textbuffer->line_root->bytes <= offset && textbuffer_has_tail(textbuffer)) {
+		if (textbuffer_index_tail_step(textbuffer, textbuffer_index_step_budget)) {
+			break;
+		}
+	}
+	textbuffer_update_line_number(textbuffer);
+
+	size_t offset_in_line = 0;
+	size_t head_bytelen = textbuffer_head_bytelen(textbuffer);
+	offset = min(max(offset, head_bytelen), head_bytelen + textbuffer->line_root->bytes - 1) - head_bytelen;
+	cursor_set_line(cursor, linetree_at_offset(textbuffer->line_root, offset, &offset_in_line));
+	cursor_set_x(cursor, offset_in_line);
+}
+
+size_t cursor_offset(struct cursor *cursor)
+{
+	return textbuffer_head_bytelen(cursor->textbuffer) + line_offset(cursor->line) + cursor->x_offset_actual;
+}
+
+size_t cursor_row(struct cursor *cursor)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	if (!textbuffer->wrap_width) {
+		return line_index(cursor->line);
+	}
+	return line_row(cursor->line) + line_wrap_row(textbuffer, cursor->line, cursor->x_offset_actual);
+}
+
+void cursor_goto_row(struct cursor *cursor, size_t row)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	if (!textbuffer->wrap_width) {
+		cursor_set_line(cursor, linetree_at(textbuffer->line_root, min(row, textbuffer->line_root->count - 1)));
+		cursor_set_x(cursor, 0);
+		return;
+	}
+	size_t row_in_line = 0;
+	struct line *line = textbuffer->line_last;
+	if (row < textbuffer->line_root->rows) {
+		line = linetree_at_row(textbuffer->line_root, row, &row_in_line);
+	}
+	cursor_set_line(cursor, line);
+	cursor_set_x(cursor, row_in_line ? line_x_at_column(textbuffer, line, row_in_line * textbuffer->wrap_width) : 0);
+}
+
+// Add an empty textchunk after the last one. Returns NULL when out of memory.
+static struct textchunk* textbuffer_add_textchunk(struct textbuffer *textbuffer)
+{
+	struct textchunk *chunk = textchunk_alloc();
+	if_null(chunk) {
+		return NULL;
+	}
+	if (textbuffer->textchunk_last) {
+		textbuffer->textchunk_last->next = chunk;
+	} else {
+		textbuffer->textchunk_head = chunk;
+	}
+	textbuffer->textchunk_last = chunk;
+	return chunk;
+}
+
+// Append text at the end of the last textchunk, or in a new textchunk when the last one is full.
+// Returns the stored text, which is shorter than 'text' when it does not fit in the textchunk, or a null slice.
+// With 'contiguous', text which does not fit in the last textchunk but fits in a new one is stored entirely there.
+static slice textbuffer_store_text(struct textbuffer *textbuffer, slice text, int contiguous)
+{
+	struct textchunk *chunk = textbuffer->textchunk_last;
+	size_t available = chunk ? textchunk_datasize - chunk->cursor : 0;
+	if (!available || (contiguous && available < slice_len(text) && slice_len(text) <= textchunk_datasize)) {
+		chunk = textbuffer_add_textchunk(textbuffer);
+		if_null(chunk) {
+			return s(NULL, NULL);
+		}
+	}
+	size_t len = min(slice_len(text), textchunk_datasize - chunk->cursor);
+	char *start = textchunk_end(chunk);
+	memcpy(start, text.start, len);
+	chunk->cursor += len;
+	return s(start, start + len);
+}
+
+static struct textpiece* line_insert_textpiece_after(struct textbuffer *textbuffer, struct textpiece *at, slice fragment)
+{
+	struct textpiece *textpiece = (struct textpiece*) slab_alloc(&textbuffer->textpiece_slab);
+	if_null(textpiece) {
+		return NULL;
+	}
+	textpiece->slice = fragment;
+	textpiece->next = at->next;
+	at->next = textpiece;
+	return textpiece;
+}
+
+// Find the fragment containing byte offset 'x' of a line, preferring the fragment ending at 'x' on fragment
+// boundaries. 'fragment_start' receives the offset of the fragment in the line.
+static struct textpiece* line_find_fragment(struct line *line, size_t x, size_t *fragment_start)
+{
+	size_t pos = 0;
+	struct textpiece *textpiece = line->fragments;
+	while (textpiece->next && pos + slice_len(textpiece->slice) < x) {
+		pos += slice_len(textpiece->slice);
+		textpiece = textpiece->next;
+	}
+	*fragment_start = pos;
+	return textpiece;
+}
+
+// Split the fragment containing byte offset 'x' so that 'x' is a fragment boundary, and return the fragment ending
+// at 'x'. When 'x' is 0 the first fragment is returned without splitting: it may start at 'x' instead.
+static struct textpiece* line_split_fragment(struct textbuffer *textbuffer, struct line *line, size_t x)
+{
+	size_t pos;
+	struct textpiece *textpiece = line_find_fragment(line, x, &pos);
+	char *split = textpiece->slice.start + (x - pos);
+	if (split != textpiece->slice.start && split != textpiece->slice.stop) {
+		if_null(line_insert_textpiece_after(textbuffer, textpiece, s(split, textpiece->slice.stop))) {
+			return NULL;
+		}
+		textpiece->slice.stop = split;
+	}
+	return textpiece;
+}
+
+// Insert 'fragment' at byte offset 'x' of a line. When the fragment ending at 'x' also ends where 'fragment' starts
+// in memory, as it happens when typing since inserted text is appended to the textchunks, it is extended in place.
+// The first fragment is always the inline fragment of the line, inserting before it swaps their content.
+static int line_insert_fragment(struct textbuffer *textbuffer, struct line *line, size_t x, slice fragment)
+{
+	if (!line->fragments) {
+		return line_append_fragment(textbuffer, line, fragment);
+	}
+	struct textpiece *textpiece = line_split_fragment(textbuffer, line, x);
+	if_null(textpiece) {
+		return -ENOMEM;
+	}
+	if (slice_empty(textpiece->slice)) {
+		textpiece->slice = fragment;
+	} else if (x == 0 && textpiece->slice.start != fragment.stop) {
+		if_null(line_insert_textpiece_after(textbuffer, textpiece, textpiece->slice)) {
+			return -ENOMEM;
+		}
+		textpiece->slice = fragment;
+	} else if (x == 0) {
+		textpiece->slice.start = fragment.start;
+	} else if (textpiece->slice.stop == fragment.start) {
+		textpiece->slice.stop = fragment.stop;
+	} else {
+		if_null(line_insert_textpiece_after(textbuffer, textpiece, fragment)) {
+			return -ENOMEM;
+		}
+	}
+	line->bytelen += slice_len(fragment);
+	line_update(textbuffer, line, x);
+	for (struct cursor *cursor = line->cursors; cursor; cursor = cursor->line_next) {
+		if ((size_t) cursor->x_offset_actual >= x) {
+			cursor_set_x(cursor, cursor->x_offset_actual + slice_len(fragment));
+		}
+	}
+	return 0;
+}
+
+// Split a line at byte offset 'x': the text after 'x' moves to a new line inserted after the line.
+static struct line* line_split(struct textbuffer *textbuffer, struct line *line, size_t x)
+{
+	struct line *new_line = line_alloc_empty(textbuffer);
+	if_null(new_line) {
+		return NULL;
+	}
+	struct textpiece *textpiece = line_split_fragment(textbuffer, line, x);
+	if_null(textpiece) {
+		slab_free(&textbuffer->line_slab, new_line);
+		return NULL;
+	}
+
+	// The fragments moving to the new line start after 'textpiece', or with it when it starts at 'x'.
+	struct textpiece *rest = textpiece->next;
+	if (x == 0 && !slice_empty(textpiece->slice)) {
+		rest = textpiece;
+	}
+	if (rest) {
+		new_line->inline_fragment = *rest;
+		if (rest == &line->inline_fragment) {
+			line->inline_fragment.slice = s(rest->slice.start, rest->slice.start);
+			line->inline_fragment.next = NULL;
+		} else {
+			textpiece->next = NULL;
+			slab_free(&textbuffer->textpiece_slab, rest);
+		}
+	} else {
+		new_line->inline_fragment.slice = s(textpiece->slice.stop, textpiece->slice.stop);
+	}
+	new_line->fragments = &new_line->inline_fragment;
+	new_line->bytelen = line->bytelen - x;
+	line->bytelen = x;
+
+	struct cursor *cursor = line->cursors;
+	while (cursor) {
+		struct cursor *next = cursor->line_next;
+		if ((size_t) cursor->x_offset_actual >= x) {
+			cursor_set_line(cursor, new_line);
+			cursor_set_x(cursor, cursor->x_offset_actual - x);
+		}
+		cursor = next;
+	}
+
+	// The line after was lexed from the end state of the whole line, which is now the end of the new line.
+	new_line->lexer_state = line->lexer_state;
+	new_line->lexer_dirty = 1;
+	line_wrap_update(textbuffer, new_line);
+	line_update(textbuffer, line, x);
+	line_insert_after(textbuffer, line, new_line);
+	return new_line;
+}
+
+// Insert 'text', stored in a textchunk or in the mapped file, at the cursor and move the cursor after it.
+// Newlines split lines. The inserted text is recorded in the journal.
+static int textbuffer_insert_slice(struct cursor *cursor, slice text)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	textbuffer->pristine = 0;
+	struct line *line = cursor->line;
+	size_t x = cursor->x_offset_actual;
+	size_t offset = textbuffer->snapshot ? cursor_offset(cursor) : 0;
+	int fail = 0;
+	slice inserted = text;
+
+	while (!fail) {
+		char *newline_char = (char*) memchr(text.start, '\n', slice_len(text));
+		slice fragment = s(text.start, newline_char ? newline_char : text.stop);
+		if (!slice_empty(fragment)) {
+			fail = line_insert_fragment(textbuffer, line, x, fragment);
+			if (fail) {
+				break;
+			}
+			journal_add_slice(&textbuffer->journal, fragment);
+			x += slice_len(fragment);
+		}
+		if (!newline_char) {
+			break;
+		}
+		struct line *next = line_split(textbuffer, line, x);
+		if_null(next) {
+			fail = -ENOMEM;
+			break;
+		}
+		journal_add_newline(&textbuffer->journal, newline_char);
+		line = next;
+		x = 0;
+		text.start = newline_char + 1;
+	}
+
+	if (fail) {
+		textbuffer_drop_snapshot(textbuffer);
+	} else {
+		textbuffer_record_change(textbuffer, offset, 0, inserted);
+	}
+	cursor_set_line(cursor, line);
+	cursor_set_x(cursor, x);
+	return fail;
+}
+
+static void cursor_clamp_x(struct cursor *cursor)
+{
+	cursor->x_offset_actual = min((size_t) max(cursor->x_offset_actual, 0), cursor->line->bytelen);
+}
+
+// Insert text already stored in a textchunk at a cursor, which is at 'offset'.
+static int textbuffer_insert_stored(struct cursor *cursor, size_t offset, slice stored)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	journal_begin_edit(&textbuffer->journal, offset);
+	int fail = textbuffer_insert_slice(cursor, stored);
+	size_t len = fail ? cursor_offset(cursor) - offset : slice_len(stored);
+	textbuffer_end_edit(textbuffer, JOURNAL_INSERT, len);
+	return fail;
+}
+
+int textbuffer_insert(struct cursor *cursor, slice text)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	cursor_clamp_x(cursor);
+	size_t offset = cursor_offset(cursor);
+	journal_begin_edit(&textbuffer->journal, offset);
+
+	int fail = 0;
+	while (!slice_empty(text) && !fail) {
+		slice stored = textbuffer_store_text(textbuffer, text, 0);
+		if (!stored.start) {
+			fail = -ENOMEM;
+			break;
+		}
+		text.start += slice_len(stored);
+		fail = textbuffer_insert_slice(cursor, stored);
+	}
+
+	textbuffer_end_edit(textbuffer, JOURNAL_INSERT, cursor_offset(cursor) - offset);
+	return fail;
+}
+
+// Remove the bytes [x, x + len) of a line, and record them in the journal.
+static int line_remove_range(struct textbuffer *textbuffer, struct line *line, size_t x, size_t len)
+{
+	if (!len) {
+		return 0;
+	}
+	if_null(line_split_fragment(textbuffer, line, x + len)) {
+		return -ENOMEM;
+	}
+	struct textpiece *before = line_split_fragment(textbuffer, line, x);
+	if_null(before) {
+		return -ENOMEM;
+	}
+
+	// Both ends of the range are fragment boundaries now: the range is made of whole fragments.
+	struct textpiece *first = x == 0 ? line->fragments : before->next;
+	struct textpiece *after = first;
+	size_t removed = 0;
+	while (removed < len) {
+		journal_add_slice(&textbuffer->journal, after->slice);
+		removed += slice_len(after->slice);
+		after = after->next;
+	}
+	struct textpiece *textpiece = first;
+	while (textpiece != after) {
+		struct textpiece *next = textpiece->next;
+		if (textpiece != &line->inline_fragment) {
+			slab_free(&textbuffer->textpiece_slab, textpiece);
+		}
+		textpiece = next;
+	}
+
+	if (x > 0) {
+		before->next = after;
+	} else if (after) {
+		// The first fragment was removed: the next one moves into the inline fragment.
+		line->inline_fragment = *after;
+		slab_free(&textbuffer->textpiece_slab, after);
+	} else {
+		line->inline_fragment.slice = s(line->inline_fragment.slice.stop, line->inline_fragment.slice.stop);
+		line->inline_fragment.next = NULL;
+	}
+	line->bytelen -= len;
+	line_update(textbuffer, line, x);
+	for (struct cursor *cursor = line->cursors; cursor; cursor = cursor->line_next) {
+		size_t cursor_x = cursor->x_offset_actual;
+		if (cursor_x > x) {
+			cursor_set_x(cursor, cursor_x < x + len ? x : cursor_x - len);
+		}
+	}
+	return 0;
+}
+
+// Remove the newline at the end of a line: the fragments of the next line move to the end of the line, and the next
+// line is removed. The newline is recorded in the journal, 'newline_char' is where it is stored or NULL.
+static int line_join_next(struct textbuffer *textbuffer, struct line *line, char *newline_char)
+{
+	struct line *next = line->next;
+	struct textpiece *last = line->fragments;
+	while (last->next) {
+		last = last->next;
+	}
+
+	// Only the inline fragment of the next line needs to be copied, other fragments are just relinked.
+	slice first = next->inline_fragment.slice;
+	if (slice_empty(first)) {
+	} else if (slice_empty(last->slice)) {
+		last->slice = first;
+	} else if (last->slice.stop == first.start) {
+		last->slice.stop = first.stop;
+	} else {
+		last = line_insert_textpiece_after(textbuffer, last, first);
+		if_null(last) {
+			return -ENOMEM;
+		}
+	}
+	last->next = next->inline_fragment.next;
+	next->inline_fragment.next = NULL;
+	size_t x = line->bytelen;
+	line->bytelen += next->bytelen;
+	journal_add_newline(&textbuffer->journal, newline_char);
+
+	while (next->cursors) {
+		struct cursor *cursor = next->cursors;
+		cursor_set_line(cursor, line);
+		cursor_set_x(cursor, x + cursor->x_offset_actual);
+	}
+
+	line_link(line, next->next);
+	if (textbuffer->line_last == next) {
+		textbuffer->line_last = line;
+	}
+	linetree_remove(&textbuffer->line_root, next);
+	// The line after was lexed from the end state of the next line, see highlight.cpp.
+	line->lexer_state = next->lexer_state;
+	line_update(textbuffer, line, x);
+	textbuffer->line_number--;
+	line_free(textbuffer, next);
+	return 0;
+}
+
+// Delete 'len' bytes after a cursor, which is at 'offset'.
+static int textbuffer_delete_at(struct cursor *cursor, size_t offset, size_t len)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	textbuffer->pristine = 0;
+	len = min(len, textbuffer_bytelen(textbuffer) - offset);
+
+	// Index the deleted lines, up to the line after the last deleted newline.
+	while (textbuffer_has_tail(textbuffer) && offset + len >= textbuffer_head_bytelen(textbuffer) + textbuffer->line_root->bytes) {
+		int fail = textbuffer_index_tail_step(textbuffer, textbuffer_index_step_budget);
+		if (fail) {
+			return fail;
+		}
+		textbuffer_update_line_number(textbuffer);
+	}
+
+	journal_begin_edit(&textbuffer->journal, offset);
+	struct line *line = cursor->line;
+	size_t x = cursor->x_offset_actual;
+	size_t remaining = len;
+	size_t n = min(remaining, line->bytelen - x);
+	// Where the newlines are stored is found before the lines are cut and joined, while their fragments still end there.
+	char *newline_char = n < remaining ? line_stored_newline(textbuffer, line) : NULL;
+	int fail = line_remove_range(textbuffer, line, x, n);
+	if (!fail) {
+		remaining -= n;
+	}
+	while (remaining && !fail) {
+		char *next_newline_char = line_stored_newline(textbuffer, line->next);
+		fail = line_join_next(textbuffer, line, newline_char);
+		if (fail) {
+			break;
+		}
+		remaining--;
+		n = min(remaining, line->bytelen - x);
+		newline_char = next_newline_char;
+		fail = line_remove_range(textbuffer, line, x, n);
+		if (!fail) {
+			remaining -= n;
+		}
+	}
+	textbuffer_end_edit(textbuffer, JOURNAL_DELETE, len - remaining);
+	if (fail) {
+		textbuffer_drop_snapshot(textbuffer);
+	} else if (len) {
+		textbuffer_record_change(textbuffer, offset, len, s(NULL, NULL));
+	}
+	cursor->x_offset_want = -1;
+	return fail;
+}
+
+int textbuffer_delete(struct cursor *cursor, size_t len)
+{
+	cursor_clamp_x(cursor);
+	return textbuffer_delete_at(cursor, cursor_offset(cursor), len);
+}
+
+// Batch edits:
+//	Editing at every cursor applies one batch of sites, see struct snapshot_change, instead of one edit per cursor.
+//	The sites are grouped with the lines they touch, and the lines of a group are rebuilt in one pass over their
+//	fragments: the text of the lines is spliced at every site of the group, cut into lines again, and these lines
+//	replace the lines of the group. The cursors on these lines are moved once, from their offsets before the batch.
+//	The journal and the snapshot record the batch as a whole, so an edit at k cursors costs O(k log n) plus the
+//	fragments of the lines it touches, whatever the number of cursors on a line.
+
+// The text of the lines of a group while it is rebuilt: pieces of text, and newlines which are slices with a NULL stop
+// whose start is the stored newline character, or NULL.
+struct batch_tokens {
+	slice *tokens;
+	size_t n;
+	size_t capacity;
+	int failed;
+};
+
+static int batch_is_newline(slice token)
+{
+	return token.stop == NULL;
+}
+
+static size_t batch_token_len(slice token)
+{
+	return batch_is_newline(token) ? 1 : slice_len(token);
+}
+
+// Push a token. Empty pieces are dropped, and a piece directly following the last piece in memory just extends it.
+static void batch_push(struct batch_tokens *tokens, slice token)
+{
+	if (!batch_is_newline(token)) {
+		if (slice_empty(token)) {
+			return;
+		}
+		slice *last = tokens->n ? tokens->tokens + tokens->n - 1 : NULL;
+		if (last && !batch_is_newline(*last) && last->stop == token.start) {
+			last->stop = token.stop;
+			return;
+		}
+	}
+	if (tokens->n == tokens->capacity) {
+		size_t capacity = max(2 * tokens->capacity, (size_t) 64);
+		slice *grown = (slice*) realloc(tokens->tokens, capacity * sizeof(slice));
+		if_null(grown) {
+			tokens->failed = 1;
+			return;
+		}
+		tokens->tokens = grown;
+		tokens->capacity = capacity;
+	}
+	tokens->tokens[tokens->n++] = token;
+}
+
+static void batch_push_text(struct batch_tokens *tokens, slice text)
+{
+	while (!slice_empty(text)) {
+		char *newline_char = (char*) memchr(text.start, '\n', slice_len(text));
+		if (!newline_char) {
+			batch_push(tokens, text);
+			return;
+		}
+		batch_push(tokens, s(text.start, newline_char));
+		batch_push(tokens, s(newline_char, NULL));
+		text.start = newline_char + 1;
+	}
+}
+
+struct batch_reader {
+	slice *tokens;
+	size_t t;
+	size_t x;                   // bytes already read in the current token
+};
+
+// Read at most 'len' bytes, 'len' > 0, as one token.
+static slice batch_read(struct batch_reader *reader, size_t len)
+{
+	slice token = reader->tokens[reader->t];
+	if (batch_is_newline(token)) {
+		reader->t++;
+		return token;
+	}
+	size_t n = min(len, slice_len(token) - reader->x);
+	slice piece = s(token.start + reader->x, token.start + reader->x + n);
+	reader->x += n;
+	if (reader->x == slice_len(token)) {
+		reader->t++;
+		reader->x = 0;
+	}
+	return piece;
+}
+
+struct cursor_position {
+	size_t offset;
+	struct cursor *cursor;
+};
+
+static int cursor_position_compare(const void *a, const void *b)
+{
+	size_t offset_a = ((struct cursor_position*) a)->offset;
+	size_t offset_b = ((struct cursor_position*) b)->offset;
+	return offset_a < offset_b ? -1 : offset_a > offset_b ? 1 : 0;
+}
+
+// Merge cursors at the same place, they are consecutive in 'positions'. Returns the number of cursors left.
+static size_t textbuffer_merge_cursors(struct textbuffer *textbuffer, struct cursor_position *positions, size_t n)
+{
+	if (!n) {
+		return 0;
+	}
+	size_t kept = 1;
+	for (size_t i = 1; i < n; i++) {
+		struct cursor *a = positions[kept - 1].cursor;
+		struct cursor *b = positions[i].cursor;
+		if (a->line != b->line || a->x_offset_actual != b->x_offset_actual) {
+			positions[kept++] = positions[i];
+		} else if (b == &textbuffer->cursor) {
+			textbuffer_remove_cursor(a);
+			positions[kept - 1] = positions[i];
+		} else {
+			textbuffer_remove_cursor(b);
+		}
+	}
+	return kept;
+}
+
+// All cursors sorted from the start of the textbuffer to its end, without duplicates.
+static struct cursor_position* textbuffer_sorted_cursors(struct textbuffer *textbuffer, size_t *n)
+{
+	struct cursor_position *positions = (struct cursor_position*) malloc(textbuffer->cursor_count * sizeof(struct cursor_position));
+	if_null(positions) {
+		return NULL;
+	}
+	size_t i = 0;
+	for (struct cursor *cursor = &textbuffer->cursor; cursor; cursor = cursor->next) {
+		cursor_clamp_x(cursor);
+		positions[i].offset = cursor_offset(cursor);
+		positions[i].cursor = cursor;
+		i++;
+	}
+	qsort(positions, i, sizeof(struct cursor_position), cursor_position_compare);
+	*n = textbuffer_merge_cursors(textbuffer, positions, i);
+	return positions;
+}
+
+struct textbuffer_batch {
+	struct snapshot_change *sites;
+	int journal_sites;          // record every site with its deleted text in the journal
+	struct cursor_position *positions;
+	size_t npositions;
+	size_t next_position;       // first cursor after the lines rebuilt so far
+	struct line *after;         // line after the lines rebuilt last
+	struct batch_tokens input;
+	struct batch_tokens output;
+	struct batch_tokens deleted;
+};
+
+// Unlink the cursors on the lines from 'start' to 'end', which are [*p, returned index) in the positions, and turn
+// their offsets into their offsets from 'start' after the sites [i, j). A cursor in a deleted range moves to the end
+// of the range, then by the sites before it.
+static size_t textbuffer_batch_cursors(struct textbuffer_batch *batch, size_t *p, size_t start, size_t end, size_t i, size_t j)
+{
+	struct cursor_position *positions = batch->positions;
+	struct snapshot_change *sites = batch->sites;
+	while (*p < batch->npositions && positions[*p].offset < start) {
+		(*p)++;
+	}
+	size_t q = *p;
+	size_t k = i;
+	size_t shift = 0;
+	for (; q < batch->npositions && positions[q].offset <= end; q++) {
+		cursor_unlink(positions[q].cursor);
+		size_t offset = positions[q].offset;
+		if (k < j && sites[k].offset < offset) {
+			offset = max(offset, sites[k].offset + sites[k].deleted);
+		}
+		while (k < j && sites[k].offset + sites[k].deleted <= offset) {
+			shift += slice_len(sites[k].inserted) - sites[k].deleted;
+			k++;
+			if (k < j && sites[k].offset < offset) {
+				offset = max(offset, sites[k].offset + sites[k].deleted);
+			}
+		}
+		positions[q].offset = offset - start + shift;
+	}
+	return q;
+}
+
+// Record the sites [i, j) in the journal, with the text they deleted.
+static void textbuffer_batch_journal(struct textbuffer *textbuffer, struct textbuffer_batch *batch, size_t i, size_t j)
+{
+	struct batch_reader deleted = { batch->deleted.tokens, 0, 0 };
+	for (size_t k = i; k < j; k++) {
+		struct snapshot_change *site = batch->sites + k;
+		for (size_t len = site->deleted; len; ) {
+			slice token = batch_read(&deleted, len);
+			len -= batch_token_len(token);
+			if (batch_is_newline(token)) {
+				journal_add_newline(&textbuffer->journal, token.start);
+			} else {
+				journal_add_slice(&textbuffer->journal, token);
+			}
+		}
+		journal_add_site(&textbuffer->journal, site->offset, site->deleted);
+	}
+}
+
+// Rebuild the lines from 'first' to 'last' with the sites [i, j) applied, 'start' and 'end' being the offsets of
+// the start of 'first' and the end of 'last'.
+static int textbuffer_batch_lines(struct textbuffer *textbuffer, struct textbuffer_batch *batch, struct line *first, struct line *last, size_t start, size_t end, size_t i, size_t j)
+{
+	batch->input.n = 0;
+	batch->output.n = 0;
+	batch->deleted.n = 0;
+	size_t old_lines = 1;
+	char *last_newline_char = NULL;
+	for (struct line *line = first; ; line = line->next) {
+		struct textpiece *last_fragment = line->fragments;
+		for (struct textpiece *fragment = line->fragments; fragment; fragment = fragment->next) {
+			// An empty fragment may be s(NULL, NULL), which reads as a newline.
+			if (fragment->slice.stop) {
+				batch_push(&batch->input, fragment->slice);
+			}
+			last_fragment = fragment;
+		}
+		char *newline_char = textbuffer_stored_newline(textbuffer, last_fragment->slice);
+		if (line == last) {
+			last_newline_char = newline_char;
+			break;
+		}
+		batch_push(&batch->input, s(newline_char, NULL));
+		old_lines++;
+	}
+
+	struct batch_reader reader = { batch->input.tokens, 0, 0 };
+	size_t offset = start;
+	for (size_t k = i; k < j; k++) {
+		struct snapshot_change *site = batch->sites + k;
+		while (offset < site->offset) {
+			slice token = batch_read(&reader, site->offset - offset);
+			offset += batch_token_len(token);
+			batch_push(&batch->output, token);
+		}
+		batch_push_text(&batch->output, site->inserted);
+		for (size_t stop = offset + site->deleted; offset < stop; ) {
+			slice token = batch_read(&reader, stop - offset);
+			offset += batch_token_len(token);
+			batch_push(&batch->deleted, token);
+		}
+	}
+	while (reader.t < batch->input.n) {
+		batch_push(&batch->output, batch_read(&reader, SIZE_MAX));
+	}
+	if (batch->input.failed || batch->output.failed || batch->deleted.failed) {
+		return -ENOMEM;
+	}
+
+	// Everything is allocated before the lines are changed, so that running out of memory leaves them untouched.
+	// The first piece of a line is its inline fragment.
+	size_t new_lines = 1;
+	size_t textpieces = 0;
+	int line_empty = 1;
+	for (size_t t = 0; t < batch->output.n; t++) {
+		if (batch_is_newline(batch->output.tokens[t])) {
+			new_lines++;
+			line_empty = 1;
+		} else if (line_empty) {
+			line_empty = 0;
+		} else {
+			textpieces++;
+		}
+	}
+	struct textpiece *spare_textpieces = NULL;
+	struct line *spare_lines = NULL;
+	int fail = 0;
+	for (size_t n = 0; n < textpieces && !fail; n++) {
+		struct textpiece *textpiece = (struct textpiece*) slab_alloc(&textbuffer->textpiece_slab);
+		if_null(textpiece) {
+			fail = -ENOMEM;
+			break;
+		}
+		textpiece->next = spare_textpieces;
+		spare_textpieces = textpiece;
+	}
+	for (size_t n = old_lines; n < new_lines && !fail; n++) {
+		struct line *line = line_alloc_empty(textbuffer);
+		if_null(line) {
+			fail = -ENOMEM;
+			break;
+		}
+		line->next = spare_lines;
+		spare_lines = line;
+	}
+	if (fail) {
+		while (spare_textpieces) {
+			struct textpiece *next = spare_textpieces->next;
+			slab_free(&textbuffer->textpiece_slab, spare_textpieces);
+			spare_textpieces = next;
+		}
+		while (spare_lines) {
+			struct line *next = spare_lines->next;
+			slab_free(&textbuffer->line_slab, spare_lines);
+			spare_lines = next;
+		}
+		return fail;
+	}
+
+	struct cursor_position *positions = batch->positions;
+	size_t p = batch->next_position;
+	size_t q = textbuffer_batch_cursors(batch, &p, start, end, i, j);
+
+	// The lines of the group are reused in order, then lines are added or removed after them.
+	u8 lexer_state = last->lexer_state;
+	struct line *line = first;
+	struct line *prev = NULL;
+	size_t line_start = 0;
+	size_t t = 0;
+	for (size_t l = 0; l < new_lines; l++) {
+		struct line *target;
+		int reused = l < old_lines;
+		if (reused) {
+			target = line;
+			line = line->next;
+			line_free_fragments(textbuffer, target);
+		} else {
+			target = spare_lines;
+			spare_lines = target->next;
+			target->next = NULL;
+		}
+		target->fragments = &target->inline_fragment;
+		target->inline_fragment.next = NULL;
+		struct textpiece *tail = NULL;
+		size_t bytelen = 0;
+		for (; t < batch->output.n && !batch_is_newline(batch->output.tokens[t]); t++) {
+			slice piece = batch->output.tokens[t];
+			if (!tail) {
+				tail = &target->inline_fragment;
+			} else {
+				tail->next = spare_textpieces;
+				tail = spare_textpieces;
+				spare_textpieces = tail->next;
+				tail->next = NULL;
+			}
+			tail->slice = piece;
+			bytelen += slice_len(piece);
+		}
+		char *newline_char = last_newline_char;
+		if (t < batch->output.n) {
+			newline_char = batch->output.tokens[t++].start;
+		}
+		if (!tail) {
+			target->inline_fragment.slice = s(newline_char, newline_char);
+		}
+		target->bytelen = bytelen;
+		if (l == new_lines - 1) {
+			// The line after was lexed from the end state of the last line.
+			target->lexer_state = lexer_state;
+		}
+		// Like line_update(), the lexer states are marked stale once for the whole batch.
+		target->lexer_dirty = 1;
+		line_wrap_update(textbuffer, target);
+		if (reused) {
+			linetree_update(target);
+		} else {
+			line_insert_after(textbuffer, prev, target);
+		}
+
+		for (; p < q && positions[p].offset <= line_start + bytelen; p++) {
+			struct cursor *cursor = positions[p].cursor;
+			size_t x = positions[p].offset - line_start;
+			if (cursor->line != target || (size_t) cursor->x_offset_actual != x) {
+				cursor_set_x(cursor, x);
+			}
+			cursor->line = target;
+			cursor_link(cursor, target);
+		}
+		line_start += bytelen + 1;
+		prev = target;
+	}
+	for (size_t l = new_lines; l < old_lines; l++) {
+		struct line *next = line->next;
+		line_link(line->prev, next);
+		if (textbuffer->line_last == line) {
+			textbuffer->line_last = line->prev;
+		}
+		linetree_remove(&textbuffer->line_root, line);
+		textbuffer->line_number--;
+		line_free(textbuffer, line);
+		line = next;
+	}
+	batch->next_position = q;
+	batch->after = prev->next;
+
+	if (batch->journal_sites) {
+		textbuffer_batch_journal(textbuffer, batch, i, j);
+	}
+	return 0;
+}
+
+// The line containing 'offset', and its offset in 'start', before the batch. Lines a few lines after 'line', which
+// starts at 'line_start', are found by walking the lines.
+static struct line* textbuffer_batch_line(struct textbuffer *textbuffer, struct line *line, size_t line_start, size_t offset, size_t shift, size_t *start)
+{
+	for (int i = 0; line && line_start <= offset && i < 16; i++) {
+		if (offset <= line_start + line->bytelen) {
+			*start = line_start;
+			return line;
+		}
+		line_start += line->bytelen + 1;
+		line = line->next;
+	}
+	size_t x;
+	line = linetree_at_offset(textbuffer->line_root, offset + shift - textbuffer_head_bytelen(textbuffer), &x);
+	*start = offset - x;
+	return line;
+}
+
+// Apply the 'n' sites of a batch, sorted by offset. The cursors are given sorted by offset in 'positions', whose
+// offsets are used up. With 'journal_sites', every site is recorded in the journal edit with the text it deletes.
+static int textbuffer_apply_batch(struct textbuffer *textbuffer, struct snapshot_change *sites, size_t n,
+		struct cursor_position *positions, size_t npositions, int journal_sites)
+{
+	if (!n) {
+		return 0;
+	}
+	textbuffer->pristine = 0;
+
+	// Index the lines touched by the sites, up to the line after the last one.
+	size_t end = sites[n - 1].offset + sites[n - 1].deleted;
+	while (sites[0].offset < textbuffer_head_bytelen(textbuffer)) {
+		int fail = textbuffer_index_head_step(textbuffer, textbuffer_index_step_budget);
+		if (fail) {
+			return fail;
+		}
+	}
+	while (textbuffer_has_tail(textbuffer) && end >= textbuffer_head_bytelen(textbuffer) + textbuffer->line_root->bytes) {
+		int fail = textbuffer_index_tail_step(textbuffer, textbuffer_index_step_budget);
+		if (fail) {
+			return fail;
+		}
+	}
+	textbuffer_update_line_number(textbuffer);
+
+	// Groups are rebuilt in order: the lines after the last group have not moved yet, except by 'shift'.
+	struct textbuffer_batch batch = {};
+	batch.sites = sites;
+	batch.journal_sites = journal_sites;
+	batch.positions = positions;
+	batch.npositions = npositions;
+	size_t after_start = 0;
+	size_t shift = 0;
+	size_t i = 0;
+	int fail = 0;
+	while (i < n && !fail) {
+		size_t start;
+		struct line *first = textbuffer_batch_line(textbuffer, batch.after, after_start, sites[i].offset, shift, &start);
+		struct line *last = first;
+		size_t last_start = start;
+		size_t j = i;
+		do {
+			last = textbuffer_batch_line(textbuffer, last, last_start, sites[j].offset + sites[j].deleted, shift, &last_start);
+			j++;
+		} while (j < n && sites[j].offset <= last_start + last->bytelen);
+
+		if (i == 0) {
+			textbuffer_highlight_dirty(textbuffer, line_index(first));
+		}
+		size_t last_end = last_start + last->bytelen;
+		fail = textbuffer_batch_lines(textbuffer, &batch, first, last, start, last_end, i, j);
+		if (!fail) {
+			for (; i < j; i++) {
+				shift += slice_len(sites[i].inserted) - sites[i].deleted;
+			}
+			after_start = last_end + 1;
+		}
+	}
+	free(batch.input.tokens);
+	free(batch.output.tokens);
+	free(batch.deleted.tokens);
+
+	if (fail) {
+		textbuffer_drop_snapshot(textbuffer);
+	} else {
+		textbuffer_record_batch(textbuffer, sites, n);
+	}
+	return fail;
+}
+
+// Apply a batch from the journal, or revert it: the inserted text follows the deleted text of all sites in the
+// slices of the edit.
+static int textbuffer_replay_batch(struct textbuffer *textbuffer, struct journal_edit *edit, int revert)
+{
+	struct journal *journal = &textbuffer->journal;
+	struct journal_site *sites = journal->sites + edit->first_site;
+	slice *slices = journal->slices + edit->first_slice;
+	size_t n = edit->nsites;
+	size_t deleted = 0;
+	for (size_t i = 0; i < n; i++) {
+		deleted += sites[i].deleted;
+	}
+	struct batch_reader reader = { slices, 0, 0 };
+	for (size_t len = deleted; len; ) {
+		len -= slice_len(batch_read(&reader, len));
+	}
+	struct batch_reader inserted = reader;
+	size_t npieces = 0;
+	while (reader.t < edit->nslices) {
+		batch_read(&reader, SIZE_MAX);
+		npieces++;
+	}
+
+	// Text made of several slices is inserted by the site, then by sites at the end of its range.
+	size_t capacity = revert ? 2 * n + edit->nslices : n * max(npieces, (size_t) 1);
+	struct snapshot_change *changes = (struct snapshot_change*) calloc(capacity, sizeof(struct snapshot_change));
+	if_null(changes) {
+		return -ENOMEM;
+	}
+	size_t nchanges = 0;
+	size_t first_site_changes = 0;
+	size_t shift = 0;
+	reader = { slices, 0, 0 };
+	for (size_t i = 0; i < n; i++) {
+		size_t offset = sites[i].offset;
+		size_t len = sites[i].deleted;
+		struct batch_reader text = inserted;
+		size_t text_len = edit->len;
+		if (revert) {
+			offset += shift;
+			shift += edit->len - sites[i].deleted;
+			len = edit->len;
+			text_len = sites[i].deleted;
+		}
+		struct batch_reader *from = revert ? &reader : &text;
+		struct snapshot_change *change = changes + nchanges++;
+		change->offset = offset;
+		change->deleted = len;
+		while (text_len) {
+			if (!slice_empty(change->inserted)) {
+				change = changes + nchanges++;
+				change->offset = offset + len;
+			}
+			change->inserted = batch_read(from, text_len);
+			text_len -= slice_len(change->inserted);
+		}
+		if (i == 0) {
+			first_site_changes = nchanges;
+		}
+	}
+
+	size_t npositions;
+	struct cursor_position *positions = textbuffer_sorted_cursors(textbuffer, &npositions);
+	if_null(positions) {
+		free(changes);
+		return -ENOMEM;
+	}
+	int fail = textbuffer_apply_batch(textbuffer, changes, nchanges, positions, npositions, 0);
+	free(positions);
+	if (!fail) {
+		// The main cursor goes to the end of the text of the first site.
+		size_t offset = changes[0].offset;
+		for (size_t i = 0; i < first_site_changes; i++) {
+			offset += slice_len(changes[i].inserted);
+		}
+		cursor_goto_offset(&textbuffer->cursor, offset);
+	}
+	free(changes);
+	return fail;
+}
+
+// Apply an edit from the journal, or revert it.
+static int textbuffer_replay(struct textbuffer *textbuffer, struct journal_edit *edit, int revert)
+{
+	if (edit->type == JOURNAL_BATCH) {
+		return textbuffer_replay_batch(textbuffer, edit, revert);
+	}
+	struct cursor *cursor = &textbuffer->cursor;
+	cursor_goto_offset(cursor, edit->offset);
+	if ((edit->type == JOURNAL_INSERT) == revert) {
+		return textbuffer_delete(cursor, edit->len);
+	}
+	slice *slices = textbuffer->journal.slices + edit->first_slice;
+	for (size_t i = 0; i < edit->nslices; i++) {
+		int fail = textbuffer_insert_slice(cursor, slices[i]);
+		if (fail) {
+			return fail;
+		}
+	}
+	return 0;
+}
+
+int textbuffer_undo(struct textbuffer *textbuffer)
+{
+	struct journal_edit *edits;
+	size_t n = journal_undo(&textbuffer->journal, &edits);
+	int fail = 0;
+	textbuffer->journal.paused = 1;
+	for (size_t i = n; i > 0 && !fail; i--) {
+		fail = textbuffer_replay(textbuffer, edits + i - 1, 1);
+	}
+	textbuffer->journal.paused = 0;
+	return fail ? fail : n > 0;
+}
+
+int textbuffer_redo(struct textbuffer *textbuffer)
+{
+	struct journal_edit *edits;
+	size_t n = journal_redo(&textbuffer->journal, &edits);
+	int fail = 0;
+	textbuffer->journal.paused = 1;
+	for (size_t i = 0; i < n && !fail; i++) {
+		fail = textbuffer_replay(textbuffer, edits + i, 0);
+	}
+	textbuffer->journal.paused = 0;
+	return fail ? fail : n > 0;
+}
+
+void textbuffer_begin_transaction(struct textbuffer *textbuffer)
+{
+	journal_begin_transaction(&textbuffer->journal);
+}
+
+void textbuffer_end_transaction(struct textbuffer *textbuffer)
+{
+	journal_end_transaction(&textbuffer->journal);
+}
+
+struct cursor* textbuffer_add_cursor(struct textbuffer *textbuffer, size_t offset)
+{
+	struct cursor *cursor = (struct cursor*) slab_alloc(&textbuffer->cursor_slab);
+	if_null(cursor) {
+		return NULL;
+	}
+	cursor->textbuffer = textbuffer;
+	cursor->line = textbuffer->line_first;
+	cursor->tracked = 1;
+	cursor_link(cursor, cursor->line);
+	cursor_goto_offset(cursor, offset);
+
+	cursor->prev = &textbuffer->cursor;
+	cursor->next = textbuffer->cursor.next;
+	if (cursor->next) {
+		cursor->next->prev = cursor;
+	}
+	textbuffer->cursor.next = cursor;
+	textbuffer->cursor_count++;
+	return cursor;
+}
+
+void textbuffer_remove_cursor(struct cursor *cursor)
+{
+	struct textbuffer *textbuffer = cursor->textbuffer;
+	assert(cursor != &textbuffer->cursor);
+	cursor_unlink(cursor);
+	cursor->prev->next = cursor->next;
+	if (cursor->next) {
+		cursor->next->prev = cursor->prev;
+	}
+	slab_free(&textbuffer->cursor_slab, cursor);
+	textbuffer->cursor_count--;
+}
+
+void textbuffer_remove_extra_cursors(struct textbuffer *textbuffer)
+{
+	while (textbuffer->cursor.next) {
+		textbuffer_remove_cursor(textbuffer->cursor.next);
+	}
+}
+
+int textbuffer_insert_all(struct textbuffer *textbuffer, slice text)
+{
+	if (textbuffer->cursor_count == 1) {
+		return textbuffer_insert(&textbuffer->cursor, text);
+	}
+	if (slice_empty(text)) {
+		return 0;
+	}
+	size_t n;
+	struct cursor_position *positions = textbuffer_sorted_cursors(textbuffer, &n);
+	if_null(positions) {
+		return -ENOMEM;
+	}
+
+	// The text is stored once and shared by all cursors. When typing, the text inserted at every cursor then follows
+	// in memory the text inserted by the previous keystroke, and just extends the fragments before cursors.
+	size_t len = slice_len(text);
+	slice *pieces = NULL;
+	size_t npieces = 0;
+	while (!slice_empty(text)) {
+		slice stored = textbuffer_store_text(textbuffer, text, 1);
+		slice *grown = stored.start ? (slice*) realloc(pieces, (npieces + 1) * sizeof(slice)) : NULL;
+		if_null(grown) {
+			free(pieces);
+			free(positions);
+			return -ENOMEM;
+		}
+		pieces = grown;
+		pieces[npieces++] = stored;
+		text.start += slice_len(stored);
+	}
+	struct snapshot_change *sites = (struct snapshot_change*) calloc(n * npieces, sizeof(struct snapshot_change));
+	if_null(sites) {
+		free(pieces);
+		free(positions);
+		return -ENOMEM;
+	}
+	for (size_t i = 0; i < n; i++) {
+		for (size_t p = 0; p < npieces; p++) {
+			sites[i * npieces + p].offset = positions[i].offset;
+			sites[i * npieces + p].inserted = pieces[p];
+		}
+	}
+
+	journal_begin_edit(&textbuffer->journal, positions[0].offset);
+	for (size_t i = 0; i < n; i++) {
+		journal_add_site(&textbuffer->journal, positions[i].offset, 0);
+	}
+	for (size_t p = 0; p < npieces; p++) {
+		journal_add_slice(&textbuffer->journal, pieces[p]);
+	}
+	int fail = textbuffer_apply_batch(textbuffer, sites, n * npieces, positions, n, 0);
+	textbuffer_end_edit(textbuffer, JOURNAL_BATCH, fail ? 0 : len);
+
+	textbuffer_merge_cursors(textbuffer, positions, n);
+	free(sites);
+	free(pieces);
+	free(positions);
+	return fail;
+}
+
+int textbuffer_delete_all(struct textbuffer *textbuffer, int len)
+{
+	if (textbuffer->cursor_count == 1) {
+		struct cursor *cursor = &textbuffer->cursor;
+		cursor_clamp_x(cursor);
+		size_t offset = cursor_offset(cursor);
+		size_t count = abs(len);
+		if (len < 0) {
+			count = min(count, offset);
+			offset -= count;
+			if (count <= (size_t) cursor->x_offset_actual) {
+				cursor_set_x(cursor, cursor->x_offset_actual - count);
+			} else {
+				cursor_goto_offset(cursor, offset);
+			}
+		}
+		return textbuffer_delete_at(cursor, offset, count);
+	}
+	size_t n;
+	struct cursor_position *positions = textbuffer_sorted_cursors(textbuffer, &n);
+	if_null(positions) {
+		return -ENOMEM;
+	}
+	struct snapshot_change *sites = (struct snapshot_change*) calloc(n, sizeof(struct snapshot_change));
+	if_null(sites) {
+		free(positions);
+		return -ENOMEM;
+	}
+
+	// Every cursor deletes 'len' bytes, the range of a cursor closer than 'len' to the range of the cursor before it
+	// (or after it when deleting backwards) continues that range.
+	size_t count = abs(len);
+	size_t bytelen = textbuffer_bytelen(textbuffer);
+	if (len < 0) {
+		size_t start = SIZE_MAX;
+		for (size_t i = n; i > 0; i--) {
+			size_t offset = min(positions[i - 1].offset, start);
+			size_t deleted = min(count, offset);
+			start = offset - deleted;
+			sites[i - 1].offset = start;
+			sites[i - 1].deleted = deleted;
+		}
+	} else {
+		size_t end = 0;
+		for (size_t i = 0; i < n; i++) {
+			size_t offset = max(positions[i].offset, end);
+			size_t deleted = min(count, bytelen - offset);
+			end = offset + deleted;
+			sites[i].offset = offset;
+			sites[i].deleted = deleted;
+		}
+	}
+	size_t nsites = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (sites[i].deleted) {
+			sites[nsites++] = sites[i];
+		}
+	}
+
+	int fail = 0;
+	if (nsites) {
+		journal_begin_edit(&textbuffer->journal, sites[0].offset);
+		fail = textbuffer_apply_batch(textbuffer, sites, nsites, positions, n, 1);
+		textbuffer_end_edit(textbuffer, JOURNAL_BATCH, 0);
+	}
+
+	textbuffer_merge_cursors(textbuffer, positions, n);
+	free(sites);
+	free(positions);
+	return fail;
+}
+
+// Replace the text by 'text' as one transaction. Only the range between the common prefix and the common suffix of
+// the current text and 'text' is replaced, so cursors and lines outside of it are untouched.
+static int textbuffer_replace_text(struct textbuffer *textbuffer, slice text)
+{
+	size_t len = textbuffer_bytelen(textbuffer);
+	struct textbuffer_snapshot *snapshot = textbuffer_snapshot(textbuffer);
+	if_null(snapshot) {
+		return -ENOMEM;
+	}
+	size_t prefix = snapshot_common_prefix(snapshot, text);
+	size_t suffix = snapshot_common_suffix(snapshot, text, min(len, slice_len(text)) - prefix);
+	snapshot_release(snapshot);
+	size_t deleted = len - prefix - suffix;
+	slice inserted = s(text.start + prefix, text.stop - suffix);
+	if (!deleted && slice_empty(inserted)) {
+		return 0;
+	}
+
+	struct cursor cursor = cursor_copy(&textbuffer->cursor);
+	cursor_goto_offset(&cursor, prefix);
+	textbuffer_begin_transaction(textbuffer);
+	int fail = 0;
+	if (deleted) {
+		fail = textbuffer_delete_at(&cursor, prefix, deleted);
+	}
+	if (!fail && !slice_empty(inserted)) {
+		fail = textbuffer_insert_stored(&cursor, prefix, inserted);
+	}
+	textbuffer_end_transaction(textbuffer);
+	return fail;
+}
+
+// Replace the whole text by 'text' without reading the current text, which can have changed or be gone past the end
+// of a truncated file: the lines and the unindexed head and tail are dropped without being scanned, and 'text' is cut
+// into lines like a newly loaded file. Cursors keep their offset, clamped to the new text. The replaced text cannot be
+// restored, and neither can the edits before: the history is forgotten.
+static int textbuffer_reset_text(struct textbuffer *textbuffer, slice text)
+{
+	// Offsets only need the lengths in the line tree.
+	size_t *offsets = (size_t*) malloc(textbuffer->cursor_count * sizeof(size_t));
+	if_null(offsets) {
+		return -ENOMEM;
+	}
+	size_t n = 0;
+	for (struct cursor *cursor = &textbuffer->cursor; cursor; cursor = cursor->next) {
+		offsets[n++] = min(cursor_offset(cursor), slice_len(text));
+	}
+
+	// The new lines go to new slabs, so that the old ones are released at once and kept if indexing fails.
+	struct slab line_slab = textbuffer->line_slab;
+	struct slab textpiece_slab = textbuffer->textpiece_slab;
+	slab_init(&textbuffer->line_slab, sizeof(struct line), textbuffer_slab_lines);
+	slab_init(&textbuffer->textpiece_slab, sizeof(struct textpiece), textbuffer_slab_textpieces);
+	struct linerun run;
+	int fail = textbuffer_index_text(textbuffer, text, &run);
+	if (fail) {
+		slab_reset(&textbuffer->line_slab);
+		slab_reset(&textbuffer->textpiece_slab);
+		textbuffer->line_slab = line_slab;
+		textbuffer->textpiece_slab = textpiece_slab;
+		free(offsets);
+		return fail;
+	}
+	slab_reset(&line_slab);
+	slab_reset(&textpiece_slab);
+	textbuffer_free_columns(textbuffer);
+	textbuffer_drop_snapshot(textbuffer);
+	journal_free(&textbuffer->journal);
+	journal_init(&textbuffer->journal, textbuffer_history_limit);
+
+	textbuffer->unindexed_head = s(NULL, NULL);
+	textbuffer->unindexed_tail = s(NULL, NULL);
+	textbuffer->ntail_appended = 0;
+	textbuffer->tail_appended_bytes = 0;
+	textbuffer->line_first = run.first;
+	textbuffer->line_last = run.last;
+	textbuffer->line_root = run.root;
+	textbuffer->line_number = run.count;
+	textbuffer->highlight_dirty = 0;
+	linetree_wrap(textbuffer, run.root);
+
+	// The lines the cursors were linked on are gone.
+	n = 0;
+	for (struct cursor *cursor = &textbuffer->cursor; cursor; cursor = cursor->next) {
+		size_t x;
+		cursor->line = linetree_at_offset(textbuffer->line_root, offsets[n++], &x);
+		cursor_link(cursor, cursor->line);
+		cursor_set_x(cursor, x);
+	}
+	free(offsets);
+	return 0;
+}
+
+// Point the text into 'text', a copy of it: the unindexed head and tail and the fragments of every line point to the
+// same bytes in 'text', as if it had just been loaded from there.
+static void textbuffer_rebase_text(struct textbuffer *textbuffer, slice text)
+{
+	assert(textbuffer_bytelen(textbuffer) == slice_len(text));
+	char *at = text.start;
+	if (textbuffer_has_head(textbuffer)) {
+		size_t len = slice_len(textbuffer->unindexed_head);
+		textbuffer->unindexed_head = s(at, at + len);
+		at += len + 1;
+	}
+	for (struct line *line = textbuffer->line_first; line; line = line->next) {
+		for (struct textpiece *fragment = line->fragments; fragment; fragment = fragment->next) {
+			size_t len = slice_len(fragment->slice);
+			fragment->slice = s(at, at + len);
+			at += len;
+		}
+		at++;
+	}
+	if (textbuffer_has_tail(textbuffer)) {
+		// The text appended behind the tail is in the new version of the file too.
+		textbuffer->unindexed_tail = s(at, text.stop);
+		textbuffer->ntail_appended = 0;
+		textbuffer->tail_appended_bytes = 0;
+	}
+}
+
+// Keep text appended while the tail is unindexed behind it, until textbuffer_index_tail_step() reaches it.
+static int textbuffer_append_behind_tail(struct textbuffer *textbuffer, slice text)
+{
+	textbuffer->tail_appended_bytes += slice_len(text);
+	slice *last = textbuffer->ntail_appended ? textbuffer->tail_appended + textbuffer->ntail_appended - 1 : NULL;
+	if (last && last->stop == text.start) {
+		last->stop = text.stop;
+		return 0;
+	}
+	if (textbuffer->ntail_appended == textbuffer->tail_appended_capacity) {
+		size_t capacity = max(2 * textbuffer->tail_appended_capacity, (size_t) 16);
+		slice *pieces = (slice*) realloc(textbuffer->tail_appended, capacity * sizeof(slice));
+		if_null(pieces) {
+			textbuffer->tail_appended_bytes -= slice_len(text);
+			return -ENOMEM;
+		}
+		textbuffer->tail_appended = pieces;
+		textbuffer->tail_appended_capacity = capacity;
+	}
+	textbuffer->tail_appended[textbuffer->ntail_appended++] = text;
+	return 0;
+}
+
+// Follow mode: the bytes appended to the file since it was last loaded are read into new textchunks and cut into
+// lines at the end of the textbuffer, so that following a log costs in proportion to what gets appended. While the
+// tail of a lazily loaded file is not indexed, they wait behind it instead. Appending is not an edit and is not
+// recorded in the journal. Cursors at the end of the text move to the new end.
+static int textbuffer_follow_append(struct textbuffer *textbuffer, struct stat *file_stat)
+{
+	int fd = open(textbuffer->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	int fail = 0;
+	struct line *last = textbuffer->line_last;
+	size_t last_len = last->bytelen;
+	size_t offset = textbuffer_bytelen(textbuffer);
+	textbuffer->pristine = 0;
+
+	off_t position = textbuffer->file_size;
+	while (position < file_stat->st_size && !fail) {
+		struct textchunk *chunk = textbuffer->textchunk_last;
+		if (!chunk || chunk->cursor == textchunk_datasize) {
+			chunk = textbuffer_add_textchunk(textbuffer);
+			if_null(chunk) {
+				fail = -ENOMEM;
+				break;
+			}
+		}
+		size_t len = min((size_t) (file_stat->st_size - position), textchunk_datasize - chunk->cursor);
+		ssize_t r = pread(fd, textchunk_end(chunk), len, position);
+		if (r <= 0) {
+			// The file got truncated since, the next reload handles it.
+			fail = r < 0 ? -errno : 0;
+			break;
+		}
+		slice text = s(textchunk_end(chunk), textchunk_end(chunk) + r);
+		chunk->cursor += r;
+		if (textbuffer_has_tail(textbuffer)) {
+			fail = textbuffer_append_behind_tail(textbuffer, text);
+		} else {
+			fail = textbuffer_append_lines(textbuffer, text);
+		}
+		if (fail) {
+			textbuffer_drop_snapshot(textbuffer);
+			break;
+		}
+		textbuffer_record_change(textbuffer, offset, 0, text);
+		offset += r;
+		position += r;
+	}
+	close(fd);
+	textbuffer_update_line_number(textbuffer);
+
+	if (last != textbuffer->line_last || last_len != last->bytelen) {
+		struct cursor *cursor = last->cursors;
+		while (cursor) {
+			struct cursor *next = cursor->line_next;
+			if ((size_t) cursor->x_offset_actual == last_len) {
+				cursor_set_line(cursor, textbuffer->line_last);
+				cursor_set_x(cursor, textbuffer->line_last->bytelen);
+			}
+			cursor = next;
+		}
+	}
+	struct stat appended_stat = *file_stat;
+	appended_stat.st_size = position;
+	textbuffer_set_identity(textbuffer, &appended_stat);
+	return fail;
+}
+
+void textbuffer_follow(struct textbuffer *textbuffer, int follow)
+{
+	textbuffer->follow = follow;
+	if (follow) {
+		textbuffer_reload(textbuffer);
+	}
+}
+
+int textbuffer_reload(struct textbuffer *textbuffer)
+{
+	// A running save replaces the file itself, its identity is updated once it completes.
+	if (textbuffer->save_job || !textbuffer->path) {
+		return 0;
+	}
+	struct stat file_stat;
+	if (stat(textbuffer->path, &file_stat) < 0) {
+		return -errno;
+	}
+	if (textbuffer_same_identity(textbuffer, &file_stat)) {
+		return 0;
+	}
+	if (textbuffer->follow && textbuffer->file_dev == file_stat.st_dev && textbuffer->file_ino == file_stat.st_ino
+		&& textbuffer->file_size < file_stat.st_size) {
+		int fail = textbuffer_follow_append(textbuffer, &file_stat);
+		return fail ? fail : 1;
+	}
+
+	struct mapped_file file = {};
+	int fail = mapped_file_load(&file, textbuffer->path);
+	if (fail) {
+		return fail;
+	}
+	struct mapped_file *retired_files = (struct mapped_file*) realloc(textbuffer->retired_files, (textbuffer->nretired_files + 1) * sizeof(struct mapped_file));
+	if_null(retired_files) {
+		mapped_file_unload(&file);
+		return -ENOMEM;
+	}
+	textbuffer->retired_files = retired_files;
+
+	// The text still pointing into the current mapping is only readable if the file was replaced. When it was written
+	// in place instead, that text already changed under the textbuffer and is replaced entirely.
+	struct stat *mapped_stat = &textbuffer->file.file_stat;
+	int in_place = !slice_empty(textbuffer->file.data) && mapped_stat->st_dev == file.file_stat.st_dev
+		&& mapped_stat->st_ino == file.file_stat.st_ino;
+	fail = in_place ? textbuffer_reset_text(textbuffer, file.data) : textbuffer_replace_text(textbuffer, file.data);
+	if (fail) {
+		mapped_file_unload(&file);
+		return fail;
+	}
+	if (!in_place) {
+		textbuffer_rebase_text(textbuffer, file.data);
+	}
+	if (!slice_empty(textbuffer->file.data)) {
+		textbuffer->retired_files[textbuffer->nretired_files++] = textbuffer->file;
+	}
+	textbuffer->file = file;
+	textbuffer->pristine = 1;
+	// Written in place, nothing points into the previous mapping anymore. Replaced, the journal usually still does.
+	textbuffer_release_files(textbuffer);
+	textbuffer_set_identity(textbuffer, &file.file_stat);
+	return 1;
+}
+
+int textbuffer_watch_fd()
+{
+	return textbuffer_inotify_fd;
+}
+
+// Reload every registered textbuffer, when some events were lost.
+static int textbuffer_reload_all()
+{
+	int reloaded = 0;
+	struct textbuffer_table *table = textbuffer_tables + TEXTBUFFER_KEY_PATH;
+	for (size_t i = 0; i < table->capacity; i++) {
+		if (table->slots[i] && textbuffer_reload(table->slots[i]) > 0) {
+			reloaded++;
+		}
+	}
+	return reloaded;
+}
+
+int textbuffer_watch_process()
+{
+	if (textbuffer_inotify_fd < 0) {
+		return 0;
+	}
+	int reloaded = 0;
+	char buffer[Kilo(4)] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	for (;;) {
+		ssize_t n = read(textbuffer_inotify_fd, buffer, sizeof(buffer));
+		if (n <= 0) {
+			break;
+		}
+		for (char *c = buffer; c < buffer + n; ) {
+			struct inotify_event *event = (struct inotify_event*) c;
+			c += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				reloaded += textbuffer_reload_all();
+				continue;
+			}
+			int i = textbuffer_find_watch(event->wd);
+			if (i < 0 || !event->len) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s", textbuffer_watches[i].dir, event->name);
+			// Files being written are reloaded once closed, unless they are followed.
+			struct textbuffer *textbuffer = textbuffer_find_path(path);
+			if (textbuffer && (textbuffer->follow || !(event->mask & IN_MODIFY)) && textbuffer_reload(textbuffer) > 0) {
+				reloaded++;
+			}
+		}
+	}
+	return reloaded;
 }
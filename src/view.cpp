@@ -0,0 +1,360 @@
+// view.cpp implements displaying a textbuffer in a rectangle of the framebuffer, around the cursor of a view.
+//
+// A view does not track absolute line numbers: view->y_offset is the row of the cursor line inside the view, and
+// the first displayed line is found by walking back from the cursor line. This keeps views working on textbuffers
+// which are only partially indexed.
+//
+// Horizontally, a view shows a window of columns starting at view->x_offset. Rows are decoded from the char covering
+// the first column of the window with a column_iter, so that scrolling along a line of 50MB costs the same as drawing
+// a short line.
+//
+// Views wrapping lines show every line on as many rows as it needs instead, and view->y_offset counts rows. The
+// textbuffer keeps the rows of its lines for the width of the view in its line tree, so that the row of the cursor
+// and the line showing a given row are both found in O(log n), whatever the length of the lines above the view.
+#include <chi.h>
+
+#include <assert.h>
+
+// Width of the line number column
+static const int view_lineno_width = 9;
+
+// Scratch buffer for assembling one row of text from the fragments of a line.
+static struct buffer view_row = {};
+// Cells of the text of the row, one char per cell.
+static struct buffer view_row_cells = {};
+// Byte offset in the line of the char drawn in every cell of the row.
+static struct buffer view_row_x = {};
+// Syntax highlighting runs of the row.
+static struct buffer view_row_runs = {};
+
+// Background color of search matches
+static const int view_match_bg = 94;
+
+void view_init(struct view *view, struct cursor *cursor)
+{
+	view->textbuffer = cursor->textbuffer;
+	view->cursor = cursor;
+	view->stream = NULL;
+	view->find = NULL;
+	view->y_offset = 0;
+	view->x_offset = 0;
+}
+
+void view_init_stream(struct view *view, struct stream_cursor *cursor)
+{
+	memset(view, 0, sizeof(struct view));
+	view->stream = cursor;
+}
+
+static void view_move_stream_cursor(struct view *view, int dy, int height)
+{
+	while (dy > 0 && stream_cursor_next_line(view->stream)) {
+		view->y_offset++;
+		dy--;
+	}
+	while (dy < 0 && stream_cursor_prev_line(view->stream)) {
+		view->y_offset--;
+		dy++;
+	}
+	view->y_offset = clamp(view->y_offset, 0, max(height - 1, 0));
+}
+
+// Rows of the cursor line above the cursor, and from the cursor to the end of the line, when lines are wrapped.
+static int view_rows_above_cursor(struct view *view)
+{
+	struct cursor *cursor = view->cursor;
+	return line_wrap_row(view->textbuffer, cursor->line, cursor->x_offset_actual);
+}
+
+static int view_rows_below_cursor(struct view *view)
+{
+	return view->cursor->line->wrap_rows - view_rows_above_cursor(view);
+}
+
+void view_move_cursor(struct view *view, int dy, int height)
+{
+	if (view->stream) {
+		view_move_stream_cursor(view, dy, height);
+		return;
+	}
+	// The cursor row moves by the rows of the lines it crosses, only one per line when lines are not wrapped.
+	int wrapping = view->are_line_wrapping && view->textbuffer->wrap_width;
+	while (dy > 0) {
+		int rows = wrapping ? view_rows_below_cursor(view) : 0;
+		if (!cursor_next_line(view->cursor)) {
+			break;
+		}
+		view->y_offset += wrapping ? rows + view_rows_above_cursor(view) : 1;
+		dy--;
+	}
+	while (dy < 0) {
+		int rows = wrapping ? view_rows_above_cursor(view) : 0;
+		if (!cursor_prev_line(view->cursor)) {
+			break;
+		}
+		view->y_offset -= wrapping ? rows + view_rows_below_cursor(view) : 1;
+		dy++;
+	}
+	view->y_offset = clamp(view->y_offset, 0, max(height - 1, 0));
+}
+
+void view_move_cursor_x(struct view *view, int dx)
+{
+	if (view->stream) {
+		return;
+	}
+	while (dx > 0 && cursor_next_char(view->cursor)) {
+		dx--;
+	}
+	while (dx < 0 && cursor_prev_char(view->cursor)) {
+		dx++;
+	}
+}
+
+void view_set_wrapping(struct view *view, int wrapping)
+{
+	wrapping = !!wrapping;
+	if (view->are_line_wrapping == wrapping) {
+		return;
+	}
+	view->are_line_wrapping = wrapping;
+	struct textbuffer *textbuffer = view->textbuffer;
+	if (!textbuffer) {
+		return;
+	}
+	textbuffer->wrap_views += wrapping ? 1 : -1;
+	if (!textbuffer->wrap_views) {
+		textbuffer_set_wrap_width(textbuffer, 0);
+	}
+}
+
+// Do not let control chars reach the terminal.
+static void view_sanitize(char *text, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if ((u8) text[i] < ' ' || text[i] == DEL) {
+			text[i] = ' ';
+		}
+	}
+}
+
+// Copy the chars of a line from 'column' into at most 'maxlen' cells, one column per cell. Tabs are expanded to
+// spaces, and bytes which are not valid UTF-8 are shown as '?'.
+static size_t view_copy_columns(struct textbuffer *textbuffer, struct line *line, size_t column, char *cells, size_t *xs, size_t maxlen)
+{
+	struct column_iter iter;
+	struct column_char c;
+	column_iter_init(&iter, textbuffer, line, column);
+	memset(cells, 0, maxlen * framebuffer_cell_bytes);
+	size_t len = 0;
+	while (len < maxlen && column_iter_next(&iter, &c)) {
+		char *cell = cells + len * framebuffer_cell_bytes;
+		size_t n = 1;
+		if (c.bytes[0] == '\t') {
+			// The tab covering the first column can start before it.
+			n = min(c.column + c.width - max(c.column, column), maxlen - len);
+			for (size_t i = 0; i < n; i++) {
+				cell[i * framebuffer_cell_bytes] = ' ';
+			}
+		} else if (!c.valid) {
+			cell[0] = '?';
+		} else {
+			memcpy(cell, c.bytes, c.len);
+			view_sanitize(cell, 1);
+		}
+		for (size_t i = 0; i < n; i++) {
+			xs[len++] = c.x;
+		}
+	}
+	return len;
+}
+
+// Set the background of 'len' columns from column 'x' of the current row of 'iter'.
+static void view_highlight(struct framebuffer_iter *iter, size_t x, size_t len, int bg)
+{
+	struct framebuffer_iter columns = *iter;
+	if (x >= (size_t) rec_w(columns.window)) {
+		return;
+	}
+	columns.window.x0 += x;
+	framebuffer_push_bg(&columns, bg, len);
+}
+
+// Set the foreground of 'len' columns from column 'x' of the current row of 'iter'.
+static void view_color(struct framebuffer_iter *iter, size_t x, size_t len, int fg)
+{
+	struct framebuffer_iter columns = *iter;
+	if (x >= (size_t) rec_w(columns.window)) {
+		return;
+	}
+	columns.window.x0 += x;
+	framebuffer_push_fg(&columns, fg, len);
+}
+
+// Color the cells of a row with the syntax highlighting runs of the bytes they display.
+static void view_draw_syntax(struct view *view, struct framebuffer_iter *iter, struct line *line, size_t text_x,
+		const size_t *xs, size_t cells)
+{
+	if (!view->textbuffer->language || !cells) {
+		return;
+	}
+	struct highlight_run *runs = (struct highlight_run*) view_row_runs.memory;
+	size_t nruns = highlight_line(view->textbuffer, line, xs[0], xs[cells - 1] + 1, runs, cells);
+	size_t cell = 0;
+	for (size_t i = 0; i < nruns; i++) {
+		while (cell < cells && xs[cell] < runs[i].x) {
+			cell++;
+		}
+		size_t first = cell;
+		while (cell < cells && xs[cell] < runs[i].x + runs[i].len) {
+			cell++;
+		}
+		view_color(iter, text_x + first, cell - first, runs[i].color);
+	}
+}
+
+// Streamed files are only ever partially in memory: every row is read from the stream as it is drawn.
+static void view_draw_stream(struct view *view, struct framebuffer *framebuffer, rec rec)
+{
+	struct stream_cursor top = *view->stream;
+	int row = 0;
+	while (row < view->y_offset && stream_cursor_prev_line(&top)) {
+		row++;
+	}
+	view->y_offset = row;
+
+	int width = rec_w(rec);
+	buffer_ensure_size(&view_row, width + 1);
+
+	struct framebuffer_iter iter = framebuffer_iter_make(framebuffer, rec);
+	int more = 1;
+	while (more && framebuffer_iter_next(&iter)) {
+		char *text = view_row.memory;
+		int n = snprintf(text, width + 1, "%*zu ", view_lineno_width - 1, top.lineno + 1);
+		n = min(n, width);
+		slice line = stream_cursor_line(&top, width - n);
+		if (!slice_empty(line)) {
+			memcpy(text + n, line.start, slice_len(line));
+			view_sanitize(text + n, slice_len(line));
+			n += slice_len(line);
+		}
+		framebuffer_push_text(&iter, text, n);
+		more = stream_cursor_next_line(&top);
+	}
+}
+
+void view_draw(struct view *view, struct framebuffer *framebuffer, rec rec)
+{
+	if (view->stream) {
+		view_draw_stream(view, framebuffer, rec);
+		return;
+	}
+	assert(view->cursor);
+
+	// A view on the last line of a followed textbuffer stays pinned to the bottom as lines get appended.
+	if (view->textbuffer->follow && view->cursor->line == view->textbuffer->line_last) {
+		view->y_offset = max(rec_h(rec) - 1, 0);
+	}
+
+	int width = rec_w(rec);
+	buffer_ensure_size(&view_row, width + 1);
+	buffer_ensure_size(&view_row_cells, (width + 1) * framebuffer_cell_bytes);
+	buffer_ensure_size(&view_row_x, (width + 1) * sizeof(size_t));
+	buffer_ensure_size(&view_row_runs, (width + 1) * sizeof(struct highlight_run));
+	size_t text_width = max(width - view_lineno_width, 1);
+
+	// Find the first line to display, moving the cursor row up if there are not enough lines above it.
+	struct cursor top = cursor_copy(view->cursor);
+	size_t wrap_row = 0;          // row of the first line to display
+	if (view->are_line_wrapping) {
+		// The first row is found in the line tree. Rows above the indexed lines are not known: until they are indexed
+		// between input events, the view stops at the first indexed line.
+		textbuffer_set_wrap_width(view->textbuffer, text_width);
+		view->x_offset = 0;
+		size_t cursor_row_number = cursor_row(view->cursor);
+		size_t first_row = cursor_row_number - min((size_t) clamp(view->y_offset, 0, max(rec_h(rec) - 1, 0)), cursor_row_number);
+		view->y_offset = cursor_row_number - first_row;
+		cursor_goto_row(&top, first_row);
+		wrap_row = first_row - line_row(top.line);
+	} else {
+		int row = 0;
+		while (row < view->y_offset && cursor_prev_line(&top)) {
+			row++;
+		}
+		view->y_offset = row;
+
+		// Scroll horizontally to keep the cursor column inside the text columns.
+		size_t cursor_column = line_column_at(view->textbuffer, view->cursor->line, view->cursor->x_offset_actual);
+		if (cursor_column < view->x_offset) {
+			view->x_offset = cursor_column;
+		} else if (cursor_column >= view->x_offset + text_width) {
+			view->x_offset = cursor_column - text_width + 1;
+		}
+	}
+
+	// Line numbers are estimated until the textbuffer is fully indexed.
+	int lineno = cursor_lineno(&top);
+	int is_indexed = textbuffer_is_indexed(view->textbuffer);
+	const char *lineno_format = is_indexed ? "%*d " : "~%*d ";
+	int lineno_width = view_lineno_width - 1 - !is_indexed;
+
+	// Offsets of the displayed text, and the matches in it.
+	size_t line_start = cursor_offset(&top) - top.x_offset_actual;
+	const size_t *matches = NULL;
+	size_t nmatches = 0;
+	if (view->find) {
+		size_t end = line_start;
+		int rows = 0;
+		for (struct line *l = top.line; l && rows < rec_h(rec); l = l->next, rows++) {
+			end += l->bytelen + 1;
+		}
+		nmatches = find_visible(view->find, line_start, end, &matches);
+	}
+
+	struct framebuffer_iter iter = framebuffer_iter_make(framebuffer, rec);
+	struct line *line = top.line;
+	while (line && framebuffer_iter_next(&iter)) {
+		char *text = view_row.memory;
+		size_t *xs = (size_t*) view_row_x.memory;
+		// Rows continuing a wrapped line have no line number.
+		int n = wrap_row ? min(view_lineno_width, width) : snprintf(text, width + 1, lineno_format, lineno_width, lineno);
+		if (wrap_row) {
+			memset(text, ' ', n);
+		}
+		n = min(n, width);
+		int text_x = n;
+		size_t column = view->are_line_wrapping ? wrap_row * text_width : view->x_offset;
+		size_t cells = view_copy_columns(view->textbuffer, line, column, view_row_cells.memory, xs, width - n);
+		framebuffer_push_text(&iter, text, n);
+		struct framebuffer_iter text_cells = iter;
+		text_cells.window.x0 += text_x;
+		framebuffer_push_cells(&text_cells, view_row_cells.memory, cells);
+		view_draw_syntax(view, &iter, line, text_x, xs, cells);
+		size_t line_end = line_start + line->bytelen;
+		while (nmatches && *matches + view->find->query_len <= line_start) {
+			matches++;
+			nmatches--;
+		}
+		// Matches are highlighted on the cells of their chars.
+		size_t cell = 0;
+		for (size_t i = 0; i < nmatches && matches[i] < line_end; i++) {
+			size_t x0 = max(matches[i], line_start) - line_start;
+			size_t x1 = min(matches[i] + view->find->query_len, line_end) - line_start;
+			while (cell < cells && xs[cell] < x0) {
+				cell++;
+			}
+			size_t first = cell;
+			while (cell < cells && xs[cell] < x1) {
+				cell++;
+			}
+			view_highlight(&iter, text_x + first, cell - first, view_match_bg);
+		}
+		if (view->are_line_wrapping && ++wrap_row < line->wrap_rows) {
+			continue;
+		}
+		wrap_row = 0;
+		line_start = line_end + 1;
+		lineno++;
+		line = cursor_next_line(&top);
+	}
+}
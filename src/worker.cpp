@@ -0,0 +1,125 @@
+// worker.cpp implements a minimal fork-join pool of threads for splitting cpu heavy work like indexing, and
+// background tasks for slow work like saving which must not block the event loop.
+#include <chi.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+struct worker_job {
+	void (*fn)(void *ctx, int task);
+	void *ctx;
+	int ntasks;
+	int next_task;
+};
+
+static void* worker_loop(void *arg)
+{
+	struct worker_job *job = (struct worker_job*) arg;
+	for (;;) {
+		int task = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+		if (job->ntasks <= task) {
+			break;
+		}
+		job->fn(job->ctx, task);
+	}
+	return NULL;
+}
+
+int worker_thread_count()
+{
+	static int count = 0;
+	if (!count) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		count = clamp(n, 1, worker_max_threads);
+	}
+	return count;
+}
+
+void worker_parallel_for(int ntasks, void (*fn)(void *ctx, int task), void *ctx)
+{
+	struct worker_job job = {
+		.fn = fn,
+		.ctx = ctx,
+		.ntasks = ntasks,
+		.next_task = 0,
+	};
+
+	// The calling thread is one of the workers, no thread is started at all for single task jobs.
+	int nthreads = min(ntasks, worker_thread_count()) - 1;
+	pthread_t threads[worker_max_threads];
+	int started = 0;
+	while (started < nthreads) {
+		if (pthread_create(&threads[started], NULL, worker_loop, &job)) {
+			// Not fatal: remaining tasks are run by the threads already started.
+			break;
+		}
+		started++;
+	}
+	worker_loop(&job);
+	for (int i = 0; i < started; i++) {
+		int r = pthread_join(threads[i], NULL);
+		assert_success(-r);
+	}
+}
+
+// Background tasks signal their completion by writing to this pipe, so that the event loop can wait for input and
+// for tasks at the same time.
+static int worker_notify_pipe[2] = {-1, -1};
+
+static void* worker_task_loop(void *arg)
+{
+	struct worker_task *task = (struct worker_task*) arg;
+	task->fn(task->ctx);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+	char c = 0;
+	while (write(worker_notify_pipe[1], &c, 1) < 0 && errno == EINTR) {
+	}
+	return NULL;
+}
+
+int worker_start(struct worker_task *task, void (*fn)(void *ctx), void *ctx)
+{
+	if (worker_notify_pipe[0] < 0 && pipe2(worker_notify_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		return -errno;
+	}
+	task->fn = fn;
+	task->ctx = ctx;
+	task->done = 0;
+	int r = pthread_create(&task->thread, NULL, worker_task_loop, task);
+	if (r) {
+		return -r;
+	}
+	return 0;
+}
+
+int worker_is_done(struct worker_task *task)
+{
+	return __atomic_load_n(&task->done, __ATOMIC_ACQUIRE);
+}
+
+void worker_join(struct worker_task *task)
+{
+	int r = pthread_join(task->thread, NULL);
+	assert_success(-r);
+}
+
+int worker_wait_input(int fd, int event_fd, int timeout_ms)
+{
+	// poll() ignores negative fds.
+	struct pollfd pollfds[3] = {
+		{ .fd = fd, .events = POLLIN, .revents = 0 },
+		{ .fd = worker_notify_pipe[0], .events = POLLIN, .revents = 0 },
+		{ .fd = event_fd, .events = POLLIN, .revents = 0 },
+	};
+	if (poll(pollfds, 3, timeout_ms) <= 0) {
+		return 0;
+	}
+	if (pollfds[1].revents) {
+		char buffer[64];
+		while (read(worker_notify_pipe[0], buffer, sizeof(buffer)) > 0) {
+		}
+	}
+	return pollfds[0].revents != 0;
+}